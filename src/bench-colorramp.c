@@ -0,0 +1,151 @@
+/* bench-colorramp.c -- Gamma ramp computation benchmark source
+   This file is part of Redshift.
+
+   Redshift is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Redshift is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Redshift.  If not, see <http://www.gnu.org/licenses/>.
+
+   Copyright (c) 2014  Mattias Andrée <maandree@member.fsf.org>
+*/
+
+/* Measures how long it takes to compute the gamma ramps of
+   a number of CRTCs with different numbers of ramp workers,
+   so that `ramp-workers' can be chosen for a machine.
+
+   Usage: bench-colorramp [MAX-WORKERS [ROUNDS]] */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "gamma-pool.h"
+#include "systemtime.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+
+static const size_t crtc_counts[] = { 1, 2, 4, 8, 16, 32 };
+static const size_t ramp_sizes[] = { 256, 1024, 4096, 16384 };
+
+
+static gamma_ramps_t
+bench_target(gamma_server_state_t *state, size_t crtc)
+{
+	return state->crtcs[crtc].current_ramps;
+}
+
+/* Returns the number of microseconds per round, or a negative value on error. */
+static double
+bench(gamma_server_state_t *state, size_t workers, size_t rounds)
+{
+	double start, end;
+
+	state->ramp_workers = workers;
+	if (workers > 1 && gamma_pool_start(state) != 0)
+		return -1;
+
+	if (systemtime_get_monotonic(&start) != 0)
+		return -1;
+	for (size_t i = 0; i < rounds; i++) {
+		/* Make every round different from the previous. */
+		for (size_t c = 0; c < state->crtcs_used; c++)
+			state->crtcs[c].settings.temperature = 3000 + (i % 64) * 50;
+		gamma_pool_fill(state, bench_target);
+	}
+	if (systemtime_get_monotonic(&end) != 0)
+		return -1;
+
+	gamma_pool_stop(state);
+	return (end - start) * 1000000. / rounds;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	size_t max_workers = gamma_pool_default_workers();
+	size_t rounds = 100;
+	gamma_server_state_t state;
+
+	if (max_workers < 4)
+		max_workers = 4;
+	if (argc > 1)
+		max_workers = (size_t)atol(argv[1]);
+	if (argc > 2)
+		rounds = (size_t)atol(argv[2]);
+	if (max_workers < 1 || rounds < 1) {
+		fprintf(stderr, "Usage: %s [MAX-WORKERS [ROUNDS]]\n", argv[0]);
+		return 1;
+	}
+
+	memset(&state, 0, sizeof(state));
+	printf("%6s %6s", "crtcs", "stops");
+	for (size_t w = 1; w <= max_workers; w++)
+		printf("  %7lu", (unsigned long)w);
+	printf("  (microseconds, by number of workers)\n");
+
+	for (size_t s = 0; s < sizeof(ramp_sizes) / sizeof(*ramp_sizes); s++) {
+		for (size_t n = 0; n < sizeof(crtc_counts) / sizeof(*crtc_counts); n++) {
+			size_t size = ramp_sizes[s];
+			size_t count = crtc_counts[n];
+			size_t best = 1;
+			double best_time = 0;
+			uint16_t *ramps;
+
+			state.crtcs = calloc(count, sizeof(gamma_crtc_state_t));
+			ramps = malloc(count * 3 * size * sizeof(uint16_t));
+			if (state.crtcs == NULL || ramps == NULL) {
+				perror("malloc");
+				return 1;
+			}
+			state.crtcs_used = count;
+			for (size_t c = 0; c < count; c++) {
+				gamma_crtc_state_t *crtc = state.crtcs + c;
+				crtc->current_ramps.red_size = size;
+				crtc->current_ramps.green_size = size;
+				crtc->current_ramps.blue_size = size;
+				crtc->current_ramps.red = ramps + (c * 3 + 0) * size;
+				crtc->current_ramps.green = ramps + (c * 3 + 1) * size;
+				crtc->current_ramps.blue = ramps + (c * 3 + 2) * size;
+				crtc->settings.gamma_correction[0] = DEFAULT_GAMMA;
+				crtc->settings.gamma_correction[1] = DEFAULT_GAMMA;
+				crtc->settings.gamma_correction[2] = DEFAULT_GAMMA;
+				crtc->settings.gamma = DEFAULT_GAMMA;
+				crtc->settings.brightness = DEFAULT_BRIGHTNESS;
+				crtc->settings.temperature = NEUTRAL_TEMP;
+			}
+
+			printf("%6lu %6lu", (unsigned long)count, (unsigned long)size);
+			for (size_t w = 1; w <= max_workers; w++) {
+				double t = bench(&state, w, rounds);
+				if (t < 0) {
+					fputs("Failed to run benchmark.\n", stderr);
+					return 1;
+				}
+				if (w == 1 || t < best_time) {
+					best = w;
+					best_time = t;
+				}
+				printf("  %7.0f", t);
+			}
+			printf("  best: %lu\n", (unsigned long)best);
+
+			free(state.crtcs);
+			free(ramps);
+		}
+	}
+
+	return 0;
+}
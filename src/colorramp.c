@@ -21,6 +21,7 @@
 
 #include "colorramp.h"
 #include "adjustments.h"
+#include "trace.h"
 
 #include <string.h>
 #include <stdint.h>
@@ -286,7 +287,7 @@ interpolate_color(float a, const float *c1, const float *c2, float *c)
 }
 
 static void
-apply_lut(uint16_t *out[3], size_t out_sizes[3], gamma_ramps_t *lut)
+apply_lut(uint16_t *cfilter, int c, size_t start, size_t end, gamma_ramps_t *lut)
 {
 	if (lut == NULL)
 		return;
@@ -300,30 +301,27 @@ apply_lut(uint16_t *out[3], size_t out_sizes[3], gamma_ramps_t *lut)
 		lut->green,
 		lut->blue
 	};
-	for (int c = 0; c < 3; c++) {
-		uint16_t *cfilter = out[c];
-		uint16_t *ccalib  = calib[c];
-		size_t gamma_size = out_sizes[c];
-		size_t size_      = calib_sizes[c] - 1;
-		for (size_t i = 0; i < gamma_size; i++) {
-			/* We a rounding a bit. We could do linear
-			   interpolation or even more advanced
-			   interpolations, but it is probably not
-			   worth it. If this is used for adjustments
-			   rather than applying the calibrations that
-			   was present when Redshift started, the
-			   lookup table can be of any size so that
-			   this issue cannot possibility be noticed. */
-			int32_t y = (int32_t)(cfilter[i]);
-			y = (float)y * size_ / UINT16_MAX + 0.5f;
-			y = y < 0 ? 0 : (y > (ssize_t)size_ ? (int32_t)size_ : y);
-			cfilter[i] = ccalib[y];
-		}
+	uint16_t *ccalib  = calib[c];
+	size_t size_      = calib_sizes[c] - 1;
+	for (size_t i = start; i < end; i++) {
+		/* We a rounding a bit. We could do linear
+		   interpolation or even more advanced
+		   interpolations, but it is probably not
+		   worth it. If this is used for adjustments
+		   rather than applying the calibrations that
+		   was present when Redshift started, the
+		   lookup table can be of any size so that
+		   this issue cannot possibility be noticed. */
+		int32_t y = (int32_t)(cfilter[i]);
+		y = (float)y * size_ / UINT16_MAX + 0.5f;
+		y = y < 0 ? 0 : (y > (ssize_t)size_ ? (int32_t)size_ : y);
+		cfilter[i] = ccalib[y];
 	}
 }
 
 void
-colorramp_fill(gamma_ramps_t out_ramps, gamma_settings_t adjustments)
+colorramp_fill_part(gamma_ramps_t out_ramps, gamma_settings_t adjustments,
+		    int c, size_t start, size_t end)
 {
 	size_t gamma_sizes[3] = {
 		out_ramps.red_size,
@@ -337,27 +335,32 @@ colorramp_fill(gamma_ramps_t out_ramps, gamma_settings_t adjustments)
 		out_ramps.blue
 	};
 
+	uint16_t *cfilter = filter[c];
+	size_t gamma_size = gamma_sizes[c];
+	double span;
+
 
 	if (adjustments.lut_pre != NULL) {
+		span = trace_begin("colorramp lut_pre");
 		gamma_ramps_t lut = *(adjustments.lut_pre);
+		uint16_t *luts[3] = { lut.red, lut.green, lut.blue };
 		if (lut.red_size   == out_ramps.red_size   &&
 		    lut.green_size == out_ramps.green_size &&
 		    lut.blue_size  == out_ramps.blue_size) {
-			memcpy(out_ramps.red, lut.red,
-			       (gamma_sizes[0] + gamma_sizes[1] + gamma_sizes[2]) * sizeof(uint16_t));
+			memcpy(cfilter + start, luts[c] + start,
+			       (end - start) * sizeof(uint16_t));
 		} else {
-			for (int c = 0; c < 3; c++) {
-				uint16_t *cfilter = filter[c];
-				size_t gamma_size_ = gamma_sizes[c] - 1;
-				for (size_t i = 0; i < gamma_sizes[c]; i++)
-					cfilter[i] = (float)i / gamma_size_ * UINT16_MAX;
-			}
-			apply_lut(filter, gamma_sizes, adjustments.lut_pre);
+			size_t gamma_size_ = gamma_size - 1;
+			for (size_t i = start; i < end; i++)
+				cfilter[i] = (float)i / gamma_size_ * UINT16_MAX;
+			apply_lut(cfilter, c, start, end, adjustments.lut_pre);
 		}
+		trace_end_value("colorramp lut_pre", span, "channel", (size_t)c);
 	}
 
 
 	/* Approximate white point. */
+	span = trace_begin("colorramp curve");
 	int temp = (int)(adjustments.temperature + 0.5f);
 	float white_point[3];
 	float alpha = (temp % 100) / 100.0;
@@ -374,22 +377,36 @@ colorramp_fill(gamma_ramps_t out_ramps, gamma_settings_t adjustments)
 #define F(Y, C)  pow((Y) * adjustments.brightness * white_point[C], \
 		     1.0f / gamma[C])
 
-	for (int c = 0; c < 3; c++) {
-		uint16_t *cfilter = filter[c];
-		size_t gamma_size = gamma_sizes[c];
-		for (size_t i = 0; i < gamma_size; i++) {
-			int32_t y = F((float)i / gamma_size, c) * (UINT16_MAX+1);
-			cfilter[i] = (uint16_t)(y < 0 ? 0 : y > UINT16_MAX ? UINT16_MAX : y);
-		}
+	for (size_t i = start; i < end; i++) {
+		int32_t y = F((float)i / gamma_size, c) * (UINT16_MAX+1);
+		cfilter[i] = (uint16_t)(y < 0 ? 0 : y > UINT16_MAX ? UINT16_MAX : y);
 	}
 
 #undef F
 
-	apply_lut(filter, gamma_sizes, adjustments.lut_post);
+	trace_end_value("colorramp curve", span, "channel", (size_t)c);
+
+	if (adjustments.lut_post != NULL) {
+		span = trace_begin("colorramp lut_post");
+		apply_lut(cfilter, c, start, end, adjustments.lut_post);
+		trace_end_value("colorramp lut_post", span, "channel", (size_t)c);
+	}
 
 	/* Apply gamma ramps used when Redshift started on top of
 	   the effects of Redshift. It would be easier to put
 	   Redshift's effects on top if this, but then calibrations
 	   would become incorrect. */
-	apply_lut(filter, gamma_sizes, adjustments.lut_calibration);
+	if (adjustments.lut_calibration != NULL) {
+		span = trace_begin("colorramp calibration");
+		apply_lut(cfilter, c, start, end, adjustments.lut_calibration);
+		trace_end_value("colorramp calibration", span, "channel", (size_t)c);
+	}
+}
+
+void
+colorramp_fill(gamma_ramps_t out_ramps, gamma_settings_t adjustments)
+{
+	colorramp_fill_part(out_ramps, adjustments, 0, 0, out_ramps.red_size);
+	colorramp_fill_part(out_ramps, adjustments, 1, 0, out_ramps.green_size);
+	colorramp_fill_part(out_ramps, adjustments, 2, 0, out_ramps.blue_size);
 }
@@ -25,4 +25,9 @@
 
 void colorramp_fill(gamma_ramps_t out_ramps, gamma_settings_t adjustments);
 
+/* Fill the entries [start, end) of one channel, 0 for red, 1 for
+   green and 2 for blue, so that parts can be filled in parallel. */
+void colorramp_fill_part(gamma_ramps_t out_ramps, gamma_settings_t adjustments,
+			 int channel, size_t start, size_t end);
+
 #endif /* ! REDSHIFT_COLORRAMP_H */
@@ -18,20 +18,34 @@
    Copyright (c) 2014  Mattias Andrée <maandree@member.fsf.org>
 */
 
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <ctype.h>
 #include <unistd.h>
 #ifndef _WIN32
 # include <pwd.h>
+# include <sys/mman.h>
 # include <sys/wait.h>
+# include <poll.h>
+# include <signal.h>
+# include <spawn.h>
+
+extern char **environ;
 #endif
 
 #include "config-ini.h"
+#include "systemtime.h"
+#include "trace.h"
 
 #ifdef ENABLE_NLS
 # include <libintl.h>
@@ -41,14 +55,12 @@
 #endif
 
 #define MAX_CONFIG_PATH  4096
-#define MAX_LINE_LENGTH   600
-/* At least 512 is required for EDIDs by themself. */
 
 
-static FILE *
-open_config_file(const char *filepath)
+static int
+open_config_file(const char *filepath, char **path_out)
 {
-	FILE *f = NULL;
+	int f = -1;
 
 	/* If a path is not specified (filepath is NULL) then
 	   the configuration file is searched for in the directories
@@ -60,40 +72,39 @@ open_config_file(const char *filepath)
 	*/
 
 	if (filepath == NULL) {
-		FILE *f = NULL;
 		char cp[MAX_CONFIG_PATH];
 		char *env;
 
-		if (f == NULL && (env = getenv("XDG_CONFIG_HOME")) != NULL &&
+		if (f < 0 && (env = getenv("XDG_CONFIG_HOME")) != NULL &&
 		    env[0] != '\0') {
 			snprintf(cp, sizeof(cp), "%s/redshift.conf", env);
-			f = fopen(cp, "r");
+			f = open(cp, O_RDONLY);
 		}
 
 #ifdef _WIN32
-		if (f == NULL && (env = getenv("localappdata")) != NULL &&
+		if (f < 0 && (env = getenv("localappdata")) != NULL &&
 		    env[0] != '\0') {
 			snprintf(cp, sizeof(cp),
 				 "%s\\redshift.conf", env);
-			f = fopen(cp, "r");
+			f = open(cp, O_RDONLY);
 		}
 #endif
-		if (f == NULL && (env = getenv("HOME")) != NULL &&
+		if (f < 0 && (env = getenv("HOME")) != NULL &&
 		    env[0] != '\0') {
 			snprintf(cp, sizeof(cp),
 				 "%s/.config/redshift.conf", env);
-			f = fopen(cp, "r");
+			f = open(cp, O_RDONLY);
 		}
 #ifndef _WIN32
 
-		if (f == NULL) {
+		if (f < 0) {
 			struct passwd *pwd = getpwuid(getuid());
 			if (pwd != NULL) {
 				char *home = pwd->pw_dir;
 				if ((home != NULL) && (*home != '\0')) {
 					snprintf(cp, sizeof(cp),
 						 "%s/.config/redshift.conf", home);
-					f = fopen(cp, "r");
+					f = open(cp, O_RDONLY);
 				} else {
 					fprintf(stderr, _("Cannot determine your home directory, "
 							  "it is from the system's user table.\n"));
@@ -108,7 +119,7 @@ open_config_file(const char *filepath)
 			}
 		}
 
-		if (f == NULL && (env = getenv("XDG_CONFIG_DIRS")) != NULL &&
+		if (f < 0 && (env = getenv("XDG_CONFIG_DIRS")) != NULL &&
 		    env[0] != '\0') {
 			char *begin = env;
 			while (1) {
@@ -120,8 +131,8 @@ open_config_file(const char *filepath)
 					snprintf(cp, sizeof(cp),
 						 "%.*s/redshift.conf", len, begin);
 
-					f = fopen(cp, "r");
-					if (f != NULL) break;
+					f = open(cp, O_RDONLY);
+					if (f >= 0) break;
 				}
 
 				if (end[0] == '\0') break;
@@ -129,20 +140,22 @@ open_config_file(const char *filepath)
 			}
 		}
 
-		if (f == NULL) {
+		if (f < 0) {
 			snprintf(cp, sizeof(cp),
 				 "%s/redshift.conf", "/etc");
-			f = fopen(cp, "r");
+			f = open(cp, O_RDONLY);
 		}
 #endif
 
+		if (f >= 0) *path_out = strdup(cp);
 		return f;
 	} else {
-		f = fopen(filepath, "r");
-		if (f == NULL) {
-			perror("fopen");
-			return NULL;
+		f = open(filepath, O_RDONLY);
+		if (f < 0) {
+			perror("open");
+			return -1;
 		}
+		*path_out = strdup(filepath);
 	}
 
 	return f;
@@ -150,156 +163,528 @@ open_config_file(const char *filepath)
 
 
 #ifndef _WIN32
-static char*
-config_ini_spawn(char* command)
-{
-	int read_write[2];
+/* A `$(...)` command being evaluated. */
+typedef struct {
+	config_ini_setting_t *setting;
+	char *command;
 	pid_t pid;
+	int fd;
+	/* The first line of the output. */
+	char *output;
+	size_t length;
+	size_t capacity;
+	int line_complete;
+	int status;
+	int timed_out;
+	double start;
+	double end;
+} config_ini_job_t;
+
+static double
+monotonic_time(void)
+{
+	double now;
+	if (systemtime_get_monotonic(&now) < 0) return 0;
+	return now;
+}
 
+/* Start a command with its standard output
+   connected to a non-blocking pipe. */
+static int
+config_ini_spawn(config_ini_job_t *job)
+{
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	int read_write[2];
+	int r;
+
+	/* Other commands must not inherit the pipe, or the end of
+	   file would not be seen until they exit. Commands may be
+	   started from other threads, so the pipe must be created
+	   close-on-exec rather than be marked afterwards. */
+#ifdef HAVE_PIPE2
+	if (pipe2(read_write, O_CLOEXEC)) {
+		perror("pipe2");
+		return -1;
+	}
+#else
 	if (pipe(read_write)) {
 		perror("pipe");
-		return NULL;
+		return -1;
 	}
+	fcntl(read_write[0], F_SETFD, FD_CLOEXEC);
+	fcntl(read_write[1], F_SETFD, FD_CLOEXEC);
+#endif
+	fcntl(read_write[0], F_SETFL, fcntl(read_write[0], F_GETFL) | O_NONBLOCK);
+
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, read_write[1], STDOUT_FILENO);
+
+	/* Put the command in its own process group so that
+	   a timeout also kills anything it has started. */
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+	posix_spawnattr_setpgroup(&attr, 0);
+
+	char *argv[] = { "sh", "-c", job->command, NULL };
+	r = posix_spawnp(&job->pid, "sh", &actions, &attr, argv, environ);
 
-	pid = fork();
-	if (pid == (pid_t)-1) {
-		perror("fork");
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+	close(read_write[1]);
+
+	if (r != 0) {
+		errno = r;
+		perror("posix_spawnp");
 		close(read_write[0]);
-		close(read_write[1]);
-		return NULL;
+		job->pid = 0;
+		return -1;
 	}
 
-	if (pid) {
-		char* output = NULL;
-		int status;
-		FILE* ch;
+	job->fd = read_write[0];
+	job->start = monotonic_time();
+	return 0;
+}
+
+/* Read available output from a command, only the first
+   line is kept but everything is read so that the
+   command is never blocked on a full pipe. */
+static void
+config_ini_collect(config_ini_job_t *job)
+{
+	char buf[4096];
 
-		waitpid(pid, &status, WUNTRACED);
-		if (!WIFEXITED(status) || WEXITSTATUS(status)) {
-			close(read_write[0]);
-			close(read_write[1]);
-			return NULL;
+	while (1) {
+		ssize_t got = read(job->fd, buf, sizeof(buf));
+		if (got < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+			perror("read");
+			got = 0;
+		}
+		if (got == 0) {
+			close(job->fd);
+			job->fd = -1;
+			return;
 		}
+		if (job->line_complete) continue;
+
+		char *nl = memchr(buf, '\n', (size_t)got);
+		size_t n = nl == NULL ? (size_t)got : (size_t)(nl - buf);
+		if (job->length + n + 1 > job->capacity) {
+			size_t capacity = job->capacity ? job->capacity : 128;
+			while (job->length + n + 1 > capacity) capacity <<= 1;
+			char *output = realloc(job->output, capacity);
+			if (output == NULL) {
+				perror("realloc");
+				job->line_complete = 1;
+				continue;
+			}
+			job->output = output;
+			job->capacity = capacity;
+		}
+		memcpy(job->output + job->length, buf, n);
+		job->length += n;
+		job->output[job->length] = '\0';
+		job->line_complete = nl != NULL;
+	}
+}
 
-		if ((ch = fdopen(read_write[0], "r")) != NULL) {
-			int size = 128;
-			output = malloc(size * sizeof(char));
-			if (output == NULL)
-				perror("malloc");
-
-			*output = '\n';
-			while (output != NULL) {
-				if (fgets(output, size, ch) == NULL || *output == '\n') {
-					free(output);
-					output = NULL;
-				}
-				else if (output[strlen(output) - 1] != '\n') {
-					output = realloc(output, (size <<= 1) * sizeof(char));
-					if (output == NULL)
-						perror("malloc");
+/* Run all `$(...)` commands in parallel and substitute
+   their output. Commands that fail or time out leave the
+   value as the text before `$(`. */
+static void
+config_ini_evaluate(config_ini_job_t *jobs, size_t n, int verbose)
+{
+	double begin = monotonic_time();
+	double total_deadline = begin + CONFIG_INI_TOTAL_TIMEOUT;
+	size_t running = 0;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		jobs[i].fd = -1;
+		if (config_ini_spawn(jobs + i) == 0) running++;
+	}
+
+	struct pollfd *fds = malloc(n * sizeof(struct pollfd));
+	size_t *fd_jobs = malloc(n * sizeof(size_t));
+	struct pollfd one_fd;
+	size_t one_job, max_fds = n;
+	if (fds == NULL || fd_jobs == NULL) {
+		/* Read the output of one command at a time instead. */
+		free(fds);
+		free(fd_jobs);
+		fds = &one_fd;
+		fd_jobs = &one_job;
+		max_fds = 1;
+	}
+
+	while (running > 0) {
+		double now = monotonic_time();
+		double deadline = total_deadline;
+		nfds_t nfds = 0;
+
+		for (i = 0; i < n; i++) {
+			config_ini_job_t *job = jobs + i;
+			if (job->pid == 0) continue;
+
+			/* Kill commands that have run for too long. */
+			double job_deadline = job->start + CONFIG_INI_COMMAND_TIMEOUT;
+			if (job_deadline > total_deadline) job_deadline = total_deadline;
+			if (now >= job_deadline && !job->timed_out) {
+				job->timed_out = 1;
+				kill(-job->pid, SIGKILL);
+				kill(job->pid, SIGKILL);
+				if (job->fd >= 0) {
+					close(job->fd);
+					job->fd = -1;
 				}
-				else {
-					output[strlen(output) - 1] = '\0';
-					break;
+			}
+
+			/* Reap commands that have closed their output. */
+			if (job->fd < 0) {
+				pid_t pid = waitpid(job->pid, &job->status,
+						    job->timed_out ? 0 : WNOHANG);
+				if (pid == job->pid || (pid < 0 && errno != EINTR)) {
+					if (pid < 0) job->status = -1;
+					job->pid = 0;
+					job->end = monotonic_time();
+					running--;
+				} else {
+					/* Not exited yet, check again shortly. */
+					if (now + 0.01 < deadline) deadline = now + 0.01;
 				}
+				continue;
 			}
+
+			if (job_deadline < deadline) deadline = job_deadline;
+			if (nfds == max_fds) continue;
+			fds[nfds].fd = job->fd;
+			fds[nfds].events = POLLIN;
+			fd_jobs[nfds++] = i;
+		}
+		if (running == 0) break;
+
+		int timeout = (int)((deadline - now) * 1000.0) + 1;
+		if (timeout < 0) timeout = 0;
+		int r = poll(fds, nfds, timeout);
+		if (r < 0 && errno != EINTR) {
+			perror("poll");
+			total_deadline = now;
+			continue;
 		}
 
-		/* I do not know if both of the two first are required, but it cannot hurt */
-		if (ch) fclose(ch);
-		close(read_write[0]);
-		close(read_write[1]);
+		for (i = 0; r > 0 && i < nfds; i++)
+			if (fds[i].revents)
+				config_ini_collect(jobs + fd_jobs[i]);
+	}
 
-		return output;
-	} else {
-		if (read_write[1] != STDOUT_FILENO) {
-			close(STDOUT_FILENO);
-			dup2(read_write[1], STDOUT_FILENO);
+	if (fds != &one_fd) {
+		free(fds);
+		free(fd_jobs);
+	}
+
+	for (i = 0; i < n; i++) {
+		config_ini_job_t *job = jobs + i;
+		if (job->fd >= 0) close(job->fd);
+
+		if (job->timed_out) {
+			fprintf(stderr, _("Command `%s' in config file timed out.\n"),
+				job->command);
+		} else if (verbose && job->start > 0) {
+			printf(_("Command `%s' in config file finished in %.3f seconds.\n"),
+			       job->command, job->end - job->start);
+		}
+
+		if (!job->timed_out && job->output != NULL && *job->output &&
+		    WIFEXITED(job->status) && !WEXITSTATUS(job->status)) {
+			job->setting->evaluated = job->output;
+			job->setting->value = strdup(job->output);
+			if (job->setting->value != NULL)
+				job->setting->value_allocated = 1;
+			else
+				job->setting->value = job->setting->raw_value;
+		} else {
+			free(job->output);
 		}
-		execlp("sh", "sh", "-c", command, NULL);
-		perror("execlp");
-		abort();
 	}
 
-	/* This really should not happen */
-	return NULL;
+	if (verbose && n > 0) {
+		printf(_("Config file commands finished in %.3f seconds.\n"),
+		       monotonic_time() - begin);
+	}
 }
 #endif
 
+/* Load the whole file into `state->buffer`, with room for
+   a terminating NUL byte after the last byte of the file. */
+static int
+load_config_file(config_ini_state_t *state, int fd)
+{
+	struct stat attr;
+	if (fstat(fd, &attr)) {
+		perror("fstat");
+		return -1;
+	}
+
+	size_t size = S_ISREG(attr.st_mode) ? (size_t)attr.st_size : 0;
+	state->source_mtime = attr.st_mtime;
+#ifdef __linux__
+	state->source_mtime_nsec = attr.st_mtim.tv_nsec;
+#endif
+
+#ifndef _WIN32
+	/* The last line is terminated in place, so the file can
+	   only be mapped if its last page has slack after the
+	   end of the file, the slack reads as zeroes. */
+	long pagesize = sysconf(_SC_PAGESIZE);
+	if (size > 0 && pagesize > 0 && size % (size_t)pagesize != 0) {
+		void *map = mmap(NULL, size + 1, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			state->buffer = map;
+			state->buffer_size = size;
+			state->buffer_mapped = size + 1;
+			goto done;
+		}
+	}
+#endif
+
+	/* Otherwise read it, the file may also be a pipe. */
+	size_t capacity = size + 1 < 4096 ? 4096 : size + 1;
+	size_t length = 0;
+	char *buffer = malloc(capacity);
+	if (buffer == NULL) {
+		perror("malloc");
+		return -1;
+	}
+
+	while (1) {
+		if (length + 1 == capacity) {
+			char *new_buffer = realloc(buffer, capacity <<= 1);
+			if (new_buffer == NULL) {
+				perror("realloc");
+				free(buffer);
+				return -1;
+			}
+			buffer = new_buffer;
+		}
+		ssize_t got = read(fd, buffer + length, capacity - length - 1);
+		if (got < 0) {
+			if (errno == EINTR) continue;
+			perror("read");
+			free(buffer);
+			return -1;
+		}
+		if (got == 0) break;
+		length += (size_t)got;
+	}
+
+	buffer[length] = '\0';
+	state->buffer = buffer;
+	state->buffer_size = length;
+	state->buffer_mapped = 0;
+
+done:
+	state->source_size = state->buffer_size;
+	return 0;
+}
+
+/* Case-insensitive FNV-1a hash of a section name. */
+static size_t __attribute__((pure))
+section_hash(const char *name)
+{
+	size_t hash = (size_t)2166136261UL;
+	for (; *name; name++) {
+		hash ^= (size_t)tolower((unsigned char)*name);
+		hash *= (size_t)16777619UL;
+	}
+	return hash;
+}
+
+/* Find the index entry for a section name, or the
+   free slot where it should be inserted. */
+static config_ini_index_t * __attribute__((pure))
+find_index(const config_ini_state_t *state, const char *name)
+{
+	size_t mask = state->index_size - 1;
+	size_t i = section_hash(name) & mask;
+	while (state->index[i].first != NULL &&
+	       strcasecmp(state->index[i].first->name, name) != 0)
+		i = (i + 1) & mask;
+	return state->index + i;
+}
+
+/* Allocate the sections, settings and the index at once. */
+static int
+config_ini_alloc(config_ini_state_t *state, size_t sections_n, size_t settings_n,
+		 config_ini_section_t **sections_out, config_ini_setting_t **settings_out)
+{
+	if (sections_n > 0) {
+		state->index_size = 1;
+		while (state->index_size < 2 * sections_n)
+			state->index_size <<= 1;
+	}
+
+	state->arena = calloc(1, state->index_size * sizeof(config_ini_index_t) +
+				 sections_n * sizeof(config_ini_section_t) +
+				 settings_n * sizeof(config_ini_setting_t) + 1);
+	if (state->arena == NULL) {
+		perror("calloc");
+		return -1;
+	}
+
+	state->index = state->arena;
+	*sections_out = (config_ini_section_t *)(state->index + state->index_size);
+	*settings_out = (config_ini_setting_t *)(*sections_out + sections_n);
+	return 0;
+}
+
+/* Insert the sections into the index, in the order
+   of the list, so that the last in the file is first. */
+static void
+config_ini_index_sections(config_ini_state_t *state)
+{
+	config_ini_section_t *section = state->sections;
+	for (; section != NULL; section = section->next) {
+		config_ini_index_t *entry = find_index(state, section->name);
+		if (entry->first == NULL)
+			entry->first = section;
+		else
+			entry->last->next_same = section;
+		entry->last = section;
+		entry->count++;
+	}
+}
+
+/* Count the section headers and the assignments in
+   the file, so that they can be allocated at once. */
+static void
+count_lines(const char *buffer, size_t size,
+	    size_t *sections, size_t *settings)
+{
+	const char *p = buffer;
+	const char *end = buffer + size;
+
+	*sections = 0;
+	*settings = 0;
+	while (p < end) {
+		const char *line_end = memchr(p, '\n', (size_t)(end - p));
+		if (line_end == NULL) line_end = end;
+
+		while (p < line_end && (*p == ' ' || *p == '\t')) p++;
+		if (p < line_end && *p != ';' && *p != '\r' && *p != '\0') {
+			if (*p == '[') (*sections)++;
+			else (*settings)++;
+		}
+
+		p = line_end + 1;
+	}
+}
+
+/* Find the output of a `$(...)` command evaluated in a previously
+   loaded config file, for an identical setting in a section with the
+   same name. Only successful evaluations are reused. */
+static const char *
+config_ini_find_evaluated(const config_ini_state_t *previous,
+			  const char *section_name,
+			  const config_ini_setting_t *setting)
+{
+	if (previous == NULL || previous->index_size == 0)
+		return NULL;
+
+	config_ini_section_t *section = find_index(previous, section_name)->first;
+	for (; section != NULL; section = section->next_same) {
+		config_ini_setting_t *old = section->settings;
+		for (; old != NULL; old = old->next) {
+			if (old->evaluated != NULL &&
+			    strcmp(old->command, setting->command) == 0 &&
+			    strcmp(old->raw_value, setting->raw_value) == 0 &&
+			    strcasecmp(old->name, setting->name) == 0)
+				return old->evaluated;
+		}
+	}
+
+	return NULL;
+}
+
 int
-config_ini_init(config_ini_state_t *state, const char *filepath)
+config_ini_init(config_ini_state_t *state, const char *filepath,
+		const config_ini_state_t *previous, int verbose)
 {
 	config_ini_section_t *section = NULL;
-	state->sections = NULL;
+	memset(state, 0, sizeof(*state));
 
-	FILE *f = open_config_file(filepath);
-	if (f == NULL) {
+	int f = open_config_file(filepath, &state->filepath);
+	if (f < 0) {
 		/* Only a serious error if a file was explicitly requested. */
 		if (filepath != NULL) return -1;
 		return 0;
 	}
 
-	char line[MAX_LINE_LENGTH];
+	int r = load_config_file(state, f);
+	close(f);
+	if (r < 0) return -1;
+
+	/* Allocate all sections, settings and the index at once. */
+	size_t sections_n, settings_n;
+	config_ini_section_t *next_section;
+	config_ini_setting_t *next_setting;
+	count_lines(state->buffer, state->buffer_size, &sections_n, &settings_n);
+	if (config_ini_alloc(state, sections_n, settings_n,
+			     &next_section, &next_setting) < 0) {
+		config_ini_free(state);
+		return -1;
+	}
+
+#ifndef _WIN32
+	config_ini_job_t *jobs = NULL;
+	size_t jobs_n = 0;
+#endif
+
+	char *line = state->buffer;
+	char *buffer_end = state->buffer + state->buffer_size;
 	char *s;
 
-	while (1) {
-		/* Handle the file input linewise. */
-		char *r = fgets(line, sizeof(line), f);
-		if (r == NULL) break;
+	while (line < buffer_end) {
+		/* Handle the file input linewise, terminating
+		   each line in place. */
+		char *line_end = memchr(line, '\n', (size_t)(buffer_end - line));
+		if (line_end == NULL) line_end = buffer_end;
+		*line_end = '\0';
 
-		/* Strip leading blanks and trailing newline. */
+		/* Strip leading blanks and trailing carriage return. */
 		s = line + strspn(line, " \t");
-		s[strcspn(s, "\r\n")] = '\0';
+		s[strcspn(s, "\r")] = '\0';
+		line = line_end + 1;
 
 		/* Skip comments and empty lines. */
 		if (s[0] == ';' || s[0] == '\0') continue;
 
 		if (s[0] == '[') {
 			/* Read name of section. */
-			const char *name = s+1;
+			char *name = s+1;
 			char *end = strchr(s, ']');
 			if (end == NULL || end[1] != '\0' || end == name) {
 				fputs(_("Malformed section header in config"
 					" file.\n"), stderr);
-				fclose(f);
-				config_ini_free(state);
-				return -1;
+				goto fail;
 			}
 
 			*end = '\0';
 
-			/* Create section. */
-			section = malloc(sizeof(config_ini_section_t));
-			if (section == NULL) {
-				fclose(f);
-				config_ini_free(state);
-				return -1;
-			}
-
-			/* Insert into section list. */
-			section->name = NULL;
-			section->settings = NULL;
+			/* Prepend to section list. */
+			section = next_section++;
+			section->name = name;
 			section->next = state->sections;
 			state->sections = section;
-
-			/* Copy section name. */
-			section->name = malloc(end - name + 1);
-			if (section->name == NULL) {
-				fclose(f);
-				config_ini_free(state);
-				return -1;
-			}
-
-			memcpy(section->name, name, end - name + 1);
 		} else {
 			/* Split assignment at equals character. */
 			char *end = strchr(s, '=');
 			if (end == NULL || end == s) {
 				fputs(_("Malformed assignment in config"
 					" file.\n"), stderr);
-				fclose(f);
-				config_ini_free(state);
-				return -1;
+				goto fail;
 			}
 
 			*end = '\0';
@@ -308,69 +693,79 @@ config_ini_init(config_ini_state_t *state, const char *filepath)
 			if (section == NULL) {
 				fputs(_("Assignment outside section in config"
 					" file.\n"), stderr);
-				fclose(f);
-				config_ini_free(state);
-				return -1;
+				goto fail;
 			}
 
-			/* Create section. */
-			config_ini_setting_t *setting =
-				malloc(sizeof(config_ini_setting_t));
-			if (setting == NULL) {
-				fclose(f);
-				config_ini_free(state);
-				return -1;
-			}
-			
-			/* Insert into section list. */
-			setting->name = NULL;
-			setting->value = NULL;
+			/* Prepend to list of settings. */
+			config_ini_setting_t *setting = next_setting++;
+			setting->name = s;
+			setting->value = value;
+			setting->raw_value = value;
 			setting->next = section->settings;
 			section->settings = setting;
 
-			/* Copy name of setting. */
-			setting->name = malloc(end - s + 1);
-			if (setting->name == NULL) {
-				fclose(f);
-				config_ini_free(state);
-				return -1;
-			}
-
-			memcpy(setting->name, s, end - s + 1);
-
-			/* Copy setting value. */
-			size_t value_len = strlen(value) + 1;
-			setting->value = malloc(value_len);
-			if (setting->value == NULL) {
-				fclose(f);
-				config_ini_free(state);
-				return -1;
-			}
-
-			memcpy(setting->value, value, value_len);
-
-			/* Evaluate value */
+			/* Queue value for evaluation. */
 			#ifndef _WIN32
-			if (strlen(setting->value) > 3 &&
-			    strstr(setting->value, "$(") &&
-			    setting->value[strlen(setting->value) - 1] == ')') {
-				char* old_value = setting->value;
-				char* command = strstr(setting->value, "$(");
-				setting->value[strlen(setting->value) - 1] = '\0';
+			size_t value_len = strlen(value);
+			if (value_len > 3 &&
+			    strstr(value, "$(") &&
+			    value[value_len - 1] == ')') {
+				if (jobs == NULL) {
+					jobs = calloc(settings_n, sizeof(config_ini_job_t));
+					if (jobs == NULL) {
+						perror("calloc");
+						goto fail;
+					}
+				}
+				char* command = strstr(value, "$(");
+				value[value_len - 1] = '\0';
 				command[0] = '\0';
-				setting->value = config_ini_spawn(command + 2);
-				if (setting->value == NULL)
-					setting->value = old_value;
-				else
-					free(old_value);
-			} 
+				setting->command = command + 2;
+
+				/* Reuse the output from the previous load if
+				   the setting has not changed. */
+				const char *output =
+					config_ini_find_evaluated(previous, section->name, setting);
+				if (output != NULL) {
+					setting->evaluated = strdup(output);
+					setting->value = strdup(output);
+					if (setting->evaluated != NULL && setting->value != NULL) {
+						setting->value_allocated = 1;
+						continue;
+					}
+					free(setting->evaluated);
+					free(setting->value);
+					setting->evaluated = NULL;
+					setting->value = value;
+				}
+
+				jobs[jobs_n].setting = setting;
+				jobs[jobs_n++].command = command + 2;
+			}
 			#endif
 		}
 	}
 
-	fclose(f);
+	config_ini_index_sections(state);
+
+#ifndef _WIN32
+	/* Evaluate values. */
+	if (jobs_n > 0) {
+		double span = trace_begin("config commands");
+		config_ini_evaluate(jobs, jobs_n, verbose);
+		trace_end_value("config commands", span, "commands", jobs_n);
+	}
+	free(jobs);
+#endif
 
 	return 0;
+
+fail:
+#ifndef _WIN32
+	free(jobs);
+#endif
+	config_ini_free(state);
+	return -1;
 }
 
 void
@@ -378,65 +773,382 @@ config_ini_free(config_ini_state_t *state)
 {
 	config_ini_section_t *section = state->sections;
 
-	while (section != NULL) {
+	for (; section != NULL; section = section->next) {
 		config_ini_setting_t *setting = section->settings;
-		config_ini_section_t *section_prev = section;
-
-		while (setting != NULL) {
-			config_ini_setting_t *setting_prev = setting;
-			free(setting->name);
-			free(setting->value);
-			setting = setting->next;
-			free(setting_prev);
+		for (; setting != NULL; setting = setting->next) {
+			if (setting->value_allocated)
+				free(setting->value);
+			free(setting->evaluated);
 		}
-
-		free(section->name);
-		section = section->next;
-		free(section_prev);
 	}
+
+	free(state->arena);
+	free(state->filepath);
+
+#ifndef _WIN32
+	if (state->buffer_mapped)
+		munmap(state->buffer, state->buffer_mapped);
+	else
+#endif
+		free(state->buffer);
+
+	memset(state, 0, sizeof(*state));
 }
 
 config_ini_section_t *
 config_ini_get_section(const config_ini_state_t *state, const char *name)
 {
-	config_ini_section_t *section = state->sections;
-	while (section != NULL) {
-		if (strcasecmp(section->name, name) == 0) {
-			return section;
-		}
-		section = section->next;
-	}
+	if (state->index_size == 0) return NULL;
 
-	return NULL;
+	/* Later sections override earlier sections. */
+	return find_index(state, name)->first;
 }
 
 config_ini_section_t **
 config_ini_get_sections(const config_ini_state_t *state, const char *name)
 {
-	config_ini_section_t **sections = malloc(1 * sizeof(config_ini_section_t*));
+	config_ini_section_t *section = NULL;
+	size_t count = 0;
+
+	if (state->index_size > 0) {
+		config_ini_index_t *entry = find_index(state, name);
+		section = entry->first;
+		count = entry->count;
+	}
+
+	config_ini_section_t **sections = malloc((count + 1) * sizeof(config_ini_section_t*));
 	if (sections == NULL) {
 		perror("malloc");
 		return NULL;
 	}
 
 	size_t ptr = 0;
-	config_ini_section_t *section = state->sections;
-	while (section != NULL) {
-		if (strcasecmp(section->name, name) == 0) {
-			sections[ptr++] = section;
- 
-			if ((ptr & -ptr) == ptr) {
-				sections = realloc(sections, (ptr << 1) * sizeof(config_ini_section_t*));
-				if (sections == NULL) {
-					perror("realloc");
-					return NULL;
-				}
-			}
-		}
- 
-		section = section->next;
-	}
+	for (; section != NULL; section = section->next_same)
+		sections[ptr++] = section;
 
 	sections[ptr] = NULL;
 	return sections;
 }
+
+
+/* Binary snapshot of an evaluated config file. The header is
+   followed by the section records, the setting records, grouped
+   by section, and NUL-terminated strings referred to by offset.
+   The records are in the order of the lists, the last in the
+   file first. */
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t sections;
+	uint32_t settings;
+	uint32_t strings_size;
+	/* Offset of the path of the config file. */
+	uint32_t source_path;
+	uint32_t source_mtime_nsec;
+	int64_t source_mtime;
+	uint64_t source_size;
+} config_ini_snapshot_header_t;
+
+typedef struct {
+	uint32_t name;
+	uint32_t settings;
+} config_ini_snapshot_section_t;
+
+typedef struct {
+	uint32_t name;
+	uint32_t value;
+} config_ini_snapshot_setting_t;
+
+#define CONFIG_INI_SNAPSHOT_MAGIC  "RSCONFIG"
+
+
+int
+config_ini_cache_path(char *path, size_t size, const char *name, int create)
+{
+	char *env;
+
+	if ((env = getenv("XDG_CACHE_HOME")) != NULL && env[0] != '\0') {
+		snprintf(path, size, "%s", env);
+	} else if ((env = getenv("HOME")) != NULL && env[0] != '\0') {
+		snprintf(path, size, "%s/.cache", env);
+	} else {
+#ifndef _WIN32
+		struct passwd *pwd = getpwuid(getuid());
+		if (pwd == NULL || pwd->pw_dir == NULL || pwd->pw_dir[0] == '\0')
+			return -1;
+		snprintf(path, size, "%s/.cache", pwd->pw_dir);
+#else
+		return -1;
+#endif
+	}
+
+	if (create) {
+#ifndef _WIN32
+		mkdir(path, 0700);
+		strncat(path, "/redshift", size - strlen(path) - 1);
+		if (mkdir(path, 0700) && errno != EEXIST) {
+			perror("mkdir");
+			return -1;
+		}
+#else
+		strncat(path, "/redshift", size - strlen(path) - 1);
+#endif
+	} else {
+		strncat(path, "/redshift", size - strlen(path) - 1);
+	}
+
+	strncat(path, "/", size - strlen(path) - 1);
+	strncat(path, name, size - strlen(path) - 1);
+	return 0;
+}
+
+int
+config_ini_write_snapshot(const config_ini_state_t *state, char **path_out)
+{
+	config_ini_snapshot_header_t header;
+	config_ini_section_t *section;
+	config_ini_setting_t *setting;
+	char path[MAX_CONFIG_PATH];
+	char tmp_path[MAX_CONFIG_PATH + 4];
+	size_t strings_size, i, j;
+	char *strings;
+
+	if (state->filepath == NULL) {
+		fputs(_("No config file to compile.\n"), stderr);
+		return -1;
+	}
+
+	if (config_ini_cache_path(path, sizeof(path), "config.snapshot", 1) < 0) {
+		fputs(_("Cannot determine the cache directory.\n"), stderr);
+		return -1;
+	}
+
+	/* Measure. */
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CONFIG_INI_SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = CONFIG_INI_SNAPSHOT_VERSION;
+	strings_size = strlen(state->filepath) + 1;
+	for (section = state->sections; section != NULL; section = section->next) {
+		header.sections++;
+		strings_size += strlen(section->name) + 1;
+		for (setting = section->settings; setting != NULL; setting = setting->next) {
+			header.settings++;
+			strings_size += strlen(setting->name) + 1;
+			strings_size += strlen(setting->value) + 1;
+		}
+	}
+	header.strings_size = (uint32_t)strings_size;
+	header.source_path = 0;
+	header.source_mtime = (int64_t)state->source_mtime;
+	header.source_mtime_nsec = (uint32_t)state->source_mtime_nsec;
+	header.source_size = (uint64_t)state->source_size;
+
+	config_ini_snapshot_section_t *sections =
+		calloc(header.sections + 1, sizeof(config_ini_snapshot_section_t));
+	config_ini_snapshot_setting_t *settings =
+		calloc(header.settings + 1, sizeof(config_ini_snapshot_setting_t));
+	strings = malloc(strings_size);
+	if (sections == NULL || settings == NULL || strings == NULL) {
+		perror("malloc");
+		goto fail;
+	}
+
+	/* Lay out. */
+#define __add_string(STR, OFFSET)				\
+	do {							\
+		size_t n__ = strlen(STR) + 1;			\
+		memcpy(strings + (OFFSET), STR, n__);		\
+		(OFFSET) += n__;				\
+	} while (0)
+
+	size_t offset = 0;
+	__add_string(state->filepath, offset);
+	for (i = 0, j = 0, section = state->sections; section != NULL;
+	     section = section->next, i++) {
+		sections[i].name = (uint32_t)offset;
+		__add_string(section->name, offset);
+		for (setting = section->settings; setting != NULL;
+		     setting = setting->next, j++) {
+			sections[i].settings++;
+			settings[j].name = (uint32_t)offset;
+			__add_string(setting->name, offset);
+			settings[j].value = (uint32_t)offset;
+			__add_string(setting->value, offset);
+		}
+	}
+
+#undef __add_string
+
+	/* Write to a temporary file and move it into place,
+	   so that a running program never sees a partial file. */
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	FILE *f = fopen(tmp_path, "wb");
+	if (f == NULL) {
+		perror("fopen");
+		goto fail;
+	}
+	if (fwrite(&header, sizeof(header), 1, f) != 1 ||
+	    (header.sections > 0 &&
+	     fwrite(sections, sizeof(*sections), header.sections, f) != header.sections) ||
+	    (header.settings > 0 &&
+	     fwrite(settings, sizeof(*settings), header.settings, f) != header.settings) ||
+	    fwrite(strings, 1, strings_size, f) != strings_size) {
+		perror("fwrite");
+		fclose(f);
+		unlink(tmp_path);
+		goto fail;
+	}
+	if (fclose(f)) {
+		perror("fclose");
+		unlink(tmp_path);
+		goto fail;
+	}
+	if (rename(tmp_path, path)) {
+		perror("rename");
+		unlink(tmp_path);
+		goto fail;
+	}
+
+	free(sections);
+	free(settings);
+	free(strings);
+
+	if (path_out != NULL) *path_out = strdup(path);
+	return 0;
+
+fail:
+	free(sections);
+	free(settings);
+	free(strings);
+	return -1;
+}
+
+int
+config_ini_load_snapshot(config_ini_state_t *state, const char *filepath)
+{
+	config_ini_snapshot_header_t header;
+	char path[MAX_CONFIG_PATH];
+	struct stat attr;
+	size_t i, j;
+
+	memset(state, 0, sizeof(*state));
+
+	if (config_ini_cache_path(path, sizeof(path), "config.snapshot", 0) < 0)
+		return 0;
+
+	int f = open(path, O_RDONLY);
+	if (f < 0) return 0;
+	int r = load_config_file(state, f);
+	close(f);
+	if (r < 0) return 0;
+
+	/* Validate the snapshot. */
+	if (state->buffer_size < sizeof(header))
+		goto invalid;
+	memcpy(&header, state->buffer, sizeof(header));
+	if (memcmp(header.magic, CONFIG_INI_SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+	    header.version != CONFIG_INI_SNAPSHOT_VERSION)
+		goto invalid;
+
+	size_t records_size =
+		header.sections * sizeof(config_ini_snapshot_section_t) +
+		header.settings * sizeof(config_ini_snapshot_setting_t);
+	if (header.sections > state->buffer_size || header.settings > state->buffer_size ||
+	    sizeof(header) + records_size + header.strings_size != state->buffer_size ||
+	    header.strings_size == 0)
+		goto invalid;
+
+	config_ini_snapshot_section_t *sections =
+		(config_ini_snapshot_section_t *)(state->buffer + sizeof(header));
+	config_ini_snapshot_setting_t *settings =
+		(config_ini_snapshot_setting_t *)(sections + header.sections);
+	char *strings = (char *)(settings + header.settings);
+
+	/* All strings are terminated if the last one is. */
+	if (strings[header.strings_size - 1] != '\0' ||
+	    header.source_path >= header.strings_size)
+		goto invalid;
+
+	/* The snapshot must be of the config file that would be
+	   loaded, which is searched for unless it is given, and
+	   the config file must not have changed. */
+	const char *source = strings + header.source_path;
+	if (filepath == NULL) {
+		char *found = NULL;
+		f = open_config_file(NULL, &found);
+		if (f < 0) goto unusable;
+		r = fstat(f, &attr);
+		close(f);
+		if (found == NULL || strcmp(found, source) != 0) {
+			free(found);
+			goto unusable;
+		}
+		free(found);
+	} else {
+		if (strcmp(filepath, source) != 0)
+			goto unusable;
+		r = stat(source, &attr);
+	}
+	if (r ||
+	    (int64_t)attr.st_mtime != header.source_mtime ||
+#ifdef __linux__
+	    (uint32_t)attr.st_mtim.tv_nsec != header.source_mtime_nsec ||
+#endif
+	    (uint64_t)attr.st_size != header.source_size) {
+		fprintf(stderr, _("Config snapshot is out of date, run"
+				  " `redshift --compile-config' to update it.\n"));
+		goto unusable;
+	}
+
+	/* Build the sections and settings. */
+	config_ini_section_t *next_section;
+	config_ini_setting_t *next_setting;
+	if (config_ini_alloc(state, header.sections, header.settings,
+			     &next_section, &next_setting) < 0)
+		goto unusable;
+
+	config_ini_section_t **section_tail = &state->sections;
+	for (i = 0, j = 0; i < header.sections; i++) {
+		config_ini_section_t *section = next_section++;
+		config_ini_setting_t **setting_tail = &section->settings;
+
+		if (sections[i].name >= header.strings_size ||
+		    sections[i].settings > header.settings - j)
+			goto invalid;
+
+		section->name = strings + sections[i].name;
+		*section_tail = section;
+		section_tail = &section->next;
+
+		for (uint32_t k = 0; k < sections[i].settings; k++, j++) {
+			config_ini_setting_t *setting = next_setting++;
+			if (settings[j].name >= header.strings_size ||
+			    settings[j].value >= header.strings_size)
+				goto invalid;
+			setting->name = strings + settings[j].name;
+			setting->value = strings + settings[j].value;
+			setting->raw_value = setting->value;
+			*setting_tail = setting;
+			setting_tail = &setting->next;
+		}
+	}
+
+	config_ini_index_sections(state);
+
+	state->filepath = strdup(source);
+	if (state->filepath == NULL) {
+		perror("strdup");
+		goto unusable;
+	}
+	state->source_mtime = (time_t)header.source_mtime;
+	state->source_mtime_nsec = (long)header.source_mtime_nsec;
+	state->source_size = (size_t)header.source_size;
+
+	return 1;
+
+invalid:
+	fprintf(stderr, _("Ignoring invalid config snapshot `%s'.\n"), path);
+unusable:
+	config_ini_free(state);
+	return 0;
+}
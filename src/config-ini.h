@@ -21,27 +21,89 @@
 #ifndef REDSHIFT_CONFIG_INI_H
 #define REDSHIFT_CONFIG_INI_H
 
+#include <stddef.h>
+#include <time.h>
+
+/* Format version of binary config snapshots. */
+#define CONFIG_INI_SNAPSHOT_VERSION  2
+
+/* Seconds a `$(...)` command in the config file may run. */
+#ifndef CONFIG_INI_COMMAND_TIMEOUT
+# define CONFIG_INI_COMMAND_TIMEOUT  5.0
+#endif
+
+/* Seconds all `$(...)` commands in the config file
+   may run, together, they are run in parallel. */
+#ifndef CONFIG_INI_TOTAL_TIMEOUT
+# define CONFIG_INI_TOTAL_TIMEOUT  10.0
+#endif
+
 typedef struct _config_ini_section config_ini_section_t;
 typedef struct _config_ini_setting config_ini_setting_t;
 
 struct _config_ini_setting {
 	config_ini_setting_t *next;
+	/* Slices of the loaded file, unless `value_allocated`
+	   is set, in which case `value` is owned by the setting. */
 	char *name;
 	char *value;
+	int value_allocated;
+	/* The value as written, up to `$(` if it contains a
+	   command, and the command, or NULL if there is none. */
+	char *raw_value;
+	char *command;
+	/* The output of the command, if it succeeded, kept
+	   unmodified so that it can be reused. */
+	char *evaluated;
 };
 
 struct _config_ini_section {
+	/* The previous section in the file. */
 	config_ini_section_t *next;
+	/* The previous section in the file with the same name. */
+	config_ini_section_t *next_same;
 	char *name;
+	/* The settings, the last in the file first. */
 	config_ini_setting_t *settings;
 };
 
+/* Hash index entry, one per distinct section name. */
 typedef struct {
+	config_ini_section_t *first;
+	config_ini_section_t *last;
+	size_t count;
+} config_ini_index_t;
+
+typedef struct {
+	/* The path of the loaded file, NULL if none was found. */
+	char *filepath;
+	/* The sections, the last in the file first. */
 	config_ini_section_t *sections;
+	/* The contents of the file, `buffer_mapped` is the length
+	   of the mapping if it is mapped rather than allocated. */
+	char *buffer;
+	size_t buffer_size;
+	size_t buffer_mapped;
+	/* The modification time and size of the file,
+	   used to tell whether a snapshot is up to date. */
+	time_t source_mtime;
+	long source_mtime_nsec;
+	size_t source_size;
+	/* Single allocation holding all sections,
+	   settings and the hash index. */
+	void *arena;
+	/* Open addressing hash table over case-folded section
+	   names, the size is zero or a power of two. */
+	config_ini_index_t *index;
+	size_t index_size;
 } config_ini_state_t;
 
 
-int config_ini_init(config_ini_state_t *state, const char *filepath);
+/* Load a config file, `previous`, which may be NULL, is a previously
+   loaded config file whose evaluated `$(...)` values are reused for
+   settings that are unchanged. */
+int config_ini_init(config_ini_state_t *state, const char *filepath,
+		    const config_ini_state_t *previous, int verbose);
 void config_ini_free(config_ini_state_t *state);
 
 config_ini_section_t *config_ini_get_section(const config_ini_state_t *state,
@@ -50,4 +112,17 @@ config_ini_section_t *config_ini_get_section(const config_ini_state_t *state,
 config_ini_section_t **config_ini_get_sections(const config_ini_state_t *state,
 					       const char *name) __attribute__((pure));
 
+/* Get the path of the file `name' in redshift's directory under the XDG
+   cache directory, the directory is created if `create' is nonzero. */
+int config_ini_cache_path(char *path, size_t size, const char *name, int create);
+
+/* Write a binary snapshot of a loaded config file, with the
+   output of its commands, to the cache directory. */
+int config_ini_write_snapshot(const config_ini_state_t *state, char **path_out);
+
+/* Load the snapshot instead of a config file, if it is of `filepath',
+   or any config file if NULL, and it has not changed since the snapshot
+   was made. Returns 1 if loaded, otherwise zero. */
+int config_ini_load_snapshot(config_ini_state_t *state, const char *filepath);
+
 #endif /* ! REDSHIFT_CONFIG_INI_H */
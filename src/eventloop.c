@@ -0,0 +1,178 @@
+/* eventloop.c -- Main loop event dispatching source
+   This file is part of Redshift.
+
+   Redshift is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Redshift is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Redshift.  If not, see <http://www.gnu.org/licenses/>.
+
+   Copyright (c) 2014  Mattias Andrée <maandree@member.fsf.org>
+*/
+
+#include "eventloop.h"
+#include "systemtime.h"
+
+#include <alloca.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifndef _WIN32
+# include <poll.h>
+#endif
+
+
+typedef struct {
+	int fd;
+	eventloop_callback_func *callback;
+	void *data;
+} eventloop_watch_t;
+
+
+static eventloop_watch_t *watches = NULL;
+static size_t watches_used = 0;
+static size_t watches_alloc = 0;
+
+
+int
+eventloop_init(void)
+{
+	watches = NULL;
+	watches_used = 0;
+	watches_alloc = 0;
+	return 0;
+}
+
+void
+eventloop_free(void)
+{
+	free(watches);
+	watches = NULL;
+	watches_used = 0;
+	watches_alloc = 0;
+	systemtime_jump_close();
+}
+
+
+/* Watch a file descriptor. */
+int
+eventloop_add(int fd, eventloop_callback_func *callback, void *data)
+{
+	if (watches_used == watches_alloc) {
+		size_t n = watches_alloc ? watches_alloc << 1 : 4;
+		eventloop_watch_t *new_watches =
+			realloc(watches, n * sizeof(eventloop_watch_t));
+		if (new_watches == NULL) {
+			perror("realloc");
+			return -1;
+		}
+		watches = new_watches;
+		watches_alloc = n;
+	}
+
+	watches[watches_used].fd = fd;
+	watches[watches_used].callback = callback;
+	watches[watches_used].data = data;
+	watches_used++;
+	return 0;
+}
+
+/* Stop watching a file descriptor. */
+void
+eventloop_remove(int fd)
+{
+	for (size_t i = 0; i < watches_used; i++) {
+		if (watches[i].fd == fd) {
+			memmove(watches + i, watches + i + 1,
+				(watches_used - i - 1) * sizeof(eventloop_watch_t));
+			watches_used--;
+			return;
+		}
+	}
+}
+
+
+#ifndef _WIN32
+
+/* Check that a watch from a snapshot has not been removed. */
+static int
+eventloop_watching(const eventloop_watch_t *watch)
+{
+	for (size_t i = 0; i < watches_used; i++) {
+		if (watches[i].fd == watch->fd &&
+		    watches[i].callback == watch->callback &&
+		    watches[i].data == watch->data)
+			return 1;
+	}
+	return 0;
+}
+
+/* Wait for events or a timeout, and dispatch events. */
+int
+eventloop_wait(double seconds, double *jump, int *resumed)
+{
+	int jump_fd = systemtime_jump_fd();
+	size_t n = watches_used + (jump_fd >= 0 ? 1 : 0);
+	struct pollfd *fds = NULL;
+	eventloop_watch_t *snapshot = NULL;
+	int r;
+
+	*jump = 0;
+	*resumed = 0;
+
+	seconds = systemtime_begin_sleep(seconds);
+
+	if (n > 0) {
+		fds = alloca(n * sizeof(struct pollfd));
+		snapshot = alloca((watches_used + 1) * sizeof(eventloop_watch_t));
+		memcpy(snapshot, watches, watches_used * sizeof(eventloop_watch_t));
+	}
+	for (size_t i = 0; i < watches_used; i++) {
+		fds[i].fd = watches[i].fd;
+		fds[i].events = POLLIN;
+		fds[i].revents = 0;
+	}
+	if (jump_fd >= 0) {
+		fds[n - 1].fd = jump_fd;
+		fds[n - 1].events = POLLIN;
+		fds[n - 1].revents = 0;
+	}
+
+	r = poll(fds, (nfds_t)n, (int)(seconds * 1000.0 + 0.5));
+	if (r < 0 && errno != EINTR) {
+		perror("poll");
+		return 0;
+	}
+
+	/* Dispatch using a snapshot so that callbacks can
+	   add and remove watches. */
+	for (size_t i = 0; r > 0 && i + (jump_fd >= 0 ? 1 : 0) < n; i++) {
+		if (fds[i].revents == 0 || !eventloop_watching(snapshot + i))
+			continue;
+		snapshot[i].callback(snapshot[i].fd, snapshot[i].data);
+	}
+
+	return systemtime_jumped(jump, resumed);
+}
+
+#else /* ! _WIN32 */
+
+int
+eventloop_wait(double seconds, double *jump, int *resumed)
+{
+	*jump = 0;
+	*resumed = 0;
+	systemtime_sleep(seconds);
+	return 0;
+}
+
+#endif /* ! _WIN32 */
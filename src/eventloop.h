@@ -0,0 +1,44 @@
+/* eventloop.h -- Main loop event dispatching header
+   This file is part of Redshift.
+
+   Redshift is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Redshift is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Redshift.  If not, see <http://www.gnu.org/licenses/>.
+
+   Copyright (c) 2014  Mattias Andrée <maandree@member.fsf.org>
+*/
+
+#ifndef REDSHIFT_EVENTLOOP_H
+#define REDSHIFT_EVENTLOOP_H
+
+
+/* Function called when a watched file descriptor is readable. */
+typedef void eventloop_callback_func(int fd, void *data);
+
+
+int eventloop_init(void);
+void eventloop_free(void);
+
+/* Watch a file descriptor. */
+int eventloop_add(int fd, eventloop_callback_func *callback, void *data);
+/* Stop watching a file descriptor. */
+void eventloop_remove(int fd);
+
+/* Wait for at most `seconds' seconds, as measured by the program's
+   clock, and dispatch events. Returns early when an event has been
+   dispatched or a signal is caught. Returns 1, and stores the size
+   of the jump in `jump', if the system clock has jumped or the system
+   has resumed from suspend, otherwise 0. */
+int eventloop_wait(double seconds, double *jump, int *resumed);
+
+
+#endif /* ! REDSHIFT_EVENTLOOP_H */
@@ -0,0 +1,100 @@
+/* filewatch.c -- Watching files for changes source
+   This file is part of Redshift.
+
+   Redshift is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Redshift is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Redshift.  If not, see <http://www.gnu.org/licenses/>.
+
+   Copyright (c) 2014  Mattias Andrée <maandree@member.fsf.org>
+*/
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#ifdef __linux__
+
+#include "filewatch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+
+int
+filewatch_open(const char *path, uint32_t events, char **name)
+{
+	int fd;
+
+	*name = NULL;
+	char *dir = strdup(path);
+	if (dir == NULL) {
+		perror("strdup");
+		return -1;
+	}
+
+	char *slash = strrchr(dir, '/');
+	if (slash == NULL) {
+		*name = strdup(dir);
+		strcpy(dir, ".");
+	} else {
+		*name = strdup(slash + 1);
+		if (slash == dir) slash++;
+		*slash = '\0';
+	}
+	if (*name == NULL) {
+		perror("strdup");
+		free(dir);
+		return -1;
+	}
+
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0) {
+		perror("inotify_init1");
+		free(dir);
+		return -1;
+	}
+
+	if (inotify_add_watch(fd, dir, events) < 0) {
+		perror("inotify_add_watch");
+		close(fd);
+		free(dir);
+		return -1;
+	}
+
+	free(dir);
+	return fd;
+}
+
+int
+filewatch_changed(int fd, const char *name)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	int relevant = 0;
+	ssize_t got;
+
+	while ((got = read(fd, buf, sizeof(buf))) > 0) {
+		char *p = buf;
+		while (p < buf + got) {
+			struct inotify_event *event = (struct inotify_event *)p;
+			if (event->len > 0 && strcmp(event->name, name) == 0)
+				relevant = 1;
+			p += sizeof(struct inotify_event) + event->len;
+		}
+	}
+
+	return relevant;
+}
+
+#endif
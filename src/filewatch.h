@@ -0,0 +1,43 @@
+/* filewatch.h -- Watching files for changes header
+   This file is part of Redshift.
+
+   Redshift is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Redshift is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Redshift.  If not, see <http://www.gnu.org/licenses/>.
+
+   Copyright (c) 2014  Mattias Andrée <maandree@member.fsf.org>
+*/
+
+#ifndef REDSHIFT_FILEWATCH_H
+#define REDSHIFT_FILEWATCH_H
+
+#ifdef __linux__
+
+#include <stdint.h>
+
+
+/* Watch the directory of a file, rather than the file itself, so
+   that files that are replaced are also seen. `events' are the
+   inotify events to watch for. Returns a file descriptor that
+   becomes readable when the directory changes, or -1 on error.
+   The name of the file in the directory is stored in `*name', and
+   must be freed, also on error. */
+int filewatch_open(const char *path, uint32_t events, char **name);
+
+/* Read the events on the file descriptor, returns 1 if
+   any of them was about the file named `name', otherwise 0. */
+int filewatch_changed(int fd, const char *name);
+
+#endif
+
+
+#endif /* ! REDSHIFT_FILEWATCH_H */
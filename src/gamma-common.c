@@ -18,13 +18,24 @@
 */
 
 #include "gamma-common.h"
+#include "gamma-io.h"
+#include "gamma-pool.h"
+#include "metrics.h"
+#include "trace.h"
 #include "adjustments.h"
 #include "colorramp.h"
+#include "config-ini.h"
+#include "systemtime.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <inttypes.h>
+#ifndef _WIN32
+# include <alloca.h>
+# include <poll.h>
+#endif
 
 #ifdef ENABLE_NLS
 # include <libintl.h>
@@ -44,6 +55,25 @@ gamma_init(gamma_server_state_t *state)
 	state->data = NULL;
 	state->sites_used = 0;
 	state->sites = NULL;
+	state->crtcs_used = 0;
+	state->crtcs = NULL;
+	state->read_ramps = NULL;
+	state->crtc_id = NULL;
+	state->refresh_partition = NULL;
+	state->hotplug_fd = NULL;
+	state->hotplug_handle = NULL;
+	state->send_ramps = NULL;
+	state->flush_site = NULL;
+	state->poll_site = NULL;
+	state->site_timeout = GAMMA_SITE_TIMEOUT;
+	state->io_thread = 0;
+	state->io = NULL;
+	state->ramp_workers = 0;
+	state->pool = NULL;
+	state->restore = 1;
+	state->ramps_read = 0;
+	state->arena = NULL;
+	state->allocations = 0;
 	state->selections_made = 1;
 	state->selections = malloc(sizeof(gamma_selection_state_t));
 
@@ -109,14 +139,85 @@ gamma_free_selections(gamma_server_state_t *state)
 }
 
 
+/* Whether an I/O thread has been left behind on any site. */
+static int
+gamma_threads_stuck(const gamma_server_state_t *state)
+{
+	for (size_t s = 0; s < state->sites_used; s++)
+		if (state->sites[s].thread_stuck)
+			return 1;
+	return 0;
+}
+
+/* Free the sites, partitions, CRTCs, site identifiers
+   and gamma ramps, but not the method dependent data. */
+static void
+gamma_free_storage(gamma_server_state_t *state)
+{
+	size_t s, p, c;
+	gamma_site_state_t *site;
+	gamma_partition_state_t *partition;
+	gamma_crtc_state_t *crtc;
+
+	/* Everything is in the arena once it has been created.
+	   It is never freed if an I/O thread that was left
+	   behind may still use the CRTCs in it. */
+	if (state->arena != NULL) {
+		if (!gamma_threads_stuck(state))
+			free(state->arena);
+		state->arena = NULL;
+		state->sites = NULL;
+		state->crtcs = NULL;
+		state->crtcs_used = 0;
+		return;
+	}
+
+	for (s = 0; s < state->sites_used; s++) {
+		site = state->sites + s;
+		for (p = 0; p < site->partitions_available; p++) {
+			partition = site->partitions + p;
+			if (partition->used == 0)
+				continue;
+			/* Free gamma ramps. */
+			for (c = 0; c < partition->crtcs_used; c++) {
+				crtc = partition->crtcs + c;
+				if (crtc->saved_ramps.red != NULL)
+					free(crtc->saved_ramps.red);
+				if (crtc->current_ramps.red != NULL)
+					free(crtc->current_ramps.red);
+			}
+			/* Free CRTC array. */
+			if (partition->crtcs != NULL)
+				free(partition->crtcs);
+		}
+		/* Free partition array. */
+		if (site->partitions != NULL)
+			free(site->partitions);
+
+		/* Free site identifier. */
+		if (site->site != NULL)
+			free(site->site);
+	}
+	/* Free site array. */
+	if (state->sites != NULL) {
+		free(state->sites);
+		state->sites = NULL;
+	}
+}
+
 /* Free all data in a state. */
-void
+int
 gamma_free(gamma_server_state_t *state)
 {
 	size_t s, p, c;
 	gamma_site_state_t *site;
 	gamma_partition_state_t *partition;
 	gamma_crtc_state_t *crtc;
+	int stuck;
+
+	/* Stop the I/O threads before the sites are closed. */
+	gamma_io_stop(state);
+	gamma_pool_stop(state);
 
 	/* Free selections. */
 	gamma_free_selections(state);
@@ -145,117 +246,33 @@ gamma_free(gamma_server_state_t *state)
 					free(crtc->settings.lut_post);
 				}
 
-				/* Free gamma ramps. */
-				if (crtc->saved_ramps.red != NULL)
-					free(crtc->saved_ramps.red);
-				if (crtc->current_ramps.red != NULL)
-					free(crtc->current_ramps.red);
-
 				/* Free method dependent CRTC data. */
-				if (crtc->data != NULL)
+				if (crtc->data != NULL && !site->thread_stuck)
 					state->free_crtc_data(crtc->data);
 			}
-			/* Free CRTC array. */
-			if (partition->crtcs != NULL)
-				free(partition->crtcs);
 
 			/* Free method dependent partition data. */
-			if (partition->data != NULL)
+			if (partition->data != NULL && !site->thread_stuck)
 				state->free_partition_data(partition->data);
 		}
-		/* Free partition array. */
-		if (site->partitions != NULL)
-			free(site->partitions);
 
-		/* Free site identifier. */
-		if (site->site != NULL)
-			free(site->site);
-
-		/* Free method dependent site data. */
-		if (site->data != NULL)
+		/* Free method dependent site data, unless
+		   an I/O thread may still be stuck on it. */
+		if (site->data != NULL && !site->thread_stuck)
 			state->free_site_data(site->data);
 	}
-	/* Free site array. */
-	if (state->sites != NULL) {
-		free(state->sites);
-		state->sites = NULL;
-	}
 
-	/* Free method dependent state data. */
-	if (state->data != NULL) {
+	/* Free method dependent state data, unless
+	   an I/O thread may still be stuck using it. */
+	stuck = gamma_threads_stuck(state);
+	if (state->data != NULL && !stuck) {
 		state->free_state_data(state->data);
 		state->data = NULL;
 	}
-}
 
-
-/* Create CRTC iterator. */
-gamma_iterator_t
-gamma_iterator(gamma_server_state_t *state)
-{
-	gamma_iterator_t iterator = {
-		.crtc      = NULL,
-		.partition = NULL,
-		.site      = NULL,
-		.state     = state
-	};
-	return iterator;
-}
-
-
-/* Get next CRTC. */
-int
-gamma_iterator_next(gamma_iterator_t *iterator)
-{
-	/* First CRTC. */
-	if (iterator->crtc == NULL) {
-		if (iterator->state->sites_used == 0)
-			return 0;
-		iterator->site      = iterator->state->sites;
-		iterator->partition = iterator->site->partitions;
-		gamma_partition_state_t *partitions_end =
-			iterator->site->partitions +
-			iterator->site->partitions_available;
-		while (iterator->partition->used == 0) {
-			iterator->partition++;
-			if (iterator->partition == partitions_end)
-				return 0;
-		}
-		if (iterator->partition->crtcs_used == 0)
-			return 0;
-		iterator->crtc = iterator->partition->crtcs;
-		return 1;
-	}
-
-	/* Next CRTC. */
-	size_t crtc_i      = (size_t)(iterator->crtc - iterator->partition->crtcs) + 1;
-	size_t partition_i = iterator->crtc->partition;
-	size_t site_i      = iterator->crtc->site_index;
-
-	if (crtc_i == iterator->partition->crtcs_used) {
-		crtc_i = 0;
-		partition_i += 1;
-	}
-next_partition:
-	if (partition_i == iterator->site->partitions_available) {
-		partition_i = 0;
-		site_i += 1;
-	}
-	if (site_i == iterator->state->sites_used)
-		return 0;
-	if (iterator->state->sites[site_i].partitions[partition_i].used == 0 ||
-	    iterator->state->sites[site_i].partitions[partition_i].crtcs_used == 0) {
-		/* Because of `state->parse_selection` and `ignorable`
-		   it is possible to have a partition that is initalised
-		   but not used. This is when used ≠ 0 but crtcs_used = 0. */
-		partition_i += 1;
-		goto next_partition;
-	}
-
-	iterator->site      = iterator->state->sites     + site_i;
-	iterator->partition = iterator->site->partitions + partition_i;
-	iterator->crtc      = iterator->partition->crtcs + crtc_i;
-	return 1;
+	/* Free the sites, partitions, CRTCs and gamma ramps. */
+	gamma_free_storage(state);
+	return stuck ? -1 : 0;
 }
 
 
@@ -301,11 +318,17 @@ gamma_open_site(gamma_server_state_t *state, size_t site_index,
 		goto fail;
 	}
 	state->sites = new_sites;
+	state->allocations += 1;
 	site = state->sites + site_index;
 
 	/* Make sure these are not freed before allocated on error. */
 	site->site = NULL;
 	site->partitions = NULL;
+	site->degraded = 0;
+	site->failed = 0;
+	site->thread_stuck = 0;
+	site->pending = 0;
+	site->pending_fd = -1;
 
 	r = state->open_site(state, site_name, site);
 	if (r != 0) {
@@ -322,6 +345,7 @@ gamma_open_site(gamma_server_state_t *state, size_t site_index,
 			perror("strdup");
 			goto fail;
 		}
+		state->allocations += 1;
 	}
 
 	/* calloc is used so that `used` in each partition is set to false. */
@@ -332,6 +356,7 @@ gamma_open_site(gamma_server_state_t *state, size_t site_index,
 		perror(state->sites != NULL ? "realloc" : "malloc");
 		goto fail;
 	}
+	state->allocations += 1;
 
 	*site_out = site;
 	return 0;
@@ -346,22 +371,32 @@ static int
 gamma_open_crtc(gamma_server_state_t *state, gamma_site_state_t *site,
 		gamma_partition_state_t *partition, size_t site_index,
 		size_t partition_index, size_t crtc_index,
-		gamma_selection_state_t *selection)
+		gamma_selection_state_t *selection, size_t selection_index)
 {
 	int rc = -1, r;
 
 	gamma_crtc_state_t *crtc = partition->crtcs + partition->crtcs_used;
-	size_t total_ramp_size = 0, rrs, grs;
-	uint16_t *ramps;
+
+	/* The method only sets the sizes of the saved
+	   ramps, unless it reads them right away. */
+	crtc->saved_ramps.red = NULL;
+	crtc->saved_ramps.green = NULL;
+	crtc->saved_ramps.blue = NULL;
 
 	r = state->open_crtc(state, site, partition, crtc_index, crtc);
 	if (r != 0) {
 		rc = r;
 		goto fail;
 	}
+	crtc->saved_ramps_read = crtc->saved_ramps.red != NULL;
+	if (crtc->saved_ramps_read)
+		state->ramps_read += 1;
 	crtc->crtc = crtc_index;
 	crtc->partition = partition_index;
 	crtc->site_index = site_index;
+	crtc->selection = selection_index;
+	crtc->id = state->crtc_id == NULL ? crtc_index :
+		   state->crtc_id(state, site, partition, crtc_index);
 	partition->crtcs_used += 1;
 
 	/* Store adjustment settigns. */
@@ -371,20 +406,12 @@ gamma_open_crtc(gamma_server_state_t *state, gamma_site_state_t *site,
 	if (selection->preserve_calibrations)
 		crtc->settings.lut_calibration = &(crtc->saved_ramps);
 
-	/* Create crtc->current_ramps. */
+	/* crtc->current_ramps is allocated with
+	   the arena, once all CRTCs are opened. */
 	crtc->current_ramps = crtc->saved_ramps;
-	total_ramp_size += rrs = crtc->current_ramps.red_size;
-	total_ramp_size += grs = crtc->current_ramps.green_size;
-	total_ramp_size +=       crtc->current_ramps.blue_size;
-	total_ramp_size *= sizeof(uint16_t);
-	ramps = malloc(total_ramp_size);
-	crtc->current_ramps.red   = ramps;
-	crtc->current_ramps.green = ramps + rrs;
-	crtc->current_ramps.blue  = ramps + rrs + grs;
-	if (ramps == NULL) {
-		perror("malloc");
-		goto fail;
-	}
+	crtc->current_ramps.red   = NULL;
+	crtc->current_ramps.green = NULL;
+	crtc->current_ramps.blue  = NULL;
 
 	return 0;
 
@@ -451,7 +478,8 @@ fail:
 static int
 gamma_open_crtcs(gamma_server_state_t *state, gamma_site_state_t *site,
 		 size_t site_index, size_t partition_index,
-		 gamma_selection_state_t *selection, int all_crtcs)
+		 gamma_selection_state_t *selection, size_t selection_index,
+		 int all_crtcs)
 {
 	int rc = -1, r;
 	gamma_partition_state_t *partition = site->partitions + partition_index;
@@ -487,6 +515,7 @@ gamma_open_crtcs(gamma_server_state_t *state, gamma_site_state_t *site,
 		goto fail;
 	}
 	partition->crtcs = new_crtcs;
+	state->allocations += 1;
 
 	for (size_t c = 0; c < selection->crtcs_count; c++) {
 		size_t crtc_index = selection->crtcs[c];
@@ -506,13 +535,23 @@ gamma_open_crtcs(gamma_server_state_t *state, gamma_site_state_t *site,
 
 		/* Open CRTC. */
 		r = gamma_open_crtc(state, site, partition, site_index,
-				    partition_index, crtc_index, selection);
+				    partition_index, crtc_index, selection,
+				    selection_index);
 		if (r != 0) {
 			rc = r;
 			goto fail;
 		}
 	}
 
+	/* Remember how to open CRTCs that appear later. */
+	if (all_crtcs) {
+		partition->all_crtcs = 1;
+		partition->selection = selection_index;
+		partition->settings = selection->settings;
+		partition->settings.lut_calibration = NULL;
+		partition->preserve_calibrations = selection->preserve_calibrations;
+	}
+
 	return 0;
 
 fail:
@@ -520,6 +559,134 @@ fail:
 }
 
 
+/* Round up to a multiple of GAMMA_RAMP_ALIGNMENT. */
+#define gamma_align(N)  (((N) + GAMMA_RAMP_ALIGNMENT - 1) & ~(size_t)(GAMMA_RAMP_ALIGNMENT - 1))
+
+/* The aligned size of a gamma ramp. */
+#define gamma_ramp_size(N)  gamma_align((N) * sizeof(uint16_t))
+
+/* Move the sites, partitions, CRTCs, site identifiers and
+   gamma ramps into one allocation, with the gamma ramps,
+   saved and current, in a slab at the end of it. */
+static int
+gamma_create_arena(gamma_server_state_t *state)
+{
+	size_t s, p, c;
+	size_t sites_size, partitions_size = 0, crtcs_size = 0;
+	size_t names_size = 0, ramps_size = 0;
+	gamma_site_state_t *site;
+	gamma_partition_state_t *partition;
+	gamma_crtc_state_t *crtc;
+
+	/* Measure what is to be moved. */
+	sites_size = gamma_align(state->sites_used * sizeof(gamma_site_state_t));
+	for (s = 0; s < state->sites_used; s++) {
+		site = state->sites + s;
+		partitions_size += site->partitions_available;
+		if (site->site != NULL)
+			names_size += strlen(site->site) + 1;
+		for (p = 0; p < site->partitions_available; p++) {
+			partition = site->partitions + p;
+			if (partition->used == 0)
+				continue;
+			crtcs_size += partition->crtcs_used;
+			for (c = 0; c < partition->crtcs_used; c++) {
+				crtc = partition->crtcs + c;
+				ramps_size += 2 * gamma_ramp_size(crtc->saved_ramps.red_size);
+				ramps_size += 2 * gamma_ramp_size(crtc->saved_ramps.green_size);
+				ramps_size += 2 * gamma_ramp_size(crtc->saved_ramps.blue_size);
+			}
+		}
+	}
+	partitions_size = gamma_align(partitions_size * sizeof(gamma_partition_state_t));
+	crtcs_size = gamma_align(crtcs_size * sizeof(gamma_crtc_state_t));
+	names_size = gamma_align(names_size);
+
+	/* Allocate extra space so that the arena can be aligned. */
+	char *arena = calloc(sites_size + partitions_size + crtcs_size + names_size +
+			     ramps_size + GAMMA_RAMP_ALIGNMENT - 1, 1);
+	if (arena == NULL) {
+		perror("calloc");
+		return -1;
+	}
+	state->allocations += 1;
+
+	char *aligned = arena + (GAMMA_RAMP_ALIGNMENT - 1);
+	aligned -= (uintptr_t)aligned % GAMMA_RAMP_ALIGNMENT;
+	gamma_site_state_t *sites = (gamma_site_state_t *)aligned;
+	gamma_partition_state_t *partitions =
+		(gamma_partition_state_t *)(aligned + sites_size);
+	gamma_crtc_state_t *crtcs =
+		(gamma_crtc_state_t *)(aligned + sites_size + partitions_size);
+	char *names = aligned + sites_size + partitions_size + crtcs_size;
+	char *ramps = names + names_size;
+	gamma_crtc_state_t *crtcs_start = crtcs;
+	size_t crtcs_used = 0;
+
+	/* Copy the state into the arena. */
+	for (s = 0; s < state->sites_used; s++) {
+		site = sites + s;
+		*site = state->sites[s];
+		if (site->site != NULL) {
+			size_t n = strlen(site->site) + 1;
+			site->site = memcpy(names, site->site, n);
+			names += n;
+		}
+		site->partitions = memcpy(partitions, site->partitions,
+					  site->partitions_available * sizeof(gamma_partition_state_t));
+		partitions += site->partitions_available;
+		site->crtcs_offset = crtcs_used;
+
+		for (p = 0; p < site->partitions_available; p++) {
+			partition = site->partitions + p;
+			partition->crtcs_offset = crtcs_used;
+			if (partition->used == 0 || partition->crtcs_used == 0) {
+				partition->crtcs = NULL;
+				continue;
+			}
+			partition->crtcs = memcpy(crtcs, partition->crtcs,
+						  partition->crtcs_used * sizeof(gamma_crtc_state_t));
+			crtcs += partition->crtcs_used;
+			crtcs_used += partition->crtcs_used;
+
+			for (c = 0; c < partition->crtcs_used; c++) {
+				crtc = partition->crtcs + c;
+				gamma_ramps_t old_saved_ramps = crtc->saved_ramps;
+				gamma_ramps_t old_current_ramps = crtc->current_ramps;
+
+#define __place(RAMPS, CHANNEL)									\
+				crtc->RAMPS.CHANNEL = (uint16_t *)ramps;			\
+				if (old_##RAMPS.CHANNEL != NULL)				\
+					memcpy(ramps, old_##RAMPS.CHANNEL,			\
+					       crtc->RAMPS.CHANNEL##_size * sizeof(uint16_t));	\
+				ramps += gamma_ramp_size(crtc->RAMPS.CHANNEL##_size);
+
+				__place(saved_ramps, red)
+				__place(saved_ramps, green)
+				__place(saved_ramps, blue)
+				__place(current_ramps, red)
+				__place(current_ramps, green)
+				__place(current_ramps, blue)
+#undef __place
+
+				/* The calibrations are in the moved CRTC. */
+				if (crtc->settings.lut_calibration != NULL)
+					crtc->settings.lut_calibration = &(crtc->saved_ramps);
+			}
+		}
+		site->crtcs_used = crtcs_used - site->crtcs_offset;
+	}
+
+	/* Release the old storage and use the arena. */
+	gamma_free_storage(state);
+	state->sites = sites;
+	state->crtcs = crtcs_start;
+	state->crtcs_used = crtcs_used;
+	state->arena = arena;
+	return 0;
+}
+
+
 /* Resolve selections. */
 int
 gamma_resolve_selections(gamma_server_state_t *state)
@@ -540,6 +707,7 @@ gamma_resolve_selections(gamma_server_state_t *state)
 
 	for (size_t i = 1; i < state->selections_made; i++) {
 		gamma_selection_state_t *selection = state->selections + i;
+		size_t selection_index = i - (size_t)default_selection;
 		gamma_site_state_t *site;
 		size_t site_index;
 
@@ -560,6 +728,12 @@ gamma_resolve_selections(gamma_server_state_t *state)
 			selection->sites_count = 1;
 		}
 
+		/* Decided once for all sites, as the lists are filled in
+		   for the first site. CRTCs found by the selection hook,
+		   by EDID, are not all CRTCs. */
+		int all_partitions = selection->partitions == NULL;
+		int all_crtcs = selection->crtcs == NULL && selection->data == NULL;
+
 		for (size_t s = 0; s < selection->sites_count; s++) {
 			/* Find matching already opened site. */
 			site_index = gamma_find_site(state, selection->sites[s]);
@@ -582,7 +756,6 @@ gamma_resolve_selections(gamma_server_state_t *state)
 					__ignorable return r;
 				}
 			}
-			int all_partitions = selection->partitions == NULL;
 
 			/* Select all partitions if none have been specified explicity. */
 			if (all_partitions && selection->partitions_count < site->partitions_available) {
@@ -610,20 +783,23 @@ gamma_resolve_selections(gamma_server_state_t *state)
 				}
 			}
 
-			/* Run CRTC selection hook. */
+			/* Run CRTC selection hook, which
+			   may search for a monitor by EDID. */
 			if (selection->data != NULL) {
+				double span = trace_begin("crtc selection");
 				r = state->parse_selection(state, site, selection, before_crtc);
+				trace_end("crtc selection", span, site->site);
 				if (r < 0) {
 					__ignorable return r;
 				}
 			}
-			int all_crtcs = selection->crtcs == NULL;
 
 			/* Open CRTCs. */
 			for (size_t p = 0; p < selection->partitions_count; p++) {
 				size_t partition_index = selection->partitions[p];
 				r = gamma_open_crtcs(state, site, site_index,
-						     partition_index, selection, all_crtcs);
+						     partition_index, selection,
+						     selection_index, all_crtcs);
 				if (r != 0) {
 					__ignorable {
 						rc = r;
@@ -636,7 +812,8 @@ gamma_resolve_selections(gamma_server_state_t *state)
 
 #undef __ignorable
 
-	rc = 0;
+	/* All CRTCs are open, so everything can be moved into one arena. */
+	rc = gamma_create_arena(state);
 
 fail:
 	/* Undo the shift made in the beginning of this function. */
@@ -651,35 +828,561 @@ fail:
 }
 
 
+/* A partition whose CRTCs are being reconciled. */
+typedef struct {
+	gamma_partition_state_t *partition;
+	/* The CRTCs before and after reconciliation,
+	   the first `kept` new CRTCs were open before. */
+	gamma_crtc_state_t *old_crtcs;
+	size_t old_crtcs_used;
+	gamma_crtc_state_t *crtcs;
+	size_t kept;
+	size_t crtcs_used;
+} gamma_reconcile_t;
+
+/* Release CRTCs that were opened during a reconciliation,
+   and their copies of the CRTC arrays. */
+static void
+gamma_reconcile_free(gamma_server_state_t *state, gamma_reconcile_t *partitions,
+		     size_t n, int close_new)
+{
+	for (size_t i = 0; i < n; i++) {
+		gamma_reconcile_t *rec = partitions + i;
+		if (rec->crtcs == NULL)
+			continue;
+		for (size_t c = rec->kept; c < rec->crtcs_used; c++) {
+			gamma_crtc_state_t *crtc = rec->crtcs + c;
+			/* The arena has a copy of the ramps read at open. */
+			if (crtc->saved_ramps.red != NULL)
+				free(crtc->saved_ramps.red);
+			if (close_new && crtc->data != NULL)
+				state->free_crtc_data(crtc->data);
+		}
+		free(rec->crtcs);
+	}
+	free(partitions);
+}
+
+/* Open the CRTCs that have appeared and close those that have
+   disappeared, leaving the other CRTCs as they are. */
+int
+gamma_reconcile(gamma_server_state_t *state, size_t *opened_out, size_t *closed_out)
+{
+	gamma_reconcile_t *partitions = NULL;
+	void **closed = NULL;
+	size_t n = 0, opened = 0, closed_count = 0;
+	size_t s, p, c, j;
+	int r;
+
+	if (state->refresh_partition == NULL)
+		return 0;
+
+	/* The I/O threads are started again by the next update. */
+	gamma_io_stop(state);
+
+	for (s = 0; s < state->sites_used; s++)
+		n += state->sites[s].partitions_available;
+	partitions = calloc(n + 1, sizeof(gamma_reconcile_t));
+	closed = malloc((state->crtcs_used + 1) * sizeof(void *));
+	if (partitions == NULL || closed == NULL) {
+		perror(partitions == NULL ? "calloc" : "malloc");
+		goto fail;
+	}
+	state->allocations += 2;
+
+	n = 0;
+	for (s = 0; s < state->sites_used; s++) {
+		gamma_site_state_t *site = state->sites + s;
+		for (p = 0; p < site->partitions_available; p++) {
+			gamma_partition_state_t *partition = site->partitions + p;
+			gamma_reconcile_t *rec = partitions + n++;
+			if (partition->used == 0)
+				continue;
+
+			/* A partition on a site that does not respond is left
+			   as it is, and so is one that cannot be read, as that
+			   may be temporary. It is read again on the next event. */
+			if (site->degraded)
+				continue;
+			if (state->refresh_partition(state, site, partition) < 0) {
+				fprintf(stderr, _("Could not read the CRTCs of partition %lu"
+						  " on site `%s', they are kept as they are.\n"),
+					(unsigned long)p, gamma_site_name(site));
+				continue;
+			}
+
+			rec->partition = partition;
+			rec->old_crtcs = partition->crtcs;
+			rec->old_crtcs_used = partition->crtcs_used;
+			rec->crtcs = malloc((partition->crtcs_used + partition->crtcs_available + 1) *
+					    sizeof(gamma_crtc_state_t));
+			if (rec->crtcs == NULL) {
+				perror("malloc");
+				goto fail;
+			}
+			state->allocations += 1;
+
+			/* Keep the CRTCs that still exist. */
+			for (c = 0; c < rec->old_crtcs_used; c++) {
+				gamma_crtc_state_t *crtc = rec->old_crtcs + c;
+				for (j = 0; j < partition->crtcs_available; j++)
+					if (state->crtc_id(state, site, partition, j) == crtc->id)
+						break;
+				if (j == partition->crtcs_available) {
+					closed[closed_count++] = crtc->data;
+					continue;
+				}
+				rec->crtcs[rec->kept] = *crtc;
+				rec->crtcs[rec->kept].crtc = j;
+				rec->kept += 1;
+			}
+			partition->crtcs = rec->crtcs;
+			partition->crtcs_used = rec->kept;
+
+			/* Open the CRTCs that have appeared. */
+			for (j = 0; partition->all_crtcs && j < partition->crtcs_available; j++) {
+				for (c = 0; c < rec->kept; c++)
+					if (rec->crtcs[c].crtc == j)
+						break;
+				if (c < rec->kept)
+					continue;
+
+				gamma_selection_state_t selection;
+				selection.settings = partition->settings;
+				selection.preserve_calibrations = partition->preserve_calibrations;
+				r = gamma_open_crtc(state, site, partition, s, p, j,
+						    &selection, partition->selection);
+				rec->crtcs_used = partition->crtcs_used;
+				if (r != 0) {
+					fprintf(stderr, _("Could not open CRTC %lu.\n"),
+						(unsigned long)j);
+					continue;
+				}
+				opened += 1;
+			}
+			rec->crtcs_used = partition->crtcs_used;
+		}
+	}
+
+	if (opened == 0 && closed_count == 0) {
+		/* Nothing has changed, but the CRTCs may have been
+		   renumbered, so only their indices are updated. */
+		for (size_t i = 0; i < n; i++) {
+			gamma_reconcile_t *rec = partitions + i;
+			if (rec->crtcs == NULL)
+				continue;
+			memcpy(rec->old_crtcs, rec->crtcs,
+			       rec->kept * sizeof(gamma_crtc_state_t));
+			rec->partition->crtcs = rec->old_crtcs;
+			rec->partition->crtcs_used = rec->old_crtcs_used;
+		}
+	} else {
+		r = gamma_create_arena(state);
+		if (r < 0) goto fail;
+
+		/* The arena no longer has the CRTCs that were closed. */
+		for (c = 0; c < closed_count; c++)
+			if (closed[c] != NULL)
+				state->free_crtc_data(closed[c]);
+	}
+
+	gamma_reconcile_free(state, partitions, n, 0);
+	free(closed);
+	if (opened_out != NULL) *opened_out = opened;
+	if (closed_out != NULL) *closed_out = closed_count;
+	return 0;
+
+fail:
+	/* Leave the CRTCs as they were. */
+	if (partitions != NULL) {
+		for (size_t i = 0; i < n; i++) {
+			gamma_reconcile_t *rec = partitions + i;
+			if (rec->partition == NULL)
+				continue;
+			rec->partition->crtcs = rec->old_crtcs;
+			rec->partition->crtcs_used = rec->old_crtcs_used;
+		}
+		gamma_reconcile_free(state, partitions, n, 1);
+	}
+	free(closed);
+	return -1;
+}
+
+
+/* Get the file descriptor that becomes readable
+   when the CRTCs of a site may have changed. */
+int
+gamma_hotplug_fd(gamma_server_state_t *state, size_t site)
+{
+	if (state->hotplug_fd == NULL || state->refresh_partition == NULL)
+		return -1;
+	return state->hotplug_fd(state, state->sites + site);
+}
+
+/* Read the events on the file descriptor of a site. */
+int
+gamma_hotplug_handle(gamma_server_state_t *state, size_t site)
+{
+	return state->hotplug_handle(state, state->sites + site);
+}
+
+
+/* Read the saved gamma ramps of a CRTC unless they have been read. */
+int
+gamma_read_saved_ramps(gamma_server_state_t *state, gamma_crtc_state_t *crtc)
+{
+	if (crtc->saved_ramps_read || state->read_ramps == NULL)
+		return 0;
+
+	/* The space is in the arena. */
+	double span = trace_begin("read ramps");
+	int r = state->read_ramps(state, crtc, crtc->saved_ramps);
+	trace_end_value("read ramps", span, "crtc", (size_t)(crtc - state->crtcs));
+	if (r != 0)
+		return -1;
+
+	crtc->saved_ramps_read = 1;
+	state->ramps_read += 1;
+	return 0;
+}
+
+
 /* Restore gamma ramps. */
 void
 gamma_restore(gamma_server_state_t *state)
 {
-	gamma_iterator_t iter = gamma_iterator(state);
-	while (gamma_iterator_next(&iter)) {
-		if (iter.crtc->saved_ramps.red == NULL)
+	gamma_crtc_state_t *crtc = state->crtcs;
+	gamma_crtc_state_t *crtcs_end = crtc + state->crtcs_used;
+
+	/* Let the I/O threads finish first. */
+	gamma_io_stop(state);
+
+	for (; crtc != crtcs_end; crtc++) {
+		if (!crtc->saved_ramps_read || state->sites[crtc->site_index].degraded)
+			continue;
+		state->set_ramps(state, crtc, crtc->saved_ramps);
+	}
+}
+
+/* Where the gamma ramps of a CRTC are computed. */
+static gamma_ramps_t
+gamma_current_ramps(gamma_server_state_t *state, size_t crtc)
+{
+	return state->crtcs[crtc].current_ramps;
+}
+
+/* Print which site something has happened to. */
+const char *
+gamma_site_name(const gamma_site_state_t *site)
+{
+	return site->site != NULL ? site->site : _("(default)");
+}
+
+/* Update gamma ramps on all CRTCs. */
+static int
+gamma_update_crtcs(gamma_server_state_t *state)
+{
+	gamma_crtc_state_t *crtc = state->crtcs;
+	gamma_crtc_state_t *crtcs_end = crtc + state->crtcs_used;
+	for (; crtc != crtcs_end; crtc++) {
+		if (state->restore || crtc->settings.lut_calibration != NULL) {
+			if (gamma_read_saved_ramps(state, crtc) != 0)
+				state->sites[crtc->site_index].failed = 1;
+		}
+	}
+
+	/* Compute all gamma ramps before applying any of them. */
+	gamma_pool_fill(state, gamma_current_ramps);
+
+	for (crtc = state->crtcs; crtc != crtcs_end; crtc++) {
+		gamma_site_state_t *site = state->sites + crtc->site_index;
+		if (site->failed) {
+			metrics_count(METRICS_RAMPS_SKIPPED, 1);
+			continue;
+		}
+		double start = metrics_begin();
+		double span = trace_begin("set_ramps");
+		int r = state->set_ramps(state, crtc, crtc->current_ramps);
+		trace_end_value("set_ramps", span, "crtc", (size_t)(crtc - state->crtcs));
+		if (r != 0) {
+			site->failed = 1;
+			continue;
+		}
+		metrics_end(METRICS_SET_RAMPS_SECONDS, start);
+		metrics_count(METRICS_RAMPS_APPLIED, 1);
+	}
+
+	/* Degraded sites are retried on every update. */
+	for (size_t s = 0; s < state->sites_used; s++) {
+		gamma_site_state_t *site = state->sites + s;
+		if (!site->degraded || site->failed)
+			continue;
+		site->degraded = 0;
+		fprintf(stderr, _("Site `%s' is responding again.\n"),
+			gamma_site_name(site));
+	}
+	return 0;
+}
+
+#ifndef _WIN32
+/* Record that a site has applied the gamma ramps sent to it. */
+static void
+gamma_site_applied(gamma_site_state_t *site, double start)
+{
+	metrics_end(METRICS_SET_RAMPS_SECONDS, start);
+	if (!site->degraded || site->failed)
+		return;
+	site->degraded = 0;
+	fprintf(stderr, _("Site `%s' is responding again.\n"),
+		gamma_site_name(site));
+}
+
+/* Update gamma ramps on all sites at once, and collect the results
+   as they arrive, so that a slow site does not delay the others.
+   Sites that do not respond in time are skipped until they do. */
+static int
+gamma_update_sites(gamma_server_state_t *state)
+{
+	struct pollfd *fds = alloca((state->sites_used + 1) * sizeof(struct pollfd));
+	char *busy = alloca(state->sites_used + 1);
+	double now, deadline;
+	size_t s, n;
+	int r;
+
+	/* Read before sending, so that no replies are waited
+	   for while gamma ramps are on their way. */
+	for (s = 0; s < state->sites_used; s++) {
+		gamma_site_state_t *site = state->sites + s;
+		gamma_crtc_state_t *crtc = state->crtcs + site->crtcs_offset;
+		gamma_crtc_state_t *crtcs_end = crtc + site->crtcs_used;
+
+		site->pending = 0;
+		busy[s] = 0;
+		if (site->degraded) {
+			/* It is said to respond again once it has
+			   applied the gamma ramps sent now. */
+			r = state->poll_site(state, site);
+			if (r < 0)
+				fprintf(stderr, _("Could not tell whether site `%s'"
+						  " responds, it is still skipped.\n"),
+					gamma_site_name(site));
+			if (r != 0) {
+				busy[s] = 1;
+				metrics_count(METRICS_RAMPS_SKIPPED, site->crtcs_used);
+				continue;
+			}
+		}
+
+		for (; crtc != crtcs_end; crtc++) {
+			if (!state->restore && crtc->settings.lut_calibration == NULL)
+				continue;
+			if (gamma_read_saved_ramps(state, crtc) != 0)
+				site->failed = 1;
+		}
+	}
+
+	gamma_pool_fill(state, gamma_current_ramps);
+
+	/* Send to all sites before waiting for any of them. The
+	   latency of a site is from here until it has responded. */
+	double start = metrics_begin();
+	for (s = 0; s < state->sites_used; s++) {
+		gamma_site_state_t *site = state->sites + s;
+		gamma_crtc_state_t *crtc = state->crtcs + site->crtcs_offset;
+		gamma_crtc_state_t *crtcs_end = crtc + site->crtcs_used;
+
+		if (busy[s] || site->crtcs_used == 0)
 			continue;
-		state->set_ramps(state, iter.crtc, iter.crtc->saved_ramps);
+		if (site->failed) {
+			metrics_count(METRICS_RAMPS_SKIPPED, site->crtcs_used);
+			continue;
+		}
+
+		double span = trace_begin("send ramps");
+		for (; crtc != crtcs_end; crtc++) {
+			if (state->send_ramps(state, crtc, crtc->current_ramps) != 0)
+				site->failed = 1;
+		}
+		metrics_count(METRICS_RAMPS_APPLIED, site->crtcs_used);
+
+		r = state->flush_site(state, site, &(site->pending_fd));
+		trace_end_value("send ramps", span, "site", s);
+		if (r < 0) site->failed = 1;
+		site->pending = r > 0;
+		if (r == 0)
+			gamma_site_applied(site, start);
+	}
+
+	if (systemtime_get_monotonic(&now) < 0) now = 0;
+	deadline = now + state->site_timeout;
+	double span = trace_begin("wait for sites");
+
+	/* The result may already have been received. */
+	for (s = 0; s < state->sites_used; s++) {
+		gamma_site_state_t *site = state->sites + s;
+		if (!site->pending) continue;
+		r = state->poll_site(state, site);
+		if (r < 0) site->failed = 1;
+		site->pending = r > 0;
+		if (r == 0)
+			gamma_site_applied(site, start);
 	}
+
+	/* Collect the results as they arrive. */
+	for (;;) {
+		for (s = n = 0; s < state->sites_used; s++) {
+			if (!state->sites[s].pending) continue;
+			fds[n].fd = state->sites[s].pending_fd;
+			fds[n].events = POLLIN;
+			fds[n].revents = 0;
+			n++;
+		}
+		if (n == 0)
+			break;
+
+		if (systemtime_get_monotonic(&now) < 0) now = deadline;
+		if (now >= deadline) {
+			for (s = 0; s < state->sites_used; s++) {
+				gamma_site_state_t *site = state->sites + s;
+				if (!site->pending) continue;
+				site->pending = 0;
+				if (site->degraded)
+					continue;
+				site->degraded = 1;
+				fprintf(stderr, _("Site `%s' did not respond within %.1f seconds,"
+						  " it is skipped until it does.\n"),
+					gamma_site_name(site), state->site_timeout);
+			}
+			break;
+		}
+
+		r = poll(fds, (nfds_t)n, (int)((deadline - now) * 1000) + 1);
+		if (r < 0 && errno != EINTR) {
+			perror("poll");
+			trace_end("wait for sites", span, NULL);
+			return -1;
+		}
+		if (r <= 0)
+			continue;
+
+		for (s = n = 0; s < state->sites_used; s++) {
+			gamma_site_state_t *site = state->sites + s;
+			if (!site->pending) continue;
+			if (fds[n++].revents == 0) continue;
+			r = state->poll_site(state, site);
+			if (r < 0) site->failed = 1;
+			site->pending = r > 0;
+			if (r == 0)
+				gamma_site_applied(site, start);
+		}
+	}
+
+	trace_end("wait for sites", span, NULL);
+	return 0;
+}
+#endif
+
+/* Update gamma ramps once, the way the adjustment method and options allow. */
+static int
+gamma_update_once(gamma_server_state_t *state)
+{
+	for (size_t s = 0; s < state->sites_used; s++)
+		state->sites[s].failed = 0;
+
+	if (state->ramp_workers == 0)
+		state->ramp_workers = gamma_pool_default_workers();
+	if (state->ramp_workers > 1 && state->pool == NULL) {
+		if (gamma_pool_start(state) != 0)
+			state->ramp_workers = 1;
+	}
+	if (state->io_thread && state->io == NULL) {
+		if (gamma_io_start(state) != 0)
+			return -1;
+		state->io_thread = state->io != NULL;
+	}
+	if (state->io != NULL)
+		return gamma_io_update(state);
+#ifndef _WIN32
+	if (state->send_ramps != NULL)
+		return gamma_update_sites(state);
+#endif
+	return gamma_update_crtcs(state);
+}
+
+/* Whether any site failed during the last update. */
+static int
+gamma_update_failed(const gamma_server_state_t *state)
+{
+	for (size_t s = 0; s < state->sites_used; s++)
+		if (state->sites[s].failed)
+			return 1;
+	return 0;
 }
 
 /* Update gamma ramps. */
 int
 gamma_update(gamma_server_state_t *state)
 {
-	gamma_iterator_t iter = gamma_iterator(state);
-	int r;
-	while (gamma_iterator_next(&iter)) {
-		if (iter.crtc->current_ramps.red == NULL)
-			continue;
-		colorramp_fill(iter.crtc->current_ramps, iter.crtc->settings);
-		r = state->set_ramps(state, iter.crtc, iter.crtc->current_ramps);
+	int r = gamma_update_once(state);
+	if (r == 0 && !gamma_update_failed(state))
+		return 0;
+
+	/* The CRTC may have been removed before we were told. */
+	if (state->refresh_partition != NULL) {
+		r = gamma_reconcile(state, NULL, NULL);
 		if (r != 0) return r;
+		r = gamma_update_once(state);
+	}
+	if (r != 0) return r;
+
+	/* A site that still fails does not stop the others
+	   from being adjusted, it is retried on the next update. */
+	for (size_t s = 0; s < state->sites_used; s++) {
+		gamma_site_state_t *site = state->sites + s;
+		if (!site->failed || site->degraded)
+			continue;
+		site->degraded = 1;
+		fprintf(stderr, _("Site `%s' failed to apply gamma ramps,"
+				  " it is retried on the next update.\n"),
+			gamma_site_name(site));
 	}
 	return 0;
 }
 
 
+/* Update the adjustments that are made per selection. */
+void
+gamma_update_selection(gamma_server_state_t *state, size_t selection,
+		       const float gamma[3], int preserve_calibrations)
+{
+	gamma_crtc_state_t *crtc = state->crtcs;
+	gamma_crtc_state_t *crtcs_end = crtc + state->crtcs_used;
+	for (; crtc != crtcs_end; crtc++) {
+		if (crtc->selection != selection)
+			continue;
+		crtc->settings.gamma_correction[0] = gamma[0];
+		crtc->settings.gamma_correction[1] = gamma[1];
+		crtc->settings.gamma_correction[2] = gamma[2];
+		crtc->settings.lut_calibration =
+			preserve_calibrations ? &(crtc->saved_ramps) : NULL;
+	}
+
+	/* And on CRTCs that the selection opens later. */
+	for (size_t s = 0; s < state->sites_used; s++) {
+		gamma_site_state_t *site = state->sites + s;
+		for (size_t p = 0; p < site->partitions_available; p++) {
+			gamma_partition_state_t *partition = site->partitions + p;
+			if (!partition->all_crtcs || partition->selection != selection)
+				continue;
+			partition->settings.gamma_correction[0] = gamma[0];
+			partition->settings.gamma_correction[1] = gamma[1];
+			partition->settings.gamma_correction[2] = gamma[2];
+			partition->preserve_calibrations = preserve_calibrations;
+		}
+	}
+}
+
+
 /* Methods for updating adjustments on all CRTCs. */
 
 static gamma_crtc_selection_t all_crtcs = {
@@ -704,29 +1407,69 @@ __gamma_update_all(temperature)
 
 /* Methods for updating adjustments on selected CRTCs. */
 
-#define __test(ANCESTOR, THIS)  (crtcs.THIS < 0 || iter.THIS == iter.ANCESTOR->THIS##s + crtcs.THIS)
-#define __test_all()            (__test(state, site) && __test(site, partition) && __test(partition, crtc))
+/* Find the CRTCs, in the array of all CRTCs, that are covered by a
+   CRTC selection. Returns the number of CRTCs in the range, and sets
+   `*filter` if not all of them are selected, that happens if a
+   partition or CRTC is selected without selecting its ancestors. */
+static size_t
+gamma_selected_range(const gamma_server_state_t *state, gamma_crtc_selection_t crtcs,
+		     size_t *first, int *filter)
+{
+	const gamma_site_state_t *site;
+	const gamma_partition_state_t *partition;
 
-#define __update(PROP)										\
-	if (crtcs.site < 0 || crtcs.partition < 0 || crtcs.crtc < 0) {				\
-		gamma_iterator_t iter = gamma_iterator(state);					\
-		if (crtcs.site < 0 && crtcs.partition < 0 && crtcs.crtc < 0) {			\
-			while (gamma_iterator_next(&iter))					\
-				iter.crtc->settings.PROP = PROP;				\
-		} else {									\
-			while (gamma_iterator_next(&iter))					\
-				if (__test_all())						\
-					iter.crtc->settings.PROP = PROP;			\
-		}										\
-	} else if ((size_t)(crtcs.site) < state->sites_used) {					\
-		gamma_site_state_t site = state->sites[crtcs.site];				\
-		gamma_partition_state_t partition;						\
-		if ((size_t)(crtcs.partition) < site.partitions_available) {			\
-			partition = site.partitions[crtcs.partition];				\
-			if (partition.used && (size_t)(crtcs.crtc) < partition.crtcs_used)	\
-				partition.crtcs[crtcs.crtc].settings.PROP = PROP;		\
-		}										\
+	*first = 0;
+	*filter = 0;
+
+	if (crtcs.site < 0) {
+		*filter = crtcs.partition >= 0 || crtcs.crtc >= 0;
+		return state->crtcs_used;
+	}
+	if ((size_t)(crtcs.site) >= state->sites_used)
+		return 0;
+	site = state->sites + crtcs.site;
+
+	if (crtcs.partition < 0) {
+		*first = site->crtcs_offset;
+		*filter = crtcs.crtc >= 0;
+		return site->crtcs_used;
+	}
+	if ((size_t)(crtcs.partition) >= site->partitions_available)
+		return 0;
+	partition = site->partitions + crtcs.partition;
+
+	if (crtcs.crtc < 0) {
+		*first = partition->crtcs_offset;
+		return partition->crtcs_used;
 	}
+	if ((size_t)(crtcs.crtc) >= partition->crtcs_used)
+		return 0;
+	*first = partition->crtcs_offset + (size_t)(crtcs.crtc);
+	return 1;
+}
+
+/* Whether a CRTC is covered by a CRTC selection,
+   given that its site is covered by it. */
+static int
+gamma_crtc_selected(const gamma_server_state_t *state, gamma_crtc_selection_t crtcs,
+		    const gamma_crtc_state_t *crtc)
+{
+	const gamma_partition_state_t *partition =
+		state->sites[crtc->site_index].partitions + crtc->partition;
+	if (crtcs.partition >= 0 && crtc->partition != (size_t)(crtcs.partition))
+		return 0;
+	return crtcs.crtc < 0 || crtc - partition->crtcs == crtcs.crtc;
+}
+
+#define __update(PROP)										\
+	size_t first;										\
+	int filter;										\
+	size_t n = gamma_selected_range(state, crtcs, &first, &filter);			\
+	gamma_crtc_state_t *crtc = state->crtcs + first;					\
+	gamma_crtc_state_t *crtcs_end = crtc + n;						\
+	for (; crtc != crtcs_end; crtc++)							\
+		if (!filter || gamma_crtc_selected(state, crtcs, crtc))				\
+			crtc->settings.PROP = PROP;
 
 void
 gamma_update_gamma(gamma_server_state_t *state, gamma_crtc_selection_t crtcs, float gamma)
@@ -757,8 +1500,6 @@ gamma_update_temperature(gamma_server_state_t *state, gamma_crtc_selection_t crt
 }
 
 #undef __update
-#undef __test_all
-#undef __test
 
 
 /* Duplicate memory area. */
@@ -888,6 +1629,35 @@ gamma_set_option(gamma_server_state_t *state, const char *key, char *value, ssiz
 			sel->settings.gamma_correction[1] = gamma[1];
 			sel->settings.gamma_correction[2] = gamma[2];
 		});
+	} else if (strcasecmp(key, "io-thread") == 0) {
+		int int_value = atoi(value);
+		if (int_value != 0 && int_value != 1) {
+			/* TRANSLATORS: `io-thread' must not be translated. */
+			fprintf(stderr,
+				_("The value for `io-thread' must be either `1' or `0'.\n"));
+			return -1;
+		}
+		state->io_thread = int_value;
+	} else if (strcasecmp(key, "ramp-workers") == 0) {
+		char *end;
+		long workers = strtol(value, &end, 10);
+		if (*value == '\0' || *end != '\0' || workers < 1) {
+			/* TRANSLATORS: `ramp-workers' must not be translated. */
+			fprintf(stderr,
+				_("The value for `ramp-workers' must be a positive integer.\n"));
+			return -1;
+		}
+		state->ramp_workers = (size_t)workers;
+	} else if (strcasecmp(key, "site-timeout") == 0) {
+		char *end;
+		double timeout = strtod(value, &end);
+		if (*value == '\0' || *end != '\0' || !(timeout > 0)) {
+			/* TRANSLATORS: `site-timeout' must not be translated. */
+			fprintf(stderr,
+				_("The value for `site-timeout' must be a positive number of seconds.\n"));
+			return -1;
+		}
+		state->site_timeout = timeout;
 	} else if (strcasecmp(key, "ignorable") == 0) {
 		int int_value = atoi(value);
 		if (int_value != 0 && int_value != 1) {
@@ -1117,3 +1887,122 @@ fail:
 	free(values);
 	return -1;
 }
+
+
+#define EDID_CACHE_FILE  "edid"
+#define MAX_EDID_CACHE_PATH  4096
+/* Enough for an EDID of 256 bytes written as hexadecimal. */
+#define MAX_EDID_CACHE_LINE  1024
+
+
+/* Write an entry of the EDID cache, without the newline. */
+static void
+gamma_edid_cache_entry(char *buf, size_t size, const char *method, const char *site,
+		       const unsigned char *edid, size_t edid_length)
+{
+	size_t n;
+	n = (size_t)snprintf(buf, size, "%s %s ", method,
+			     site == NULL || *site == '\0' ? "-" : site);
+	for (size_t i = 0; i < edid_length && n + 3 < size; i++, n += 2)
+		sprintf(buf + n, "%02x", edid[i]);
+}
+
+int
+gamma_edid_cache_load(const char *method, const char *site,
+		      const unsigned char *edid, size_t edid_length,
+		      uint64_t *key, size_t *partition, size_t *crtc)
+{
+	char path[MAX_EDID_CACHE_PATH];
+	char entry[MAX_EDID_CACHE_LINE];
+	char line[MAX_EDID_CACHE_LINE];
+	size_t entry_len;
+	int found = 0;
+	FILE *f;
+
+	/* Site names with spaces would not be read back. */
+	if (site != NULL && strchr(site, ' ') != NULL)
+		return 0;
+
+	if (config_ini_cache_path(path, sizeof(path), EDID_CACHE_FILE, 0) < 0)
+		return 0;
+
+	f = fopen(path, "r");
+	if (f == NULL) return 0;
+
+	/* Each line is `METHOD SITE EDID KEY PARTITION CRTC'. */
+	gamma_edid_cache_entry(entry, sizeof(entry), method, site, edid, edid_length);
+	entry_len = strlen(entry);
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, entry, entry_len) || line[entry_len] != ' ')
+			continue;
+		/* A corrupt entry is as good as none. */
+		uint64_t k;
+		unsigned long p, c;
+		if (sscanf(line + entry_len, " %" SCNu64 " %lu %lu", &k, &p, &c) == 3) {
+			*key = k;
+			*partition = (size_t)p;
+			*crtc = (size_t)c;
+			found = 1;
+		}
+		break;
+	}
+
+	fclose(f);
+	return found;
+}
+
+int
+gamma_edid_cache_save(const char *method, const char *site,
+		      const unsigned char *edid, size_t edid_length,
+		      uint64_t key, size_t partition, size_t crtc)
+{
+	char path[MAX_EDID_CACHE_PATH];
+	char tmp_path[MAX_EDID_CACHE_PATH + 4];
+	char entry[MAX_EDID_CACHE_LINE];
+	char line[MAX_EDID_CACHE_LINE];
+	size_t entry_len;
+	FILE *in, *out;
+
+	if (site != NULL && strchr(site, ' ') != NULL)
+		return 0;
+
+	if (config_ini_cache_path(path, sizeof(path), EDID_CACHE_FILE, 1) < 0)
+		return -1;
+
+	/* Move into place so that a partial file is never read. */
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	out = fopen(tmp_path, "w");
+	if (out == NULL) {
+		perror("fopen");
+		return -1;
+	}
+
+	/* Keep the entries of other monitors. */
+	gamma_edid_cache_entry(entry, sizeof(entry), method, site, edid, edid_length);
+	entry_len = strlen(entry);
+	in = fopen(path, "r");
+	if (in != NULL) {
+		while (fgets(line, sizeof(line), in) != NULL) {
+			if (strchr(line, '\n') == NULL)
+				continue;
+			if (!strncmp(line, entry, entry_len) && line[entry_len] == ' ')
+				continue;
+			fputs(line, out);
+		}
+		fclose(in);
+	}
+
+	fprintf(out, "%s %" PRIu64 " %lu %lu\n", entry, key,
+		(unsigned long)partition, (unsigned long)crtc);
+	if (fclose(out) != 0) {
+		perror("fclose");
+		remove(tmp_path);
+		return -1;
+	}
+	if (rename(tmp_path, path) < 0) {
+		perror("rename");
+		remove(tmp_path);
+		return -1;
+	}
+	return 0;
+}
@@ -26,6 +26,16 @@
 #include <unistd.h>
 
 
+/* The alignment of the gamma ramps, in bytes, a cache line. */
+#ifndef GAMMA_RAMP_ALIGNMENT
+# define GAMMA_RAMP_ALIGNMENT  64
+#endif
+
+/* Seconds a site may take to apply gamma ramps, by default. */
+#ifndef GAMMA_SITE_TIMEOUT
+# define GAMMA_SITE_TIMEOUT  2.0
+#endif
+
 
 enum gamma_selection_hook {
 	before_site,
@@ -43,7 +53,6 @@ struct gamma_partition_state;
 struct gamma_site_state;
 struct gamma_selection_state;
 struct gamma_server_state;
-struct gamma_iterator;
 struct gamma_crtc_selection;
 
 /* Typedef:s of the structures. */
@@ -52,7 +61,6 @@ typedef struct gamma_partition_state gamma_partition_state_t;
 typedef struct gamma_site_state      gamma_site_state_t;
 typedef struct gamma_selection_state gamma_selection_state_t;
 typedef struct gamma_server_state    gamma_server_state_t;
-typedef struct gamma_iterator        gamma_iterator_t;
 typedef struct gamma_crtc_selection  gamma_crtc_selection_t;
 
 
@@ -75,6 +83,31 @@ typedef void gamma_invalid_partition_func(const gamma_site_state_t *site, size_t
 
 typedef int gamma_set_ramps_func(gamma_server_state_t *state, gamma_crtc_state_t *crtc, gamma_ramps_t ramps);
 
+typedef int gamma_read_ramps_func(gamma_server_state_t *state, gamma_crtc_state_t *crtc, gamma_ramps_t ramps);
+
+typedef size_t gamma_crtc_id_func(gamma_server_state_t *state,
+				  gamma_site_state_t *site,
+				  gamma_partition_state_t *partition, size_t crtc);
+
+typedef int gamma_refresh_partition_func(gamma_server_state_t *state,
+					 gamma_site_state_t *site,
+					 gamma_partition_state_t *partition);
+
+typedef int gamma_hotplug_fd_func(gamma_server_state_t *state, gamma_site_state_t *site);
+
+typedef int gamma_hotplug_handle_func(gamma_server_state_t *state, gamma_site_state_t *site);
+/* Send gamma ramps to a CRTC without waiting for them to be applied. */
+typedef int gamma_send_ramps_func(gamma_server_state_t *state, gamma_crtc_state_t *crtc,
+				  gamma_ramps_t ramps);
+/* Finish sending gamma ramps to a site. Returns 1 and stores a file
+   descriptor that becomes readable when the site may have applied
+   them, zero if it already has, and -1 on error. */
+typedef int gamma_flush_site_func(gamma_server_state_t *state, gamma_site_state_t *site,
+				  int *fd);
+/* Check whether a site has applied the gamma ramps sent to it,
+   returns 1 if not yet, zero if it has, and -1 on error. */
+typedef int gamma_poll_site_func(gamma_server_state_t *state, gamma_site_state_t *site);
+
 typedef int gamma_set_option_func(gamma_server_state_t *state,
 				  const char *key, char *value, ssize_t section);
 
@@ -91,10 +124,20 @@ struct gamma_crtc_state {
 	size_t crtc;
 	size_t partition;
 	size_t site_index;
+	/* Adjustment method implementation specific identifier of
+	   the CRTC, it does not change when CRTCs come and go. */
+	size_t id;
+	/* The index of the selection the CRTC was opened
+	   by, zero if there is only the default selection. */
+	size_t selection;
 	/* Saved (restored to on exit) and
-	   current (about to be applied) gamma ramps. */
+	   current (about to be applied) gamma ramps.
+	   The saved ramps are not read until they are needed,
+	   until then only their sizes are set. */
 	gamma_ramps_t saved_ramps;
 	gamma_ramps_t current_ramps;
+	/* Whether the saved ramps have been read. */
+	int saved_ramps_read;
 	/* Color adjustments. */
 	gamma_settings_t settings;
 };
@@ -110,6 +153,15 @@ struct gamma_partition_state {
 	/* The selected CRTCs. */
 	size_t crtcs_used;
 	gamma_crtc_state_t *crtcs;
+	/* The index of the first of the selected CRTCs
+	   in the server's array of all CRTCs. */
+	size_t crtcs_offset;
+	/* Whether all CRTCs were selected, CRTCs that appear
+	   later are then opened with the selection's settings. */
+	int all_crtcs;
+	size_t selection;
+	gamma_settings_t settings;
+	int preserve_calibrations;
 };
 
 /* Site (e.g. display) state. */
@@ -122,6 +174,24 @@ struct gamma_site_state {
 	size_t partitions_available;
 	/* The partitions. */
 	gamma_partition_state_t *partitions;
+	/* The CRTCs of all partitions in the server's array
+	   of all CRTCs, they are stored consecutively. */
+	size_t crtcs_offset;
+	size_t crtcs_used;
+	/* Whether the site did not apply gamma ramps within the time
+	   limit or failed to apply them, it is then skipped until it
+	   has applied them, or retried if it failed. */
+	int degraded;
+	/* Whether reading or applying gamma ramps failed on the
+	   site during the current update. */
+	int failed;
+	/* Whether an I/O thread that did not exit in time was left
+	   behind on the site, which then is never closed. */
+	int thread_stuck;
+	/* Whether the site has not yet applied the gamma ramps sent
+	   to it, and the file descriptor to wait on for it. */
+	int pending;
+	int pending_fd;
 };
 
 /* CRTC selection state. */
@@ -155,6 +225,10 @@ struct gamma_server_state {
 	/* The selected sites. */
 	size_t sites_used;
 	gamma_site_state_t *sites;
+	/* All CRTCs, in the order of their sites and partitions,
+	   available once the selections have been resolved. */
+	size_t crtcs_used;
+	gamma_crtc_state_t *crtcs;
 	/* The selections, zeroth determines the defaults. */
 	size_t selections_made;
 	gamma_selection_state_t *selections;
@@ -171,6 +245,53 @@ struct gamma_server_state {
 	gamma_invalid_partition_func *invalid_partition;
 	/* Function that applies a gamma ramp. */
 	gamma_set_ramps_func *set_ramps;
+	/* Function that reads the current gamma ramps of a CRTC, NULL
+	   if they are read when the CRTC is opened. */
+	gamma_read_ramps_func *read_ramps;
+	/* Functions that follow changes to the set of CRTCs, NULL if
+	   the adjustment method does not support that. `crtc_id` gets
+	   the identifier of a CRTC, `refresh_partition` updates the
+	   available CRTCs of a partition. `hotplug_fd` gets a file
+	   descriptor that becomes readable when the CRTCs of a site may
+	   have changed, `hotplug_handle` returns 1 if they have. */
+	gamma_crtc_id_func *crtc_id;
+	gamma_refresh_partition_func *refresh_partition;
+	gamma_hotplug_fd_func *hotplug_fd;
+	gamma_hotplug_handle_func *hotplug_handle;
+	/* Functions that update the sites concurrently, NULL if the
+	   adjustment method does not support that, `set_ramps` is then
+	   used for one CRTC at a time. `send_ramps` sends gamma ramps
+	   to a CRTC, `flush_site` is called when all CRTCs of a site
+	   have been sent to, and `poll_site` collects the result. */
+	gamma_send_ramps_func *send_ramps;
+	gamma_flush_site_func *flush_site;
+	gamma_poll_site_func *poll_site;
+	/* Seconds a site may take to apply gamma ramps
+	   before it is considered degraded. */
+	double site_timeout;
+	/* Whether gamma ramps are applied by one thread per site,
+	   and the threads, NULL until the first update. */
+	int io_thread;
+	void *io;
+	/* The number of workers that compute gamma ramps, zero until
+	   the default is chosen, and the workers, NULL if only the
+	   main thread computes gamma ramps. */
+	size_t ramp_workers;
+	void *pool;
+	/* Whether the saved gamma ramps will be restored, they are
+	   then read before the CRTCs are first adjusted, otherwise
+	   only if the calibrations are preserved. */
+	int restore;
+	/* The number of CRTCs whose gamma ramps have been read. */
+	size_t ramps_read;
+	/* The sites, partitions, CRTCs, site identifiers and gamma
+	   ramps, moved into a single allocation once the selections
+	   have been resolved, NULL until then. The gamma ramps are
+	   aligned to GAMMA_RAMP_ALIGNMENT bytes. */
+	void *arena;
+	/* The number of heap allocations made for the sites,
+	   partitions, CRTCs and gamma ramps. */
+	size_t allocations;
 	/* Function that parses options not unrecognised by the
 	   common infrastructure. Negative on failure, zero on success
 	   and positive if the key was not unrecognised. */
@@ -184,16 +305,6 @@ struct gamma_server_state {
 };
 
 
-/* CRTC iterator. */
-struct gamma_iterator {
-	/* The current CRTC, partition and site. */
-	gamma_crtc_state_t *crtc;
-	gamma_partition_state_t *partition;
-	gamma_site_state_t *site;
-	/* The gamma state whose CRTCs are being iterated. */
-	gamma_server_state_t *state;
-};
-
 /* CRTC selection. */
 struct gamma_crtc_selection {
 	ssize_t site;
@@ -212,15 +323,9 @@ int gamma_init(gamma_server_state_t *state);
 /* Free all CRTC selection data in a state. */
 void gamma_free_selections(gamma_server_state_t *state);
 
-/* Free all data in a state. */
-void gamma_free(gamma_server_state_t *state);
-
-
-/* Create CRTC iterator. */
-gamma_iterator_t gamma_iterator(gamma_server_state_t *state);
-
-/* Get next CRTC. */
-int gamma_iterator_next(gamma_iterator_t *iterator);
+/* Free all data in a state. Returns -1 if an I/O thread has been
+   left behind, it may still use the state, which must then be kept. */
+int gamma_free(gamma_server_state_t *state);
 
 
 /* Find the index of a site or the index for a new site. */
@@ -231,12 +336,32 @@ size_t gamma_find_site(const gamma_server_state_t *state, const char *site) __at
 int gamma_resolve_selections(gamma_server_state_t *state);
 
 
+/* Get the file descriptor that becomes readable when the CRTCs
+   of a site may have changed, -1 if the method cannot tell. */
+int gamma_hotplug_fd(gamma_server_state_t *state, size_t site);
+
+/* Read the events on the file descriptor of a site, returns 1 if
+   the CRTCs may have changed, 0 if not, and -1 on failure. */
+int gamma_hotplug_handle(gamma_server_state_t *state, size_t site);
+
+/* Open the CRTCs that have appeared and close those that have
+   disappeared, leaving the other CRTCs as they are. */
+int gamma_reconcile(gamma_server_state_t *state, size_t *opened, size_t *closed);
+
+
+/* Read the saved gamma ramps of a CRTC unless they have been read. */
+int gamma_read_saved_ramps(gamma_server_state_t *state, gamma_crtc_state_t *crtc);
+
 /* Restore gamma ramps. */
 void gamma_restore(gamma_server_state_t *state);
 
-/* Update gamma ramps. */
+/* Update gamma ramps. Sites that fail are reported and retried on
+   the next update, -1 is only returned on other failures. */
 int gamma_update(gamma_server_state_t *state);
 
+/* Print which site something has happened to. */
+const char *gamma_site_name(const gamma_site_state_t *site) __attribute__((pure));
+
 
 /* Methods for updating adjustments on all CRTCs. */
 void gamma_update_all_gamma(gamma_server_state_t *state, float gamma);
@@ -249,6 +374,12 @@ void gamma_update_brightness(gamma_server_state_t *state, gamma_crtc_selection_t
 void gamma_update_temperature(gamma_server_state_t *state, gamma_crtc_selection_t crtcs, float temperature);
 
 
+/* Update the adjustments that are made per selection,
+   on the CRTCs that were opened by a selection. */
+void gamma_update_selection(gamma_server_state_t *state, size_t selection,
+			    const float gamma[3], int preserve_calibrations);
+
+
 /* Parse and apply an option. */
 int gamma_set_option(gamma_server_state_t *state, const char *key, char *value, ssize_t section);
 
@@ -280,4 +411,17 @@ int gamma_select_partitions(gamma_server_state_t *state, char *value, char delim
 int gamma_select_sites(gamma_server_state_t *state, char *value, char delimiter, ssize_t section);
 
 
+/* Look up where a monitor was found last time, by its EDID, `method'
+   and the site's name (may be NULL). Returns 1 and stores the location
+   and the method dependent key that tells whether the location is
+   still valid, 0 if the monitor is not in the cache. */
+int gamma_edid_cache_load(const char *method, const char *site,
+			  const unsigned char *edid, size_t edid_length,
+			  uint64_t *key, size_t *partition, size_t *crtc);
+
+/* Remember where a monitor was found. */
+int gamma_edid_cache_save(const char *method, const char *site,
+			  const unsigned char *edid, size_t edid_length,
+			  uint64_t key, size_t partition, size_t crtc);
+
 #endif /* ! REDSHIFT_GAMMA_COMMON_H */
@@ -29,6 +29,10 @@
 #include <limits.h>
 #include <errno.h>
 #include <grp.h>
+#ifdef __linux__
+# include <sys/socket.h>
+# include <linux/netlink.h>
+#endif
 
 #ifdef ENABLE_NLS
 # include <libintl.h>
@@ -43,6 +47,7 @@
 
 #include "gamma-drm.h"
 #include "colorramp.h"
+#include "metrics.h"
 
 
 int
@@ -53,6 +58,15 @@ drm_auto()
 #undef testenv
 }
 
+static void
+drm_free_site(void *data)
+{
+	drm_site_data_t *site_data = data;
+	if (site_data->uevent_fd >= 0)
+		close(site_data->uevent_fd);
+	free(data);
+}
+
 static void
 drm_free_partition(void *data)
 {
@@ -78,6 +92,14 @@ drm_open_site(gamma_server_state_t *state, char *site, gamma_site_state_t *site_
 	site_out->data = NULL;
 	site_out->partitions_available = 0;
 
+	drm_site_data_t *site_data = malloc(sizeof(drm_site_data_t));
+	if (site_data == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	site_data->uevent_fd = -1;
+	site_out->data = site_data;
+
 	/* Count the number of available graphics cards. */
 	char pathname[PATH_MAX];
 	struct stat _attr;
@@ -109,6 +131,7 @@ drm_open_partition(gamma_server_state_t *state, gamma_site_state_t *site,
 	data->res = NULL;
 	data->index = partition;
 	data->connectors = NULL;
+	data->edid_property = 0;
 	partition_out->data = data;
 
 	/* Acquire access to a graphics card. */
@@ -225,21 +248,19 @@ drm_open_crtc(gamma_server_state_t *state, gamma_site_state_t *site,
 	crtc_out->saved_ramps.green_size = (size_t)gamma_size;
 	crtc_out->saved_ramps.blue_size  = (size_t)gamma_size;
 
-	/* Valgrind complains about us reading uninitialize memory if we just use malloc. */
-	crtc_out->saved_ramps.red   = calloc(3 * (size_t)gamma_size, sizeof(uint16_t));
-	crtc_out->saved_ramps.green = crtc_out->saved_ramps.red   + gamma_size;
-	crtc_out->saved_ramps.blue  = crtc_out->saved_ramps.green + gamma_size;
-	if (crtc_out->saved_ramps.red == NULL) {
-		perror("malloc");
-		return -1;
-	}
+	return 0;
+}
 
-	int r = drmModeCrtcGetGamma(card->fd, crtc_id, gamma_size, crtc_out->saved_ramps.red,
-				    crtc_out->saved_ramps.green, crtc_out->saved_ramps.blue);
+static int
+drm_read_ramps(gamma_server_state_t *state, gamma_crtc_state_t *crtc, gamma_ramps_t ramps)
+{
+	drm_card_data_t *card = state->sites[crtc->site_index].partitions[crtc->partition].data;
+	int r = drmModeCrtcGetGamma(card->fd, (uint32_t)(long)(crtc->data), ramps.red_size,
+				    ramps.red, ramps.green, ramps.blue);
 	if (r < 0) {
 		fprintf(stderr, _("DRM could not read gamma ramps on CRTC %ld on\n"
 				  "graphics card %ld.\n"),
-			crtc, card->index);
+			crtc->crtc, card->index);
 		return -1;
 	}
 
@@ -284,9 +305,8 @@ drm_set_ramps(gamma_server_state_t *state, gamma_crtc_state_t *crtc, gamma_ramps
 		case ENODEV:
 		case ENXIO:
 			/* XXX: I have not actually tested removing my graphics card or,
-			        monitor but I imagine either of these is what would happen. */
-			fprintf(stderr,
-				_("Please do not unplug your monitors or remove graphics cards.\n"));
+			        monitor but I imagine either of these is what would happen.
+			   The caller looks for removed CRTCs and tries again. */
 			return -1;
 		default:
 			perror("drmModeCrtcSetGamma");
@@ -296,6 +316,101 @@ drm_set_ramps(gamma_server_state_t *state, gamma_crtc_state_t *crtc, gamma_ramps
 	return 0;
 }
 
+static size_t
+drm_crtc_id(gamma_server_state_t *state, gamma_site_state_t *site,
+	    gamma_partition_state_t *partition, size_t crtc)
+{
+	(void) state;
+	(void) site;
+	drm_card_data_t *card = partition->data;
+	return (size_t)(card->res->crtcs[crtc]);
+}
+
+static int
+drm_refresh_partition(gamma_server_state_t *state, gamma_site_state_t *site,
+		      gamma_partition_state_t *partition)
+{
+	(void) state;
+	(void) site;
+	drm_card_data_t *card = partition->data;
+	drmModeRes *res = drmModeGetResources(card->fd);
+	if (res == NULL || res->count_crtcs < 0) {
+		if (res != NULL)
+			drmModeFreeResources(res);
+		return -1;
+	}
+	drmModeFreeResources(card->res);
+	card->res = res;
+	partition->crtcs_available = (size_t)(res->count_crtcs);
+	return 0;
+}
+
+static int
+drm_hotplug_fd(gamma_server_state_t *state, gamma_site_state_t *site)
+{
+	(void) state;
+#ifdef __linux__
+	drm_site_data_t *site_data = site->data;
+	struct sockaddr_nl addr;
+
+	/* Listen to the events the kernel sends to udev. */
+	site_data->uevent_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+				      NETLINK_KOBJECT_UEVENT);
+	if (site_data->uevent_fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = 1;
+	if (bind(site_data->uevent_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("bind");
+		close(site_data->uevent_fd);
+		site_data->uevent_fd = -1;
+		return -1;
+	}
+	return site_data->uevent_fd;
+#else
+	(void) site;
+	return -1;
+#endif
+}
+
+static int
+drm_hotplug_handle(gamma_server_state_t *state, gamma_site_state_t *site)
+{
+	(void) state;
+#ifdef __linux__
+	drm_site_data_t *site_data = site->data;
+	char buf[4096];
+	int changed = 0;
+	ssize_t got;
+
+	/* Each event is a sequence of NUL-terminated
+	   strings, ACTION@DEVPATH followed by KEY=VALUE:s. */
+	while ((got = recv(site_data->uevent_fd, buf, sizeof(buf) - 1, 0)) != 0) {
+		if (got < 0 && errno == EINTR) continue;
+		if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+		if (got < 0) {
+			perror("recv");
+			return -1;
+		}
+		buf[got] = '\0';
+		int drm = 0, hotplug = 0;
+		for (char *p = buf; p < buf + got; p += strlen(p) + 1) {
+			if (strcmp(p, "SUBSYSTEM=drm") == 0) drm = 1;
+			if (strcmp(p, "HOTPLUG=1") == 0) hotplug = 1;
+		}
+		if (drm && hotplug) changed = 1;
+	}
+
+	return changed;
+#else
+	(void) site;
+	return 0;
+#endif
+}
+
 static int
 drm_set_option(gamma_server_state_t *state, const char *key, char *value, ssize_t section)
 {
@@ -360,6 +475,96 @@ drm_set_option(gamma_server_state_t *state, const char *key, char *value, ssize_
 	return 1;
 }
 
+/* Get the EDID of a connected monitor, NULL if it has none. */
+static drmModePropertyBlobRes *
+drm_get_edid(drm_card_data_t *card_data, drmModeConnector *connector)
+{
+	int prop_n = connector->count_props;
+
+	/* The property has the same identifier on all connectors of a
+	   card, so only its first lookup goes through the names. */
+	for (int prop_i = 0; card_data->edid_property == 0 && prop_i < prop_n; prop_i++) {
+		drmModePropertyRes *prop = drmModeGetProperty(card_data->fd, connector->props[prop_i]);
+		if (prop == NULL)
+			continue;
+		if (!strcmp("EDID", prop->name))
+			card_data->edid_property = connector->props[prop_i];
+		drmModeFreeProperty(prop);
+	}
+
+	for (int prop_i = 0; prop_i < prop_n; prop_i++) {
+		if (connector->props[prop_i] != card_data->edid_property)
+			continue;
+		uint64_t blob_id = connector->prop_values[prop_i];
+		return drmModeGetPropertyBlob(card_data->fd, (uint32_t)blob_id);
+	}
+	return NULL;
+}
+
+/* Get the index of the CRTC a monitor is connected to,
+   -1 if it is not connected to any. */
+static int
+drm_connector_crtc(drm_card_data_t *card_data, drmModeConnector *connector)
+{
+	drmModeRes *res = card_data->res;
+	drmModeEncoder* encoder = drmModeGetEncoder(card_data->fd, connector->encoder_id);
+	if (encoder == NULL)
+		return -1;
+	uint32_t crtc_id = encoder->crtc_id;
+	drmModeFreeEncoder(encoder);
+
+	for (int crtc = 0; crtc < res->count_crtcs; crtc++)
+		if (res->crtcs[crtc] == crtc_id)
+			return crtc;
+	return -1;
+}
+
+/* Check whether the monitor with the seeked EDID is connected to a
+   connector, returns the index of the CRTC or -1 if it is not. */
+static int
+drm_test_edid(drm_card_data_t *card_data, drmModeConnector *connector,
+	      drm_selection_data_t *selection_data)
+{
+	if (connector == NULL || connector->connection != DRM_MODE_CONNECTED)
+	  /* This is required to avoid segmentation violation,
+	     connector->count_props is non zero just because the
+	     there is not connection, and we cannot reproperaties
+	     when there is no connection .*/
+		return -1;
+
+	drmModePropertyBlobRes *blob = drm_get_edid(card_data, connector);
+	if (blob == NULL)
+		return -1;
+	int found = blob->length == selection_data->edid_length &&
+		!memcmp(blob->data, selection_data->edid, (size_t)(blob->length));
+	drmModeFreePropertyBlob(blob);
+
+	return found ? drm_connector_crtc(card_data, connector) : -1;
+}
+
+static int
+drm_select_found(gamma_selection_state_t *selection, size_t card, size_t crtc)
+{
+	free(selection->crtcs);
+	selection->crtcs = malloc(sizeof(size_t));
+	if (selection->crtcs == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	selection->crtcs[0] = crtc;
+	selection->crtcs_count = 1;
+
+	free(selection->partitions);
+	selection->partitions = malloc(sizeof(size_t));
+	if (selection->partitions == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	selection->partitions[0] = card;
+	selection->partitions_count = 1;
+	return 0;
+}
+
 static int
 drm_parse_selection(gamma_server_state_t *state, gamma_site_state_t *site,
 		    gamma_selection_state_t *selection, enum gamma_selection_hook when)
@@ -370,8 +575,8 @@ drm_parse_selection(gamma_server_state_t *state, gamma_site_state_t *site,
 		return 0;
 
 	drm_selection_data_t *selection_data = selection->data;
-	unsigned char *edid_seeked = selection_data->edid;
-	uint32_t edid_length = selection_data->edid_length;
+	uint64_t cached_connector;
+	size_t cached_card, cached_crtc;
 
 	if (selection->partitions_count == 0) {
 		selection->partitions = malloc(site->partitions_available * sizeof(size_t));
@@ -384,6 +589,31 @@ drm_parse_selection(gamma_server_state_t *state, gamma_site_state_t *site,
 			selection->partitions[i] = i;
 	}
 
+	/* DRM has no configuration timestamp, instead the connector
+	   the monitor was found on last time is checked again. */
+	if (gamma_edid_cache_load("drm", site->site, selection_data->edid,
+				  (size_t)(selection_data->edid_length),
+				  &cached_connector, &cached_card, &cached_crtc)) {
+		int selected = 0;
+		for (size_t i = 0; i < selection->partitions_count; i++)
+			if (selection->partitions[i] == cached_card)
+				selected = 1;
+		if (selected && cached_card < site->partitions_available &&
+		    site->partitions[cached_card].used) {
+			drm_card_data_t *card_data = site->partitions[cached_card].data;
+			drmModeConnector *connector =
+				drmModeGetConnector(card_data->fd, (uint32_t)cached_connector);
+			int crtc = drm_test_edid(card_data, connector, selection_data);
+			if (connector != NULL)
+				drmModeFreeConnector(connector);
+			if (crtc >= 0 && (size_t)crtc == cached_crtc) {
+				metrics_count(METRICS_EDID_CACHE_HITS, 1);
+				return drm_select_found(selection, cached_card, cached_crtc);
+			}
+		}
+	}
+	metrics_count(METRICS_EDID_CACHE_MISSES, 1);
+
 	for (size_t card_i = 0; card_i < selection->partitions_count; card_i++) {
 		size_t card_index = selection->partitions[card_i];
 		gamma_partition_state_t *card = site->partitions + card_index;
@@ -407,62 +637,15 @@ drm_parse_selection(gamma_server_state_t *state, gamma_site_state_t *site,
 
 		for (ssize_t connector_i = 0; connector_i < cconnector_n; connector_i++) {
 			drmModeConnector *connector = card_data->connectors[connector_i];
-
-			if (connector->connection != DRM_MODE_CONNECTED)
-			  /* This is required to avoid segmentation violation,
-			     connector->count_props is non zero just because the
-			     there is not connection, and we cannot reproperaties
-			     when there is no connection .*/
+			int crtc = drm_test_edid(card_data, connector, selection_data);
+			if (crtc < 0)
 				continue;
 
-			int prop_n = connector->count_props;
-
-			for (int prop_i = 0; prop_i < prop_n; prop_i++) {
-				drmModePropertyRes *prop;
-				drmModePropertyBlobRes *blob;
-
-				prop = drmModeGetProperty(fd, connector->props[prop_i]);
-				if (!strcmp("EDID", prop->name)) {
-					uint64_t blob_id = connector->prop_values[prop_i];
-					blob = drmModeGetPropertyBlob(fd, (uint32_t)blob_id);
-					uint32_t length = blob->length;
-					unsigned char *value = blob->data;
-
-					if ((length == edid_length) &&
-					    !memcmp(value, edid_seeked, (size_t)length)) {
-						drmModeEncoder* encoder =
-							drmModeGetEncoder(fd, connector->encoder_id);
-						uint32_t crtc_id = encoder->crtc_id;
-						int crtc;
-
-						for (crtc = 0; crtc < res->count_crtcs; crtc++)
-							if (res->crtcs[crtc] == crtc_id)
-								break;
-
-						selection->crtcs = malloc(sizeof(size_t));
-						if (selection->crtcs == NULL) {
-							perror("malloc");
-							return -1;
-						}
-						selection->crtcs[0] = (size_t)crtc;
-						selection->crtcs_count = 1;
-						selection->partitions = malloc(sizeof(size_t));
-						if (selection->partitions == NULL) {
-							perror("malloc");
-							return -1;
-						}
-						selection->partitions[0] = card_index;
-						selection->partitions_count = 1;
-
-						drmModeFreeEncoder(encoder);
-						drmModeFreeProperty(prop);
-						drmModeFreePropertyBlob(blob);
-						return crtc < res->count_crtcs ? 0 : -1;
-					}
-					drmModeFreePropertyBlob(blob);
-				}
-				drmModeFreeProperty(prop);
-			}
+			gamma_edid_cache_save("drm", site->site, selection_data->edid,
+					      (size_t)(selection_data->edid_length),
+					      (uint64_t)(res->connectors[connector_i]),
+					      card_index, (size_t)crtc);
+			return drm_select_found(selection, card_index, (size_t)crtc);
 		}
 	}
 
@@ -478,6 +661,7 @@ drm_init(gamma_server_state_t *state)
 	if (r != 0) return r;
 
 	state->selections->sizeof_data = sizeof(drm_selection_data_t);
+	state->free_site_data          = drm_free_site;
 	state->free_partition_data     = drm_free_partition;
 	state->free_crtc_data          = drm_free_crtc;
 	state->open_site               = drm_open_site;
@@ -485,6 +669,11 @@ drm_init(gamma_server_state_t *state)
 	state->open_crtc               = drm_open_crtc;
 	state->invalid_partition       = drm_invalid_partition;
 	state->set_ramps               = drm_set_ramps;
+	state->read_ramps              = drm_read_ramps;
+	state->crtc_id                 = drm_crtc_id;
+	state->refresh_partition       = drm_refresh_partition;
+	state->hotplug_fd              = drm_hotplug_fd;
+	state->hotplug_handle          = drm_hotplug_handle;
 	state->set_option              = drm_set_option;
 	state->parse_selection         = drm_parse_selection;
 
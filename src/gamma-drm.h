@@ -36,11 +36,19 @@
 #endif
 
 
+typedef struct {
+	/* Socket for kernel uevents, telling when monitors
+	   are plugged in or unplugged, -1 if not opened. */
+	int uevent_fd;
+} drm_site_data_t;
+
 typedef struct {
 	int fd;
 	drmModeRes *res;
 	size_t index;
 	drmModeConnector** connectors;
+	/* The identifier of the EDID property, 0 until it is known. */
+	uint32_t edid_property;
 } drm_card_data_t;
 
 typedef struct {
@@ -22,6 +22,20 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#ifndef _WIN32
+# include <fcntl.h>
+# include <unistd.h>
+#endif
+#ifdef GAMMA_DUMMY_CONCURRENT
+# include <sys/timerfd.h>
+#endif
+#ifdef _WIN32
+# include <windows.h>
+#endif
 
 #ifdef ENABLE_NLS
 # include <libintl.h>
@@ -38,22 +52,474 @@ gamma_dummy_auto()
 }
 
 
+static void
+gamma_dummy_free_state(void *data)
+{
+	gamma_dummy_state_t *dummy = data;
+#ifndef _WIN32
+	if (dummy->hotplug_fd >= 0) close(dummy->hotplug_fd);
+	if (dummy->hotplug_keep_fd >= 0) close(dummy->hotplug_keep_fd);
+#endif
+	gamma_record_close(&dummy->record);
+	free(dummy->record_path);
+	free(dummy->hotplug_path);
+	free(dummy->crtcs);
+	free(dummy);
+}
+
+static void
+gamma_dummy_free_site(void *data)
+{
+	gamma_dummy_site_t *site = data;
+#ifdef GAMMA_DUMMY_CONCURRENT
+	if (site->timer_fd >= 0) close(site->timer_fd);
+#endif
+	free(site);
+}
+
+static void
+gamma_dummy_free_nothing(void *data)
+{
+	(void) data;
+}
+
+static int
+gamma_dummy_open_site(gamma_server_state_t *state, char *site, gamma_site_state_t *site_out)
+{
+	gamma_dummy_state_t *dummy = state->data;
+	gamma_dummy_site_t *data;
+	(void) site;
+
+	data = malloc(sizeof(gamma_dummy_site_t));
+	if (data == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	data->sent = 0;
+	data->timer_fd = -1;
+#ifdef GAMMA_DUMMY_CONCURRENT
+	/* Becomes readable when the site has applied the gamma ramps. */
+	data->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (data->timer_fd < 0) {
+		perror("timerfd_create");
+		free(data);
+		return -1;
+	}
+#endif
+
+	site_out->data = data;
+	site_out->partitions_available = dummy->partitions_count;
+	return 0;
+}
+
+static int
+gamma_dummy_open_partition(gamma_server_state_t *state, gamma_site_state_t *site,
+			   size_t partition, gamma_partition_state_t *partition_out)
+{
+	gamma_dummy_state_t *dummy = state->data;
+	(void) site;
+	(void) partition;
+	partition_out->data = NULL;
+	partition_out->crtcs_available = dummy->crtcs_count;
+	return 0;
+}
+
+static int
+gamma_dummy_open_crtc(gamma_server_state_t *state, gamma_site_state_t *site,
+		      gamma_partition_state_t *partition, size_t crtc, gamma_crtc_state_t *crtc_out)
+{
+	gamma_dummy_state_t *dummy = state->data;
+	gamma_dummy_crtc_t *data;
+	size_t n = dummy->ramp_size;
+	(void) partition;
+
+	/* The gamma ramps the CRTC has, after its other data. */
+	data = malloc(sizeof(gamma_dummy_crtc_t) + 3 * n * sizeof(uint16_t));
+	if (data == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	data->ramps.red_size = data->ramps.green_size = data->ramps.blue_size = n;
+	data->ramps.red = (uint16_t *)(data + 1);
+	data->ramps.green = data->ramps.red + n;
+	data->ramps.blue = data->ramps.green + n;
+	/* Different, but reproducible, failures for every CRTC. */
+	uint64_t z = dummy->seed + (((uint64_t)(site - state->sites) << 32) + (uint64_t)crtc + 1) *
+		0x9E3779B97F4A7C15ULL;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	data->random = (z ^ (z >> 31)) | 1;
+	data->site = site->data;
+
+	/* The dummy CRTCs are not calibrated. */
+	for (size_t i = 0; i < n; i++) {
+		uint16_t value = (uint16_t)(i * UINT16_MAX / (n - 1));
+		data->ramps.red[i] = data->ramps.green[i] = data->ramps.blue[i] = value;
+	}
+
+	crtc_out->data = data;
+	crtc_out->saved_ramps.red_size   = n;
+	crtc_out->saved_ramps.green_size = n;
+	crtc_out->saved_ramps.blue_size  = n;
+	return 0;
+}
+
+/* Decide whether an operation on a CRTC fails, with
+   the probability given by the `fail-rate' option. */
+static int
+gamma_dummy_fails(gamma_dummy_state_t *dummy, gamma_dummy_crtc_t *crtc)
+{
+	if (dummy->fail_rate <= 0)
+		return 0;
+	/* xorshift64*, each CRTC has its own so that
+	   CRTCs can be updated from different threads. */
+	crtc->random ^= crtc->random >> 12;
+	crtc->random ^= crtc->random << 25;
+	crtc->random ^= crtc->random >> 27;
+	uint64_t x = crtc->random * 2685821657736338717ULL;
+	return (double)(x >> 11) / 9007199254740992.0 < dummy->fail_rate;
+}
+
+/* Copy gamma ramps of the same size. */
+static void
+gamma_dummy_copy_ramps(gamma_ramps_t to, gamma_ramps_t from)
+{
+	memcpy(to.red, from.red, to.red_size * sizeof(uint16_t));
+	memcpy(to.green, from.green, to.green_size * sizeof(uint16_t));
+	memcpy(to.blue, from.blue, to.blue_size * sizeof(uint16_t));
+}
+
+static int
+gamma_dummy_read_ramps(gamma_server_state_t *state, gamma_crtc_state_t *crtc, gamma_ramps_t ramps)
+{
+	gamma_dummy_state_t *dummy = state->data;
+	gamma_dummy_crtc_t *data = crtc->data;
+
+	if (gamma_dummy_fails(dummy, data)) {
+		fputs(_("Simulated failure to read gamma ramps.\n"), stderr);
+		return -1;
+	}
+	gamma_dummy_copy_ramps(ramps, data->ramps);
+	return 0;
+}
+
+/* Pretend to wait for the display. */
+static void
+gamma_dummy_delay(double seconds)
+{
+	if (seconds <= 0)
+		return;
+#ifndef _WIN32
+	struct timespec ts;
+	ts.tv_sec = (time_t)seconds;
+	ts.tv_nsec = (long)((seconds - (double)ts.tv_sec) * 1000000000.0);
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR);
+#else
+	Sleep((DWORD)(seconds * 1000.0));
+#endif
+}
+
+static int
+gamma_dummy_send_ramps(gamma_server_state_t *state, gamma_crtc_state_t *crtc, gamma_ramps_t ramps)
+{
+	gamma_dummy_state_t *dummy = state->data;
+	gamma_dummy_crtc_t *data = crtc->data;
+
+	if (gamma_dummy_fails(dummy, data)) {
+		fputs(_("Simulated failure to apply gamma ramps.\n"), stderr);
+		return -1;
+	}
+	gamma_dummy_copy_ramps(data->ramps, ramps);
+	data->site->sent++;
+	if (dummy->record.file != NULL)
+		return gamma_record_write(&dummy->record, (size_t)(crtc - state->crtcs),
+					  &crtc->settings, ramps);
+	return 0;
+}
+
 static int
 gamma_dummy_set_ramps(gamma_server_state_t *state, gamma_crtc_state_t *crtc, gamma_ramps_t ramps)
 {
+	gamma_dummy_state_t *dummy = state->data;
+	gamma_dummy_crtc_t *data = crtc->data;
+	int r;
+
+	r = gamma_dummy_send_ramps(state, crtc, ramps);
+	data->site->sent = 0;
+	gamma_dummy_delay(dummy->latency);
+	return r;
+}
+
+#ifdef GAMMA_DUMMY_CONCURRENT
+/* The site applies the gamma ramps one CRTC at a time,
+   taking `latency' seconds for each. */
+static int
+gamma_dummy_flush_site(gamma_server_state_t *state, gamma_site_state_t *site, int *fd)
+{
+	gamma_dummy_state_t *dummy = state->data;
+	gamma_dummy_site_t *data = site->data;
+	struct itimerspec spec;
+	double seconds = dummy->latency * (double)(data->sent);
+
+	data->sent = 0;
+	if (seconds <= 0)
+		return 0;
+
+	memset(&spec, 0, sizeof(spec));
+	spec.it_value.tv_sec = (time_t)seconds;
+	spec.it_value.tv_nsec = (long)((seconds - (double)spec.it_value.tv_sec) * 1000000000.0);
+	if (timerfd_settime(data->timer_fd, 0, &spec, NULL) < 0) {
+		perror("timerfd_settime");
+		return -1;
+	}
+	*fd = data->timer_fd;
+	return 1;
+}
+
+static int
+gamma_dummy_poll_site(gamma_server_state_t *state, gamma_site_state_t *site)
+{
+	gamma_dummy_site_t *data = site->data;
+	uint64_t expirations;
+	(void) state;
+
+	if (read(data->timer_fd, &expirations, sizeof(expirations)) < 0) {
+		if (errno == EAGAIN || errno == EINTR) {
+			/* Not expired, or not armed as the gamma
+			   ramps were applied without latency. */
+			struct itimerspec spec;
+			if (timerfd_gettime(data->timer_fd, &spec) < 0) {
+				perror("timerfd_gettime");
+				return -1;
+			}
+			return spec.it_value.tv_sec != 0 || spec.it_value.tv_nsec != 0;
+		}
+		perror("read");
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+static size_t
+gamma_dummy_crtc_id(gamma_server_state_t *state, gamma_site_state_t *site,
+		    gamma_partition_state_t *partition, size_t crtc)
+{
+	gamma_dummy_state_t *dummy = state->data;
+	(void) site;
+	(void) partition;
+	return dummy->crtcs[crtc];
+}
+
+static int
+gamma_dummy_refresh_partition(gamma_server_state_t *state, gamma_site_state_t *site,
+			      gamma_partition_state_t *partition)
+{
+	gamma_dummy_state_t *dummy = state->data;
+	(void) site;
+	partition->crtcs_available = dummy->crtcs_count;
+	return 0;
+}
+
+static int
+gamma_dummy_hotplug_fd(gamma_server_state_t *state, gamma_site_state_t *site)
+{
+	gamma_dummy_state_t *dummy = state->data;
+	(void) site;
+	return dummy->hotplug_fd;
+}
+
+/* Parse a line listing the identifiers of the CRTCs that exist.
+   Returns 1 if the line is such a list, otherwise zero. */
+static int
+gamma_dummy_parse_crtcs(gamma_dummy_state_t *dummy, const char *line)
+{
+	size_t *crtcs, n = 0;
+	char *end;
+
+	/* A line of N characters cannot list more than N/2 + 1 CRTCs. */
+	crtcs = malloc((strlen(line) / 2 + 1) * sizeof(size_t));
+	if (crtcs == NULL) {
+		perror("malloc");
+		return 0;
+	}
+
+	for (;;) {
+		while (*line == ' ' || *line == '\t' || *line == ',') line++;
+		if (*line == '\0') break;
+		errno = 0;
+		unsigned long id = strtoul(line, &end, 10);
+		if (errno != 0 || end == line || *line == '-') {
+			fputs(_("Ignoring malformed list of CRTCs.\n"), stderr);
+			free(crtcs);
+			return 0;
+		}
+		crtcs[n++] = (size_t)id;
+		line = end;
+	}
+
+	free(dummy->crtcs);
+	dummy->crtcs = crtcs;
+	dummy->crtcs_count = n;
+	return 1;
+}
+
+static int
+gamma_dummy_hotplug_handle(gamma_server_state_t *state, gamma_site_state_t *site)
+{
+#ifndef _WIN32
+	gamma_dummy_state_t *dummy = state->data;
+	int changed = 0;
+	char buf[512];
+	ssize_t got;
+
+	(void) site;
+
+	while ((got = read(dummy->hotplug_fd, buf, sizeof(buf))) != 0) {
+		if (got < 0 && errno == EINTR) continue;
+		if (got < 0 && errno == EAGAIN) break;
+		if (got < 0) {
+			perror("read");
+			return -1;
+		}
+
+		for (ssize_t i = 0; i < got; i++) {
+			if (buf[i] != '\n') {
+				/* Overlong lines are dropped. */
+				if (dummy->line_len + 1 >= sizeof(dummy->line))
+					dummy->line_len = 0;
+				dummy->line[dummy->line_len++] = buf[i];
+				continue;
+			}
+			dummy->line[dummy->line_len] = '\0';
+			dummy->line_len = 0;
+			changed |= gamma_dummy_parse_crtcs(dummy, dummy->line);
+		}
+	}
+
+	return changed;
+#else
 	(void) state;
-	(void) crtc;
-	(void) ramps;
+	(void) site;
+	return 0;
+#endif
+}
+
+/* Parse a count option. Returns -1 if it is malformed. */
+static int
+gamma_dummy_parse_count(const char *key, const char *value, size_t *count)
+{
+	char *end;
+	errno = 0;
+	unsigned long n = strtoul(value, &end, 10);
+	if (errno != 0 || end == value || *end != '\0' || *value == '-') {
+		fprintf(stderr, _("Malformed %s option: `%s'.\n"), key, value);
+		return -1;
+	}
+	*count = (size_t)n;
 	return 0;
 }
 
 static int
 gamma_dummy_set_option(gamma_server_state_t *state, const char *key, char *value, ssize_t section)
 {
-	(void) state;
-	(void) key;
-	(void) value;
-	(void) section;
+	gamma_dummy_state_t *dummy = state->data;
+	size_t n;
+
+	if (strcasecmp(key, "sites") == 0) {
+		if (gamma_dummy_parse_count(key, value, &n) < 0)
+			return -1;
+		if (n == 0) {
+			fprintf(stderr, _("Malformed %s option: `%s'.\n"), key, value);
+			return -1;
+		}
+		/* The sites are named by their index. */
+		char *names = malloc(n * (3 * sizeof(size_t) + 1) + 1);
+		if (names == NULL) {
+			perror("malloc");
+			return -1;
+		}
+		char *p = names;
+		for (size_t i = 0; i < n; i++)
+			p += sprintf(p, i == 0 ? "%lu" : ",%lu", (unsigned long)i);
+		int r = gamma_select_sites(state, names, ',', section);
+		free(names);
+		if (r < 0) return r;
+		dummy->sites_count = n;
+		return 0;
+	} else if (strcasecmp(key, "partitions") == 0) {
+		return gamma_dummy_parse_count(key, value, &dummy->partitions_count);
+	} else if (strcasecmp(key, "ramp-size") == 0) {
+		if (gamma_dummy_parse_count(key, value, &n) < 0)
+			return -1;
+		if (n < 2 || n > UINT16_MAX + 1) {
+			fprintf(stderr, _("Malformed %s option: `%s'.\n"), key, value);
+			return -1;
+		}
+		dummy->ramp_size = n;
+		return 0;
+	} else if (strcasecmp(key, "fail-rate") == 0) {
+		char *end;
+		errno = 0;
+		dummy->fail_rate = strtod(value, &end);
+		if (errno != 0 || end == value || *end != '\0' ||
+		    !(dummy->fail_rate >= 0 && dummy->fail_rate <= 1)) {
+			fprintf(stderr, _("Malformed %s option: `%s'.\n"), key, value);
+			return -1;
+		}
+		return 0;
+	} else if (strcasecmp(key, "seed") == 0) {
+		if (gamma_dummy_parse_count(key, value, &n) < 0)
+			return -1;
+		dummy->seed = (uint64_t)n;
+		return 0;
+	} else if (strcasecmp(key, "latency") == 0) {
+		char *end;
+		errno = 0;
+		dummy->latency = strtod(value, &end);
+		if (errno != 0 || end == value || *end != '\0' || !(dummy->latency >= 0)) {
+			fprintf(stderr, _("Malformed %s option: `%s'.\n"), key, value);
+			return -1;
+		}
+		return 0;
+	} else if (dummy->recording && strcasecmp(key, "file") == 0) {
+		free(dummy->record_path);
+		dummy->record_path = strdup(value);
+		if (dummy->record_path == NULL) {
+			perror("strdup");
+			return -1;
+		}
+		return 0;
+	} else if (dummy->recording && strcasecmp(key, "ramps") == 0) {
+		dummy->record.ramps = strcmp(value, "1") == 0;
+		if (!dummy->record.ramps && strcmp(value, "0") != 0) {
+			fprintf(stderr, _("Malformed %s option: `%s'.\n"), key, value);
+			return -1;
+		}
+		return 0;
+	} else if (strcasecmp(key, "crtcs") == 0) {
+		if (gamma_dummy_parse_count(key, value, &n) < 0)
+			return -1;
+		size_t *crtcs = malloc((n + 1) * sizeof(size_t));
+		if (crtcs == NULL) {
+			perror("malloc");
+			return -1;
+		}
+		for (size_t i = 0; i < n; i++)
+			crtcs[i] = i;
+		free(dummy->crtcs);
+		dummy->crtcs = crtcs;
+		dummy->crtcs_count = n;
+		return 0;
+	} else if (strcasecmp(key, "hotplug") == 0) {
+		free(dummy->hotplug_path);
+		dummy->hotplug_path = strdup(value);
+		if (dummy->hotplug_path == NULL) {
+			perror("strdup");
+			return -1;
+		}
+		return 0;
+	}
 	return 1;
 }
 
@@ -64,20 +530,93 @@ gamma_dummy_init(gamma_server_state_t *state)
 	int r;
 	r = gamma_init(state);
 	if (r != 0) return r;
-	state->data = NULL;
-	state->set_ramps = gamma_dummy_set_ramps;
-	state->set_option = gamma_dummy_set_option;
+
+	gamma_dummy_state_t *dummy = malloc(sizeof(gamma_dummy_state_t));
+	if (dummy == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	dummy->crtcs = malloc(sizeof(size_t));
+	if (dummy->crtcs == NULL) {
+		perror("malloc");
+		free(dummy);
+		return -1;
+	}
+	/* One CRTC unless told otherwise. */
+	dummy->sites_count = 1;
+	dummy->partitions_count = 1;
+	dummy->crtcs[0] = 0;
+	dummy->crtcs_count = 1;
+	dummy->ramp_size = GAMMA_DUMMY_RAMP_SIZE;
+	dummy->latency = 0;
+	dummy->fail_rate = 0;
+	dummy->seed = 1;
+	dummy->hotplug_path = NULL;
+	dummy->hotplug_fd = -1;
+	dummy->hotplug_keep_fd = -1;
+	dummy->line_len = 0;
+	dummy->recording = 0;
+	dummy->record_path = NULL;
+	dummy->record.file = NULL;
+	dummy->record.ramps = 0;
+
+	state->data = dummy;
+	state->free_state_data   = gamma_dummy_free_state;
+	state->free_site_data    = gamma_dummy_free_site;
+	state->free_partition_data = gamma_dummy_free_nothing;
+	state->free_crtc_data    = free;
+	state->open_site         = gamma_dummy_open_site;
+	state->open_partition    = gamma_dummy_open_partition;
+	state->open_crtc         = gamma_dummy_open_crtc;
+	state->set_ramps         = gamma_dummy_set_ramps;
+	state->read_ramps        = gamma_dummy_read_ramps;
+	state->set_option        = gamma_dummy_set_option;
+	state->crtc_id           = gamma_dummy_crtc_id;
+	state->refresh_partition = gamma_dummy_refresh_partition;
+	state->hotplug_fd        = gamma_dummy_hotplug_fd;
+	state->hotplug_handle    = gamma_dummy_hotplug_handle;
+#ifdef GAMMA_DUMMY_CONCURRENT
+	state->send_ramps        = gamma_dummy_send_ramps;
+	state->flush_site        = gamma_dummy_flush_site;
+	state->poll_site         = gamma_dummy_poll_site;
+#endif
 	return 0;
 }
 
 int
 gamma_dummy_start(gamma_server_state_t *state)
 {
-	(void) state;
-	fputs(_("WARNING: Using dummy gamma method! "
-		"Display will not be affected by this gamma method.\n"),
-	      stderr);
-	return 0;
+	gamma_dummy_state_t *dummy = state->data;
+
+	if (!dummy->recording) {
+		fputs(_("WARNING: Using dummy gamma method! "
+			"Display will not be affected by this gamma method.\n"),
+		      stderr);
+	}
+
+	if (dummy->hotplug_path != NULL) {
+#ifndef _WIN32
+		dummy->hotplug_fd = open(dummy->hotplug_path,
+					 O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+		if (dummy->hotplug_fd < 0) {
+			perror("open");
+			return -1;
+		}
+		/* Keep the FIFO open when writers come and go. */
+		dummy->hotplug_keep_fd = open(dummy->hotplug_path,
+					      O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+		if (dummy->hotplug_keep_fd < 0) {
+			perror("open");
+			return -1;
+		}
+#else
+		fputs(_("The dummy method cannot follow a FIFO on Windows.\n"),
+		      stderr);
+		return -1;
+#endif
+	}
+
+	return gamma_resolve_selections(state);
 }
 
 void
@@ -87,4 +626,74 @@ gamma_dummy_print_help(FILE *f)
 		"the color temperature to the terminal.\n"),
 	      f);
 	fputs("\n", f);
+
+	/* TRANSLATORS: Dummy help output
+	   left column must not be translated */
+	fputs(_("  sites=N\tThe number of sites to pretend there are\n"
+		"  partitions=N\tThe number of partitions per site\n"
+		"  crtcs=N\tThe number of CRTCs per partition\n"
+		"  ramp-size=N\tThe number of stops in the gamma ramps\n"
+		"  latency=SECONDS\tTime each application of gamma ramps takes\n"
+		"  fail-rate=P\tProbability that reading or applying gamma ramps fails\n"
+		"  seed=N\tSeed for the simulated failures\n"
+		"  hotplug=FIFO\tFIFO that lists the CRTCs whenever they change\n"), f);
+	fputs("\n", f);
+}
+
+
+int
+gamma_dummy_record_auto()
+{
+	return 0;
+}
+
+int
+gamma_dummy_record_init(gamma_server_state_t *state)
+{
+	int r = gamma_dummy_init(state);
+	if (r != 0) return r;
+	((gamma_dummy_state_t *)(state->data))->recording = 1;
+	return 0;
+}
+
+int
+gamma_dummy_record_start(gamma_server_state_t *state)
+{
+	gamma_dummy_state_t *dummy = state->data;
+	int r;
+
+	if (dummy->record_path == NULL) {
+		fputs(_("The record method needs a trace file, `file=PATH'.\n"),
+		      stderr);
+		return -1;
+	}
+
+	r = gamma_dummy_start(state);
+	if (r != 0) return r;
+
+	return gamma_record_open(&dummy->record, dummy->record_path, dummy->record.ramps,
+				 dummy->sites_count, dummy->partitions_count,
+				 dummy->crtcs_count, dummy->ramp_size);
+}
+
+void
+gamma_dummy_record_print_help(FILE *f)
+{
+	fputs(_("Does not affect the display but writes every application\n"
+		"of gamma ramps to a trace, that can be replayed with `--replay'.\n"),
+	      f);
+	fputs("\n", f);
+
+	/* TRANSLATORS: Record help output
+	   left column must not be translated */
+	fputs(_("  file=PATH\tThe trace to write\n"
+		"  ramps=1\tWrite the gamma ramps, not only their hash\n"
+		"  sites=N\tThe number of sites to pretend there are\n"
+		"  partitions=N\tThe number of partitions per site\n"
+		"  crtcs=N\tThe number of CRTCs per partition\n"
+		"  ramp-size=N\tThe number of stops in the gamma ramps\n"
+		"  latency=SECONDS\tTime each application of gamma ramps takes\n"
+		"  fail-rate=P\tProbability that reading or applying gamma ramps fails\n"
+		"  seed=N\tSeed for the simulated failures\n"), f);
+	fputs("\n", f);
 }
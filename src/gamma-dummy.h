@@ -23,6 +23,65 @@
 
 #include "redshift.h"
 #include "gamma-common.h"
+#include "gamma-record.h"
+
+
+/* The size of the dummy gamma ramps. */
+#define GAMMA_DUMMY_RAMP_SIZE  256
+
+/* Sites are updated concurrently where a timer can
+   tell when a simulated site is done. */
+#ifdef __linux__
+# define GAMMA_DUMMY_CONCURRENT
+#endif
+
+
+/* A simulated site. */
+typedef struct {
+	/* The number of CRTCs sent to since the last flush. */
+	size_t sent;
+	/* Expires when the gamma ramps have been applied. */
+	int timer_fd;
+} gamma_dummy_site_t;
+
+/* A simulated CRTC. */
+typedef struct {
+	/* The gamma ramps the CRTC has. */
+	gamma_ramps_t ramps;
+	/* Random state for simulated failures. */
+	uint64_t random;
+	gamma_dummy_site_t *site;
+} gamma_dummy_crtc_t;
+
+
+typedef struct {
+	/* The number of sites and partitions per site to pretend there are. */
+	size_t sites_count;
+	size_t partitions_count;
+	/* The identifiers of the CRTCs that exist. */
+	size_t *crtcs;
+	size_t crtcs_count;
+	/* The number of stops in the gamma ramps. */
+	size_t ramp_size;
+	/* Seconds each application of gamma ramps takes. */
+	double latency;
+	/* The probability that reading or applying gamma ramps
+	   fails, and the seed the failures are drawn from. */
+	double fail_rate;
+	uint64_t seed;
+	/* A FIFO that lists the CRTCs whenever they change. */
+	char *hotplug_path;
+	int hotplug_fd;
+	int hotplug_keep_fd;
+	/* The incomplete last line read from the FIFO. */
+	char line[256];
+	size_t line_len;
+	/* Whether this is the record method, where the gamma
+	   ramps are written to the trace at `record_path'. */
+	int recording;
+	char *record_path;
+	gamma_record_t record;
+} gamma_dummy_state_t;
 
 
 int gamma_dummy_auto(void);
@@ -32,5 +91,13 @@ int gamma_dummy_start(gamma_server_state_t *state);
 
 void gamma_dummy_print_help(FILE *f);
 
+/* The dummy method, recording the gamma ramps it is given. */
+int gamma_dummy_record_auto(void);
+
+int gamma_dummy_record_init(gamma_server_state_t *state);
+int gamma_dummy_record_start(gamma_server_state_t *state);
+
+void gamma_dummy_record_print_help(FILE *f);
+
 
 #endif /* ! REDSHIFT_GAMMA_DUMMY_H */
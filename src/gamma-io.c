@@ -0,0 +1,554 @@
+/* gamma-io.c -- Gamma ramp I/O threads source
+   This file is part of Redshift.
+
+   Redshift is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Redshift is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Redshift.  If not, see <http://www.gnu.org/licenses/>.
+
+   Copyright (c) 2014  Mattias Andrée <maandree@member.fsf.org>
+*/
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "gamma-io.h"
+#include "gamma-pool.h"
+#include "metrics.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+# define GAMMA_IO_THREADED
+# include <pthread.h>
+# include <signal.h>
+# include <time.h>
+# include <fcntl.h>
+# include <unistd.h>
+#endif
+
+#ifdef ENABLE_NLS
+# include <libintl.h>
+# define _(s) gettext(s)
+#else
+# define _(s) s
+#endif
+
+
+#ifdef GAMMA_IO_THREADED
+
+
+/* Set in the middle slot of a mailbox when it
+   holds gamma ramps the thread has not taken. */
+#define GAMMA_IO_FRESH  4
+
+/* The state of a request for the site's thread to read
+   the saved gamma ramps of a CRTC, in `read' of its mailbox. */
+#define GAMMA_IO_READ_WANTED  1
+#define GAMMA_IO_READ_DONE    2
+#define GAMMA_IO_READ_FAILED  3
+
+/* Three sets of gamma ramps for one CRTC, written by the main
+   thread and applied by the site's thread. The main thread owns
+   `back', the site's thread owns `front', and they exchange their
+   set with `middle'. Neither waits for the other, and the thread
+   always takes the newest gamma ramps. */
+typedef struct {
+	gamma_ramps_t ramps[3];
+	int back;
+	int front;
+	int middle;
+	int read;
+} gamma_io_mailbox_t;
+
+typedef struct {
+	gamma_server_state_t *state;
+	gamma_site_state_t *site;
+	/* The mailboxes of the site's CRTCs. */
+	gamma_io_mailbox_t *mailboxes;
+	pthread_t thread;
+	int running;
+	/* Written to when there are new gamma ramps. */
+	int wake_pipe[2];
+	/* Set by the thread when gamma ramps could not be applied,
+	   and by the main thread when the thread shall exit. */
+	int failed;
+	int quit;
+	/* `exited' is set by the thread when it exits, and `abandoned'
+	   by the main thread if it gave up waiting for that, in which
+	   case the thread frees this structure itself. */
+	pthread_mutex_t lock;
+	pthread_cond_t exit_cond;
+	int exited;
+	int abandoned;
+} gamma_io_site_t;
+
+typedef struct {
+	/* One allocation per site, as a thread that is
+	   abandoned keeps its own after the rest is freed. */
+	gamma_io_site_t **sites;
+	gamma_io_mailbox_t *mailboxes;
+	/* The space for the gamma ramps of the mailboxes. */
+	uint16_t *ramps;
+} gamma_io_t;
+
+
+static void
+gamma_io_site_free(gamma_io_site_t *site_io)
+{
+	if (site_io->wake_pipe[0] >= 0) close(site_io->wake_pipe[0]);
+	if (site_io->wake_pipe[1] >= 0) close(site_io->wake_pipe[1]);
+	pthread_mutex_destroy(&site_io->lock);
+	pthread_cond_destroy(&site_io->exit_cond);
+	free(site_io);
+}
+
+/* Whether the main thread has given up on the thread, which
+   must then not touch anything but its own structure. */
+static int
+gamma_io_abandoned(gamma_io_site_t *io)
+{
+	pthread_mutex_lock(&io->lock);
+	int abandoned = io->abandoned;
+	pthread_mutex_unlock(&io->lock);
+	return abandoned;
+}
+
+static void *
+gamma_io_thread(void *data)
+{
+	gamma_io_site_t *io = data;
+	gamma_server_state_t *state = io->state;
+	size_t offset = io->site->crtcs_offset;
+	gamma_crtc_state_t *crtcs = state->crtcs + offset;
+	size_t n = io->site->crtcs_used;
+	char buf[64];
+	ssize_t got;
+
+	for (;;) {
+		/* Wakeups that arrive while gamma ramps
+		   are being applied are handled together. */
+		got = read(io->wake_pipe[0], buf, sizeof(buf));
+		if (got < 0 && errno == EINTR) continue;
+		if (got <= 0) break;
+
+		/* Saved gamma ramps are read here rather than by the
+		   main thread, as it must not wait for the site. */
+		for (size_t i = 0; i < n; i++) {
+			gamma_io_mailbox_t *mailbox = io->mailboxes + i;
+			if (__atomic_load_n(&mailbox->read, __ATOMIC_ACQUIRE) != GAMMA_IO_READ_WANTED)
+				continue;
+			double span = trace_begin("read ramps");
+			int r = state->read_ramps(state, crtcs + i, crtcs[i].saved_ramps);
+			trace_end_value("read ramps", span, "crtc", offset + i);
+			__atomic_store_n(&mailbox->read, r == 0 ? GAMMA_IO_READ_DONE :
+					 GAMMA_IO_READ_FAILED, __ATOMIC_RELEASE);
+
+			if (gamma_io_abandoned(io))
+				goto exit;
+		}
+
+		for (size_t i = 0; i < n; i++) {
+			gamma_io_mailbox_t *mailbox = io->mailboxes + i;
+			if (!(__atomic_load_n(&mailbox->middle, __ATOMIC_ACQUIRE) & GAMMA_IO_FRESH))
+				continue;
+			int middle = __atomic_exchange_n(&mailbox->middle, mailbox->front,
+							 __ATOMIC_ACQ_REL);
+			mailbox->front = middle & ~GAMMA_IO_FRESH;
+			double start = metrics_begin();
+			double span = trace_begin("set_ramps");
+			if (state->set_ramps(state, crtcs + i, mailbox->ramps[mailbox->front]) != 0)
+				__atomic_store_n(&io->failed, 1, __ATOMIC_RELEASE);
+			trace_end_value("set_ramps", span, "crtc", offset + i);
+			metrics_end(METRICS_SET_RAMPS_SECONDS, start);
+			metrics_count(METRICS_RAMPS_APPLIED, 1);
+
+			/* The CRTCs and mailboxes may be gone. */
+			if (gamma_io_abandoned(io))
+				goto exit;
+		}
+
+		/* Checked last so that the last gamma ramps are applied. */
+		if (__atomic_load_n(&io->quit, __ATOMIC_ACQUIRE))
+			break;
+	}
+
+exit:
+	pthread_mutex_lock(&io->lock);
+	io->exited = 1;
+	int abandoned = io->abandoned;
+	pthread_cond_signal(&io->exit_cond);
+	pthread_mutex_unlock(&io->lock);
+	if (abandoned)
+		gamma_io_site_free(io);
+	return NULL;
+}
+
+/* Wait at most `timeout' seconds for a thread to exit. Returns
+   -1 and abandons the thread if it has not, as it is stuck
+   applying gamma ramps to a site that does not respond. */
+static int
+gamma_io_join(gamma_io_site_t *site_io, double timeout)
+{
+	struct timespec deadline;
+	int exited, r = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += (time_t)timeout;
+	deadline.tv_nsec += (long)((timeout - (time_t)timeout) * 1000000000L);
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec += 1;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&site_io->lock);
+	while (!site_io->exited && r != ETIMEDOUT)
+		r = pthread_cond_timedwait(&site_io->exit_cond, &site_io->lock, &deadline);
+	exited = site_io->exited;
+	if (!exited) {
+		/* Under the lock, as the thread frees
+		   its structure once it has seen this. */
+		site_io->abandoned = 1;
+		pthread_detach(site_io->thread);
+	}
+	pthread_mutex_unlock(&site_io->lock);
+
+	if (!exited)
+		return -1;
+	pthread_join(site_io->thread, NULL);
+	return 0;
+}
+
+static void
+gamma_io_wake(gamma_io_site_t *io)
+{
+	/* If the pipe is full, the thread has not woken up
+	   yet and will see the new gamma ramps anyway. */
+	while (write(io->wake_pipe[1], "", 1) < 0 && errno == EINTR);
+}
+
+/* Whether the saved gamma ramps of a CRTC are needed but
+   have not been read, the CRTC is then left alone. */
+static int
+gamma_io_unread(gamma_server_state_t *state, size_t c)
+{
+	gamma_crtc_state_t *crtc = state->crtcs + c;
+	return !crtc->saved_ramps_read && state->read_ramps != NULL &&
+	       (state->restore || crtc->settings.lut_calibration != NULL);
+}
+
+/* Take the saved gamma ramps of a CRTC if the site's thread
+   has read them. Returns -1 if the thread could not read them. */
+static int
+gamma_io_collect(gamma_server_state_t *state, size_t c)
+{
+	gamma_io_mailbox_t *mailbox = ((gamma_io_t *)(state->io))->mailboxes + c;
+	int read = __atomic_load_n(&mailbox->read, __ATOMIC_ACQUIRE);
+	if (read != GAMMA_IO_READ_DONE && read != GAMMA_IO_READ_FAILED)
+		return 0;
+	__atomic_store_n(&mailbox->read, 0, __ATOMIC_RELAXED);
+	if (read == GAMMA_IO_READ_FAILED)
+		return -1;
+	state->crtcs[c].saved_ramps_read = 1;
+	state->ramps_read += 1;
+	return 0;
+}
+
+
+int
+gamma_io_start(gamma_server_state_t *state)
+{
+	gamma_io_t *io;
+	size_t ramps_size = 0, s, c;
+	uint16_t *ramps;
+	sigset_t all, old;
+
+	/* Read the saved gamma ramps that are needed
+	   before the threads start to use the sites. */
+	for (c = 0; c < state->crtcs_used; c++) {
+		gamma_crtc_state_t *crtc = state->crtcs + c;
+		gamma_site_state_t *site = state->sites + crtc->site_index;
+		if (site->thread_stuck ||
+		    (!state->restore && crtc->settings.lut_calibration == NULL))
+			continue;
+		if (gamma_read_saved_ramps(state, crtc) != 0)
+			site->failed = 1;
+	}
+
+	io = calloc(1, sizeof(gamma_io_t));
+	if (io == NULL) {
+		perror("calloc");
+		return -1;
+	}
+	state->io = io;
+	state->allocations += 1;
+
+	io->sites = calloc(state->sites_used + 1, sizeof(gamma_io_site_t *));
+	io->mailboxes = calloc(state->crtcs_used + 1, sizeof(gamma_io_mailbox_t));
+	for (c = 0; c < state->crtcs_used; c++) {
+		gamma_ramps_t *saved = &(state->crtcs[c].saved_ramps);
+		ramps_size += 3 * (saved->red_size + saved->green_size + saved->blue_size);
+	}
+	io->ramps = malloc((ramps_size + 1) * sizeof(uint16_t));
+	if (io->sites == NULL || io->mailboxes == NULL || io->ramps == NULL) {
+		perror("malloc");
+		goto fail;
+	}
+	state->allocations += 3;
+
+	/* Give each mailbox three sets of gamma ramps. */
+	ramps = io->ramps;
+	for (c = 0; c < state->crtcs_used; c++) {
+		gamma_ramps_t *saved = &(state->crtcs[c].saved_ramps);
+		gamma_io_mailbox_t *mailbox = io->mailboxes + c;
+		for (int i = 0; i < 3; i++) {
+			mailbox->ramps[i] = *saved;
+			mailbox->ramps[i].red = ramps;
+			ramps += saved->red_size;
+			mailbox->ramps[i].green = ramps;
+			ramps += saved->green_size;
+			mailbox->ramps[i].blue = ramps;
+			ramps += saved->blue_size;
+		}
+		mailbox->back = 0;
+		mailbox->middle = 1;
+		mailbox->front = 2;
+	}
+
+
+	/* Signals must be handled by the main thread,
+	   so block them in the I/O threads. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (s = 0; s < state->sites_used; s++) {
+		gamma_io_site_t *site_io;
+		int r;
+
+		/* A site that did not let its last thread exit
+		   is skipped, the thread may still be stuck. */
+		if (state->sites[s].thread_stuck)
+			continue;
+
+		site_io = io->sites[s] = calloc(1, sizeof(gamma_io_site_t));
+		if (site_io == NULL) {
+			perror("calloc");
+			pthread_sigmask(SIG_SETMASK, &old, NULL);
+			goto fail;
+		}
+		state->allocations += 1;
+		site_io->wake_pipe[0] = -1;
+		site_io->wake_pipe[1] = -1;
+		/* The deadline of gamma_io_join() must not move with
+		   the wall clock, so the condition uses the monotonic clock. */
+		pthread_condattr_t cond_attr;
+		pthread_condattr_init(&cond_attr);
+		pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+		pthread_mutex_init(&site_io->lock, NULL);
+		pthread_cond_init(&site_io->exit_cond, &cond_attr);
+		pthread_condattr_destroy(&cond_attr);
+
+		site_io->state = state;
+		site_io->site = state->sites + s;
+		site_io->mailboxes = io->mailboxes + site_io->site->crtcs_offset;
+
+		/* Hooks and commands must not inherit the pipe. The
+		   thread sleeps in read(3), so only the end written
+		   by the main thread is made non-blocking. */
+#ifdef HAVE_PIPE2
+		if (pipe2(site_io->wake_pipe, O_CLOEXEC) < 0) {
+			perror("pipe2");
+			pthread_sigmask(SIG_SETMASK, &old, NULL);
+			goto fail;
+		}
+#else
+		if (pipe(site_io->wake_pipe) < 0) {
+			perror("pipe");
+			pthread_sigmask(SIG_SETMASK, &old, NULL);
+			goto fail;
+		}
+		fcntl(site_io->wake_pipe[0], F_SETFD, FD_CLOEXEC);
+		fcntl(site_io->wake_pipe[1], F_SETFD, FD_CLOEXEC);
+#endif
+		fcntl(site_io->wake_pipe[1], F_SETFL,
+		      fcntl(site_io->wake_pipe[1], F_GETFL) | O_NONBLOCK);
+
+		r = pthread_create(&(site_io->thread), NULL, gamma_io_thread, site_io);
+		if (r != 0) {
+			errno = r;
+			perror("pthread_create");
+			pthread_sigmask(SIG_SETMASK, &old, NULL);
+			goto fail;
+		}
+		site_io->running = 1;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	return 0;
+
+fail:
+	gamma_io_stop(state);
+	return -1;
+}
+
+
+void
+gamma_io_stop(gamma_server_state_t *state)
+{
+	gamma_io_t *io = state->io;
+	int left_behind = 0;
+	if (io == NULL)
+		return;
+
+	for (size_t s = 0; io->sites != NULL && s < state->sites_used; s++) {
+		gamma_io_site_t *site_io = io->sites[s];
+		gamma_site_state_t *site = state->sites + s;
+		if (site_io == NULL)
+			continue;
+		if (site_io->running) {
+			__atomic_store_n(&site_io->quit, 1, __ATOMIC_RELEASE);
+			gamma_io_wake(site_io);
+			/* Never wait for a site that does not respond. */
+			if (gamma_io_join(site_io, state->site_timeout) < 0) {
+				site->degraded = 1;
+				site->thread_stuck = 1;
+				fprintf(stderr, _("Site `%s' did not respond within %.1f seconds,"
+						  " it is skipped from now on.\n"),
+					gamma_site_name(site), state->site_timeout);
+				left_behind = 1;
+				continue;
+			}
+		}
+		/* The thread may have read saved gamma ramps
+		   that are needed to restore the CRTCs. */
+		for (size_t i = 0; i < site->crtcs_used; i++)
+			gamma_io_collect(state, site->crtcs_offset + i);
+		gamma_io_site_free(site_io);
+	}
+
+	/* A thread that was left behind may still read its
+	   mailboxes, so they are never freed then. */
+	free(io->sites);
+	if (!left_behind) {
+		free(io->mailboxes);
+		free(io->ramps);
+	}
+	free(io);
+	state->io = NULL;
+}
+
+
+/* The set of gamma ramps the main thread owns. */
+static gamma_ramps_t
+gamma_io_back_ramps(gamma_server_state_t *state, size_t crtc)
+{
+	gamma_io_mailbox_t *mailbox = ((gamma_io_t *)(state->io))->mailboxes + crtc;
+	gamma_ramps_t none = { 0, 0, 0, NULL, NULL, NULL };
+	/* The calibration may be the saved gamma ramps,
+	   which the site's thread may be writing. */
+	if (gamma_io_unread(state, crtc))
+		return none;
+	return mailbox->ramps[mailbox->back];
+}
+
+int
+gamma_io_update(gamma_server_state_t *state)
+{
+	gamma_io_t *io = state->io;
+
+	/* Saved gamma ramps that have become needed, as calibrations
+	   are now preserved, are read by the site's thread, and the
+	   CRTC is left alone until they have been. */
+	for (size_t c = 0; c < state->crtcs_used; c++) {
+		gamma_crtc_state_t *crtc = state->crtcs + c;
+		if (!gamma_io_unread(state, c) || io->sites[crtc->site_index] == NULL)
+			continue;
+		if (gamma_io_collect(state, c) != 0)
+			state->sites[crtc->site_index].failed = 1;
+		if (gamma_io_unread(state, c))
+			__atomic_store_n(&io->mailboxes[c].read,
+					 GAMMA_IO_READ_WANTED, __ATOMIC_RELEASE);
+	}
+
+	gamma_pool_fill(state, gamma_io_back_ramps);
+
+	for (size_t s = 0; s < state->sites_used; s++) {
+		gamma_site_state_t *site = state->sites + s;
+		gamma_io_site_t *site_io = io->sites[s];
+		/* The saved gamma ramps may not have been read. */
+		if (site_io == NULL || site->failed) {
+			metrics_count(METRICS_RAMPS_SKIPPED, site->crtcs_used);
+			continue;
+		}
+
+		/* The thread failed to apply the previous gamma ramps. */
+		if (__atomic_exchange_n(&site_io->failed, 0, __ATOMIC_ACQ_REL))
+			site->failed = 1;
+		else if (site->degraded && !site->thread_stuck) {
+			site->degraded = 0;
+			fprintf(stderr, _("Site `%s' is responding again.\n"),
+				gamma_site_name(site));
+		}
+
+		for (size_t i = 0; i < site_io->site->crtcs_used; i++) {
+			gamma_io_mailbox_t *mailbox = site_io->mailboxes + i;
+			if (gamma_io_unread(state, site->crtcs_offset + i)) {
+				metrics_count(METRICS_RAMPS_SKIPPED, 1);
+				continue;
+			}
+			int middle = __atomic_exchange_n(&mailbox->middle,
+							 mailbox->back | GAMMA_IO_FRESH,
+							 __ATOMIC_ACQ_REL);
+			mailbox->back = middle & ~GAMMA_IO_FRESH;
+			/* The thread never took the previous gamma ramps. */
+			if (middle & GAMMA_IO_FRESH)
+				metrics_count(METRICS_RAMPS_SKIPPED, 1);
+		}
+
+		if (site_io->site->crtcs_used > 0)
+			gamma_io_wake(site_io);
+	}
+
+	return 0;
+}
+
+
+#else /* ! GAMMA_IO_THREADED */
+
+
+int
+gamma_io_start(gamma_server_state_t *state)
+{
+	(void) state;
+	fputs(_("I/O threads are not supported, gamma ramps"
+		" are applied from the main thread.\n"), stderr);
+	return 0;
+}
+
+void
+gamma_io_stop(gamma_server_state_t *state)
+{
+	(void) state;
+}
+
+int
+gamma_io_update(gamma_server_state_t *state)
+{
+	(void) state;
+	return -1;
+}
+
+
+#endif /* ! GAMMA_IO_THREADED */
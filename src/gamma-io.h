@@ -0,0 +1,48 @@
+/* gamma-io.h -- Gamma ramp I/O threads header
+   This file is part of Redshift.
+
+   Redshift is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Redshift is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Redshift.  If not, see <http://www.gnu.org/licenses/>.
+
+   Copyright (c) 2014  Mattias Andrée <maandree@member.fsf.org>
+*/
+
+#ifndef REDSHIFT_GAMMA_IO_H
+#define REDSHIFT_GAMMA_IO_H
+
+#include "gamma-common.h"
+
+
+/* Start one thread per site that applies the gamma ramps. The saved
+   gamma ramps that are needed are read first, so that the threads are
+   the only users of the sites afterwards, sites where they cannot be
+   read are marked as failed. Sites where an earlier thread is stuck
+   get no new thread. Returns -1 on error, and zero without starting
+   any threads if threads are not supported. */
+int gamma_io_start(gamma_server_state_t *state);
+
+/* Stop the threads after they have applied the last gamma ramps.
+   A thread that does not exit within the site timeout is left
+   behind, and its site is marked as degraded and stuck. */
+void gamma_io_stop(gamma_server_state_t *state);
+
+/* Compute the gamma ramps of all CRTCs and hand them over to the
+   threads, without waiting. Gamma ramps that a thread has not yet
+   started to apply are replaced. Saved gamma ramps that have become
+   needed are read by the threads, and their CRTCs are skipped until
+   they have been. Sites that failed to apply earlier gamma ramps or
+   to read saved gamma ramps are marked as failed. Returns -1 on error. */
+int gamma_io_update(gamma_server_state_t *state);
+
+
+#endif /* ! REDSHIFT_GAMMA_IO_H */
@@ -0,0 +1,328 @@
+/* gamma-pool.c -- Parallel gamma ramp computation source
+   This file is part of Redshift.
+
+   Redshift is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Redshift is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Redshift.  If not, see <http://www.gnu.org/licenses/>.
+
+   Copyright (c) 2014  Mattias Andrée <maandree@member.fsf.org>
+*/
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "gamma-pool.h"
+#include "colorramp.h"
+#include "metrics.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+# define GAMMA_POOL_THREADED
+# include <pthread.h>
+# include <signal.h>
+# include <unistd.h>
+#endif
+
+
+/* Fill the gamma ramps of all CRTCs one at a time. */
+static void
+gamma_pool_fill_serial(gamma_server_state_t *state, gamma_pool_target_func *target)
+{
+	for (size_t c = 0; c < state->crtcs_used; c++) {
+		double span = trace_begin("colorramp_fill");
+		colorramp_fill(target(state, c), state->crtcs[c].settings);
+		trace_end_value("colorramp_fill", span, "crtc", c);
+	}
+}
+
+
+#ifdef GAMMA_POOL_THREADED
+
+
+typedef struct {
+	pthread_mutex_t mutex;
+	/* Signalled when there is a new job, and when a job is done. */
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	pthread_t *threads;
+	size_t threads_running;
+	int quit;
+	/* Incremented for each job. */
+	unsigned long generation;
+	/* The current job. `offsets[i]' is the first block of
+	   channel `i % 3' of CRTC `i / 3'. `next' is the next
+	   block to fill, and `finished' how many are filled. */
+	gamma_server_state_t *state;
+	gamma_pool_target_func *target;
+	size_t *offsets;
+	size_t offsets_size;
+	size_t tasks;
+	size_t next;
+	size_t finished;
+	/* The number of workers that are filling blocks. */
+	size_t active;
+} gamma_pool_t;
+
+
+/* Fill blocks until there are none left, returns how many were filled. */
+static size_t
+gamma_pool_work(gamma_pool_t *pool)
+{
+	size_t task, done = 0;
+	double span = trace_begin("colorramp blocks");
+
+	while ((task = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->tasks) {
+		/* Find the channel the block belongs to. */
+		size_t lo = 0, hi = pool->state->crtcs_used * 3;
+		while (hi - lo > 1) {
+			size_t mid = (lo + hi) / 2;
+			if (pool->offsets[mid] <= task) lo = mid;
+			else hi = mid;
+		}
+
+		size_t crtc = lo / 3;
+		int channel = (int)(lo % 3);
+		gamma_ramps_t ramps = pool->target(pool->state, crtc);
+		size_t sizes[3] = { ramps.red_size, ramps.green_size, ramps.blue_size };
+		size_t start = (task - pool->offsets[lo]) * GAMMA_POOL_BLOCK;
+		size_t end = start + GAMMA_POOL_BLOCK;
+		if (end > sizes[channel]) end = sizes[channel];
+
+		colorramp_fill_part(ramps, pool->state->crtcs[crtc].settings,
+				    channel, start, end);
+		done++;
+	}
+
+	trace_end_value("colorramp blocks", span, "blocks", done);
+	return done;
+}
+
+static void *
+gamma_pool_thread(void *data)
+{
+	gamma_pool_t *pool = data;
+	unsigned long seen = 0;
+
+	pthread_mutex_lock(&pool->mutex);
+	for (;;) {
+		while (!pool->quit && pool->generation == seen)
+			pthread_cond_wait(&pool->work_cond, &pool->mutex);
+		if (pool->quit)
+			break;
+		seen = pool->generation;
+		pool->active++;
+		pthread_mutex_unlock(&pool->mutex);
+
+		size_t done = gamma_pool_work(pool);
+
+		pthread_mutex_lock(&pool->mutex);
+		pool->finished += done;
+		/* A job is not over until no worker can touch it. */
+		if (--pool->active == 0)
+			pthread_cond_signal(&pool->done_cond);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+
+size_t
+gamma_pool_default_workers(void)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 4)
+		return 1;
+	cpus /= 2;
+	return cpus > GAMMA_POOL_MAX_WORKERS ? GAMMA_POOL_MAX_WORKERS : (size_t)cpus;
+}
+
+int
+gamma_pool_start(gamma_server_state_t *state)
+{
+	gamma_pool_t *pool;
+	sigset_t all, old;
+	size_t n = state->ramp_workers - 1;
+
+	pool = calloc(1, sizeof(gamma_pool_t));
+	if (pool == NULL) {
+		perror("calloc");
+		return -1;
+	}
+	pool->threads = calloc(n + 1, sizeof(pthread_t));
+	if (pool->threads == NULL) {
+		perror("calloc");
+		free(pool);
+		return -1;
+	}
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+	state->pool = pool;
+	state->allocations += 2;
+
+	/* Signals must be handled by the main thread,
+	   so block them in the workers. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (; pool->threads_running < n; pool->threads_running++) {
+		int r = pthread_create(pool->threads + pool->threads_running,
+				       NULL, gamma_pool_thread, pool);
+		if (r != 0) {
+			errno = r;
+			perror("pthread_create");
+			pthread_sigmask(SIG_SETMASK, &old, NULL);
+			gamma_pool_stop(state);
+			return -1;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	return 0;
+}
+
+void
+gamma_pool_stop(gamma_server_state_t *state)
+{
+	gamma_pool_t *pool = state->pool;
+	if (pool == NULL)
+		return;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->mutex);
+	for (size_t i = 0; i < pool->threads_running; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_mutex_destroy(&pool->mutex);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_cond_destroy(&pool->done_cond);
+	free(pool->threads);
+	free(pool->offsets);
+	free(pool);
+	state->pool = NULL;
+}
+
+static void
+gamma_pool_run(gamma_server_state_t *state, gamma_pool_target_func *target)
+{
+	gamma_pool_t *pool = state->pool;
+	size_t stops = 0, tasks = 0;
+
+	if (pool == NULL) {
+		gamma_pool_fill_serial(state, target);
+		return;
+	}
+
+	/* The CRTCs only change when monitors are plugged in or unplugged. */
+	if (pool->offsets_size < state->crtcs_used * 3 + 1) {
+		size_t *offsets = realloc(pool->offsets,
+					  (state->crtcs_used * 3 + 1) * sizeof(size_t));
+		if (offsets == NULL) {
+			perror("realloc");
+			gamma_pool_fill_serial(state, target);
+			return;
+		}
+		pool->offsets = offsets;
+		pool->offsets_size = state->crtcs_used * 3 + 1;
+		state->allocations += 1;
+	}
+
+	for (size_t c = 0; c < state->crtcs_used; c++) {
+		gamma_ramps_t ramps = target(state, c);
+		size_t sizes[3] = { ramps.red_size, ramps.green_size, ramps.blue_size };
+		for (int i = 0; i < 3; i++) {
+			pool->offsets[c * 3 + i] = tasks;
+			tasks += (sizes[i] + GAMMA_POOL_BLOCK - 1) / GAMMA_POOL_BLOCK;
+			stops += sizes[i];
+		}
+	}
+	pool->offsets[state->crtcs_used * 3] = tasks;
+
+	if (stops < GAMMA_POOL_MIN_STOPS || tasks < 2) {
+		gamma_pool_fill_serial(state, target);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	/* A worker that woke up late for the last job may still
+	   be looking at it, it will not find anything to do. */
+	while (pool->active > 0)
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+	pool->state = state;
+	pool->target = target;
+	pool->tasks = tasks;
+	pool->next = 0;
+	pool->finished = 0;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	/* Work as well, rather than only wait. */
+	size_t done = gamma_pool_work(pool);
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->finished += done;
+	while (pool->finished < pool->tasks || pool->active > 0)
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+
+#else /* ! GAMMA_POOL_THREADED */
+
+
+size_t
+gamma_pool_default_workers(void)
+{
+	return 1;
+}
+
+int
+gamma_pool_start(gamma_server_state_t *state)
+{
+	state->ramp_workers = 1;
+	return 0;
+}
+
+void
+gamma_pool_stop(gamma_server_state_t *state)
+{
+	(void) state;
+}
+
+static void
+gamma_pool_run(gamma_server_state_t *state, gamma_pool_target_func *target)
+{
+	gamma_pool_fill_serial(state, target);
+}
+
+
+#endif /* ! GAMMA_POOL_THREADED */
+
+
+void
+gamma_pool_fill(gamma_server_state_t *state, gamma_pool_target_func *target)
+{
+	double start = metrics_begin();
+	double span = trace_begin("fill");
+	gamma_pool_run(state, target);
+	trace_end_value("fill", span, "crtcs", state->crtcs_used);
+	metrics_end(METRICS_FILL_SECONDS, start);
+	metrics_count(METRICS_RAMPS_COMPUTED, state->crtcs_used);
+}
@@ -0,0 +1,63 @@
+/* gamma-pool.h -- Parallel gamma ramp computation header
+   This file is part of Redshift.
+
+   Redshift is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Redshift is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Redshift.  If not, see <http://www.gnu.org/licenses/>.
+
+   Copyright (c) 2014  Mattias Andrée <maandree@member.fsf.org>
+*/
+
+#ifndef REDSHIFT_GAMMA_POOL_H
+#define REDSHIFT_GAMMA_POOL_H
+
+#include "gamma-common.h"
+
+
+/* The number of stops of one channel a worker fills at a time. */
+#ifndef GAMMA_POOL_BLOCK
+# define GAMMA_POOL_BLOCK  1024
+#endif
+
+/* The least number of stops, of all CRTCs together, that are filled
+   in parallel. Fewer are filled faster than workers are woken up. */
+#ifndef GAMMA_POOL_MIN_STOPS
+# define GAMMA_POOL_MIN_STOPS  (2 * GAMMA_POOL_BLOCK)
+#endif
+
+/* The largest number of workers used by default. */
+#ifndef GAMMA_POOL_MAX_WORKERS
+# define GAMMA_POOL_MAX_WORKERS  8
+#endif
+
+
+/* Get where the gamma ramps of a CRTC shall be written. */
+typedef gamma_ramps_t gamma_pool_target_func(gamma_server_state_t *state, size_t crtc);
+
+
+/* The number of workers used if it is not configured, one
+   on systems with few processors, where it does not pay off. */
+size_t gamma_pool_default_workers(void);
+
+/* Start `state->ramp_workers - 1' threads, the caller of
+   `gamma_pool_fill' is the last worker. Returns -1 on error. */
+int gamma_pool_start(gamma_server_state_t *state);
+void gamma_pool_stop(gamma_server_state_t *state);
+
+/* Fill the gamma ramps of all CRTCs, in parallel if the pool has
+   been started and there are enough stops. Returns when all are
+   filled. The gamma ramps are split into blocks of each channel,
+   and the workers take the next block until none is left. */
+void gamma_pool_fill(gamma_server_state_t *state, gamma_pool_target_func *target);
+
+
+#endif /* ! REDSHIFT_GAMMA_POOL_H */
@@ -201,10 +201,12 @@ quartz_set_ramps(gamma_server_state_t *state, gamma_crtc_state_t *crtc, gamma_ra
 	CGGammaValue *green = red_green_blue + 1 * gamma_size;
 	CGGammaValue *blue  = red_green_blue + 2 * gamma_size;
 
-	/* Convert pending gamma ramps to float format. */
+	/* Convert pending gamma ramps to float format. The
+	   channels are not necessarily stored consecutively. */
+	uint16_t *ramps_int[3] = { ramps.red, ramps.green, ramps.blue };
 	for (size_t c = 0; c < 3; c++) {
-		uint16_t     *ramp_int   = crtc->current_ramps.red + c * gamma_size;
-		CGGammaValue *ramp_float = red_green_blue          + c * gamma_size;
+		uint16_t     *ramp_int   = ramps_int[c];
+		CGGammaValue *ramp_float = red_green_blue + c * gamma_size;
 		for (uint32_t i = 0; i < gamma_size; i++)
 		        ramp_float[i] = (CGGammaValue)(ramp_int[i]) / UINT16_MAX;
 	}
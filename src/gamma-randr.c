@@ -19,12 +19,12 @@
 */
 
 #include "gamma-randr.h"
+#include "metrics.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
-#include <alloca.h>
 
 #ifdef ENABLE_NLS
 # include <libintl.h>
@@ -49,7 +49,8 @@ static void
 randr_free_site(void *data)
 {
 	/* Close connection. */
-	xcb_disconnect((xcb_connection_t *)data);
+	xcb_disconnect(((randr_site_data_t *)data)->connection);
+	free(data);
 }
 
 static void
@@ -102,7 +103,16 @@ randr_open_site(gamma_server_state_t *state, char *site, gamma_site_state_t *sit
 		return -1;
 	}
 
-	site_out->data = connection;
+	randr_site_data_t *site_data = malloc(sizeof(randr_site_data_t));
+	if (site_data == NULL) {
+		perror("malloc");
+		free(ver_reply);
+		xcb_disconnect(connection);
+		return -1;
+	}
+	site_data->connection = connection;
+	site_data->sent = 0;
+	site_out->data = site_data;
 
 	/* Get the number of available screens. */
 	const xcb_setup_t *setup = xcb_get_setup(connection);
@@ -127,7 +137,7 @@ randr_open_partition(gamma_server_state_t *state, gamma_site_state_t *site,
 	}
 	data->crtcs = NULL;
 
-	xcb_connection_t *connection = site->data;
+	xcb_connection_t *connection = ((randr_site_data_t *)(site->data))->connection;
 
 	/* Get screen. */
 	const xcb_setup_t *setup = xcb_get_setup(connection);
@@ -194,15 +204,17 @@ randr_open_crtc(gamma_server_state_t *state, gamma_site_state_t *site,
 	(void) state;
 
 	randr_screen_data_t *screen_data = partition->data;
-	xcb_randr_crtc_t *crtc_id = screen_data->crtcs + crtc;
-	xcb_connection_t *connection = site->data;
+	xcb_randr_crtc_t crtc_id = screen_data->crtcs[crtc];
+	xcb_connection_t *connection = ((randr_site_data_t *)(site->data))->connection;
 	xcb_generic_error_t *error;
 
-	crtc_out->data = crtc_id;
+	/* The list of CRTCs is replaced when monitors are
+	   plugged in or unplugged, so keep the identifier. */
+	crtc_out->data = (void*)(size_t)crtc_id;
 
 	/* Request size of gamma ramps. */
 	xcb_randr_get_crtc_gamma_size_cookie_t gamma_size_cookie =
-		xcb_randr_get_crtc_gamma_size(connection, *crtc_id);
+		xcb_randr_get_crtc_gamma_size(connection, crtc_id);
 	xcb_randr_get_crtc_gamma_size_reply_t *gamma_size_reply =
 		xcb_randr_get_crtc_gamma_size_reply(connection,
 						    gamma_size_cookie,
@@ -216,7 +228,6 @@ randr_open_crtc(gamma_server_state_t *state, gamma_site_state_t *site,
 	}
 
 	ssize_t ramp_size = gamma_size_reply->size;
-	size_t ramp_memsize = (size_t)ramp_size * sizeof(uint16_t);
 	free(gamma_size_reply);
 
 	if (ramp_size < 2) {
@@ -229,18 +240,21 @@ randr_open_crtc(gamma_server_state_t *state, gamma_site_state_t *site,
 	crtc_out->saved_ramps.green_size = (size_t)ramp_size;
 	crtc_out->saved_ramps.blue_size  = (size_t)ramp_size;
 
-	/* Allocate space for saved gamma ramps. */
-	crtc_out->saved_ramps.red   = malloc(3 * ramp_memsize);
-	crtc_out->saved_ramps.green = crtc_out->saved_ramps.red   + ramp_size;
-	crtc_out->saved_ramps.blue  = crtc_out->saved_ramps.green + ramp_size;
-	if (crtc_out->saved_ramps.red == NULL) {
-		perror("malloc");
-		return -1;
-	}
+	return 0;
+}
+
+static int
+randr_read_ramps(gamma_server_state_t *state, gamma_crtc_state_t *crtc, gamma_ramps_t ramps)
+{
+	xcb_connection_t *connection =
+		((randr_site_data_t *)(state->sites[crtc->site_index].data))->connection;
+	xcb_randr_crtc_t crtc_id = (xcb_randr_crtc_t)(size_t)crtc->data;
+	xcb_generic_error_t *error;
+	size_t ramp_memsize = ramps.red_size * sizeof(uint16_t);
 
 	/* Request current gamma ramps. */
 	xcb_randr_get_crtc_gamma_cookie_t gamma_get_cookie =
-		xcb_randr_get_crtc_gamma(connection, *crtc_id);
+		xcb_randr_get_crtc_gamma(connection, crtc_id);
 	xcb_randr_get_crtc_gamma_reply_t *gamma_get_reply =
 		xcb_randr_get_crtc_gamma_reply(connection,
 					       gamma_get_cookie,
@@ -257,9 +271,9 @@ randr_open_crtc(gamma_server_state_t *state, gamma_site_state_t *site,
 	uint16_t *gamma_b = xcb_randr_get_crtc_gamma_blue(gamma_get_reply);
 
 	/* Copy gamma ramps into CRTC state. */
-	memcpy(crtc_out->saved_ramps.red,   gamma_r, ramp_memsize);
-	memcpy(crtc_out->saved_ramps.green, gamma_g, ramp_memsize);
-	memcpy(crtc_out->saved_ramps.blue,  gamma_b, ramp_memsize);
+	memcpy(ramps.red,   gamma_r, ramp_memsize);
+	memcpy(ramps.green, gamma_g, ramp_memsize);
+	memcpy(ramps.blue,  gamma_b, ramp_memsize);
 
 	free(gamma_get_reply);
 	return 0;
@@ -282,12 +296,13 @@ randr_invalid_partition(const gamma_site_state_t *site, size_t partition)
 static int
 randr_set_ramps(gamma_server_state_t *state, gamma_crtc_state_t *crtc, gamma_ramps_t ramps)
 {
-	xcb_connection_t *connection = state->sites[crtc->site_index].data;
+	xcb_connection_t *connection =
+		((randr_site_data_t *)(state->sites[crtc->site_index].data))->connection;
 	xcb_generic_error_t *error;
 
 	/* Set new gamma ramps */
 	xcb_void_cookie_t gamma_set_cookie =
-		xcb_randr_set_crtc_gamma_checked(connection, *(xcb_randr_crtc_t *)(crtc->data),
+		xcb_randr_set_crtc_gamma_checked(connection, (xcb_randr_crtc_t)(size_t)crtc->data,
 						 ramps.red_size, ramps.red, ramps.green, ramps.blue);
 	error = xcb_request_check(connection, gamma_set_cookie);
 
@@ -300,6 +315,194 @@ randr_set_ramps(gamma_server_state_t *state, gamma_crtc_state_t *crtc, gamma_ram
 	return 0;
 }
 
+static int
+randr_send_ramps(gamma_server_state_t *state, gamma_crtc_state_t *crtc, gamma_ramps_t ramps)
+{
+	randr_site_data_t *site_data = state->sites[crtc->site_index].data;
+
+	/* xcb has no way to queue a request without blocking, so
+	   this waits if the buffer and the socket are both full.
+	   With I/O threads, that only holds up the thread of the site. */
+	xcb_void_cookie_t gamma_set_cookie =
+		xcb_randr_set_crtc_gamma_checked(site_data->connection,
+						 (xcb_randr_crtc_t)(size_t)crtc->data,
+						 ramps.red_size, ramps.red, ramps.green, ramps.blue);
+
+	if (!site_data->sent)
+		site_data->first_sequence = gamma_set_cookie.sequence;
+	site_data->last_sequence = gamma_set_cookie.sequence;
+	site_data->sent = 1;
+	return 0;
+}
+
+static int
+randr_flush_site(gamma_server_state_t *state, gamma_site_state_t *site, int *fd)
+{
+	(void) state;
+
+	randr_site_data_t *site_data = site->data;
+	if (!site_data->sent)
+		return 0;
+
+	/* Requests are answered in order, so when this is
+	   answered the gamma ramps have been applied. */
+	site_data->sync = xcb_get_input_focus(site_data->connection);
+	xcb_flush(site_data->connection);
+
+	if (xcb_connection_has_error(site_data->connection)) {
+		fprintf(stderr, _("Lost connection to the X server.\n"));
+		return -1;
+	}
+
+	*fd = xcb_get_file_descriptor(site_data->connection);
+	return 1;
+}
+
+static int
+randr_poll_site(gamma_server_state_t *state, gamma_site_state_t *site)
+{
+	(void) state;
+
+	randr_site_data_t *site_data = site->data;
+	xcb_connection_t *connection = site_data->connection;
+	xcb_generic_error_t *error;
+	void *reply;
+	int r = 0;
+
+	if (!site_data->sent)
+		return 0;
+
+	if (!xcb_poll_for_reply(connection, site_data->sync.sequence, &reply, &error)) {
+		if (xcb_connection_has_error(connection)) {
+			fprintf(stderr, _("Lost connection to the X server.\n"));
+			site_data->sent = 0;
+			return -1;
+		}
+		return 1;
+	}
+	free(reply);
+	free(error);
+
+	/* The requests before the synchronisation have all been
+	   answered, so checking them for errors does not wait. */
+	for (unsigned int sequence = site_data->first_sequence;; sequence++) {
+		xcb_void_cookie_t cookie = { .sequence = sequence };
+		error = xcb_request_check(connection, cookie);
+		if (error) {
+			fprintf(stderr, _("`%s' returned error %d\n"),
+				"RANDR Set CRTC Gamma", error->error_code);
+			free(error);
+			r = -1;
+		}
+		if (sequence == site_data->last_sequence)
+			break;
+	}
+
+	site_data->sent = 0;
+	return r;
+}
+
+static size_t
+randr_crtc_id(gamma_server_state_t *state, gamma_site_state_t *site,
+	      gamma_partition_state_t *partition, size_t crtc)
+{
+	(void) state;
+	(void) site;
+	randr_screen_data_t *screen_data = partition->data;
+	return (size_t)(screen_data->crtcs[crtc]);
+}
+
+static int
+randr_refresh_partition(gamma_server_state_t *state, gamma_site_state_t *site,
+			gamma_partition_state_t *partition)
+{
+	(void) state;
+
+	randr_screen_data_t *data = partition->data;
+	xcb_connection_t *connection = ((randr_site_data_t *)(site->data))->connection;
+	xcb_generic_error_t *error;
+
+	/* Get the new list of CRTCs for the screen. */
+	xcb_randr_get_screen_resources_current_cookie_t res_cookie =
+		xcb_randr_get_screen_resources_current(connection, data->screen.root);
+	xcb_randr_get_screen_resources_current_reply_t *res_reply =
+		xcb_randr_get_screen_resources_current_reply(connection,
+							     res_cookie,
+							     &error);
+
+	if (error) {
+		fprintf(stderr, _("`%s' returned error %d\n"),
+			"RANDR Get Screen Resources Current",
+			error->error_code);
+		return -1;
+	}
+
+	xcb_randr_crtc_t *crtcs =
+		xcb_randr_get_screen_resources_current_crtcs(res_reply);
+
+	xcb_randr_crtc_t *new_crtcs = malloc(res_reply->num_crtcs * sizeof(xcb_randr_crtc_t));
+	if (new_crtcs == NULL && res_reply->num_crtcs > 0) {
+		perror("malloc");
+		free(res_reply);
+		return -1;
+	}
+	memcpy(new_crtcs, crtcs, res_reply->num_crtcs * sizeof(xcb_randr_crtc_t));
+
+	free(data->crtcs);
+	data->crtcs = new_crtcs;
+	partition->crtcs_available = res_reply->num_crtcs;
+
+	free(res_reply);
+	return 0;
+}
+
+static int
+randr_hotplug_fd(gamma_server_state_t *state, gamma_site_state_t *site)
+{
+	xcb_connection_t *connection = ((randr_site_data_t *)(site->data))->connection;
+
+	/* Ask for notifications on the screens in use. */
+	for (size_t i = 0; i < site->partitions_available; i++) {
+		gamma_partition_state_t *partition = site->partitions + i;
+		if (partition->used == 0) continue;
+		randr_screen_data_t *data = partition->data;
+		xcb_randr_select_input(connection, data->screen.root,
+				       XCB_RANDR_NOTIFY_MASK_SCREEN_CHANGE |
+				       XCB_RANDR_NOTIFY_MASK_CRTC_CHANGE);
+	}
+	xcb_flush(connection);
+
+	(void) state;
+	return xcb_get_file_descriptor(connection);
+}
+
+static int
+randr_hotplug_handle(gamma_server_state_t *state, gamma_site_state_t *site)
+{
+	(void) state;
+
+	xcb_connection_t *connection = ((randr_site_data_t *)(site->data))->connection;
+	const xcb_query_extension_reply_t *extension =
+		xcb_get_extension_data(connection, &xcb_randr_id);
+	xcb_generic_event_t *event;
+	int changed = 0;
+
+	while ((event = xcb_poll_for_event(connection)) != NULL) {
+		uint8_t type = event->response_type & ~0x80;
+		if (type == extension->first_event + XCB_RANDR_SCREEN_CHANGE_NOTIFY ||
+		    type == extension->first_event + XCB_RANDR_NOTIFY)
+			changed = 1;
+		free(event);
+	}
+
+	if (xcb_connection_has_error(connection)) {
+		fprintf(stderr, _("Lost connection to the X server.\n"));
+		return -1;
+	}
+
+	return changed;
+}
+
 static int
 randr_set_option(gamma_server_state_t *state, const char *key, char *value, ssize_t section)
 {
@@ -372,64 +575,152 @@ strdup_fail:
 
 
 static int
-randr_test_edid(xcb_connection_t *connection, xcb_randr_output_t output, xcb_atom_t atom,
-		gamma_selection_state_t *selection, xcb_randr_crtc_t *crtcs, int crtc_n,
-		xcb_randr_crtc_t output_crtc)
+randr_select_found(gamma_selection_state_t *selection, size_t screen, size_t crtc)
 {
-	randr_selection_data_t *selection_data = selection->data;
-	unsigned char *edid_seeked = selection_data->edid;
-	int edid_length = selection_data->edid_length;
+	free(selection->crtcs);
+	selection->crtcs = malloc(sizeof(size_t));
+	if (selection->crtcs == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	selection->crtcs[0] = crtc;
+	selection->crtcs_count = 1;
 
-	xcb_randr_get_output_property_cookie_t val_cookie;
-	xcb_randr_get_output_property_reply_t *val_reply;
-	xcb_generic_error_t *error;
+	free(selection->partitions);
+	selection->partitions = malloc(sizeof(size_t));
+	if (selection->partitions == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	selection->partitions[0] = screen;
+	selection->partitions_count = 1;
+	return 0;
+}
 
-	/* Acquire the property's value, we know that it is either 128 bytes
-	   or 256 bytes long, and we have a limit defined in gamma-randr.h. */
-	val_cookie = xcb_randr_get_output_property(connection, output, atom,
-						   XCB_GET_PROPERTY_TYPE_ANY,
-						   0, MAX_EDID_LENGTH, 0, 0);
 
-	val_reply = xcb_randr_get_output_property_reply(connection, val_cookie, &error);
+/* The requests for the outputs of a screen, which are
+   sent for all screens before any of them is waited for. */
+typedef struct {
+	xcb_randr_get_screen_resources_current_reply_t *res_reply;
+	xcb_randr_get_output_info_cookie_t *out_cookies;
+	xcb_randr_get_output_property_cookie_t *val_cookies;
+} randr_edid_query_t;
 
-	if (error) {
-		fprintf(stderr, _("`%s' returned error %d\n"),
-			"RANDR Get Output Property", error->error_code);
+
+/* Ask for the information and the EDID of every output of a screen. */
+static int
+randr_query_edid(xcb_connection_t *connection, xcb_atom_t atom,
+		 randr_edid_query_t *query)
+{
+	xcb_randr_get_screen_resources_current_reply_t *res_reply = query->res_reply;
+	xcb_randr_output_t *outputs = xcb_randr_get_screen_resources_current_outputs(res_reply);
+	size_t output_n = (size_t)(res_reply->num_outputs);
+
+	query->out_cookies = malloc(output_n * sizeof(xcb_randr_get_output_info_cookie_t));
+	query->val_cookies = malloc(output_n * sizeof(xcb_randr_get_output_property_cookie_t));
+	if ((query->out_cookies == NULL || query->val_cookies == NULL) && output_n > 0) {
+		perror("malloc");
+		free(query->out_cookies);
+		free(query->val_cookies);
+		query->out_cookies = NULL;
+		query->val_cookies = NULL;
 		return -1;
 	}
 
-	unsigned char* value = xcb_randr_get_output_property_data(val_reply);
-	int length = xcb_randr_get_output_property_data_length(val_reply);
+	/* The property's value is either 128 bytes or 256
+	   bytes long, and we have a limit defined in gamma-randr.h. */
+	for (size_t i = 0; i < output_n; i++) {
+		query->out_cookies[i] = xcb_randr_get_output_info(connection, outputs[i],
+								  res_reply->config_timestamp);
+		query->val_cookies[i] = xcb_randr_get_output_property(connection, outputs[i], atom,
+								      XCB_GET_PROPERTY_TYPE_ANY,
+								      0, MAX_EDID_LENGTH, 0, 0);
+	}
+
+	return 0;
+}
 
-	/* Compare found EDID against seeked EDID. */
-	if ((length == edid_length) && !memcmp(value, edid_seeked, (size_t)length)) {
-		int crtc;
+/* Look for the monitor with the seeked EDID among the outputs of a
+   screen, or only discard the replies unless `r' is 1. Returns 1 if
+   it is not connected to the screen, and frees the query's cookies. */
+static int
+randr_find_edid(xcb_connection_t *connection,
+		const randr_selection_data_t *selection_data,
+		const gamma_partition_state_t *screen,
+		randr_edid_query_t *query, int r, size_t *crtc_out)
+{
+	randr_screen_data_t *screen_data = screen->data;
+	size_t output_n = (size_t)(query->res_reply->num_outputs);
+	xcb_randr_get_output_info_cookie_t *out_cookies = query->out_cookies;
+	xcb_randr_get_output_property_cookie_t *val_cookies = query->val_cookies;
+	xcb_generic_error_t *error;
 
-		/* Find CRTC index. */
-		for (crtc = 0; crtc < crtc_n; crtc++)
-			if (crtcs[crtc] == output_crtc)
-				break;
+	if (out_cookies == NULL)
+		output_n = 0;
 
-		free(val_reply);
+	for (size_t i = 0; i < output_n; i++) {
+		xcb_randr_get_output_info_reply_t *out_reply;
+		xcb_randr_get_output_property_reply_t *val_reply;
 
-		if (crtc < crtc_n) {
-			free(selection->crtcs);
-			selection->crtcs = malloc(sizeof(size_t));
-			if (selection->crtcs == NULL) {
-				perror("malloc");
-				return -1;
+		if (r != 1) {
+			xcb_discard_reply(connection, out_cookies[i].sequence);
+			xcb_discard_reply(connection, val_cookies[i].sequence);
+			continue;
+		}
+
+		out_reply = xcb_randr_get_output_info_reply(connection, out_cookies[i], &error);
+		if (error) {
+			fprintf(stderr, _("`%s' returned error %d\n"),
+				"RANDR Get Output Information",
+				error->error_code);
+			free(error);
+			xcb_discard_reply(connection, val_cookies[i].sequence);
+			r = -1;
+			continue;
+		}
+
+		val_reply = xcb_randr_get_output_property_reply(connection, val_cookies[i], &error);
+		if (error) {
+			fprintf(stderr, _("`%s' returned error %d\n"),
+				"RANDR Get Output Property", error->error_code);
+			free(error);
+			free(out_reply);
+			r = -1;
+			continue;
+		}
+
+		unsigned char* value = xcb_randr_get_output_property_data(val_reply);
+		int length = xcb_randr_get_output_property_data_length(val_reply);
+
+		/* Compare the monitor's EDID against seeked EDID. */
+		if (out_reply->connection == XCB_RANDR_CONNECTION_CONNECTED &&
+		    length == selection_data->edid_length &&
+		    !memcmp(value, selection_data->edid, (size_t)length)) {
+			size_t crtc;
+
+			/* Find CRTC index. */
+			for (crtc = 0; crtc < screen->crtcs_available; crtc++)
+				if (screen_data->crtcs[crtc] == out_reply->crtc)
+					break;
+
+			if (crtc < screen->crtcs_available) {
+				*crtc_out = crtc;
+				r = 0;
+			} else {
+				fputs(_("Monitor is not connected."), stderr);
+				r = -1;
 			}
-			selection->crtcs[0] = (size_t)crtc;
-			selection->crtcs_count = 1;
-		} else {
-			fputs(_("Monitor is not connected."), stderr);
-			return -1;
 		}
 
-		return 0;
+		free(val_reply);
+		free(out_reply);
 	}
-	free(val_reply);
-	return 1;
+
+	free(out_cookies);
+	free(val_cookies);
+	query->out_cookies = NULL;
+	query->val_cookies = NULL;
+	return r;
 }
 
 
@@ -442,7 +733,11 @@ randr_parse_selection(gamma_server_state_t *state, gamma_site_state_t *site,
 	if (when != before_crtc)
 		return 0;
 
-	xcb_connection_t *connection = site->data;
+	xcb_connection_t *connection = ((randr_site_data_t *)(site->data))->connection;
+	randr_selection_data_t *selection_data = selection->data;
+	xcb_generic_error_t *error;
+	uint64_t cached_timestamp;
+	size_t cached_screen, cached_crtc;
 
 	if (selection->partitions_count == 0) {
 		selection->partitions = malloc(site->partitions_available * sizeof(size_t));
@@ -455,134 +750,144 @@ randr_parse_selection(gamma_server_state_t *state, gamma_site_state_t *site,
 			selection->partitions[i] = i;
 	}
 
+	/* Where the monitor was found last time is still
+	   valid if the outputs have not been reconfigured. */
+	if (gamma_edid_cache_load("randr", site->site, selection_data->edid,
+				  (size_t)(selection_data->edid_length),
+				  &cached_timestamp, &cached_screen, &cached_crtc)) {
+		int selected = 0;
+		for (size_t i = 0; i < selection->partitions_count; i++)
+			if (selection->partitions[i] == cached_screen)
+				selected = 1;
+		if (selected && cached_screen < site->partitions_available &&
+		    site->partitions[cached_screen].used &&
+		    cached_crtc < site->partitions[cached_screen].crtcs_available) {
+			randr_screen_data_t *screen_data = site->partitions[cached_screen].data;
+			xcb_randr_get_screen_resources_current_cookie_t res_cookie;
+			xcb_randr_get_screen_resources_current_reply_t *res_reply;
+
+			res_cookie = xcb_randr_get_screen_resources_current(connection,
+									    screen_data->screen.root);
+			res_reply = xcb_randr_get_screen_resources_current_reply(connection,
+										 res_cookie, &error);
+			if (error) {
+				free(error);
+			} else {
+				int valid = res_reply->config_timestamp == cached_timestamp;
+				free(res_reply);
+				if (valid) {
+					metrics_count(METRICS_EDID_CACHE_HITS, 1);
+					return randr_select_found(selection, cached_screen,
+								  cached_crtc);
+				}
+			}
+		}
+	}
+	metrics_count(METRICS_EDID_CACHE_MISSES, 1);
+
+	/* Intern the atom once instead of asking
+	   for the name of every output property. */
+	xcb_intern_atom_cookie_t atom_cookie = xcb_intern_atom(connection, 1, 4, "EDID");
+
+	/* Acquire information about all screens at once. */
+	xcb_randr_get_screen_resources_current_cookie_t *res_cookies =
+		malloc(selection->partitions_count *
+		       sizeof(xcb_randr_get_screen_resources_current_cookie_t));
+	randr_edid_query_t *queries = calloc(selection->partitions_count + 1,
+					     sizeof(randr_edid_query_t));
+	if (res_cookies == NULL || queries == NULL) {
+		perror("malloc");
+		free(res_cookies);
+		free(queries);
+		xcb_discard_reply(connection, atom_cookie.sequence);
+		return -1;
+	}
 	for (size_t screen_i = 0; screen_i < selection->partitions_count; screen_i++) {
-		size_t screen_index = selection->partitions[screen_i];
-		gamma_partition_state_t *screen = site->partitions + screen_index;
+		gamma_partition_state_t *screen = site->partitions + selection->partitions[screen_i];
+		randr_screen_data_t *screen_data = screen->data;
 		if (screen->used == 0)
 			continue;
-		randr_screen_data_t *screen_data = screen->data;
+		res_cookies[screen_i] =
+			xcb_randr_get_screen_resources_current(connection, screen_data->screen.root);
+	}
+
+	xcb_atom_t atom = XCB_ATOM_NONE;
+	xcb_intern_atom_reply_t *atom_reply =
+		xcb_intern_atom_reply(connection, atom_cookie, &error);
+	if (error) {
+		fprintf(stderr, _("`%s' returned error %d\n"),
+			"Intern Atom", error->error_code);
+		free(error);
+	} else {
+		atom = atom_reply->atom;
+		free(atom_reply);
+	}
+
+	/* Without the atom, no monitor has an EDID. */
+	int r = atom == XCB_ATOM_NONE ? -1 : 1;
+	size_t found_screen = 0, found_crtc = 0;
+	uint32_t found_timestamp = 0;
 
-		xcb_randr_get_screen_resources_current_cookie_t res_cookie;
+	/* Ask for the outputs of each screen as soon as its resources
+	   have arrived, the replies are waited for when all are sent. The
+	   resources of the next screen were asked for before the outputs
+	   of this one, so their reply does not wait for the outputs. */
+	for (size_t screen_i = 0; screen_i < selection->partitions_count; screen_i++) {
+		gamma_partition_state_t *screen = site->partitions + selection->partitions[screen_i];
 		xcb_randr_get_screen_resources_current_reply_t *res_reply;
-		xcb_generic_error_t *error;
 
-		/* Acquire information about the screen. */
-		res_cookie = xcb_randr_get_screen_resources_current(connection, screen_data->screen.root);
-		res_reply = xcb_randr_get_screen_resources_current_reply(connection, res_cookie, &error);
+		if (screen->used == 0)
+			continue;
+		if (r != 1) {
+			xcb_discard_reply(connection, res_cookies[screen_i].sequence);
+			continue;
+		}
 
+		res_reply = xcb_randr_get_screen_resources_current_reply(connection,
+									 res_cookies[screen_i],
+									 &error);
 		if (error) {
 			fprintf(stderr, _("`%s' returned error %d\n"),
 				"RANDR Get Screen Resources Current",
 				error->error_code);
-			return -1;
+			free(error);
+			r = -1;
+			continue;
 		}
 
-		xcb_randr_output_t *outputs = xcb_randr_get_screen_resources_current_outputs(res_reply);
-
-		/* Iterate over all connectors to and look for one that is connected
-		   and whose monitor is has matching extended display identification data. */
-		for (int output_i = 0; output_i < res_reply->num_outputs; output_i++) {
-			xcb_randr_get_output_info_cookie_t out_cookie;
-			xcb_randr_get_output_info_reply_t *out_reply;
-
-			/* Acquire information about the output. */
-			out_cookie = xcb_randr_get_output_info(connection, outputs[output_i],
-							       res_reply->config_timestamp);
-			out_reply = xcb_randr_get_output_info_reply(connection, out_cookie, &error);
-
-			if (error) {
-				fprintf(stderr, _("`%s' returned error %d\n"),
-					"RANDR Get Output Information",
-					error->error_code);
-				free(res_reply);
-				return -1;
-			}
-
-			/* Check connection status. */
-			if (out_reply->connection != XCB_RANDR_CONNECTION_CONNECTED) {
-				free(out_reply);
-				continue;
-			}
-
-			xcb_randr_list_output_properties_cookie_t prop_cookie;
-			xcb_randr_list_output_properties_reply_t *prop_reply;
-			xcb_atom_t *atoms;
-			xcb_atom_t *atoms_end;
-
-			/* Acquire a list of all properties of the output. */
-			prop_cookie = xcb_randr_list_output_properties(connection, outputs[output_i]);
-			prop_reply = xcb_randr_list_output_properties_reply(connection, prop_cookie, &error);
+		queries[screen_i].res_reply = res_reply;
+		if (randr_query_edid(connection, atom, queries + screen_i) < 0)
+			r = -1;
+	}
+	free(res_cookies);
 
-			if (error) {
-				fprintf(stderr, _("`%s' returned error %d\n"),
-					"RANDR List Output Properties",
-					error->error_code);
-				free(out_reply);
-				free(res_reply);
-				return -1;
-			}
+	for (size_t screen_i = 0; screen_i < selection->partitions_count; screen_i++) {
+		size_t screen_index = selection->partitions[screen_i];
+		gamma_partition_state_t *screen = site->partitions + screen_index;
+		randr_edid_query_t *query = queries + screen_i;
 
-			atoms = xcb_randr_list_output_properties_atoms(prop_reply);
-			atoms_end = atoms + xcb_randr_list_output_properties_atoms_length(prop_reply);
-
-			for (; atoms != atoms_end; atoms++) {
-				xcb_get_atom_name_cookie_t atom_name_cookie;
-				xcb_get_atom_name_reply_t *atom_name_reply;
-				char *atom_name;
-				char *atom_name_;
-				int atom_name_len;
-
-				/* Aqcuire the atom name. */
-				atom_name_cookie = xcb_get_atom_name(connection, *atoms);
-				atom_name_reply = xcb_get_atom_name_reply(connection, atom_name_cookie, &error);
-
-				if (error) {
-					fprintf(stderr, _("`%s' returned error %d\n"),
-						"RANDR Get Atom Name",
-						error->error_code);
-					free(prop_reply);
-					free(out_reply);
-					free(res_reply);
-					return -1;
-				}
+		if (query->res_reply == NULL)
+			continue;
 
-				atom_name_ = xcb_get_atom_name_name(atom_name_reply);
-				atom_name_len = xcb_get_atom_name_name_length(atom_name_reply);
-
-				/* NUL-terminate the atom name. */
-				atom_name = alloca(((size_t)atom_name_len + 1) * sizeof(char));
-				memcpy(atom_name, atom_name_, (size_t)atom_name_len * sizeof(char));
-				*(atom_name + atom_name_len) = 0;
-
-				if (!strcmp(atom_name, "EDID")) {
-					int r = randr_test_edid(connection, outputs[output_i], *atoms,
-								selection, screen_data->crtcs,
-								(int)(screen->crtcs_available),
-								out_reply->crtc);
-					if (r != 1) {
-						free(atom_name_reply);
-						free(prop_reply);
-						free(out_reply);
-						free(res_reply);
-						free(selection->partitions);
-						selection->partitions = malloc(sizeof(ssize_t));
-						if (selection->partitions == NULL) {
-							perror("malloc");
-							return -1;
-						}
-						selection->partitions[0] = screen_index;
-						selection->partitions_count = 1;
-						return r;
-					}
-				}
-				free(atom_name_reply);
-			}
-			free(prop_reply);
-			free(out_reply);
+		/* Once found, the replies for the other screens are discarded. */
+		int found = randr_find_edid(connection, selection_data, screen,
+					    query, r, &found_crtc);
+		if (r == 1) {
+			r = found;
+			found_screen = screen_index;
+			found_timestamp = query->res_reply->config_timestamp;
 		}
-		free(res_reply);
+		free(query->res_reply);
 	}
-	return -1;
+	free(queries);
+
+	if (r != 0)
+		return -1;
+
+	gamma_edid_cache_save("randr", site->site, selection_data->edid,
+			      (size_t)(selection_data->edid_length),
+			      (uint64_t)found_timestamp, found_screen, found_crtc);
+	return randr_select_found(selection, found_screen, found_crtc);
 }
 
 
@@ -602,6 +907,14 @@ randr_init(gamma_server_state_t *state)
 	state->open_crtc               = randr_open_crtc;
 	state->invalid_partition       = randr_invalid_partition;
 	state->set_ramps               = randr_set_ramps;
+	state->read_ramps              = randr_read_ramps;
+	state->crtc_id                 = randr_crtc_id;
+	state->refresh_partition       = randr_refresh_partition;
+	state->hotplug_fd              = randr_hotplug_fd;
+	state->hotplug_handle          = randr_hotplug_handle;
+	state->send_ramps              = randr_send_ramps;
+	state->flush_site              = randr_flush_site;
+	state->poll_site               = randr_poll_site;
 	state->set_option              = randr_set_option;
 	state->parse_selection         = randr_parse_selection;
 
@@ -642,6 +955,7 @@ randr_print_help(FILE *f)
 	fputs(_("  edid=VALUE\tThe EDID of the monitor to apply adjustments to\n"
 		"  crtc=N\tList of comma separated CRTCs to apply adjustments to\n"
 		"  screen=N\tList of comma separated X screens to apply adjustments to\n"
-		"  display=NAME\tList of comma separated X displays to apply adjustments to\n"), f);
+		"  display=NAME\tList of comma separated X displays to apply adjustments to\n"
+		"  site-timeout=SECONDS\tTime a display may take before it is skipped\n"), f);
 	fputs("\n", f);
 }
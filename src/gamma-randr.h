@@ -38,6 +38,17 @@
 #endif
 
 
+typedef struct {
+	xcb_connection_t *connection;
+	/* The request answered when all gamma ramps sent to the
+	   display have been applied, and the range of requests that
+	   sent them, valid if `sent' is nonzero. */
+	xcb_get_input_focus_cookie_t sync;
+	unsigned int first_sequence;
+	unsigned int last_sequence;
+	int sent;
+} randr_site_data_t;
+
 typedef struct {
 	xcb_screen_t screen;
 	xcb_randr_crtc_t *crtcs;
@@ -0,0 +1,334 @@
+/* gamma-record.c -- Gamma ramp trace recording and replay source
+   This file is part of Redshift.
+
+   Redshift is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Redshift is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Redshift.  If not, see <http://www.gnu.org/licenses/>.
+
+   Copyright (c) 2014  Mattias Andrée <maandree@member.fsf.org>
+*/
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "gamma-record.h"
+#include "colorramp.h"
+#include "systemtime.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef ENABLE_NLS
+# include <libintl.h>
+# define _(s) gettext(s)
+#else
+# define _(s) s
+#endif
+
+/* Traces are opened close-on-exec, so that hooks
+   and commands do not inherit them, where supported. */
+#ifndef _WIN32
+# define FOPEN_CLOEXEC  "e"
+#else
+# define FOPEN_CLOEXEC  ""
+#endif
+
+
+/* Larger gamma ramps are taken as a sign of a corrupt trace. */
+#define GAMMA_RECORD_MAX_RAMP_SIZE  (1UL << 20)
+
+
+uint64_t
+gamma_record_hash(gamma_ramps_t ramps)
+{
+	const uint16_t *channels[3] = { ramps.red, ramps.green, ramps.blue };
+	size_t sizes[3] = { ramps.red_size, ramps.green_size, ramps.blue_size };
+	uint64_t hash = 14695981039346656037ULL;
+
+	/* Byte by byte, low byte first, so that the hash
+	   does not depend on the byte order. */
+	for (int c = 0; c < 3; c++) {
+		for (size_t i = 0; i < sizes[c]; i++) {
+			hash = (hash ^ (channels[c][i] & 0xFF)) * 1099511628211ULL;
+			hash = (hash ^ (channels[c][i] >> 8)) * 1099511628211ULL;
+		}
+	}
+	return hash;
+}
+
+
+int
+gamma_record_open(gamma_record_t *record, const char *path, int ramps,
+		  size_t sites, size_t partitions, size_t crtcs, size_t ramp_size)
+{
+	gamma_record_header_t header;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, GAMMA_RECORD_MAGIC, sizeof(header.magic));
+	header.version = GAMMA_RECORD_VERSION;
+	header.byte_order = GAMMA_RECORD_BYTE_ORDER;
+	header.sites = (uint32_t)sites;
+	header.partitions = (uint32_t)partitions;
+	header.crtcs = (uint32_t)crtcs;
+	header.ramp_size = (uint32_t)ramp_size;
+
+	record->ramps = ramps;
+	record->file = fopen(path, "wb" FOPEN_CLOEXEC);
+	if (record->file == NULL) {
+		perror("fopen");
+		return -1;
+	}
+	if (fwrite(&header, sizeof(header), 1, record->file) != 1) {
+		perror("fwrite");
+		fclose(record->file);
+		record->file = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+int
+gamma_record_write(gamma_record_t *record, size_t crtc,
+		   const gamma_settings_t *settings, gamma_ramps_t ramps)
+{
+	gamma_record_entry_t entry;
+
+	memset(&entry, 0, sizeof(entry));
+	if (systemtime_get_time(&entry.time) < 0)
+		entry.time = 0;
+	entry.hash = gamma_record_hash(ramps);
+	entry.crtc = (uint32_t)crtc;
+	if (record->ramps)
+		entry.flags |= GAMMA_RECORD_RAMPS;
+	if (settings->lut_calibration != NULL || settings->lut_pre != NULL ||
+	    settings->lut_post != NULL)
+		entry.flags |= GAMMA_RECORD_LUT;
+	entry.sizes[0] = (uint32_t)ramps.red_size;
+	entry.sizes[1] = (uint32_t)ramps.green_size;
+	entry.sizes[2] = (uint32_t)ramps.blue_size;
+	memcpy(entry.gamma_correction, settings->gamma_correction,
+	       sizeof(entry.gamma_correction));
+	entry.gamma = settings->gamma;
+	entry.brightness = settings->brightness;
+	entry.temperature = settings->temperature;
+
+	/* Sites may be updated from their own threads. */
+#ifndef _WIN32
+	flockfile(record->file);
+#endif
+	int ok = fwrite(&entry, sizeof(entry), 1, record->file) == 1;
+	if (ok && record->ramps)
+		ok = fwrite(ramps.red, sizeof(uint16_t), ramps.red_size, record->file) == ramps.red_size &&
+			fwrite(ramps.green, sizeof(uint16_t), ramps.green_size, record->file) == ramps.green_size &&
+			fwrite(ramps.blue, sizeof(uint16_t), ramps.blue_size, record->file) == ramps.blue_size;
+#ifndef _WIN32
+	funlockfile(record->file);
+#endif
+	if (!ok) {
+		perror("fwrite");
+		return -1;
+	}
+	return 0;
+}
+
+int
+gamma_record_close(gamma_record_t *record)
+{
+	int r = 0;
+	if (record->file == NULL)
+		return 0;
+	if (fclose(record->file) != 0) {
+		perror("fclose");
+		r = -1;
+	}
+	record->file = NULL;
+	return r;
+}
+
+
+/* Make room for gamma ramps of the sizes of an entry. */
+static int
+gamma_record_resize(gamma_ramps_t *ramps, const uint32_t sizes[3])
+{
+	size_t n = (size_t)sizes[0] + sizes[1] + sizes[2];
+	uint16_t *buf = realloc(ramps->red, n * sizeof(uint16_t));
+	if (buf == NULL) {
+		perror("realloc");
+		return -1;
+	}
+	ramps->red_size = sizes[0];
+	ramps->green_size = sizes[1];
+	ramps->blue_size = sizes[2];
+	ramps->red = buf;
+	ramps->green = ramps->red + ramps->red_size;
+	ramps->blue = ramps->green + ramps->green_size;
+	return 0;
+}
+
+static int
+gamma_record_same_size(gamma_ramps_t a, gamma_ramps_t b)
+{
+	return a.red_size == b.red_size && a.green_size == b.green_size &&
+		a.blue_size == b.blue_size;
+}
+
+long
+gamma_record_replay(const char *path, gamma_server_state_t *state, int verbose)
+{
+	gamma_record_header_t header;
+	gamma_record_entry_t entry;
+	gamma_ramps_t computed, recorded;
+	unsigned long entries = 0, differ = 0, unchecked = 0;
+	double compute_time = 0, apply_time = 0, t0, t1;
+	long rc = -1;
+	FILE *f;
+
+	memset(&computed, 0, sizeof(computed));
+	memset(&recorded, 0, sizeof(recorded));
+
+	f = fopen(path, "rb" FOPEN_CLOEXEC);
+	if (f == NULL) {
+		perror("fopen");
+		return -1;
+	}
+	if (fread(&header, sizeof(header), 1, f) != 1 ||
+	    memcmp(header.magic, GAMMA_RECORD_MAGIC, sizeof(header.magic)) != 0) {
+		fprintf(stderr, _("Not a gamma ramp trace: `%s'.\n"), path);
+		goto done;
+	}
+	if (header.byte_order != GAMMA_RECORD_BYTE_ORDER) {
+		fprintf(stderr, _("The trace `%s' was recorded on a machine"
+				  " with another byte order.\n"), path);
+		goto done;
+	}
+	if (header.version != GAMMA_RECORD_VERSION) {
+		fprintf(stderr, _("Unsupported trace version: %lu.\n"),
+			(unsigned long)(header.version));
+		goto done;
+	}
+	if (verbose) {
+		printf(_("Trace of %lu sites with %lu partitions"
+			 " and %lu CRTCs each, with %lu stops.\n"),
+		       (unsigned long)(header.sites), (unsigned long)(header.partitions),
+		       (unsigned long)(header.crtcs), (unsigned long)(header.ramp_size));
+	}
+
+	while (fread(&entry, sizeof(entry), 1, f) == 1) {
+		gamma_settings_t settings;
+		int have_recorded = entry.flags & GAMMA_RECORD_RAMPS;
+
+		for (int i = 0; i < 3; i++) {
+			if (entry.sizes[i] < 2 || entry.sizes[i] > GAMMA_RECORD_MAX_RAMP_SIZE) {
+				fprintf(stderr, _("Corrupt entry in trace: `%s'.\n"), path);
+				goto done;
+			}
+		}
+
+		memcpy(settings.gamma_correction, entry.gamma_correction,
+		       sizeof(settings.gamma_correction));
+		settings.gamma = entry.gamma;
+		settings.brightness = entry.brightness;
+		settings.temperature = entry.temperature;
+		settings.lut_calibration = NULL;
+		settings.lut_pre = NULL;
+		settings.lut_post = NULL;
+
+		if (gamma_record_resize(&computed, entry.sizes) != 0)
+			goto done;
+		systemtime_get_monotonic(&t0);
+		colorramp_fill(computed, settings);
+		systemtime_get_monotonic(&t1);
+		compute_time += t1 - t0;
+
+		if (have_recorded) {
+			if (gamma_record_resize(&recorded, entry.sizes) != 0)
+				goto done;
+			size_t n = recorded.red_size + recorded.green_size + recorded.blue_size;
+			if (fread(recorded.red, sizeof(uint16_t), n, f) != n) {
+				fprintf(stderr, _("The trace `%s' is truncated.\n"), path);
+				goto done;
+			}
+		}
+
+		if (entry.flags & GAMMA_RECORD_LUT) {
+			unchecked++;
+		} else if (gamma_record_hash(computed) != entry.hash) {
+			differ++;
+			if (verbose)
+				printf(_("Gamma ramps of entry %lu differ from the trace.\n"),
+				       entries);
+		}
+		entries++;
+
+		if (state == NULL || state->crtcs_used == 0)
+			continue;
+
+		gamma_crtc_state_t *crtc = state->crtcs + entry.crtc % state->crtcs_used;
+		gamma_ramps_t ramps = crtc->current_ramps;
+		memcpy(crtc->settings.gamma_correction, entry.gamma_correction,
+		       sizeof(entry.gamma_correction));
+		crtc->settings.gamma = entry.gamma;
+		crtc->settings.brightness = entry.brightness;
+		crtc->settings.temperature = entry.temperature;
+
+		/* Apply what was applied if it is known, otherwise
+		   what the CRTC would get with the recorded settings. */
+		if (have_recorded && gamma_record_same_size(ramps, recorded)) {
+			memcpy(ramps.red, recorded.red, ramps.red_size * sizeof(uint16_t));
+			memcpy(ramps.green, recorded.green, ramps.green_size * sizeof(uint16_t));
+			memcpy(ramps.blue, recorded.blue, ramps.blue_size * sizeof(uint16_t));
+		} else if (gamma_record_same_size(ramps, computed) &&
+			   crtc->settings.lut_calibration == NULL &&
+			   crtc->settings.lut_pre == NULL && crtc->settings.lut_post == NULL) {
+			memcpy(ramps.red, computed.red, ramps.red_size * sizeof(uint16_t));
+			memcpy(ramps.green, computed.green, ramps.green_size * sizeof(uint16_t));
+			memcpy(ramps.blue, computed.blue, ramps.blue_size * sizeof(uint16_t));
+		} else {
+			if (crtc->settings.lut_calibration != NULL &&
+			    gamma_read_saved_ramps(state, crtc) != 0)
+				goto done;
+			systemtime_get_monotonic(&t0);
+			colorramp_fill(ramps, crtc->settings);
+			systemtime_get_monotonic(&t1);
+			compute_time += t1 - t0;
+		}
+
+		systemtime_get_monotonic(&t0);
+		if (state->set_ramps(state, crtc, ramps) != 0)
+			goto done;
+		systemtime_get_monotonic(&t1);
+		apply_time += t1 - t0;
+	}
+	if (ferror(f)) {
+		perror("fread");
+		goto done;
+	}
+
+	printf(_("Replayed %lu gamma ramp applications, %lu of them"
+		 " differ from the trace.\n"), entries, differ);
+	if (unchecked > 0) {
+		printf(_("%lu could not be checked as they used lookup tables.\n"),
+		       unchecked);
+	}
+	if (verbose) {
+		printf(_("Computing gamma ramps took %.6f seconds,"
+			 " applying them %.6f seconds.\n"), compute_time, apply_time);
+	}
+	rc = (long)differ;
+
+done:
+	free(computed.red);
+	free(recorded.red);
+	fclose(f);
+	return rc;
+}
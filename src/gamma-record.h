@@ -0,0 +1,101 @@
+/* gamma-record.h -- Gamma ramp trace recording and replay header
+   This file is part of Redshift.
+
+   Redshift is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Redshift is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Redshift.  If not, see <http://www.gnu.org/licenses/>.
+
+   Copyright (c) 2014  Mattias Andrée <maandree@member.fsf.org>
+*/
+
+#ifndef REDSHIFT_GAMMA_RECORD_H
+#define REDSHIFT_GAMMA_RECORD_H
+
+#include "gamma-common.h"
+
+#include <stdio.h>
+#include <stdint.h>
+
+
+/* The first bytes of a trace. */
+#define GAMMA_RECORD_MAGIC  "RSTRACE"
+#define GAMMA_RECORD_VERSION  1
+/* Written in the byte order of the machine that recorded
+   the trace, traces are only replayed in the same order. */
+#define GAMMA_RECORD_BYTE_ORDER  0x01020304UL
+
+/* The gamma ramps follow the entry. */
+#define GAMMA_RECORD_RAMPS  1
+/* Lookup tables were used, they are not recorded,
+   so the gamma ramps cannot be computed again. */
+#define GAMMA_RECORD_LUT  2
+
+
+/* The beginning of a trace. */
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	/* The topology that was recorded. */
+	uint32_t sites;
+	uint32_t partitions;
+	uint32_t crtcs;
+	uint32_t ramp_size;
+} gamma_record_header_t;
+
+/* One application of gamma ramps, followed by the red,
+   green and blue ramps if `flags' has GAMMA_RECORD_RAMPS. */
+typedef struct {
+	/* When, according to the clock the settings follow. */
+	double time;
+	/* FNV-1a hash of the red, green and blue ramps. */
+	uint64_t hash;
+	/* Index of the CRTC among all opened CRTCs. */
+	uint32_t crtc;
+	uint32_t flags;
+	uint32_t sizes[3];
+	float gamma_correction[3];
+	float gamma;
+	float brightness;
+	float temperature;
+	uint32_t reserved;
+} gamma_record_entry_t;
+
+
+typedef struct {
+	FILE *file;
+	/* Whether the gamma ramps are written, not only their hash. */
+	int ramps;
+} gamma_record_t;
+
+
+/* Hash gamma ramps so that a trace can be checked without storing them. */
+uint64_t gamma_record_hash(gamma_ramps_t ramps);
+
+/* Create a trace and write its header. Returns -1 on error. */
+int gamma_record_open(gamma_record_t *record, const char *path, int ramps,
+		      size_t sites, size_t partitions, size_t crtcs, size_t ramp_size);
+
+/* Add an application of gamma ramps to the trace. */
+int gamma_record_write(gamma_record_t *record, size_t crtc,
+		       const gamma_settings_t *settings, gamma_ramps_t ramps);
+
+int gamma_record_close(gamma_record_t *record);
+
+/* Compute the gamma ramps of every entry of a trace again, and
+   apply them to the CRTC with the same index, modulo the number
+   of CRTCs, if `state' is not NULL. Returns the number of entries
+   whose gamma ramps are not those of the trace, or -1 on error. */
+long gamma_record_replay(const char *path, gamma_server_state_t *state, int verbose);
+
+
+#endif /* ! REDSHIFT_GAMMA_RECORD_H */
@@ -136,21 +136,17 @@ vidmode_open_crtc(gamma_server_state_t *state, gamma_site_state_t *site,
 	crtc_out->saved_ramps.green_size = (size_t)ramp_size;
 	crtc_out->saved_ramps.blue_size  = (size_t)ramp_size;
 
-	/* Allocate space for saved gamma ramps. */
-	crtc_out->saved_ramps.red = malloc(3 * (size_t)ramp_size * sizeof(uint16_t));
-	if (crtc_out->saved_ramps.red == NULL) {
-		perror("malloc");
-		return -1;
-	}
+	return 0;
+}
 
-	crtc_out->saved_ramps.green = crtc_out->saved_ramps.red + ramp_size;
-	crtc_out->saved_ramps.blue = crtc_out->saved_ramps.green + ramp_size;
+static int
+vidmode_read_ramps(gamma_server_state_t *state, gamma_crtc_state_t *crtc, gamma_ramps_t ramps)
+{
+	int r;
 
 	/* Save current gamma ramps so we can restore them at program exit. */
-	r = XF86VidModeGetGammaRamp(display, screen, (size_t)ramp_size,
-				    crtc_out->saved_ramps.red,
-				    crtc_out->saved_ramps.green,
-				    crtc_out->saved_ramps.blue);
+	r = XF86VidModeGetGammaRamp((Display *)(state->sites[crtc->site_index].data), crtc->partition,
+				    ramps.red_size, ramps.red, ramps.green, ramps.blue);
 	if (!r) {
 		fprintf(stderr, _("X request failed: %s\n"),
 			"XF86VidModeGetGammaRamp");
@@ -214,6 +210,7 @@ vidmode_init(gamma_server_state_t *state)
 	state->open_crtc           = vidmode_open_crtc;
 	state->invalid_partition   = vidmode_invalid_partition;
 	state->set_ramps           = vidmode_set_ramps;
+	state->read_ramps          = vidmode_read_ramps;
 	state->set_option          = vidmode_set_option;
 
 	state->selections->sites = malloc(1 * sizeof(char *));
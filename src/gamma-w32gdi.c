@@ -166,7 +166,15 @@ static int
 w32gdi_set_ramps(gamma_server_state_t *state, gamma_crtc_state_t *crtc, gamma_ramps_t ramps)
 {
 	(void) state;
-	int r = SetDeviceGammaRamp(crtc->data, ramps.red);
+
+	/* SetDeviceGammaRamp takes the channels consecutively,
+	   but they are not necessarily stored that way. */
+	WORD gamma_ramps[3 * GAMMA_RAMP_SIZE];
+	memcpy(gamma_ramps + 0 * GAMMA_RAMP_SIZE, ramps.red, GAMMA_RAMP_SIZE * sizeof(WORD));
+	memcpy(gamma_ramps + 1 * GAMMA_RAMP_SIZE, ramps.green, GAMMA_RAMP_SIZE * sizeof(WORD));
+	memcpy(gamma_ramps + 2 * GAMMA_RAMP_SIZE, ramps.blue, GAMMA_RAMP_SIZE * sizeof(WORD));
+
+	int r = SetDeviceGammaRamp(crtc->data, gamma_ramps);
 	if (!r) {
 		/* TODO it happens that SetDeviceGammaRamp returns FALSE on
 		   occasions where the adjustment seems to be successful.
@@ -17,7 +17,15 @@
    Copyright (c) 2014  Mattias Andrée <maandree@member.fsf.org>
 */
 
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
 #include "hooks.h"
+#include "eventloop.h"
+#include "systemtime.h"
+#include "metrics.h"
+#include "trace.h"
 
 #include <stddef.h>
 #include <stdlib.h>
@@ -25,6 +33,21 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <errno.h>
+#ifndef _WIN32
+# include <fcntl.h>
+# include <signal.h>
+# include <spawn.h>
+# include <sys/wait.h>
+#endif
+
+#ifdef ENABLE_NLS
+# include <libintl.h>
+# define _(s) gettext(s)
+#else
+# define _(s) s
+#endif
+
 extern char **environ;
 
 
@@ -37,32 +60,213 @@ static size_t hooks_n[3] = { 0, 0, 0 };
 #ifndef _WIN32
 
 
-void
-run_hooks(int event, int silence)
+/* A running hook. */
+typedef struct {
+	pid_t pid;
+	int event;
+	size_t hook;
+	int verbose;
+	double started;
+} hook_process_t;
+
+static hook_process_t running[HOOKS_MAX_RUNNING];
+static size_t running_n = 0;
+
+/* The event whose hooks are waiting to be started, and the
+   next of its hooks to start. A new event replaces the hooks
+   of an earlier event that have not been started yet. */
+static int queued_event = -1;
+static size_t queued_next = 0;
+static int queued_silence = 0;
+
+/* Spawn-to-exit time of each hook. */
+static double *latency[3] = { NULL, NULL, NULL };
+
+/* Written to by the SIGCHLD handler, so that
+   the event loop reaps the hooks. */
+static int sigchld_pipe[2] = { -1, -1 };
+static struct sigaction old_sigchld;
+
+
+static void
+sigchld(int signo)
+{
+	int saved_errno = errno;
+	(void) signo;
+	if (write(sigchld_pipe[1], "", 1) < 0) {
+		/* The pipe is full, the event loop will wake up anyway. */
+	}
+	errno = saved_errno;
+}
+
+
+/* Start a hook, with its output discarded if `silence'
+   is set, so that it does not interfere with front-ends. */
+static int
+spawn_hook(int event, size_t hook, int silence)
 {
-	char *command[] = { "sh", "-c", "", NULL };
-	pid_t pid = silence ? fork() : vfork();
-	if (pid == (pid_t)-1)
-		perror(silence ? "fork" : "vfork");
-	if (pid) return;
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	char *command[] = { "sh", "-c", hooks[event][hook], NULL };
+	hook_process_t *process = running + running_n;
+	double start = metrics_begin();
+	double span = trace_begin("hook spawn");
+	int r;
 
-	/* Make sure out does not interfere with front-ends */
+	posix_spawn_file_actions_init(&actions);
 	if (silence) {
-		close(STDOUT_FILENO);
-		close(STDERR_FILENO);
+		posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO,
+						 "/dev/null", O_WRONLY, 0);
+		posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO,
+						 STDERR_FILENO);
+	}
+
+	/* Own process group, so that a timeout also
+	   kills the commands started by the hook. */
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+	posix_spawnattr_setpgroup(&attr, 0);
+
+	r = posix_spawn(&process->pid, "/bin/sh", &actions, &attr, command, environ);
+
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+
+	if (r != 0) {
+		errno = r;
+		perror("posix_spawn");
+		return -1;
 	}
 
+	metrics_end(METRICS_HOOK_SPAWN_SECONDS, start);
+	metrics_count(METRICS_HOOKS_SPAWNED, 1);
+	trace_end("hook spawn", span, hooks[event][hook]);
+
+	process->event = event;
+	process->hook = hook;
+	process->verbose = silence;
+	systemtime_get_monotonic(&process->started);
+	running_n++;
+	return 0;
+}
+
+/* Start queued hooks while below the concurrency limit. */
+static void
+start_queued_hooks(void)
+{
+	while (queued_event >= 0 && running_n < HOOKS_MAX_RUNNING) {
+		if (queued_next >= hooks_n[queued_event]) {
+			queued_event = -1;
+			break;
+		}
+		spawn_hook(queued_event, queued_next++, queued_silence);
+	}
+}
+
+
+void
+reap_hooks(void)
+{
+	double now;
 	size_t i;
-	for (i = 0; i < hooks_n[event]; i++) {
-		command[2] = hooks[event][i];
-		pid_t pid = vfork();
+
+	systemtime_get_monotonic(&now);
+
+	for (i = 0; i < running_n;) {
+		hook_process_t *process = running + i;
+		int status;
+
+		/* Only wait for hooks, other children
+		   are waited for by their owners. */
+		pid_t pid = waitpid(process->pid, &status, WNOHANG);
 		if (pid == 0) {
-			execve("/bin/sh", command, environ);
-			exit(1);
+			if (now - process->started >= HOOKS_TIMEOUT) {
+				fprintf(stderr, _("Hook `%s' timed out.\n"),
+					hooks[process->event][process->hook]);
+				kill(-process->pid, SIGKILL);
+				kill(process->pid, SIGKILL);
+				waitpid(process->pid, &status, 0);
+			} else {
+				i++;
+				continue;
+			}
+		} else if (pid < 0 && errno == EINTR) {
+			continue;
+		}
+
+		latency[process->event][process->hook] = now - process->started;
+		if (process->verbose) {
+			printf(_("Hook `%s' finished in %.3f seconds.\n"),
+			       hooks[process->event][process->hook],
+			       latency[process->event][process->hook]);
 		}
+
+		*process = running[--running_n];
+	}
+
+	start_queued_hooks();
+}
+
+static void
+hooks_sigchld_event(int fd, void *data)
+{
+	char buf[64];
+	(void) data;
+	while (read(fd, buf, sizeof(buf)) > 0);
+	reap_hooks();
+}
+
+
+int
+init_hooks(void)
+{
+	struct sigaction sigact;
+
+#ifdef HAVE_PIPE2
+	if (pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK)) {
+		perror("pipe2");
+		return -1;
 	}
+#else
+	if (pipe(sigchld_pipe)) {
+		perror("pipe");
+		return -1;
+	}
+	for (int i = 0; i < 2; i++) {
+		fcntl(sigchld_pipe[i], F_SETFD, FD_CLOEXEC);
+		fcntl(sigchld_pipe[i], F_SETFL, fcntl(sigchld_pipe[i], F_GETFL) | O_NONBLOCK);
+	}
+#endif
+
+	if (eventloop_add(sigchld_pipe[0], hooks_sigchld_event, NULL) < 0) {
+		close(sigchld_pipe[0]);
+		close(sigchld_pipe[1]);
+		sigchld_pipe[0] = sigchld_pipe[1] = -1;
+		return -1;
+	}
+
+	sigemptyset(&sigact.sa_mask);
+	sigact.sa_handler = sigchld;
+	sigact.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigaction(SIGCHLD, &sigact, &old_sigchld);
+
+	return 0;
+}
 
-	exit(0);
+void
+run_hooks(int event, int silence)
+{
+	if (hooks_n[event] == 0)
+		return;
+
+	/* Replace hooks of an earlier event that have not
+	   started yet, so rapid changes between periods do
+	   not pile up shells. */
+	queued_event = event;
+	queued_next = 0;
+	queued_silence = silence;
+
+	reap_hooks();
 }
 
 int
@@ -74,6 +278,12 @@ add_hook(int event, const char *action)
 		perror("realloc");
 		return -1;
 	}
+	latency[event] = realloc(latency[event], hooks_n[event] * sizeof(double));
+	if (latency[event] == NULL) {
+		perror("realloc");
+		return -1;
+	}
+	latency[event][i] = 0;
 	hooks[event][i] = strdup(action);
 	if (hooks[event][i] == NULL) {
 		perror("strdup");
@@ -86,11 +296,24 @@ void
 free_hooks(void)
 {
 	size_t i, j;
+
+	/* Hooks that are still running are left to finish. */
+	if (sigchld_pipe[0] >= 0) {
+		sigaction(SIGCHLD, &old_sigchld, NULL);
+		eventloop_remove(sigchld_pipe[0]);
+		close(sigchld_pipe[0]);
+		close(sigchld_pipe[1]);
+		sigchld_pipe[0] = sigchld_pipe[1] = -1;
+	}
+	running_n = 0;
+	queued_event = -1;
+
 	for (i = 0; i < 3; i++) {
 		for (j = 0; j < hooks_n[i]; j++) {
 			free(hooks[i][j]);
 		}
 		free(hooks[i]);
+		free(latency[i]);
 	}
 }
 
@@ -98,6 +321,18 @@ free_hooks(void)
 #else /* ! _WIN32 */
 
 
+int
+init_hooks(void)
+{
+	return 0;
+}
+
+void
+reap_hooks(void)
+{
+	/* do nothing */
+}
+
 void
 run_hooks(int event, int silence)
 {
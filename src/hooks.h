@@ -27,6 +27,22 @@
 
 
 
+/* The maximum number of hooks running at once. */
+#ifndef HOOKS_MAX_RUNNING
+# define HOOKS_MAX_RUNNING  4
+#endif
+
+/* Seconds a hook may run before it is killed. */
+#ifndef HOOKS_TIMEOUT
+# define HOOKS_TIMEOUT  30.0
+#endif
+
+
+/* Reap hooks through the event loop. */
+int init_hooks(void);
+/* Reap finished hooks, kill those that have timed out
+   and start queued hooks. */
+void reap_hooks(void);
 void run_hooks(int event, int silence);
 int add_hook(int event, const char *action);
 void free_hooks(void);
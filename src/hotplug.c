@@ -0,0 +1,143 @@
+/* hotplug.c -- Display hotplug source
+   This file is part of Redshift.
+
+   Redshift is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Redshift is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Redshift.  If not, see <http://www.gnu.org/licenses/>.
+
+   Copyright (c) 2014  Mattias Andrée <maandree@member.fsf.org>
+*/
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "hotplug.h"
+#include "eventloop.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef ENABLE_NLS
+# include <libintl.h>
+# define _(s) gettext(s)
+#else
+# define _(s) s
+#endif
+
+
+/* The followed state and the watched file descriptors. */
+static gamma_server_state_t *hotplug_state = NULL;
+static int *hotplug_fds = NULL;
+static size_t hotplug_fds_count = 0;
+static int hotplug_verbose = 0;
+
+/* Set when CRTCs have been added or removed. */
+static int changed = 0;
+
+
+static void
+hotplug_dispatch(int fd, void *data)
+{
+	size_t site = (size_t)data;
+	size_t opened, closed;
+	int r;
+
+	(void) fd;
+
+	r = gamma_hotplug_handle(hotplug_state, site);
+	if (r < 0) {
+		fputs(_("Unable to follow display changes.\n"), stderr);
+		eventloop_remove(hotplug_fds[site]);
+		hotplug_fds[site] = -1;
+		return;
+	}
+	if (r == 0) return;
+
+	r = gamma_reconcile(hotplug_state, &opened, &closed);
+	if (r < 0) {
+		fputs(_("Failed to update the set of CRTCs.\n"), stderr);
+		return;
+	}
+	if (opened == 0 && closed == 0) return;
+
+	if (hotplug_verbose) {
+		printf(_("Display configuration changed,"
+			 " %lu CRTCs added and %lu removed.\n"),
+		       (unsigned long)opened, (unsigned long)closed);
+	}
+	changed = 1;
+}
+
+
+int
+hotplug_start(gamma_server_state_t *state, int verbose)
+{
+	hotplug_state = state;
+	hotplug_verbose = verbose;
+
+	hotplug_fds = malloc((state->sites_used + 1) * sizeof(int));
+	if (hotplug_fds == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	hotplug_fds_count = 0;
+
+	/* Only the sites that have been looked at are counted,
+	   so that hotplug_free() does not see the others. */
+	for (size_t s = 0; s < state->sites_used; s++) {
+		hotplug_fds[s] = gamma_hotplug_fd(state, s);
+		hotplug_fds_count = s + 1;
+		if (hotplug_fds[s] < 0)
+			continue;
+		if (eventloop_add(hotplug_fds[s], hotplug_dispatch,
+				  (void *)s) < 0) {
+			hotplug_fds[s] = -1;
+			hotplug_free();
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void
+hotplug_free(void)
+{
+	for (size_t s = 0; s < hotplug_fds_count; s++)
+		if (hotplug_fds[s] >= 0)
+			eventloop_remove(hotplug_fds[s]);
+	free(hotplug_fds);
+	hotplug_fds = NULL;
+	hotplug_fds_count = 0;
+	hotplug_state = NULL;
+}
+
+int
+hotplug_poll(void)
+{
+	/* Events that arrive while the adjustment method waits for
+	   a reply are queued without the file descriptor remaining
+	   readable, so they are looked for before every wait. */
+	for (size_t s = 0; s < hotplug_fds_count; s++)
+		if (hotplug_fds[s] >= 0)
+			hotplug_dispatch(hotplug_fds[s], (void *)s);
+	return changed;
+}
+
+int
+hotplug_take(void)
+{
+	int r = changed;
+	changed = 0;
+	return r;
+}
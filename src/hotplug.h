@@ -0,0 +1,40 @@
+/* hotplug.h -- Display hotplug header
+   This file is part of Redshift.
+
+   Redshift is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Redshift is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Redshift.  If not, see <http://www.gnu.org/licenses/>.
+
+   Copyright (c) 2014  Mattias Andrée <maandree@member.fsf.org>
+*/
+
+#ifndef REDSHIFT_HOTPLUG_H
+#define REDSHIFT_HOTPLUG_H
+
+#include "gamma-common.h"
+
+
+/* Follow CRTCs that are added or removed, if the adjustment
+   method supports it. The event loop must have been initialised. */
+int hotplug_start(gamma_server_state_t *state, int verbose);
+void hotplug_free(void);
+
+/* Handle the events that have already been received, returns
+   1 if CRTCs have been added or removed, like `hotplug_take'. */
+int hotplug_poll(void);
+
+/* Returns 1 if CRTCs have been added or
+   removed since the last call. */
+int hotplug_take(void);
+
+
+#endif /* ! REDSHIFT_HOTPLUG_H */
@@ -0,0 +1,372 @@
+/* location-file.c -- File location provider source
+   This file is part of Redshift.
+
+   Redshift is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Redshift is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Redshift.  If not, see <http://www.gnu.org/licenses/>.
+
+   Copyright (c) 2014  Mattias Andrée <maandree@member.fsf.org>
+*/
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#ifndef _WIN32
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef __linux__
+# include <sys/inotify.h>
+#endif
+
+#include "location-file.h"
+#include "location.h"
+#include "filewatch.h"
+#include "redshift.h"
+
+#ifdef ENABLE_NLS
+# include <libintl.h>
+# define _(s) gettext(s)
+#else
+# define _(s) s
+#endif
+
+
+/* The largest regular file that is read. */
+#define LOCATION_FILE_MAX_SIZE  (64 << 10)
+
+
+/* Parse a line of the form `LAT LON', `LAT:LON' or `LAT,LON'.
+   Returns 1 if the line is a location, otherwise zero. */
+static int
+location_file_parse(const char *line, float *lat, float *lon)
+{
+	char *end;
+	float v_lat, v_lon;
+
+	while (isspace((unsigned char)*line)) line++;
+	if (*line == '\0' || *line == '#') return 0;
+
+	errno = 0;
+	v_lat = strtof(line, &end);
+	if (errno != 0 || end == line) goto malformed;
+	line = end;
+	while (isspace((unsigned char)*line)) line++;
+	if (*line == ':' || *line == ',') line++;
+
+	v_lon = strtof(line, &end);
+	if (errno != 0 || end == line) goto malformed;
+	while (isspace((unsigned char)*end)) end++;
+	if (*end != '\0') goto malformed;
+
+	if (v_lat < MIN_LAT || v_lat > MAX_LAT ||
+	    v_lon < MIN_LON || v_lon > MAX_LON)
+		goto malformed;
+
+	*lat = v_lat;
+	*lon = v_lon;
+	return 1;
+
+malformed:
+	fputs(_("Ignoring malformed location from file.\n"), stderr);
+	return 0;
+}
+
+/* Use the last location in `buf', returns 1 if there is one. */
+static int
+location_file_parse_lines(location_file_state_t *state, char *buf)
+{
+	int found = 0;
+	char *line = buf, *end;
+
+	for (; line != NULL; line = end) {
+		end = strchr(line, '\n');
+		if (end != NULL) *end++ = '\0';
+		if (location_file_parse(line, &state->lat, &state->lon))
+			found = 1;
+	}
+
+	if (found) state->have_location = 1;
+	return found;
+}
+
+/* Read the whole regular file. */
+static int
+location_file_read_file(location_file_state_t *state)
+{
+	char *buf;
+	size_t len = 0;
+	ssize_t got;
+	int fd, r;
+
+	fd = open(state->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		perror("open");
+		return -1;
+	}
+
+	buf = malloc(LOCATION_FILE_MAX_SIZE + 1);
+	if (buf == NULL) {
+		perror("malloc");
+		close(fd);
+		return -1;
+	}
+
+	while (len < LOCATION_FILE_MAX_SIZE) {
+		got = read(fd, buf + len, LOCATION_FILE_MAX_SIZE - len);
+		if (got < 0 && errno == EINTR) continue;
+		if (got < 0) {
+			perror("read");
+			free(buf);
+			close(fd);
+			return -1;
+		}
+		if (got == 0) break;
+		len += (size_t)got;
+	}
+	close(fd);
+
+	buf[len] = '\0';
+	r = location_file_parse_lines(state, buf);
+	free(buf);
+	return r;
+}
+
+/* Read what is available from the FIFO, returns 1 if
+   a location has been read. Lines can be split across
+   reads, so the last incomplete line is kept. */
+static int
+location_file_read_fifo(location_file_state_t *state)
+{
+	char buf[512];
+	int found = 0;
+	ssize_t got;
+
+	while ((got = read(state->fd, buf, sizeof(buf))) != 0) {
+		if (got < 0 && errno == EINTR) continue;
+		if (got < 0 && errno == EAGAIN) break;
+		if (got < 0) {
+			perror("read");
+			return -1;
+		}
+
+		for (ssize_t i = 0; i < got; i++) {
+			if (buf[i] != '\n') {
+				/* Overlong lines are dropped. */
+				if (state->line_len + 1 >= sizeof(state->line))
+					state->line_len = 0;
+				state->line[state->line_len++] = buf[i];
+				continue;
+			}
+			state->line[state->line_len] = '\0';
+			state->line_len = 0;
+			if (location_file_parse(state->line, &state->lat,
+						&state->lon)) {
+				state->have_location = 1;
+				found = 1;
+			}
+		}
+	}
+
+	return found;
+}
+
+
+
+
+int
+location_file_init(location_file_state_t *state)
+{
+	memset(state, 0, sizeof(*state));
+	state->fd = -1;
+	state->keep_fd = -1;
+	state->watch_fd = -1;
+	return 0;
+}
+
+int
+location_file_start(location_file_state_t *state)
+{
+	struct stat attr;
+
+	if (state->path == NULL) {
+		fputs(_("The path of the location file must be set.\n"),
+		      stderr);
+		return -1;
+	}
+
+	if (stat(state->path, &attr) < 0) {
+		perror("stat");
+		return -1;
+	}
+
+	state->fifo = S_ISFIFO(attr.st_mode);
+	if (!state->fifo) {
+#ifdef __linux__
+		/* The file can still be read once. */
+		state->watch_fd = filewatch_open(state->path,
+						 IN_CLOSE_WRITE | IN_MOVED_TO,
+						 &state->watch_name);
+		if (state->watch_fd < 0)
+			fputs(_("Unable to watch the location file"
+				" for changes.\n"), stderr);
+#endif
+		return 0;
+	}
+
+	state->fd = open(state->path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (state->fd < 0) {
+		perror("open");
+		return -1;
+	}
+
+	/* Without a writer the FIFO would be at end of file
+	   whenever no one else has it open for writing. */
+	state->keep_fd = open(state->path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+	if (state->keep_fd < 0) {
+		perror("open");
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+location_file_free(location_file_state_t *state)
+{
+	if (state->fd >= 0) close(state->fd);
+	if (state->keep_fd >= 0) close(state->keep_fd);
+	if (state->watch_fd >= 0) close(state->watch_fd);
+	state->fd = state->keep_fd = state->watch_fd = -1;
+	free(state->path);
+	free(state->watch_name);
+	state->path = NULL;
+	state->watch_name = NULL;
+}
+
+void
+location_file_print_help(FILE *f)
+{
+	fputs(_("Read the location from a file or FIFO, and follow"
+		" changes to it.\n"), f);
+	fputs("\n", f);
+
+	/* TRANSLATORS: File location help output
+	   left column must not be translated */
+	fputs(_("  path=FILE\tThe file to read\n"), f);
+	fputs("\n", f);
+	fputs(_("Each line is a location given as `LAT LON', the last"
+		" line is used.\n"
+		"Negative values represent west / south,"
+		" respectively.\n"), f);
+	fputs("\n", f);
+}
+
+int
+location_file_set_option(location_file_state_t *state, const char *key,
+			 const char *value)
+{
+	if (strcasecmp(key, "path") == 0) {
+		free(state->path);
+		state->path = strdup(value);
+		if (state->path == NULL) {
+			perror("strdup");
+			return -1;
+		}
+	} else {
+		fprintf(stderr, _("Unknown method parameter: `%s'.\n"), key);
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+location_file_get_location(location_file_state_t *state, float *lat,
+			   float *lon)
+{
+	int r;
+
+	if (!state->fifo) {
+		r = location_file_read_file(state);
+		if (r < 0) return -1;
+	} else {
+		/* Wait for the first location, unless it is
+		   asked for in the background and no longer needed. */
+		struct pollfd pfds[2] = {
+			{ .fd = state->fd, .events = POLLIN },
+			{ .fd = location_cancel_fd(), .events = POLLIN }
+		};
+		while (!state->have_location) {
+			r = poll(pfds, 2, -1);
+			if (r < 0 && errno == EINTR) continue;
+			if (r < 0) {
+				perror("poll");
+				return -1;
+			}
+			if (pfds[1].revents)
+				return -1;
+			if (location_file_read_fifo(state) < 0)
+				return -1;
+		}
+	}
+
+	if (!state->have_location) {
+		fprintf(stderr, _("No location in `%s'.\n"), state->path);
+		return -1;
+	}
+
+	*lat = state->lat;
+	*lon = state->lon;
+	return 0;
+}
+
+int
+location_file_get_fd(location_file_state_t *state)
+{
+	return state->fifo ? state->fd : state->watch_fd;
+}
+
+int
+location_file_handle(location_file_state_t *state, float *lat, float *lon)
+{
+	int r;
+
+	if (state->fifo) {
+		r = location_file_read_fifo(state);
+	} else {
+#ifdef __linux__
+		if (!filewatch_changed(state->watch_fd, state->watch_name))
+			return 0;
+		r = location_file_read_file(state);
+#else
+		r = 0;
+#endif
+	}
+
+	if (r <= 0) return r;
+
+	*lat = state->lat;
+	*lon = state->lon;
+	return 1;
+}
+
+#endif /* ! _WIN32 */
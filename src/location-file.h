@@ -0,0 +1,64 @@
+/* location-file.h -- File location provider header
+   This file is part of Redshift.
+
+   Redshift is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Redshift is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Redshift.  If not, see <http://www.gnu.org/licenses/>.
+
+   Copyright (c) 2014  Mattias Andrée <maandree@member.fsf.org>
+*/
+
+#ifndef REDSHIFT_LOCATION_FILE_H
+#define REDSHIFT_LOCATION_FILE_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+
+typedef struct {
+	char *path;
+	/* Whether the file is a FIFO. */
+	int fifo;
+	/* The read and write ends of the FIFO, the write
+	   end keeps the FIFO open when writers come and go. */
+	int fd;
+	int keep_fd;
+	/* Watch for changes to a regular file. */
+	int watch_fd;
+	char *watch_name;
+	/* The incomplete last line read from the FIFO. */
+	char line[128];
+	size_t line_len;
+	/* The last location read. */
+	float lat;
+	float lon;
+	int have_location;
+} location_file_state_t;
+
+
+int location_file_init(location_file_state_t *state);
+int location_file_start(location_file_state_t *state);
+void location_file_free(location_file_state_t *state);
+
+void location_file_print_help(FILE *f);
+int location_file_set_option(location_file_state_t *state,
+			     const char *key, const char *value);
+
+int location_file_get_location(location_file_state_t *state, float *lat,
+			       float *lon);
+
+int location_file_get_fd(location_file_state_t *state);
+int location_file_handle(location_file_state_t *state, float *lat,
+			 float *lon);
+
+
+#endif /* ! REDSHIFT_LOCATION_FILE_H */
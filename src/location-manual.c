@@ -48,7 +48,7 @@ location_manual_start(location_manual_state_t *state)
 	/* Latitude and longitude must be set */
 	if (isnan(state->lat) || isnan(state->lon)) {
 		fputs(_("Latitude and longitude must be set.\n"), stderr);
-		exit(EXIT_FAILURE);
+		return -1;
 	}
 
 	return 0;
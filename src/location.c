@@ -0,0 +1,477 @@
+/* location.c -- Location acquisition source
+   This file is part of Redshift.
+
+   Redshift is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Redshift is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Redshift.  If not, see <http://www.gnu.org/licenses/>.
+
+   Copyright (c) 2014  Mattias Andrée <maandree@member.fsf.org>
+*/
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "location.h"
+#include "config-ini.h"
+#include "eventloop.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+# define LOCATION_THREADED
+# include <pthread.h>
+# include <signal.h>
+# include <fcntl.h>
+# include <unistd.h>
+#endif
+
+#ifdef ENABLE_NLS
+# include <libintl.h>
+# define _(s) gettext(s)
+#else
+# define _(s) s
+#endif
+
+
+#define LOCATION_CACHE_FILE  "location"
+#define MAX_CACHE_PATH  4096
+
+
+/* The provider that is asked for, or follows, the location. */
+static const location_provider_t *provider = NULL;
+static void *provider_state = NULL;
+static int provider_fd = -1;
+
+/* The location in use, and how far from it a new
+   location must be before it is used instead. */
+static float current_lat;
+static float current_lon;
+static double threshold;
+
+/* The delivered location, `delivered' is only accessed
+   with atomic operations and is set after the location. */
+static float delivered_lat;
+static float delivered_lon;
+static int delivered = 0;
+
+#ifdef LOCATION_THREADED
+static pthread_t worker;
+static int worker_running = 0;
+/* Written to by the worker when it has finished. */
+static int wake_pipe[2] = { -1, -1 };
+/* Written to when the worker shall give up. */
+static int cancel_pipe[2] = { -1, -1 };
+/* `worker_done' is set by the worker when it has finished,
+   and `cancelled' when the location is no longer needed. */
+static pthread_mutex_t worker_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t worker_cond;
+static int worker_done = 0;
+static int cancelled = 0;
+/* Set if the worker did not finish in time, it may then
+   still use the provider and the pipes, so they are kept. */
+static int worker_abandoned = 0;
+#endif
+
+
+int
+location_cache_load(float *lat, float *lon, double ttl)
+{
+	char path[MAX_CACHE_PATH];
+	double saved, now;
+	float cached_lat, cached_lon;
+	FILE *f;
+	int r;
+
+	if (config_ini_cache_path(path, sizeof(path), LOCATION_CACHE_FILE, 0) < 0)
+		return 0;
+
+	f = fopen(path, "r");
+	if (f == NULL) return 0;
+	r = fscanf(f, "%f %f %lf", &cached_lat, &cached_lon, &saved);
+	fclose(f);
+	if (r != 3) return 0;
+
+	if (cached_lat < MIN_LAT || cached_lat > MAX_LAT ||
+	    cached_lon < MIN_LON || cached_lon > MAX_LON)
+		return 0;
+
+	/* The wall clock is used rather than the program's
+	   clock, which may be virtual. A location from the
+	   future is as good as stale. */
+	now = (double)time(NULL);
+	if (saved > now || now - saved > ttl)
+		return 0;
+
+	*lat = cached_lat;
+	*lon = cached_lon;
+	return 1;
+}
+
+int
+location_cache_save(float lat, float lon)
+{
+	char path[MAX_CACHE_PATH];
+	char tmp_path[MAX_CACHE_PATH + 4];
+	FILE *f;
+
+	if (config_ini_cache_path(path, sizeof(path), LOCATION_CACHE_FILE, 1) < 0)
+		return -1;
+
+	/* Move into place so that a partial file is never read. */
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	f = fopen(tmp_path, "w");
+	if (f == NULL) {
+		perror("fopen");
+		return -1;
+	}
+	fprintf(f, "%f %f %.0f\n", lat, lon, (double)time(NULL));
+	if (fclose(f) != 0) {
+		perror("fclose");
+		remove(tmp_path);
+		return -1;
+	}
+	if (rename(tmp_path, path) < 0) {
+		perror("rename");
+		remove(tmp_path);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/* The great-circle distance, in kilometres, between two locations. */
+static double
+location_distance(double lat1, double lon1, double lat2, double lon2)
+{
+#define RAD(x)  ((x) * (M_PI / 180))
+	double dlat = RAD(lat2 - lat1) / 2;
+	double dlon = RAD(lon2 - lon1) / 2;
+	double a = sin(dlat) * sin(dlat) +
+		cos(RAD(lat1)) * cos(RAD(lat2)) * sin(dlon) * sin(dlon);
+	return 2 * 6371.0 * asin(sqrt(a < 1 ? a : 1));
+#undef RAD
+}
+
+/* Use a new location unless it is too close to the current one,
+   returns 1 if it is used. */
+static int
+location_deliver(float lat, float lon)
+{
+	if (location_distance(current_lat, current_lon, lat, lon) < threshold)
+		return 0;
+
+	current_lat = lat;
+	current_lon = lon;
+	delivered_lat = lat;
+	delivered_lon = lon;
+	__atomic_store_n(&delivered, 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* Ask the provider for the location. */
+static void
+location_query(void)
+{
+	float lat, lon;
+	int r;
+
+	r = provider->get_location(provider_state, &lat, &lon);
+	if (r < 0) {
+#ifdef LOCATION_THREADED
+		if (__atomic_load_n(&cancelled, __ATOMIC_ACQUIRE))
+			return;
+#endif
+		fputs(_("Unable to get location from provider,"
+			" keeping the cached location.\n"), stderr);
+		return;
+	}
+
+	if (lat < MIN_LAT || lat > MAX_LAT ||
+	    lon < MIN_LON || lon > MAX_LON) {
+		fputs(_("Location from provider is out of range,"
+			" keeping the cached location.\n"), stderr);
+		return;
+	}
+
+	/* Renew the cache even if the location has not changed. */
+	location_cache_save(lat, lon);
+	location_deliver(lat, lon);
+}
+
+static void
+location_unfollow(void)
+{
+	if (provider_fd >= 0) {
+		eventloop_remove(provider_fd);
+		provider_fd = -1;
+	}
+#ifdef LOCATION_THREADED
+	/* A worker that was left behind may still use the provider. */
+	if (worker_abandoned)
+		return;
+#endif
+	if (provider != NULL) {
+		provider->free(provider_state);
+		provider = NULL;
+		provider_state = NULL;
+	}
+}
+
+/* Called by the main loop when the location may have changed. */
+static void
+location_event(int fd, void *data)
+{
+	float lat, lon;
+	int r;
+
+	r = provider->handle(provider_state, &lat, &lon);
+	if (r < 0) {
+		fputs(_("Unable to follow the location,"
+			" keeping the current location.\n"), stderr);
+		location_unfollow();
+		return;
+	}
+	if (r > 0 && location_deliver(lat, lon))
+		location_cache_save(lat, lon);
+
+	/* The provider may have reopened its file. */
+	fd = provider->get_fd(provider_state);
+	if (fd != provider_fd) {
+		eventloop_remove(provider_fd);
+		provider_fd = -1;
+		if (fd >= 0 && eventloop_add(fd, location_event, NULL) == 0)
+			provider_fd = fd;
+	}
+}
+
+/* Follow the location if the provider supports it,
+   otherwise the provider is no longer needed. */
+static void
+location_follow(void)
+{
+	int fd = -1;
+
+	if (provider->get_fd != NULL)
+		fd = provider->get_fd(provider_state);
+
+	if (fd < 0 || eventloop_add(fd, location_event, NULL) < 0) {
+		location_unfollow();
+		return;
+	}
+	provider_fd = fd;
+}
+
+
+#ifdef LOCATION_THREADED
+static void *
+location_worker(void *data)
+{
+	location_query();
+
+	pthread_mutex_lock(&worker_lock);
+	worker_done = 1;
+	pthread_cond_signal(&worker_cond);
+	pthread_mutex_unlock(&worker_lock);
+
+	/* Wake the main loop. */
+	while (write(wake_pipe[1], "", 1) < 0 && errno == EINTR);
+	return NULL;
+}
+
+/* Wait at most LOCATION_STOP_TIMEOUT seconds for the worker to
+   finish. Returns -1 and leaves the worker behind if it has not,
+   as the provider may never answer and cannot be interrupted. */
+static int
+location_join(void)
+{
+	struct timespec deadline;
+	int done, r = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += (time_t)LOCATION_STOP_TIMEOUT;
+	deadline.tv_nsec += (long)((LOCATION_STOP_TIMEOUT -
+				    (time_t)LOCATION_STOP_TIMEOUT) * 1000000000L);
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec += 1;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&worker_lock);
+	while (!worker_done && r != ETIMEDOUT)
+		r = pthread_cond_timedwait(&worker_cond, &worker_lock, &deadline);
+	done = worker_done;
+	pthread_mutex_unlock(&worker_lock);
+
+	if (!done) {
+		pthread_detach(worker);
+		worker_abandoned = 1;
+		return -1;
+	}
+	pthread_join(worker, NULL);
+	return 0;
+}
+
+/* Called by the main loop when the worker has finished. */
+static void
+location_finished(int fd, void *data)
+{
+	char buf[64];
+	while (read(fd, buf, sizeof(buf)) > 0);
+
+	if (worker_running) {
+		pthread_join(worker, NULL);
+		pthread_cond_destroy(&worker_cond);
+		worker_running = 0;
+		location_follow();
+	}
+}
+#endif
+
+
+int
+location_start(const location_provider_t *location_provider, void *state,
+	       int query, float lat, float lon, double min_distance)
+{
+	provider = location_provider;
+	provider_state = state;
+	current_lat = lat;
+	current_lon = lon;
+	threshold = min_distance;
+
+	if (!query) {
+		location_follow();
+		return 0;
+	}
+
+#ifdef LOCATION_THREADED
+#ifdef HAVE_PIPE2
+	if (pipe2(wake_pipe, O_CLOEXEC | O_NONBLOCK) ||
+	    pipe2(cancel_pipe, O_CLOEXEC | O_NONBLOCK)) {
+		perror("pipe2");
+		location_free();
+		return -1;
+	}
+#else
+	if (pipe(wake_pipe) || pipe(cancel_pipe)) {
+		perror("pipe");
+		location_free();
+		return -1;
+	}
+	for (int i = 0; i < 2; i++) {
+		fcntl(wake_pipe[i], F_SETFD, FD_CLOEXEC);
+		fcntl(wake_pipe[i], F_SETFL, fcntl(wake_pipe[i], F_GETFL) | O_NONBLOCK);
+		fcntl(cancel_pipe[i], F_SETFD, FD_CLOEXEC);
+		fcntl(cancel_pipe[i], F_SETFL, fcntl(cancel_pipe[i], F_GETFL) | O_NONBLOCK);
+	}
+#endif
+
+	if (eventloop_add(wake_pipe[0], location_finished, NULL) < 0) {
+		location_free();
+		return -1;
+	}
+
+	/* The deadline of location_join() must not move with the
+	   wall clock, so the condition uses the monotonic clock. */
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&worker_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	worker_done = 0;
+	cancelled = 0;
+
+	/* Signals must be handled by the main loop,
+	   so block them in the worker. */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	int r = pthread_create(&worker, NULL, location_worker, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (r != 0) {
+		errno = r;
+		perror("pthread_create");
+		pthread_cond_destroy(&worker_cond);
+		location_free();
+		return -1;
+	}
+
+	worker_running = 1;
+#else
+	location_query();
+	location_follow();
+#endif
+
+	return 0;
+}
+
+int
+location_free(void)
+{
+#ifdef LOCATION_THREADED
+	/* A provider that waits for the location is told to give
+	   up, others cannot be interrupted and are waited for. */
+	if (worker_running) {
+		__atomic_store_n(&cancelled, 1, __ATOMIC_RELEASE);
+		while (write(cancel_pipe[1], "", 1) < 0 && errno == EINTR);
+		if (location_join() < 0)
+			fputs(_("The location provider did not answer in time,"
+				" it is left behind.\n"), stderr);
+		else
+			pthread_cond_destroy(&worker_cond);
+		worker_running = 0;
+	}
+
+	if (wake_pipe[0] >= 0)
+		eventloop_remove(wake_pipe[0]);
+	if (!worker_abandoned) {
+		for (int i = 0; i < 2; i++) {
+			if (wake_pipe[i] >= 0) close(wake_pipe[i]);
+			if (cancel_pipe[i] >= 0) close(cancel_pipe[i]);
+			wake_pipe[i] = cancel_pipe[i] = -1;
+		}
+	}
+#endif
+
+	location_unfollow();
+#ifdef LOCATION_THREADED
+	return worker_abandoned ? -1 : 0;
+#else
+	return 0;
+#endif
+}
+
+int
+location_cancel_fd(void)
+{
+#ifdef LOCATION_THREADED
+	return cancel_pipe[0];
+#else
+	return -1;
+#endif
+}
+
+int
+location_take(float *lat, float *lon)
+{
+	if (!__atomic_exchange_n(&delivered, 0, __ATOMIC_ACQUIRE))
+		return 0;
+	*lat = delivered_lat;
+	*lon = delivered_lon;
+	return 1;
+}
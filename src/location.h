@@ -0,0 +1,72 @@
+/* location.h -- Location acquisition header
+   This file is part of Redshift.
+
+   Redshift is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Redshift is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Redshift.  If not, see <http://www.gnu.org/licenses/>.
+
+   Copyright (c) 2014  Mattias Andrée <maandree@member.fsf.org>
+*/
+
+#ifndef REDSHIFT_LOCATION_H
+#define REDSHIFT_LOCATION_H
+
+#include "redshift.h"
+
+
+/* Seconds the cached location is used for at startup. */
+#ifndef LOCATION_CACHE_TTL
+# define LOCATION_CACHE_TTL  (7 * 24 * 60 * 60.0)
+#endif
+
+/* Kilometres the location must change by to be used. */
+#ifndef LOCATION_THRESHOLD
+# define LOCATION_THRESHOLD  1.0
+#endif
+
+/* Seconds a provider that is asked in the background
+   is waited for when the location is no longer needed. */
+#ifndef LOCATION_STOP_TIMEOUT
+# define LOCATION_STOP_TIMEOUT  2.0
+#endif
+
+
+/* Load the last known location, returns 1 if it is
+   at most `ttl' seconds old, otherwise zero. */
+int location_cache_load(float *lat, float *lon, double ttl);
+int location_cache_save(float lat, float lon);
+
+/* Take over a started provider in continual mode. If `query', the
+   current location is cached and the provider is asked for the
+   location in the background. Afterwards the location is followed
+   if the provider supports it, otherwise the provider is freed.
+   Locations less than `threshold' kilometres from the current one
+   are ignored. The event loop must have been initialised. */
+int location_start(const location_provider_t *provider, void *state,
+		   int query, float lat, float lon, double threshold);
+
+/* Stop following the location. A provider that has not answered
+   within LOCATION_STOP_TIMEOUT seconds is left behind, -1 is then
+   returned and the provider's state must be kept. */
+int location_free(void);
+
+/* A file descriptor that becomes readable when the location is no
+   longer needed, for a provider that waits for the location to
+   wait on as well, or -1 if it is not asked in the background. */
+int location_cancel_fd(void);
+
+/* Returns 1 and stores the location if a new
+   one has arrived since the last call. */
+int location_take(float *lat, float *lon);
+
+
+#endif /* ! REDSHIFT_LOCATION_H */
@@ -0,0 +1,425 @@
+/* metrics.c -- Runtime statistics source
+   This file is part of Redshift.
+
+   Redshift is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Redshift is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Redshift.  If not, see <http://www.gnu.org/licenses/>.
+
+   Copyright (c) 2014  Mattias Andrée <maandree@member.fsf.org>
+*/
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "metrics.h"
+#include "systemtime.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifndef _WIN32
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/socket.h>
+# include <sys/stat.h>
+# include <sys/un.h>
+# include "eventloop.h"
+#endif
+
+#ifdef ENABLE_NLS
+# include <libintl.h>
+# define _(s) gettext(s)
+#else
+# define _(s) s
+#endif
+
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL  0
+#endif
+
+/* Where sockets cannot be created close-on-exec, they are
+   marked afterwards, and the fopen(3) mode flag is unknown. */
+#ifndef SOCK_CLOEXEC
+# define SOCK_CLOEXEC  0
+#endif
+#ifndef _WIN32
+# define FOPEN_CLOEXEC  "e"
+#else
+# define FOPEN_CLOEXEC  ""
+#endif
+
+
+/* Upper bounds of the histogram buckets, in seconds,
+   the last bucket has no upper bound. */
+#define METRICS_BUCKETS  12
+static const double bucket_bounds[METRICS_BUCKETS - 1] = {
+	0.00001, 0.00005, 0.0001, 0.0005, 0.001, 0.005,
+	0.01, 0.05, 0.1, 0.5, 1.0
+};
+
+static const struct {
+	const char *name;
+	const char *help;
+} counter_info[METRICS_COUNTERS] = {
+	{ "redshift_wakeups_total", "Times the main loop woke up." },
+	{ "redshift_updates_total", "Times the colour temperature was applied." },
+	{ "redshift_updates_skipped_total", "Main loop iterations that applied nothing." },
+	{ "redshift_ramps_computed_total", "Gamma ramps computed, one per CRTC." },
+	{ "redshift_ramps_applied_total", "Gamma ramps given to the adjustment method." },
+	{ "redshift_ramps_skipped_total",
+	  "Gamma ramps not applied, as their site was unresponsive or newer ramps came." },
+	{ "redshift_edid_cache_hits_total", "Monitors found where the EDID cache said." },
+	{ "redshift_edid_cache_misses_total", "Monitors that had to be searched for." },
+	{ "redshift_location_cache_hits_total", "Start-ups that used the cached location." },
+	{ "redshift_solar_iterations_total", "Solar elevations computed to find transitions." },
+	{ "redshift_reloads_total", "Times the configuration was reloaded." },
+	{ "redshift_hooks_spawned_total", "Hooks that were started." }
+};
+
+static const struct {
+	const char *name;
+	const char *help;
+} histogram_info[METRICS_HISTOGRAMS] = {
+	{ "redshift_set_ramps_seconds", "Time to apply gamma ramps to a CRTC or site." },
+	{ "redshift_fill_seconds", "Time to compute the gamma ramps of all CRTCs." },
+	{ "redshift_reload_seconds", "Time to reload the configuration." },
+	{ "redshift_hook_spawn_seconds", "Time to start a hook." }
+};
+
+typedef struct {
+	unsigned long buckets[METRICS_BUCKETS];
+	unsigned long long sum_ns;
+} metrics_histogram_data_t;
+
+
+static unsigned long counters[METRICS_COUNTERS];
+static metrics_histogram_data_t histograms[METRICS_HISTOGRAMS];
+
+static int enabled = 0;
+static char *method_label = NULL;
+static char *socket_path = NULL;
+static char *file_path = NULL;
+static int socket_fd = -1;
+static double last_write = 0;
+
+
+void
+metrics_count(metrics_counter_t counter, unsigned long n)
+{
+	__atomic_fetch_add(counters + counter, n, __ATOMIC_RELAXED);
+}
+
+double
+metrics_begin(void)
+{
+	double now;
+	if (!__atomic_load_n(&enabled, __ATOMIC_RELAXED) ||
+	    systemtime_get_monotonic(&now) < 0)
+		return 0;
+	return now;
+}
+
+void
+metrics_end(metrics_histogram_t histogram, double start)
+{
+	metrics_histogram_data_t *data = histograms + histogram;
+	double now, seconds;
+	size_t i;
+
+	if (start == 0 || systemtime_get_monotonic(&now) < 0)
+		return;
+	seconds = now - start;
+	if (seconds < 0) seconds = 0;
+
+	for (i = 0; i < METRICS_BUCKETS - 1; i++)
+		if (seconds <= bucket_bounds[i])
+			break;
+	__atomic_fetch_add(data->buckets + i, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&data->sum_ns, (unsigned long long)(seconds * 1e9),
+			   __ATOMIC_RELAXED);
+}
+
+
+int
+metrics_write(FILE *f)
+{
+	for (size_t c = 0; c < METRICS_COUNTERS; c++) {
+		fprintf(f, "# HELP %s %s\n# TYPE %s counter\n%s %lu\n",
+			counter_info[c].name, counter_info[c].help,
+			counter_info[c].name, counter_info[c].name,
+			__atomic_load_n(counters + c, __ATOMIC_RELAXED));
+	}
+
+	for (size_t h = 0; h < METRICS_HISTOGRAMS; h++) {
+		metrics_histogram_data_t *data = histograms + h;
+		const char *name = histogram_info[h].name;
+		/* Only the gamma ramp latency depends on the method. */
+		const char *label = h == METRICS_SET_RAMPS_SECONDS ? "method" : NULL;
+		const char *value = method_label != NULL ? method_label : "";
+		unsigned long total = 0;
+
+		fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n",
+			name, histogram_info[h].help, name);
+		for (size_t i = 0; i < METRICS_BUCKETS; i++) {
+			total += __atomic_load_n(data->buckets + i, __ATOMIC_RELAXED);
+			fprintf(f, "%s_bucket{", name);
+			if (label != NULL)
+				fprintf(f, "%s=\"%s\",", label, value);
+			if (i < METRICS_BUCKETS - 1)
+				fprintf(f, "le=\"%g\"} %lu\n", bucket_bounds[i], total);
+			else
+				fprintf(f, "le=\"+Inf\"} %lu\n", total);
+		}
+		double sum = (double)__atomic_load_n(&data->sum_ns, __ATOMIC_RELAXED) / 1e9;
+		if (label != NULL) {
+			fprintf(f, "%s_sum{%s=\"%s\"} %.9f\n%s_count{%s=\"%s\"} %lu\n",
+				name, label, value, sum, name, label, value, total);
+		} else {
+			fprintf(f, "%s_sum %.9f\n%s_count %lu\n", name, sum, name, total);
+		}
+	}
+
+	return ferror(f) ? -1 : 0;
+}
+
+/* Replace the metrics file, so that readers never see half of it. */
+static int
+metrics_write_file(void)
+{
+	size_t n = strlen(file_path);
+	char *tmp = malloc(n + sizeof(".tmp"));
+	FILE *f;
+
+	if (tmp == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	memcpy(tmp, file_path, n);
+	strcpy(tmp + n, ".tmp");
+
+	f = fopen(tmp, "w" FOPEN_CLOEXEC);
+	if (f == NULL) {
+		perror("fopen");
+		free(tmp);
+		return -1;
+	}
+	int r = metrics_write(f);
+	if (fclose(f) != 0 || r < 0) {
+		perror("fwrite");
+		remove(tmp);
+		free(tmp);
+		return -1;
+	}
+	if (rename(tmp, file_path) < 0) {
+		perror("rename");
+		remove(tmp);
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+	return 0;
+}
+
+
+int
+metrics_init(const char *socket_path_, const char *file_path_, const char *method)
+{
+	if (socket_path_ == NULL && file_path_ == NULL)
+		return 0;
+
+	if (socket_path_ != NULL && (socket_path = strdup(socket_path_)) == NULL)
+		goto fail;
+	if (file_path_ != NULL && (file_path = strdup(file_path_)) == NULL)
+		goto fail;
+	if (method != NULL && (method_label = strdup(method)) == NULL)
+		goto fail;
+	__atomic_store_n(&enabled, 1, __ATOMIC_RELAXED);
+	return 0;
+
+fail:
+	perror("strdup");
+	return -1;
+}
+
+#ifndef _WIN32
+/* Called by the main loop when a client has connected. */
+static void
+metrics_accept(int fd, void *data)
+{
+	char *buf = NULL;
+	size_t size = 0;
+	FILE *f;
+	int client;
+	(void) data;
+
+	client = accept(fd, NULL, NULL);
+	if (client < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			perror("accept");
+		return;
+	}
+
+	/* The metrics fit in the socket buffer, so a client
+	   that does not read cannot stall the main loop. */
+	f = open_memstream(&buf, &size);
+	if (f == NULL) {
+		perror("open_memstream");
+		close(client);
+		return;
+	}
+	metrics_write(f);
+	fclose(f);
+	if (send(client, buf, size, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+		perror("send");
+	free(buf);
+	close(client);
+}
+
+/* Remove a socket that no instance listens on anymore. */
+static int
+metrics_remove_stale(const char *path, const struct sockaddr_un *address)
+{
+	struct stat attr;
+	int probe, r, saved_errno;
+
+	if (lstat(path, &attr) < 0) {
+		if (errno == ENOENT)
+			return 0;
+		perror("lstat");
+		return -1;
+	}
+	if (!S_ISSOCK(attr.st_mode)) {
+		fprintf(stderr, _("`%s' exists and is not a socket.\n"), path);
+		return -1;
+	}
+
+	/* Without blocking, as a busy instance may not
+	   accept the connection right away. */
+	probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (probe < 0) {
+		perror("socket");
+		return -1;
+	}
+	if (SOCK_CLOEXEC == 0)
+		fcntl(probe, F_SETFD, FD_CLOEXEC);
+	fcntl(probe, F_SETFL, O_NONBLOCK);
+	r = connect(probe, (const struct sockaddr *)address, sizeof(*address));
+	saved_errno = errno;
+	close(probe);
+	if (r == 0 || saved_errno == EAGAIN || saved_errno == EINPROGRESS) {
+		fprintf(stderr, _("The metrics socket `%s' is used by"
+				  " another instance of Redshift.\n"), path);
+		return -1;
+	}
+	if (saved_errno != ECONNREFUSED) {
+		errno = saved_errno;
+		perror("connect");
+		return -1;
+	}
+
+	if (unlink(path) < 0) {
+		perror("unlink");
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+int
+metrics_listen(void)
+{
+	if (socket_path == NULL)
+		return 0;
+
+#ifndef _WIN32
+	struct sockaddr_un address;
+
+	if (strlen(socket_path) >= sizeof(address.sun_path)) {
+		fprintf(stderr, _("The metrics socket path is too long: `%s'.\n"),
+			socket_path);
+		return -1;
+	}
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, socket_path);
+
+	socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (socket_fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	if (SOCK_CLOEXEC == 0)
+		fcntl(socket_fd, F_SETFD, FD_CLOEXEC);
+	fcntl(socket_fd, F_SETFL, O_NONBLOCK);
+
+	/* Replace the socket left by a previous instance,
+	   but not another file or the socket of a running one. */
+	if (metrics_remove_stale(socket_path, &address) < 0)
+		goto fail;
+	if (bind(socket_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+		perror("bind");
+		goto fail;
+	}
+	if (listen(socket_fd, 4) < 0) {
+		perror("listen");
+		goto fail;
+	}
+	if (eventloop_add(socket_fd, metrics_accept, NULL) < 0)
+		goto fail;
+	return 0;
+
+fail:
+	close(socket_fd);
+	socket_fd = -1;
+	return -1;
+#else
+	fputs(_("Metrics sockets are not supported on Windows.\n"), stderr);
+	return -1;
+#endif
+}
+
+void
+metrics_tick(void)
+{
+	double now;
+
+	if (file_path == NULL || systemtime_get_monotonic(&now) < 0)
+		return;
+	if (last_write != 0 && now - last_write < METRICS_FILE_INTERVAL)
+		return;
+	last_write = now;
+	metrics_write_file();
+}
+
+void
+metrics_free(void)
+{
+	if (file_path != NULL)
+		metrics_write_file();
+
+#ifndef _WIN32
+	if (socket_fd >= 0) {
+		eventloop_remove(socket_fd);
+		close(socket_fd);
+		unlink(socket_path);
+		socket_fd = -1;
+	}
+#endif
+
+	free(socket_path);
+	free(file_path);
+	free(method_label);
+	socket_path = file_path = method_label = NULL;
+	/* I/O threads that were left behind may still time spans. */
+	__atomic_store_n(&enabled, 0, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,82 @@
+/* metrics.h -- Runtime statistics header
+   This file is part of Redshift.
+
+   Redshift is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Redshift is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Redshift.  If not, see <http://www.gnu.org/licenses/>.
+
+   Copyright (c) 2014  Mattias Andrée <maandree@member.fsf.org>
+*/
+
+#ifndef REDSHIFT_METRICS_H
+#define REDSHIFT_METRICS_H
+
+#include <stdio.h>
+
+
+/* Seconds between rewrites of the metrics file. */
+#ifndef METRICS_FILE_INTERVAL
+# define METRICS_FILE_INTERVAL  10.0
+#endif
+
+
+typedef enum {
+	METRICS_WAKEUPS,
+	METRICS_UPDATES,
+	METRICS_UPDATES_SKIPPED,
+	METRICS_RAMPS_COMPUTED,
+	METRICS_RAMPS_APPLIED,
+	METRICS_RAMPS_SKIPPED,
+	METRICS_EDID_CACHE_HITS,
+	METRICS_EDID_CACHE_MISSES,
+	METRICS_LOCATION_CACHE_HITS,
+	METRICS_SOLAR_ITERATIONS,
+	METRICS_RELOADS,
+	METRICS_HOOKS_SPAWNED,
+	METRICS_COUNTERS
+} metrics_counter_t;
+
+typedef enum {
+	METRICS_SET_RAMPS_SECONDS,
+	METRICS_FILL_SECONDS,
+	METRICS_RELOAD_SECONDS,
+	METRICS_HOOK_SPAWN_SECONDS,
+	METRICS_HISTOGRAMS
+} metrics_histogram_t;
+
+
+/* Counters are always kept, they are cheap and may be
+   incremented from any thread. */
+void metrics_count(metrics_counter_t counter, unsigned long n);
+
+/* Time something. Returns the current time, or zero if neither a
+   metrics socket nor a metrics file is used, in which case
+   `metrics_end' does nothing, so that the clock is not read. */
+double metrics_begin(void);
+void metrics_end(metrics_histogram_t histogram, double start);
+
+/* Enable timing and remember where the metrics are published,
+   either path may be NULL. `method' labels the gamma ramp latency. */
+int metrics_init(const char *socket_path, const char *file_path, const char *method);
+/* Answer connections to the metrics socket from the event loop.
+   The event loop must have been initialised. */
+int metrics_listen(void);
+/* Rewrite the metrics file if it is due. */
+void metrics_tick(void);
+/* Write the metrics file a last time and close the socket. */
+void metrics_free(void);
+
+/* Write the metrics in the Prometheus text format. */
+int metrics_write(FILE *f);
+
+
+#endif /* ! REDSHIFT_METRICS_H */
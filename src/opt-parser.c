@@ -24,18 +24,27 @@
 
 
 int
-parseopt(int argc, char *const *argv, const char *shortopts, const char **args, int *args_count)
+parseopt(int argc, char *const *argv, const char *shortopts, const struct option *longopts,
+	     const char **args, int *args_count)
 {
 	int opt;
+	int has_arg = 0;
 	char *p;
 
 	*args_count = 0;
-	opt = getopt(argc, argv, shortopts);
+	opt = getopt_long(argc, argv, shortopts, longopts, NULL);
 	if (opt < 0)
 		return opt;
 
-	p = strchr(shortopts, opt);
-	if ((p == NULL) || (p[1] != ':'))
+	if (opt < 256) {
+		p = strchr(shortopts, opt);
+		has_arg = (p != NULL) && (p[1] == ':');
+	} else {
+		for (; longopts != NULL && longopts->name != NULL; longopts++)
+			if (longopts->val == opt)
+				has_arg = longopts->has_arg != no_argument;
+	}
+	if (!has_arg || (optarg == NULL))
 		return opt;
 
 	args[(*args_count)++] = optarg;
@@ -19,8 +19,11 @@
 #ifndef REDSHIFT_OPT_PARSER_H
 #define REDSHIFT_OPT_PARSER_H
 
+#include <getopt.h>
 
-int parseopt(int argc, char *const *argv, const char *shortopts, const char **args, int *args_count);
+
+int parseopt(int argc, char *const *argv, const char *shortopts, const struct option *longopts,
+	     const char **args, int *args_count);
 
 char *coalesce_args(const char *const *args, int args_count, char delimiter, char final);
 
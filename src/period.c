@@ -0,0 +1,203 @@
+/* period.c -- Period tracking source
+   This file is part of Redshift.
+
+   Redshift is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Redshift is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Redshift.  If not, see <http://www.gnu.org/licenses/>.
+
+   Copyright (c) 2014  Mattias Andrée <maandree@member.fsf.org>
+*/
+
+#include "period.h"
+#include "hooks.h"
+#include "solar.h"
+#include "metrics.h"
+#include "trace.h"
+
+#include <math.h>
+
+
+/* The sun's elevation is sampled this many seconds apart when
+   searching for crossings, so excursions past a transition
+   elevation shorter than this may be missed. */
+#define PERIOD_STEP  300.0
+
+/* How far ahead crossings are searched for. If there is none, the
+   search is resumed from there when that time is reached. */
+#define PERIOD_HORIZON  (2 * 24 * 60 * 60.0)
+
+/* The precision, in seconds, of crossing times. */
+#define PERIOD_PRECISION  0.01
+
+/* The number of crossings that are followed in one update before
+   the tracker starts over from the current time, this is only
+   reached if the clock has jumped far into the future. */
+#define PERIOD_MAX_CROSSINGS  16
+
+
+/* The period at elevation `elevation' when the sun was in `current'. */
+static int
+period_classify(const period_tracker_t *tracker, double elevation, int current)
+{
+	double high = tracker->transition_high;
+	double low = tracker->transition_low;
+	double h = tracker->hysteresis;
+
+	switch (current) {
+	case HOOK_DAY:
+		if (elevation >= high - h) return HOOK_DAY;
+		return elevation <= low - h ? HOOK_NIGHT : HOOK_TWILIGHT;
+	case HOOK_NIGHT:
+		if (elevation <= low + h) return HOOK_NIGHT;
+		return elevation >= high + h ? HOOK_DAY : HOOK_TWILIGHT;
+	case HOOK_TWILIGHT:
+		if (elevation >= high + h) return HOOK_DAY;
+		if (elevation <= low - h) return HOOK_NIGHT;
+		return HOOK_TWILIGHT;
+	default:
+		if (elevation >= high) return HOOK_DAY;
+		if (elevation <= low) return HOOK_NIGHT;
+		return HOOK_TWILIGHT;
+	}
+}
+
+
+/* When the sun, being in `current' at `t', next leaves it. Returns
+   the first point in time at which it has left, or the end of the
+   search horizon if it does not leave before that. */
+static double
+period_next_crossing(const period_tracker_t *tracker, double t, int current)
+{
+#define LEFT(T)  \
+	(period_classify(tracker, solar_elevation((T), tracker->lat, tracker->lon), \
+			 current) != current)
+
+	double t1 = t, t2, tm;
+	double span = trace_begin("period crossing");
+	unsigned long iterations = 0;
+
+	for (t2 = t + PERIOD_STEP; t2 <= t + PERIOD_HORIZON; t2 += PERIOD_STEP) {
+		iterations++;
+		if (!LEFT(t2)) {
+			t1 = t2;
+			continue;
+		}
+		/* The sun has left between `t1' and `t2'. */
+		while (t2 - t1 > PERIOD_PRECISION) {
+			iterations++;
+			tm = (t1 + t2) / 2.0;
+			if (LEFT(tm)) t2 = tm;
+			else t1 = tm;
+		}
+		metrics_count(METRICS_SOLAR_ITERATIONS, iterations);
+		trace_end_value("period crossing", span, "elevations", iterations);
+		return t2;
+	}
+
+	metrics_count(METRICS_SOLAR_ITERATIONS, iterations);
+	trace_end_value("period crossing", span, "elevations", iterations);
+	return t + PERIOD_HORIZON;
+
+#undef LEFT
+}
+
+
+/* Determine the period from the elevation at `now'. */
+static void
+period_rebase(period_tracker_t *tracker, double now)
+{
+	double elevation = solar_elevation(now, tracker->lat, tracker->lon);
+	int candidate = period_classify(tracker, elevation, tracker->candidate);
+
+	if (candidate != tracker->candidate) {
+		/* The exact time is unknown. */
+		tracker->candidate = candidate;
+		tracker->candidate_since = now;
+	}
+	tracker->next_crossing = period_next_crossing(tracker, now, candidate);
+	tracker->valid = 1;
+}
+
+
+void
+period_init(period_tracker_t *tracker)
+{
+	tracker->period = -1;
+	tracker->candidate = -1;
+	tracker->candidate_since = NAN;
+	tracker->next_crossing = NAN;
+	tracker->valid = 0;
+}
+
+void
+period_invalidate(period_tracker_t *tracker)
+{
+	tracker->valid = 0;
+}
+
+int
+period_update(period_tracker_t *tracker, double now, double lat, double lon,
+	      const settings_t *settings, double *when)
+{
+	int crossings = 0;
+
+	/* Start over if what the crossing times were
+	   computed from has changed. */
+	if (!tracker->valid ||
+	    tracker->lat != lat || tracker->lon != lon ||
+	    tracker->transition_low != settings->transition_low ||
+	    tracker->transition_high != settings->transition_high ||
+	    tracker->hysteresis != settings->elevation_hysteresis) {
+		tracker->lat = lat;
+		tracker->lon = lon;
+		tracker->transition_low = settings->transition_low;
+		tracker->transition_high = settings->transition_high;
+		tracker->hysteresis = settings->elevation_hysteresis;
+		period_rebase(tracker, now);
+	}
+
+	/* Follow the crossings that have passed. */
+	while (tracker->next_crossing <= now) {
+		double crossing = tracker->next_crossing;
+		double elevation;
+		int candidate;
+
+		if (++crossings > PERIOD_MAX_CROSSINGS) {
+			period_rebase(tracker, now);
+			break;
+		}
+
+		/* At the end of the search horizon the sun
+		   may still be in the same period. */
+		elevation = solar_elevation(crossing, lat, lon);
+		candidate = period_classify(tracker, elevation, tracker->candidate);
+		if (candidate != tracker->candidate) {
+			tracker->candidate = candidate;
+			tracker->candidate_since = crossing;
+		}
+
+		tracker->next_crossing =
+			period_next_crossing(tracker, crossing, candidate);
+	}
+
+	if (tracker->candidate == tracker->period) return 0;
+
+	/* The first period is reported at once. */
+	if (tracker->period >= 0 &&
+	    now < tracker->candidate_since + settings->period_dwell) {
+		return 0;
+	}
+
+	tracker->period = tracker->candidate;
+	if (when != NULL) *when = tracker->candidate_since;
+	return 1;
+}
@@ -0,0 +1,65 @@
+/* period.h -- Period tracking header
+   This file is part of Redshift.
+
+   Redshift is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Redshift is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Redshift.  If not, see <http://www.gnu.org/licenses/>.
+
+   Copyright (c) 2014  Mattias Andrée <maandree@member.fsf.org>
+*/
+
+#ifndef REDSHIFT_PERIOD_H
+#define REDSHIFT_PERIOD_H
+
+#include "settings.h"
+
+
+/* Tracks whether it is day, night or twilight (the hook events)
+   from the times the sun crosses the transition elevations, rather
+   than from the elevation at each iteration of the main loop.
+
+   To leave a period the sun must pass the transition elevation by
+   the elevation-hysteresis setting, and the new period must last
+   for the period-dwell setting before it is reported. */
+typedef struct {
+	/* The reported period, -1 before the first report. */
+	int period;
+	/* The period the sun is in, and when it entered it. */
+	int candidate;
+	double candidate_since;
+	/* When the sun next leaves `candidate', or when
+	   to continue looking for when it does. */
+	double next_crossing;
+
+	/* What the crossing times are computed from. */
+	double lat;
+	double lon;
+	double transition_low;
+	double transition_high;
+	double hysteresis;
+	int valid;
+} period_tracker_t;
+
+
+void period_init(period_tracker_t *tracker);
+
+/* Forget the crossing times, they are recomputed on the next update.
+   Used when the clock has jumped. */
+void period_invalidate(period_tracker_t *tracker);
+
+/* Returns 1 and stores the time of the transition in `when' if the
+   reported period has changed, otherwise 0. */
+int period_update(period_tracker_t *tracker, double now, double lat, double lon,
+		  const settings_t *settings, double *when);
+
+
+#endif /* ! REDSHIFT_PERIOD_H */
@@ -0,0 +1,188 @@
+/* plugins.c -- Plugin loading source
+   This file is part of Redshift.
+
+   Redshift is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Redshift is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Redshift.  If not, see <http://www.gnu.org/licenses/>.
+
+   Copyright (c) 2014  Mattias Andrée <maandree@member.fsf.org>
+*/
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "plugins.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#ifdef HAVE_DLOPEN
+# include <dlfcn.h>
+#endif
+
+#ifdef ENABLE_NLS
+# include <libintl.h>
+# define _(s) gettext(s)
+#else
+# define _(s) s
+#endif
+
+
+
+#ifdef HAVE_DLOPEN
+
+
+/* A loaded plugin, functions it does
+   not export are NULL. */
+typedef struct {
+	void *handle;
+	redshift_plugin_on_period_change_func *on_period_change;
+	redshift_plugin_on_temperature_change_func *on_temperature_change;
+	redshift_plugin_free_func *free;
+} plugin_t;
+
+static plugin_t *plugins = NULL;
+static size_t plugins_n = 0;
+
+
+/* Look up an optional function. Function pointers cannot be
+   assigned from void pointers in ISO C, so it is copied through
+   the pointer's representation as dlsym(3) recommends. */
+#define LOOKUP(handle, name, var)  \
+	(*(void **)(&(var)) = dlsym((handle), (name)))
+
+
+int
+add_plugin(const char *path)
+{
+	redshift_plugin_init_func *init;
+	plugin_t plugin;
+	plugin_t *new_plugins;
+
+	/* Bind lazily, and keep the symbols to the plugin itself
+	   so that plugins cannot interfere with each other. */
+	plugin.handle = dlopen(path, RTLD_LAZY | RTLD_LOCAL);
+	if (plugin.handle == NULL) {
+		fprintf(stderr, _("Unable to load plugin `%s': %s\n"),
+			path, dlerror());
+		return -1;
+	}
+
+	LOOKUP(plugin.handle, "redshift_plugin_init", init);
+	LOOKUP(plugin.handle, "redshift_plugin_on_period_change",
+	       plugin.on_period_change);
+	LOOKUP(plugin.handle, "redshift_plugin_on_temperature_change",
+	       plugin.on_temperature_change);
+	LOOKUP(plugin.handle, "redshift_plugin_free", plugin.free);
+
+	if (init != NULL && init(REDSHIFT_PLUGIN_API_VERSION) < 0) {
+		fprintf(stderr, _("Plugin `%s' failed to initialize.\n"),
+			path);
+		dlclose(plugin.handle);
+		return -1;
+	}
+
+	new_plugins = realloc(plugins, (plugins_n + 1) * sizeof(plugin_t));
+	if (new_plugins == NULL) {
+		perror("realloc");
+		if (plugin.free != NULL) plugin.free();
+		dlclose(plugin.handle);
+		return -1;
+	}
+	plugins = new_plugins;
+	plugins[plugins_n++] = plugin;
+
+	return 0;
+}
+
+void
+free_plugins(void)
+{
+	/* Unload in reverse order of loading. */
+	while (plugins_n > 0) {
+		plugin_t *plugin = &plugins[--plugins_n];
+		if (plugin->free != NULL) plugin->free();
+		dlclose(plugin->handle);
+	}
+	free(plugins);
+	plugins = NULL;
+}
+
+int
+have_plugins(void)
+{
+	return plugins_n > 0;
+}
+
+void
+plugins_period_change(const redshift_plugin_state_t *state, int previous)
+{
+	size_t i;
+	for (i = 0; i < plugins_n; i++) {
+		if (plugins[i].on_period_change != NULL) {
+			plugins[i].on_period_change(state, previous);
+		}
+	}
+}
+
+void
+plugins_temperature_change(const redshift_plugin_state_t *state)
+{
+	size_t i;
+	for (i = 0; i < plugins_n; i++) {
+		if (plugins[i].on_temperature_change != NULL) {
+			plugins[i].on_temperature_change(state);
+		}
+	}
+}
+
+
+#else /* ! HAVE_DLOPEN */
+
+
+int
+add_plugin(const char *path)
+{
+	fprintf(stderr, _("Unable to load plugin `%s':"
+			  " plugins are not supported.\n"),
+		path);
+	return -1;
+}
+
+void
+free_plugins(void)
+{
+	/* do nothing */
+}
+
+int
+have_plugins(void)
+{
+	return 0;
+}
+
+void
+plugins_period_change(const redshift_plugin_state_t *state, int previous)
+{
+	(void) state;
+	(void) previous;
+}
+
+void
+plugins_temperature_change(const redshift_plugin_state_t *state)
+{
+	(void) state;
+}
+
+
+#endif /* ! HAVE_DLOPEN */
@@ -0,0 +1,36 @@
+/* plugins.h -- Plugin loading header
+   This file is part of Redshift.
+
+   Redshift is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Redshift is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Redshift.  If not, see <http://www.gnu.org/licenses/>.
+
+   Copyright (c) 2014  Mattias Andrée <maandree@member.fsf.org>
+*/
+
+#ifndef REDSHIFT_PLUGINS_H
+#define REDSHIFT_PLUGINS_H
+
+#include "redshift-plugin.h"
+
+
+int add_plugin(const char *path);
+void free_plugins(void);
+
+/* Whether any plugins are loaded. */
+int have_plugins(void) __attribute__((pure));
+
+void plugins_period_change(const redshift_plugin_state_t *state, int previous);
+void plugins_temperature_change(const redshift_plugin_state_t *state);
+
+
+#endif /* ! REDSHIFT_PLUGINS_H */
@@ -0,0 +1,302 @@
+/* probe.c -- Concurrent probing source
+   This file is part of Redshift.
+
+   Redshift is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Redshift is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Redshift.  If not, see <http://www.gnu.org/licenses/>.
+
+   Copyright (c) 2014  Mattias Andrée <maandree@member.fsf.org>
+*/
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "probe.h"
+#include "systemtime.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+# define PROBE_THREADED
+# include <pthread.h>
+# include <signal.h>
+# include <time.h>
+#endif
+
+#ifdef ENABLE_NLS
+# include <libintl.h>
+# define _(s) gettext(s)
+#else
+# define _(s) s
+#endif
+
+
+#define PROBE_RUNNING    0
+#define PROBE_SUCCEEDED  1
+#define PROBE_FAILED     2
+
+
+/* Print how long a probe took. */
+static void
+probe_report(const char *what, const probe_t *probe, int status, double elapsed)
+{
+	switch (status) {
+	case PROBE_SUCCEEDED:
+		printf(_("Probed %s `%s': succeeded in %.3f seconds.\n"),
+		       what, probe->name, elapsed);
+		break;
+	case PROBE_FAILED:
+		printf(_("Probed %s `%s': failed in %.3f seconds.\n"),
+		       what, probe->name, elapsed);
+		break;
+	default:
+		printf(_("Probed %s `%s': timed out after %.3f seconds.\n"),
+		       what, probe->name, elapsed);
+		break;
+	}
+}
+
+
+#ifdef PROBE_THREADED
+
+
+/* A probe and what has become of it. */
+typedef struct {
+	probe_t probe;
+	int status;
+	double elapsed;
+	/* Set when the caller no longer waits for the probe,
+	   the probe then cleans up after itself. */
+	int abandoned;
+	struct probe_run *run;
+} probe_slot_t;
+
+/* Shared by the caller and the probes, freed by the
+   last of them to finish with it. */
+typedef struct probe_run {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	size_t refs;
+	double started;
+	probe_slot_t *slots;
+} probe_run_t;
+
+
+static void
+probe_release(probe_run_t *run)
+{
+	/* Called with the mutex held. */
+	if (--run->refs > 0) {
+		pthread_mutex_unlock(&run->mutex);
+		return;
+	}
+	pthread_mutex_unlock(&run->mutex);
+	pthread_mutex_destroy(&run->mutex);
+	pthread_cond_destroy(&run->cond);
+	free(run->slots);
+	free(run);
+}
+
+static void *
+probe_thread(void *data)
+{
+	probe_slot_t *slot = data;
+	probe_run_t *run = slot->run;
+	double now, span;
+	int r;
+
+	span = trace_begin("probe");
+	r = slot->probe.probe(slot->probe.data);
+	trace_end("probe", span, slot->probe.name);
+	if (systemtime_get_monotonic(&now) < 0) now = run->started;
+
+	pthread_mutex_lock(&run->mutex);
+	slot->status = r == 0 ? PROBE_SUCCEEDED : PROBE_FAILED;
+	slot->elapsed = now - run->started;
+	if (slot->abandoned) {
+		if (r == 0) slot->probe.discard(slot->probe.data);
+		free(slot->probe.data);
+	}
+	pthread_cond_signal(&run->cond);
+	probe_release(run);
+	return NULL;
+}
+
+/* The first probe, in order, that has succeeded while all before
+   it have failed. Returns -2 if that is not known yet. */
+static ssize_t
+probe_decided(const probe_run_t *run, size_t n, int timed_out)
+{
+	for (size_t i = 0; i < n; i++) {
+		if (run->slots[i].status == PROBE_SUCCEEDED)
+			return (ssize_t)i;
+		if (run->slots[i].status == PROBE_RUNNING && !timed_out)
+			return -2;
+	}
+	return -1;
+}
+
+ssize_t
+probe_first(probe_t *probes, size_t n, double timeout,
+	    const char *what, int verbose)
+{
+	probe_run_t *run;
+	struct timespec deadline;
+	sigset_t all, old;
+	ssize_t chosen;
+	size_t started = 0;
+	int timed_out = 0;
+	double span = trace_begin("probing");
+
+	run = malloc(sizeof(probe_run_t));
+	if (run == NULL) {
+		perror("malloc");
+		goto fail;
+	}
+	run->slots = calloc(n, sizeof(probe_slot_t));
+	if (run->slots == NULL) {
+		perror("calloc");
+		free(run);
+		goto fail;
+	}
+	/* The deadline must not move with the wall clock,
+	   so the condition uses the monotonic clock. */
+	pthread_condattr_t cond_attr;
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+	pthread_mutex_init(&run->mutex, NULL);
+	pthread_cond_init(&run->cond, &cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+	run->refs = 1;
+	if (systemtime_get_monotonic(&run->started) < 0)
+		run->started = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += (time_t)timeout;
+	deadline.tv_nsec += (long)((timeout - (time_t)timeout) * 1000000000L);
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec += 1;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	/* Signals must be handled by the main thread,
+	   so block them in the probes. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_mutex_lock(&run->mutex);
+	for (; started < n; started++) {
+		probe_slot_t *slot = &run->slots[started];
+		pthread_attr_t attr;
+		pthread_t thread;
+		int r;
+
+		slot->probe = probes[started];
+		slot->status = PROBE_RUNNING;
+		slot->run = run;
+
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		r = pthread_create(&thread, &attr, probe_thread, slot);
+		pthread_attr_destroy(&attr);
+		if (r != 0) {
+			errno = r;
+			perror("pthread_create");
+			break;
+		}
+		run->refs++;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	/* Probes that could not be started have failed. */
+	for (size_t i = started; i < n; i++) {
+		run->slots[i].probe = probes[i];
+		run->slots[i].status = PROBE_FAILED;
+	}
+
+	/* Wait until the outcome is known, without waiting
+	   for probes that come after one that has succeeded. */
+	while ((chosen = probe_decided(run, n, timed_out)) == -2) {
+		int r = pthread_cond_timedwait(&run->cond, &run->mutex, &deadline);
+		if (r == ETIMEDOUT) timed_out = 1;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		probe_slot_t *slot = &run->slots[i];
+		if (verbose) {
+			double now, elapsed = slot->elapsed;
+			if (slot->status == PROBE_RUNNING &&
+			    systemtime_get_monotonic(&now) == 0)
+				elapsed = now - run->started;
+			probe_report(what, &slot->probe, slot->status, elapsed);
+		}
+
+		if ((ssize_t)i == chosen) continue;
+		if (slot->status == PROBE_RUNNING) {
+			slot->abandoned = 1;
+			continue;
+		}
+		if (slot->status == PROBE_SUCCEEDED)
+			slot->probe.discard(slot->probe.data);
+		free(slot->probe.data);
+	}
+
+	probe_release(run);
+	trace_end("probing", span, what);
+	return chosen;
+
+fail:
+	for (size_t i = 0; i < n; i++)
+		free(probes[i].data);
+	trace_end("probing", span, what);
+	return -1;
+}
+
+
+#else /* ! PROBE_THREADED */
+
+
+ssize_t
+probe_first(probe_t *probes, size_t n, double timeout,
+	    const char *what, int verbose)
+{
+	ssize_t chosen = -1;
+	double start, end, span;
+
+	/* One at a time, in order, until one succeeds. */
+	for (size_t i = 0; i < n; i++) {
+		if (chosen >= 0) {
+			free(probes[i].data);
+			continue;
+		}
+		if (systemtime_get_monotonic(&start) < 0) start = 0;
+		span = trace_begin("probe");
+		int r = probes[i].probe(probes[i].data);
+		trace_end("probe", span, probes[i].name);
+		if (systemtime_get_monotonic(&end) < 0) end = start;
+		if (verbose) {
+			probe_report(what, &probes[i],
+				     r == 0 ? PROBE_SUCCEEDED : PROBE_FAILED,
+				     end - start);
+		}
+		if (r == 0) chosen = (ssize_t)i;
+		else free(probes[i].data);
+	}
+
+	return chosen;
+}
+
+
+#endif /* ! PROBE_THREADED */
@@ -0,0 +1,58 @@
+/* probe.h -- Concurrent probing header
+   This file is part of Redshift.
+
+   Redshift is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Redshift is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Redshift.  If not, see <http://www.gnu.org/licenses/>.
+
+   Copyright (c) 2014  Mattias Andrée <maandree@member.fsf.org>
+*/
+
+#ifndef REDSHIFT_PROBE_H
+#define REDSHIFT_PROBE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+
+/* Seconds the probes may take. */
+#ifndef PROBE_TIMEOUT
+# define PROBE_TIMEOUT  5.0
+#endif
+
+
+/* Try to start something, returns zero on success. */
+typedef int probe_func(void *data);
+/* Release what a successful probe has started,
+   when another probe is used instead. */
+typedef void probe_discard_func(void *data);
+
+typedef struct {
+	const char *name;
+	probe_func *probe;
+	probe_discard_func *discard;
+	/* Allocated with malloc(3). */
+	void *data;
+} probe_t;
+
+
+/* Run the probes concurrently and return the index of the first of
+   them, in order, that succeeds within `timeout' seconds, or -1 if
+   none does. The chosen probe's data is returned to the caller, the
+   data of the others is discarded and freed when they have finished,
+   in the background for probes that have timed out. `what' is
+   the kind of probes, used in the verbose output. */
+ssize_t probe_first(probe_t *probes, size_t n, double timeout,
+		    const char *what, int verbose);
+
+
+#endif /* ! REDSHIFT_PROBE_H */
@@ -0,0 +1,87 @@
+/* redshift-plugin.h -- Plugin interface header
+   This file is part of Redshift.
+
+   Redshift is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Redshift is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Redshift.  If not, see <http://www.gnu.org/licenses/>.
+
+   Copyright (c) 2014  Mattias Andrée <maandree@member.fsf.org>
+*/
+
+#ifndef REDSHIFT_PLUGIN_H
+#define REDSHIFT_PLUGIN_H
+
+/* Plugins are shared objects listed as `plugin' in the `hooks'
+   section of the configuration file. They are loaded in continual
+   mode and called from the main loop, so callbacks must return
+   promptly. All functions are optional, a plugin exports the ones
+   it needs under the names given below. */
+
+
+/* Incremented when the interface changes incompatibly. */
+#define REDSHIFT_PLUGIN_API_VERSION  1
+
+
+/* Periods, the same as the hook events. */
+#define REDSHIFT_PLUGIN_PERIOD_NONE      (-1)
+#define REDSHIFT_PLUGIN_PERIOD_DAY       0
+#define REDSHIFT_PLUGIN_PERIOD_NIGHT     1
+#define REDSHIFT_PLUGIN_PERIOD_TWILIGHT  2
+
+
+/* The state of the program when a callback is made. */
+typedef struct {
+	/* The program's clock, in seconds since the epoch. For
+	   period changes, the time the period started. */
+	double timestamp;
+	/* The location, in degrees. */
+	double latitude;
+	double longitude;
+	/* The angular elevation of the sun, in degrees. */
+	double elevation;
+	/* The current period. */
+	int period;
+	/* The applied color temperature and brightness. */
+	int temperature;
+	float brightness;
+	/* Whether adjustments have been disabled. */
+	int disabled;
+	/* Settings. */
+	int temp_day;
+	int temp_night;
+	float brightness_day;
+	float brightness_night;
+	float transition_low;
+	float transition_high;
+} redshift_plugin_state_t;
+
+
+/* `redshift_plugin_init': called when the plugin has been
+   loaded, with REDSHIFT_PLUGIN_API_VERSION. The plugin is
+   unloaded if it returns a negative value. */
+typedef int redshift_plugin_init_func(int api_version);
+
+/* `redshift_plugin_on_period_change': called when the
+   period changes, `previous' is the previous period. */
+typedef void redshift_plugin_on_period_change_func(const redshift_plugin_state_t *state,
+						   int previous);
+
+/* `redshift_plugin_on_temperature_change': called when the
+   temperature or brightness changes, including every step
+   of transitions. */
+typedef void redshift_plugin_on_temperature_change_func(const redshift_plugin_state_t *state);
+
+/* `redshift_plugin_free': called before the plugin is unloaded. */
+typedef void redshift_plugin_free_func(void);
+
+
+#endif /* ! REDSHIFT_PLUGIN_H */
@@ -48,10 +48,19 @@
 #include "config-ini.h"
 #include "solar.h"
 #include "systemtime.h"
+#include "eventloop.h"
+#include "reload.h"
 #include "adjustments.h"
 #include "opt-parser.h"
 #include "gamma-common.h"
 #include "hooks.h"
+#include "plugins.h"
+#include "period.h"
+#include "location.h"
+#include "hotplug.h"
+#include "probe.h"
+#include "metrics.h"
+#include "trace.h"
 
 
 #define MIN(x,y)  ((x) < (y) ? (x) : (y))
@@ -59,6 +68,7 @@
 
 
 #include "gamma-dummy.h"
+#include "gamma-record.h"
 
 #ifdef ENABLE_DRM
 # include "gamma-drm.h"
@@ -82,6 +92,7 @@
 
 
 #include "location-manual.h"
+#include "location-file.h"
 
 #ifdef ENABLE_GEOCLUE
 # include "location-geoclue.h"
@@ -115,6 +126,7 @@ static const gamma_method_t gamma_methods[] = {
 	__method("wingdi", w32gdi),
 #endif
 	__method("dummy", gamma_dummy),
+	__method("record", gamma_dummy_record),
 	{ NULL }
 };
 #undef __method
@@ -126,6 +138,9 @@ typedef union {
 #ifdef ENABLE_GEOCLUE
 	location_geoclue_state_t geoclue;
 #endif
+#ifndef _WIN32
+	location_file_state_t file;
+#endif
 } location_state_t;
 
 
@@ -142,7 +157,27 @@ static const location_provider_t location_providers[] = {
 		(location_provider_set_option_func *)
 		location_geoclue_set_option,
 		(location_provider_get_location_func *)
-		location_geoclue_get_location
+		location_geoclue_get_location,
+		NULL,
+		NULL
+	},
+#endif
+#ifndef _WIN32
+	{
+		"file",
+		(location_provider_init_func *)location_file_init,
+		(location_provider_start_func *)location_file_start,
+		(location_provider_free_func *)location_file_free,
+		(location_provider_print_help_func *)
+		location_file_print_help,
+		(location_provider_set_option_func *)
+		location_file_set_option,
+		(location_provider_get_location_func *)
+		location_file_get_location,
+		(location_provider_get_fd_func *)
+		location_file_get_fd,
+		(location_provider_handle_func *)
+		location_file_handle
 	},
 #endif
 	{
@@ -155,7 +190,9 @@ static const location_provider_t location_providers[] = {
 		(location_provider_set_option_func *)
 		location_manual_set_option,
 		(location_provider_get_location_func *)
-		location_manual_get_location
+		location_manual_get_location,
+		NULL,
+		NULL
 	},
 	{ NULL }
 };
@@ -199,6 +236,19 @@ static int reload = 0;
 static settings_t settings;
 
 
+/* Options that only have a long form. */
+#define OPT_COMPILE_CONFIG  256
+#define OPT_REPLAY  257
+#define OPT_TRACE  258
+
+static const struct option long_options[] = {
+	{ "compile-config", no_argument, NULL, OPT_COMPILE_CONFIG },
+	{ "replay", required_argument, NULL, OPT_REPLAY },
+	{ "trace", required_argument, NULL, OPT_TRACE },
+	{ NULL, 0, NULL, 0 }
+};
+
+
 /* Print which period (night, day or transition) we're currently in. */
 static void
 print_period(double elevation)
@@ -282,6 +332,41 @@ print_help(const char *program_name)
 	      stdout);
 	fputs("\n", stdout);
 
+	/* TRANSLATORS: help output 4b
+	   `max' must not be translated
+	   no-wrap */
+	fputs(_("  -S T[:F[:D]]\tUse a virtual clock starting at T seconds"
+		" after the epoch\n"
+		"  \t\trunning F times faster than real time, or as fast\n"
+		"  \t\tas possible if F is `max', and exit after D seconds\n"),
+	      stdout);
+	fputs("\n", stdout);
+
+	/* TRANSLATORS: help output 4c
+	   no-wrap */
+	fputs(_("  --compile-config\n"
+		"  \t\tWrite a snapshot of the configuration file, with\n"
+		"  \t\tthe output of its commands, that is loaded instead\n"
+		"  \t\twhile the configuration file is unchanged\n"),
+	      stdout);
+	fputs("\n", stdout);
+
+	/* TRANSLATORS: help output 4d
+	   `record' and `dummy' must not be translated
+	   no-wrap */
+	fputs(_("  --replay=FILE\tCompute the gamma ramps of a trace from the\n"
+		"  \t\t`record' method again, check them and apply them\n"
+		"  \t\twith the selected method, `dummy' by default\n"),
+	      stdout);
+	fputs("\n", stdout);
+
+	/* TRANSLATORS: help output 4e
+	   no-wrap */
+	fputs(_("  --trace=FILE\tWrite how long each step took, in the\n"
+		"  \t\tChrome trace event format, until Redshift exits\n"),
+	      stdout);
+	fputs("\n", stdout);
+
 	/* TRANSLATORS: help output 5 */
 	printf(_("The neutral temperature is %uK. Using this value will not\n"
 		 "change the color temperature of the display. Setting the\n"
@@ -335,10 +420,11 @@ print_provider_list()
 }
 
 
+/* Initialize a location provider and set its options. */
 static int
-provider_try_start(const location_provider_t *provider,
-		   location_state_t *state,
-		   config_ini_state_t *config, char *args)
+provider_try_init(const location_provider_t *provider,
+		  location_state_t *state,
+		  config_ini_state_t *config, char *args)
 {
 	int r;
 
@@ -414,8 +500,15 @@ provider_try_start(const location_provider_t *provider,
 		}
 	}
 
-	/* Start provider. */
-	r = provider->start(state);
+	return 0;
+}
+
+static int
+provider_start(const location_provider_t *provider, location_state_t *state)
+{
+	double span = trace_begin("provider start");
+	int r = provider->start(state);
+	trace_end("provider start", span, provider->name);
 	if (r < 0) {
 		provider->free(state);
 		fprintf(stderr, _("Failed to start provider %s.\n"),
@@ -427,10 +520,42 @@ provider_try_start(const location_provider_t *provider,
 }
 
 static int
-method_try_start(const gamma_method_t *method,
-		 gamma_server_state_t *state,
-		 config_ini_state_t *config, char *args,
-		 char *gamma)
+provider_try_start(const location_provider_t *provider,
+		   location_state_t *state,
+		   config_ini_state_t *config, char *args)
+{
+	if (provider_try_init(provider, state, config, args) < 0)
+		return -1;
+	return provider_start(provider, state);
+}
+
+
+/* A location provider being probed. */
+typedef struct {
+	const location_provider_t *provider;
+	location_state_t state;
+} provider_probe_t;
+
+static int
+provider_probe(void *data)
+{
+	provider_probe_t *probe = data;
+	return provider_start(probe->provider, &probe->state);
+}
+
+static void
+provider_probe_discard(void *data)
+{
+	provider_probe_t *probe = data;
+	probe->provider->free(&probe->state);
+}
+
+/* Initialize an adjustment method and set its options. */
+static int
+method_try_init(const gamma_method_t *method,
+		gamma_server_state_t *state,
+		config_ini_state_t *config, char *args,
+		const char *gamma)
 {
 	int r;
 
@@ -442,10 +567,16 @@ method_try_start(const gamma_method_t *method,
 	}
 
 
-	/* Set default gamma. */
+	/* Set default gamma, the value is parsed in place. */
 	if (gamma != NULL) {
-		r = gamma_set_option(state, "gamma", gamma, 0);
-		free(gamma);
+		char *value = strdup(gamma);
+		if (value == NULL) {
+			perror("strdup");
+			gamma_free(state);
+			return -1;
+		}
+		r = gamma_set_option(state, "gamma", value, 0);
+		free(value);
 		if (r < 0) {
 			gamma_free(state);
 			return -1;
@@ -518,8 +649,15 @@ method_try_start(const gamma_method_t *method,
 		}
 	}
 
-	/* Start method. */
-	r = method->start(state);
+	return 0;
+}
+
+static int
+method_start(const gamma_method_t *method, gamma_server_state_t *state)
+{
+	double span = trace_begin("method start");
+	int r = method->start(state);
+	trace_end("method start", span, method->name);
 	if (r < 0) {
 		gamma_free(state);
 		fprintf(stderr, _("Failed to start adjustment method %s.\n"),
@@ -530,6 +668,38 @@ method_try_start(const gamma_method_t *method,
 	return 0;
 }
 
+static int
+method_try_start(const gamma_method_t *method,
+		 gamma_server_state_t *state,
+		 config_ini_state_t *config, char *args,
+		 const char *gamma)
+{
+	if (method_try_init(method, state, config, args, gamma) < 0)
+		return -1;
+	return method_start(method, state);
+}
+
+
+/* An adjustment method being probed. */
+typedef struct {
+	const gamma_method_t *method;
+	gamma_server_state_t state;
+} method_probe_t;
+
+static int
+method_probe(void *data)
+{
+	method_probe_t *probe = data;
+	return method_start(probe->method, &probe->state);
+}
+
+static void
+method_probe_discard(void *data)
+{
+	method_probe_t *probe = data;
+	gamma_free(&probe->state);
+}
+
 /* A brightness string contains either one floating point value,
    or two values separated by a colon. */
 static void
@@ -546,6 +716,44 @@ parse_brightness_string(const char *str, float *bright_day, float *bright_night)
 	}
 }
 
+/* A clock string contains the start time of the virtual clock,
+   optionally followed by the speed factor and the run time,
+   all separated by colons. */
+static int
+parse_clock_string(char *str, double *start, double *speed, double *duration)
+{
+	char *end;
+	char *s = strchr(str, ':');
+	if (s != NULL) *(s++) = '\0';
+
+	errno = 0;
+	*start = strtod(str, &end);
+	if (errno != 0 || end == str || *end != '\0') return -1;
+
+	*speed = 1.0;
+	*duration = NAN;
+	if (s == NULL) return 0;
+
+	str = s;
+	s = strchr(str, ':');
+	if (s != NULL) *(s++) = '\0';
+
+	if (strcasecmp(str, "max") == 0) {
+		*speed = 0.0;
+	} else {
+		*speed = strtod(str, &end);
+		if (errno != 0 || end == str || *end != '\0' || *speed <= 0.0)
+			return -1;
+	}
+	if (s == NULL) return 0;
+
+	*duration = strtod(s, &end);
+	if (errno != 0 || end == s || *end != '\0' || *duration < 0.0)
+		return -1;
+
+	return 0;
+}
+
 static const gamma_method_t *
 find_gamma_method(const char *name)
 {
@@ -579,9 +787,12 @@ find_location_provider(const char *name)
 static int
 set_temperature(gamma_server_state_t *state, int temp, float brightness)
 {
+	double span = trace_begin("update");
 	gamma_update_all_brightness(state, brightness);
 	gamma_update_all_temperature(state, (float)temp);
-	return gamma_update(state);
+	int r = gamma_update(state);
+	trace_end_value("update", span, "temperature", (size_t)temp);
+	return r;
 }
 
 
@@ -636,6 +847,28 @@ print_twilight_period(double now, double lat, double lon, double elevation)
 }
 
 
+/* Describe the current state to plugins. */
+static void
+plugin_state(redshift_plugin_state_t *state, double now, double lat, double lon,
+	     double elevation, int period, int temp, float brightness, int disabled)
+{
+	state->timestamp = now;
+	state->latitude = lat;
+	state->longitude = lon;
+	state->elevation = elevation;
+	state->period = period;
+	state->temperature = temp;
+	state->brightness = brightness;
+	state->disabled = disabled;
+	state->temp_day = settings.temp_day;
+	state->temp_night = settings.temp_night;
+	state->brightness_day = settings.brightness_day;
+	state->brightness_night = settings.brightness_night;
+	state->transition_low = settings.transition_low;
+	state->transition_high = settings.transition_high;
+}
+
+
 int
 main(int argc, char *argv[])
 {
@@ -655,6 +888,8 @@ main(int argc, char *argv[])
 	char *config_filepath = NULL;
 
 	char *gamma = NULL;
+	char *gamma_cmdline = NULL;
+	char *method_gamma = NULL;
 	settings_t settings_cmdline;
 	settings_init(&settings);
 
@@ -663,11 +898,22 @@ main(int argc, char *argv[])
 
 	const location_provider_t *provider = NULL;
 	char *provider_args = NULL;
+	double location_ttl = LOCATION_CACHE_TTL;
+	double location_threshold = LOCATION_THRESHOLD;
+	double probe_timeout = PROBE_TIMEOUT;
+	const char *metrics_socket = NULL;
+	const char *metrics_file = NULL;
 
 	program_mode_t mode = PROGRAM_MODE_CONTINUAL;
 	int verbose = 0;
+	int compile_config = 0;
+	char *replay_path = NULL;
 	char *s;
 
+	/* Virtual clock, the end is NAN if it runs forever. */
+	double clock_start, clock_speed, clock_duration;
+	double clock_end = NAN;
+
 	/* Flush messages consistently even if redirected to a pipe or
 	   file.  Change the flush behaviour to line-buffered, without
 	   changing the actual buffers being used. */
@@ -678,7 +924,8 @@ main(int argc, char *argv[])
 	int opt;
 	const char **args = alloca(argc * sizeof(char*));
 	int args_count;
-	while ((opt = parseopt(argc, argv, "b:c:g:hl:m:oO:pPrt:vVx", args, &args_count)) != -1) {
+	while ((opt = parseopt(argc, argv, "b:c:g:hl:m:oO:pPrS:t:vVx", long_options,
+				args, &args_count)) != -1) {
 		float gamma_[3];
 		switch (opt) {
 		case 'b':
@@ -699,6 +946,12 @@ main(int argc, char *argv[])
 				perror("strdup");
 				abort();
 			}
+			free(gamma_cmdline);
+			gamma_cmdline = strdup(optarg);
+			if (gamma_cmdline == NULL) {
+				perror("strdup");
+				abort();
+			}
 			r = parse_gamma_string(optarg, gamma_);
 			if (r < 0) {
 				fputs(_("Malformed gamma argument.\n"),
@@ -814,6 +1067,19 @@ main(int argc, char *argv[])
 		case 'r':
 			settings.transition = 0;
 			break;
+		case 'S':
+			r = parse_clock_string(optarg, &clock_start,
+					       &clock_speed, &clock_duration);
+			if (r < 0) {
+				fputs(_("Malformed clock argument.\n"),
+				      stderr);
+				fputs(_("Try `-h' for more information.\n"),
+				      stderr);
+				exit(EXIT_FAILURE);
+			}
+			systemtime_set_virtual(clock_start, clock_speed);
+			clock_end = clock_start + clock_duration;
+			break;
 		case 't':
 			s = strchr(optarg, ':');
 			if (s == NULL) {
@@ -837,6 +1103,17 @@ main(int argc, char *argv[])
 		case 'x':
 			mode = PROGRAM_MODE_RESET;
 			break;
+		case OPT_COMPILE_CONFIG:
+			compile_config = 1;
+			break;
+		case OPT_REPLAY:
+			mode = PROGRAM_MODE_REPLAY;
+			replay_path = optarg;
+			break;
+		case OPT_TRACE:
+			if (trace_open(optarg) < 0)
+				exit(EXIT_FAILURE);
+			break;
 		case '?':
 			fputs(_("Try `-h' for more information.\n"), stderr);
 			exit(EXIT_FAILURE);
@@ -846,12 +1123,39 @@ main(int argc, char *argv[])
 
 	settings_copy(&settings_cmdline, &settings);
 
-	/* Load settings from config file. */
+	/* Load settings from the config file, or its
+	   snapshot if it is up to date. */
 	config_ini_state_t config_state;
-	r = config_ini_init(&config_state, config_filepath);
-	if (r < 0) {
-		fputs("Unable to load config file.\n", stderr);
-		exit(EXIT_FAILURE);
+	double span = trace_begin("config parse");
+	r = 0;
+	if (!compile_config)
+		r = config_ini_load_snapshot(&config_state, config_filepath);
+	if (r > 0) {
+		if (verbose) {
+			printf(_("Using snapshot of config file `%s'.\n"),
+			       config_state.filepath);
+		}
+		trace_end("config parse", span, "snapshot");
+	} else {
+		r = config_ini_init(&config_state, config_filepath, NULL, verbose);
+		if (r < 0) {
+			fputs("Unable to load config file.\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+		trace_end("config parse", span, config_state.filepath);
+	}
+
+	/* Write snapshot of the config file and exit. */
+	if (compile_config) {
+		char *snapshot_path = NULL;
+		r = config_ini_write_snapshot(&config_state, &snapshot_path);
+		if (r == 0) {
+			printf(_("Wrote snapshot of config file `%s' to `%s'.\n"),
+			       config_state.filepath, snapshot_path);
+		}
+		free(snapshot_path);
+		config_ini_free(&config_state);
+		exit(r < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
 	}
 
 	/* Read global config settings. */
@@ -887,6 +1191,51 @@ main(int argc, char *argv[])
 						exit(EXIT_FAILURE);
 					}
 				}
+			} else if (strcasecmp(setting->name,
+					      "location-cache-ttl") == 0) {
+				char *end;
+				location_ttl = strtod(setting->value, &end);
+				if (*setting->value == '\0' || *end != '\0' ||
+				    !(location_ttl >= 0)) {
+					/* TRANSLATORS: `location-cache-ttl'
+					   must not be translated. */
+					fputs(_("The value for `location-cache-ttl' must be"
+						" a non-negative number of seconds.\n"),
+					      stderr);
+					exit(EXIT_FAILURE);
+				}
+			} else if (strcasecmp(setting->name,
+					      "location-threshold") == 0) {
+				char *end;
+				location_threshold = strtod(setting->value, &end);
+				if (*setting->value == '\0' || *end != '\0' ||
+				    !(location_threshold >= 0)) {
+					/* TRANSLATORS: `location-threshold'
+					   must not be translated. */
+					fputs(_("The value for `location-threshold' must be"
+						" a non-negative number of kilometres.\n"),
+					      stderr);
+					exit(EXIT_FAILURE);
+				}
+			} else if (strcasecmp(setting->name,
+					      "probe-timeout") == 0) {
+				char *end;
+				probe_timeout = strtod(setting->value, &end);
+				if (*setting->value == '\0' || *end != '\0' ||
+				    !(probe_timeout > 0) || !isfinite(probe_timeout)) {
+					/* TRANSLATORS: `probe-timeout'
+					   must not be translated. */
+					fputs(_("The value for `probe-timeout' must be"
+						" a positive number of seconds.\n"),
+					      stderr);
+					exit(EXIT_FAILURE);
+				}
+			} else if (strcasecmp(setting->name,
+					      "metrics-socket") == 0) {
+				metrics_socket = setting->value;
+			} else if (strcasecmp(setting->name,
+					      "metrics-file") == 0) {
+				metrics_file = setting->value;
 			} else if (strcasecmp(setting->name,
 					      "location-provider") == 0) {
 				if (provider == NULL) {
@@ -922,6 +1271,13 @@ main(int argc, char *argv[])
 				hook_event = HOOK_NIGHT;
 			} else if (strcasecmp(setting->name, "twilight") == 0) {
 				hook_event = HOOK_TWILIGHT;
+			} else if (strcasecmp(setting->name, "plugin") == 0) {
+				/* Plugins are only called from the main loop. */
+				if (mode != PROGRAM_MODE_CONTINUAL) continue;
+				r = add_plugin(setting->value);
+				if (r < 0)
+					exit(EXIT_FAILURE);
+				continue;
 			} else {
 				fprintf(stderr, _("Unknown hook `%s'.\n"),
 					setting->name);
@@ -939,41 +1295,76 @@ main(int argc, char *argv[])
 
 	float lat = NAN;
 	float lon = NAN;
+	int location_cached = 0;
 
 	/* Initialize location provider. If provider is NULL
-	   try all providers until one that works is found. */
-	location_state_t location_state;
-
-	/* Location is not needed for reset mode and manual mode. */
+	   try all providers until one that works is found. The
+	   provider's state is used through `location_state', as
+	   a probed provider's state stays where it was started. */
+	location_state_t location_data;
+	location_state_t *location_state = &location_data;
+	provider_probe_t *chosen_provider = NULL;
+
+	/* Location is not needed for reset mode, manual mode and replay mode. */
 	if (mode != PROGRAM_MODE_RESET &&
-	    mode != PROGRAM_MODE_MANUAL) {
+	    mode != PROGRAM_MODE_MANUAL &&
+	    mode != PROGRAM_MODE_REPLAY) {
 		if (provider != NULL) {
 			/* Use provider specified on command line. */
-			r = provider_try_start(provider, &location_state, &config_state,
+			r = provider_try_start(provider, location_state, &config_state,
 					       provider_args == NULL ? NULL :
 					       provider_args + strlen(provider_args) + 1);
 			if (r < 0) exit(EXIT_FAILURE);
 		} else {
-			/* Try all providers, use the first that works. */
+			/* Start all providers at once, use the first,
+			   in order, that works. They are initialized
+			   here as the options are read from the
+			   configuration, only starting them can be slow. */
+			probe_t probes[sizeof(location_providers) /
+				       sizeof(*location_providers)];
+			size_t n = 0;
 			for (int i = 0;
 			     location_providers[i].name != NULL; i++) {
 				const location_provider_t *p =
 					&location_providers[i];
-				fprintf(stderr,
-					_("Trying location provider `%s'...\n"),
-					p->name);
-				r = provider_try_start(p, &location_state,
-						       &config_state, NULL);
+				/* The location file has no default path,
+				   so it is only tried if it is configured. */
+				if (strcmp(p->name, "file") == 0 &&
+				    config_ini_get_section(&config_state, "file") == NULL)
+					continue;
+				provider_probe_t *probe =
+					malloc(sizeof(provider_probe_t));
+				if (probe == NULL) {
+					perror("malloc");
+					exit(EXIT_FAILURE);
+				}
+				probe->provider = p;
+				r = provider_try_init(p, &probe->state,
+						      &config_state, NULL);
 				if (r < 0) {
-					fputs(_("Trying next provider...\n"),
-					      stderr);
+					free(probe);
 					continue;
 				}
+				probes[n].name = p->name;
+				probes[n].probe = provider_probe;
+				probes[n].discard = provider_probe_discard;
+				probes[n].data = probe;
+				n++;
+			}
 
+			ssize_t chosen = probe_first(probes, n, probe_timeout,
+						     _("location provider"),
+						     verbose);
+			if (chosen >= 0) {
 				/* Found provider that works. */
-				printf(_("Using provider `%s'.\n"), p->name);
-				provider = p;
-				break;
+				provider_probe_t *probe = probes[chosen].data;
+				provider = probe->provider;
+				/* The probe is kept for as long as the
+				   provider, which may point into it. */
+				location_state = &probe->state;
+				chosen_provider = probe;
+				printf(_("Using provider `%s'.\n"),
+				       provider->name);
 			}
 
 			/* Failure if no providers were successful at this
@@ -985,15 +1376,45 @@ main(int argc, char *argv[])
 			}
 		}
 
-		/* Get current location. */
-		r = provider->get_location(&location_state, &lat, &lon);
-		if (r < 0) {
-		        fputs(_("Unable to get location from provider.\n"),
-		              stderr);
-		        exit(EXIT_FAILURE);
+		/* In continual mode, start with the last known location
+		   and ask the provider in the background, unless the
+		   location is given manually. */
+		if (mode == PROGRAM_MODE_CONTINUAL && location_ttl > 0 &&
+		    strcmp(provider->name, "manual") != 0) {
+			location_cached = location_cache_load(&lat, &lon,
+							      location_ttl);
+		}
+
+		if (location_cached) {
+			metrics_count(METRICS_LOCATION_CACHE_HITS, 1);
+			if (verbose) {
+				fputs(_("Using the cached location until"
+					" the provider answers.\n"), stdout);
+			}
+		} else {
+			/* Get current location. */
+			span = trace_begin("get location");
+			r = provider->get_location(location_state, &lat, &lon);
+			trace_end("get location", span, provider->name);
+			if (r < 0) {
+				fputs(_("Unable to get location from provider.\n"),
+				      stderr);
+				exit(EXIT_FAILURE);
+			}
+
+			/* In continual mode the provider
+			   may follow the location. */
+			if (mode != PROGRAM_MODE_CONTINUAL) {
+				provider->free(location_state);
+				free(chosen_provider);
+			}
+
+			if (strcmp(provider->name, "manual") != 0 &&
+			    lat >= MIN_LAT && lat <= MAX_LAT &&
+			    lon >= MIN_LON && lon <= MAX_LON) {
+				location_cache_save(lat, lon);
+			}
 		}
-	
-		provider->free(&location_state);
 	
 		if (verbose) {
 		        /* TRANSLATORS: Append degree symbols after %f if possible. */
@@ -1026,7 +1447,8 @@ main(int argc, char *argv[])
 		}
 	}
 
-	r = settings_validate(&settings, mode == PROGRAM_MODE_MANUAL, mode == PROGRAM_MODE_RESET);
+	r = settings_validate(&settings, mode == PROGRAM_MODE_MANUAL,
+			      mode == PROGRAM_MODE_RESET || mode == PROGRAM_MODE_REPLAY);
 	if (r < 0)
 		exit(EXIT_FAILURE);
 
@@ -1036,14 +1458,40 @@ main(int argc, char *argv[])
 	}
 
 	/* Initialize gamma adjustment method. If method is NULL
-	   try all methods until one that works is found. */
-	gamma_server_state_t state;
+	   try all methods until one that works is found. As for
+	   the location provider, a probed method's state is used
+	   where it was started. */
+	gamma_server_state_t method_data;
+	gamma_server_state_t *state = &method_data;
+	method_probe_t *chosen_method = NULL;
+	size_t gamma_allocations = 0;
 
 	/* Gamma adjustment not needed for print mode */
 	if (mode != PROGRAM_MODE_PRINT) {
+		/* Remember gamma from the method options, for
+		   reloads, before they are parsed in place. */
+		if (method_args != NULL) {
+			char *opt = method_args + strlen(method_args) + 1;
+			for (; *opt != '\0'; opt += strlen(opt) + 1) {
+				if (strncasecmp(opt, "gamma=", 6) != 0)
+					continue;
+				free(method_gamma);
+				method_gamma = strdup(opt + 6);
+				if (method_gamma == NULL) {
+					perror("strdup");
+					abort();
+				}
+			}
+		}
+
+		/* Do not touch the displays when replaying
+		   unless a method is specified. */
+		if (method == NULL && mode == PROGRAM_MODE_REPLAY)
+			method = find_gamma_method("dummy");
+
 		if (method != NULL) {
 			/* Use method specified on command line. */
-			r = method_try_start(method, &state, &config_state,
+			r = method_try_start(method, state, &config_state,
 					     method_args == NULL ? NULL :
 					     method_args + strlen(method_args) + 1,
 					     gamma);
@@ -1052,22 +1500,47 @@ main(int argc, char *argv[])
 				exit(EXIT_FAILURE);
 			}
 		} else {
-			/* Try all methods, use the first that works. */
+			/* Start all methods at once, use the first,
+			   in order, that works. */
+			probe_t probes[sizeof(gamma_methods) /
+				       sizeof(*gamma_methods)];
+			size_t n = 0;
 			for (int i = 0; gamma_methods[i].name != NULL; i++) {
 				const gamma_method_t *m = &gamma_methods[i];
 				if (!m->autostart_test())
 					continue;
 
-				r = method_try_start(m, &state, &config_state, NULL, gamma);
+				method_probe_t *probe = malloc(sizeof(method_probe_t));
+				if (probe == NULL) {
+					perror("malloc");
+					exit(EXIT_FAILURE);
+				}
+				probe->method = m;
+				r = method_try_init(m, &probe->state, &config_state,
+						    NULL, gamma);
 				if (r < 0) {
-					fputs(_("Trying next method...\n"), stderr);
+					free(probe);
 					continue;
 				}
+				probes[n].name = m->name;
+				probes[n].probe = method_probe;
+				probes[n].discard = method_probe_discard;
+				probes[n].data = probe;
+				n++;
+			}
 
+			ssize_t chosen = probe_first(probes, n, probe_timeout,
+						     _("adjustment method"),
+						     verbose);
+			if (chosen >= 0) {
 				/* Found method that works. */
-				printf(_("Using method `%s'.\n"), m->name);
-				method = m;
-				break;
+				method_probe_t *probe = probes[chosen].data;
+				/* The probe is kept for as long as
+				   the method, which may point into it. */
+				method = probe->method;
+				state = &probe->state;
+				chosen_method = probe;
+				printf(_("Using method `%s'.\n"), method->name);
 			}
 
 			/* Failure if no methods were successful at this point. */
@@ -1076,9 +1549,19 @@ main(int argc, char *argv[])
 				exit(EXIT_FAILURE);
 			}
 		}
+
+		/* Only continual mode restores the gamma ramps on exit,
+		   the other modes need not read them unless the
+		   calibrations are preserved. */
+		state->restore = mode == PROGRAM_MODE_CONTINUAL;
+		gamma_allocations = state->allocations;
 	}
 
-	config_ini_free(&config_state);
+	/* Time the work from here on if the metrics are published. */
+	r = metrics_init(metrics_socket, metrics_file,
+			 method != NULL ? method->name : NULL);
+	if (r < 0)
+		exit(EXIT_FAILURE);
 
 	switch (mode) {
 	case PROGRAM_MODE_ONE_SHOT:
@@ -1093,11 +1576,13 @@ main(int argc, char *argv[])
 		r = systemtime_get_time(&now);
 		if (r < 0) {
 			fputs(_("Unable to read system time.\n"), stderr);
-			gamma_free(&state);
+			gamma_free(state);
 			exit(EXIT_FAILURE);
 		}
 
+		span = trace_begin("solar elevation");
 		double elevation = solar_elevation(now, lat, lon);
+		trace_end("solar elevation", span, NULL);
 
 		if (verbose) {
 			/* TRANSLATORS: Append degree symbol if possible. */
@@ -1122,10 +1607,10 @@ main(int argc, char *argv[])
 		}
 
 		/* Adjust temperature */
-		r = set_temperature(&state, temp, brightness);
+		r = set_temperature(state, temp, brightness);
 		if (r < 0) {
 			fputs(_("Temperature adjustment failed.\n"), stderr);
-			gamma_free(&state);
+			gamma_free(state);
 			exit(EXIT_FAILURE);
 		}
 
@@ -1139,22 +1624,31 @@ main(int argc, char *argv[])
 		if (verbose) printf(_("Color temperature: %uK\n"), settings.temp_set);
 
 		/* Adjust temperature */
-		r = set_temperature(&state, settings.temp_set, settings.brightness_day);
+		r = set_temperature(state, settings.temp_set, settings.brightness_day);
 		if (r < 0) {
 			fputs(_("Temperature adjustment failed.\n"), stderr);
-			gamma_free(&state);
+			gamma_free(state);
 			exit(EXIT_FAILURE);
 		}
 
 	}
 	break;
+	case PROGRAM_MODE_REPLAY:
+	{
+		long differ = gamma_record_replay(replay_path, state, verbose);
+		if (differ != 0) {
+			gamma_free(state);
+			exit(EXIT_FAILURE);
+		}
+	}
+	break;
 	case PROGRAM_MODE_RESET:
 	{
 		/* Reset screen */
-		r = set_temperature(&state, NEUTRAL_TEMP, 1.0);
+		r = set_temperature(state, NEUTRAL_TEMP, 1.0);
 		if (r < 0) {
 			fputs(_("Temperature adjustment failed.\n"), stderr);
-			gamma_free(&state);
+			gamma_free(state);
 			exit(EXIT_FAILURE);
 		}
 	}
@@ -1162,6 +1656,13 @@ main(int argc, char *argv[])
 	case PROGRAM_MODE_CONTINUAL:
 	{
 		int hook_event = -1;
+		period_tracker_t period_tracker;
+		period_init(&period_tracker);
+
+		/* What plugins were last told. */
+		int plugin_temp = -1;
+		float plugin_brightness = -1.0;
+		int plugin_disabled = -1;
 
 		/* Make an initial transition from 6500K */
 		int short_trans_delta = -1;
@@ -1205,9 +1706,74 @@ main(int argc, char *argv[])
 		systemtime_init();
 #endif
 
+		r = eventloop_init();
+		if (r < 0) {
+			gamma_free(state);
+			exit(EXIT_FAILURE);
+		}
+
+		/* Reload the configuration in the background. */
+		reload_request_t reload_request = {
+			.config_filepath = config_filepath,
+			.gamma = gamma_cmdline,
+			.method_gamma = method_gamma,
+			.method_name = method->name,
+			.mode = mode,
+			.verbose = verbose
+		};
+		settings_copy(&reload_request.settings_cmdline, &settings_cmdline);
+		r = reload_init(&reload_request, &config_state);
+		if (r < 0) {
+			eventloop_free();
+			gamma_free(state);
+			exit(EXIT_FAILURE);
+		}
+
+		/* Reap hooks from the event loop. */
+		r = init_hooks();
+		if (r < 0) {
+			reload_free();
+			eventloop_free();
+			gamma_free(state);
+			exit(EXIT_FAILURE);
+		}
+
+		/* Replace the cached location when the provider
+		   answers, and follow the location if supported. */
+		r = location_start(provider, location_state, location_cached,
+				   lat, lon, location_threshold);
+		if (r < 0) {
+			reload_free();
+			eventloop_free();
+			gamma_free(state);
+			exit(EXIT_FAILURE);
+		}
+
+		/* Adjust monitors that are plugged in later. */
+		r = hotplug_start(state, verbose);
+		if (r < 0) {
+			location_free();
+			reload_free();
+			eventloop_free();
+			gamma_free(state);
+			exit(EXIT_FAILURE);
+		}
+
+		/* Answer requests for the metrics. */
+		r = metrics_listen();
+		if (r < 0) {
+			hotplug_free();
+			location_free();
+			reload_free();
+			eventloop_free();
+			gamma_free(state);
+			exit(EXIT_FAILURE);
+		}
+
 		/* Continuously adjust color temperature */
 		int done = 0;
 		int disabled = 0;
+		int force_update = 0;
 		settings_t old_settings;
 		settings_t new_settings;
 		double reload_trans_delta = 0.2;
@@ -1215,39 +1781,31 @@ main(int argc, char *argv[])
 		int reloading = 0;
 		
 		while (1) {
-			/* Reload settings if reload signal was caught */
+			/* Reload settings in the background if
+			   reload signal was caught */
 			if (reload) {
 				reload = 0;
-				settings_copy(&new_settings, &settings_cmdline);
-
-				/* Load settings from config file. */
-				config_ini_state_t config_state;
-				r = config_ini_init(&config_state, config_filepath);
-				if (r < 0) {
-					fputs("Unable to load config file.\n", stderr);
-					goto reload_failed;
-				}
+				reload_start(0);
+			}
 
-				/* Read global config settings. */
-				config_ini_section_t *section =
-					config_ini_get_section(&config_state, "redshift");
-				if (section != NULL) {
-					config_ini_setting_t *setting = section->settings;
-					while (setting != NULL) {
-						r = settings_parse(&new_settings, setting->name, setting->value, mode);
-						if (r < 0) {
-							config_ini_free(&config_state);
-							goto reload_failed;
-						}
-						setting = setting->next;
-					}
-				}
+			/* Apply reloaded settings once they are ready,
+			   only what has changed is applied */
+			reload_result_t *reloaded = reload_take();
+			for (size_t i = 0; reloaded != NULL &&
+				     i < reloaded->selections_count; i++) {
+				reload_selection_t *sel = reloaded->selections + i;
+				if (!sel->changed) continue;
+				gamma_update_selection(state, i, sel->gamma,
+						       sel->preserve_calibrations);
+				force_update = 1;
+			}
+			if (reloaded != NULL && !reloaded->settings_changed) {
+				reload_free_result(reloaded);
+			} else if (reloaded != NULL) {
+				settings_copy(&new_settings, &reloaded->settings);
+				reload_free_result(reloaded);
+				force_update = 1;
 
-				config_ini_free(&config_state);
-				settings_finalize(&new_settings);
-				r = settings_validate(&new_settings, 0, 0);
-				if (r < 0) goto reload_failed;
-				
 				if (new_settings.reload_transition) {
 					settings_copy(&old_settings, &settings);
 					reloading = 1;
@@ -1267,7 +1825,21 @@ main(int argc, char *argv[])
 					       settings.brightness_day, settings.brightness_night);
 				}
 			}
-		reload_failed:
+
+
+			/* Use the new location, the solar
+			   schedule follows it automatically. */
+			if (location_take(&lat, &lon)) {
+				if (verbose) {
+				        /* TRANSLATORS: Append degree symbols if possible. */
+					printf(_("Location: %f, %f\n"), lat, lon);
+				}
+				force_update = 1;
+			}
+
+			/* New CRTCs must be adjusted right away. */
+			if (hotplug_take())
+				force_update = 1;
 
 			/* Perform reload transition */
 			if (reloading) {
@@ -1322,11 +1894,15 @@ main(int argc, char *argv[])
 			if (r < 0) {
 				fputs(_("Unable to read system time.\n"),
 				      stderr);
-				gamma_free(&state);
+				gamma_free(state);
 				exit(EXIT_FAILURE);
 			}
 
+			/* Stop when the virtual clock has run out. */
+			if (!done && now >= clock_end) exiting = 1;
+
 			/* Skip over transition if transitions are disabled */
+			double schedule = trace_begin("schedule");
 			int set_adjustments = 0;
 			if (!settings.transition) {
 				if (short_trans_delta) {
@@ -1337,7 +1913,9 @@ main(int argc, char *argv[])
 			}
 
 			/* Current angular elevation of the sun */
+			span = trace_begin("solar elevation");
 			double elevation = solar_elevation(now, lat, lon);
+			trace_end("solar elevation", span, NULL);
 
 			/* Use elevation of sun to set color temperature */
 			int temp = (int)calculate_interpolated_value(elevation,
@@ -1372,6 +1950,7 @@ main(int argc, char *argv[])
 
 			brightness = adjustment_alpha*1.0 +
 				(1.0-adjustment_alpha)*brightness;
+			trace_end_value("schedule", schedule, "temperature", (size_t)temp);
 
 			/* Quit loop when done */
 			if (done && !short_trans_delta) break;
@@ -1382,41 +1961,97 @@ main(int argc, char *argv[])
 			}
 
 			/* Adjust temperature */
-			if (!disabled || short_trans_delta || set_adjustments) {
-				r = set_temperature(&state, temp, brightness);
+			if (!disabled || short_trans_delta || set_adjustments ||
+			    force_update) {
+				force_update = 0;
+				metrics_count(METRICS_UPDATES, 1);
+				r = set_temperature(state, temp, brightness);
 				if (r < 0) {
 					fputs(_("Temperature adjustment"
 						" failed.\n"), stderr);
-					gamma_free(&state);
+					gamma_free(state);
 					exit(EXIT_FAILURE);
 				}
 
-				int new_hook_event = HOOK_TWILIGHT;
-				if (elevation >= settings.transition_high)
-					new_hook_event = HOOK_DAY;
-				else if (elevation <= settings.transition_low)
-					new_hook_event = HOOK_NIGHT;
-				if (hook_event != new_hook_event) {
-					hook_event = new_hook_event;
+				/* Hooks are run once for each transition,
+				   even if the sun lingers at its elevation. */
+				double period_start;
+				if (period_update(&period_tracker, now, lat, lon,
+						  &settings, &period_start)) {
+					int old_hook_event = hook_event;
+					hook_event = period_tracker.period;
 					run_hooks(hook_event, verbose);
+					if (have_plugins()) {
+						redshift_plugin_state_t ps;
+						plugin_state(&ps, period_start, lat, lon,
+							     elevation, hook_event, temp,
+							     brightness, disabled);
+						plugins_period_change(&ps, old_hook_event);
+					}
 					if (verbose) {
+						printf(_("Period changed at %.0f.\n"),
+						       period_start);
 						print_twilight_period(now, lat, lon, elevation);
 					}
 				}
+
+				/* Plugins are called for every step of
+				   transitions, but not when nothing changed. */
+				if (have_plugins() &&
+				    (temp != plugin_temp ||
+				     brightness != plugin_brightness ||
+				     disabled != plugin_disabled)) {
+					redshift_plugin_state_t ps;
+					plugin_temp = temp;
+					plugin_brightness = brightness;
+					plugin_disabled = disabled;
+					plugin_state(&ps, now, lat, lon, elevation,
+						     hook_event, temp, brightness,
+						     disabled);
+					plugins_temperature_change(&ps);
+				}
+			} else {
+				metrics_count(METRICS_UPDATES_SKIPPED, 1);
 			}
 
-			/* Sleep for 5 seconds or 0.1 second. */
-#ifndef _WIN32
-			if (short_trans_delta || reloading) usleep(100000);
-			else usleep(5000000);
-#else /* ! _WIN32 */
-			if (short_trans_delta || reloading) Sleep(100);
-			else Sleep(5000);
-#endif /* ! _WIN32 */
+			/* Kill hooks that have run for too long. */
+			reap_hooks();
+			metrics_tick();
+
+			/* Sleep for 5 seconds or 0.1 second, unless
+			   CRTCs that must be adjusted have appeared. */
+			double jump;
+			int resumed;
+			r = eventloop_wait(hotplug_poll() ? 0 :
+					   short_trans_delta || reloading ? 0.1 : 5.0,
+					   &jump, &resumed);
+			metrics_count(METRICS_WAKEUPS, 1);
+			if (r) {
+				/* The gamma ramps may have been reset while the
+				   system was suspended, so apply them again even
+				   if nothing has changed. */
+				if (resumed) {
+					fprintf(stderr, _("Resumed from suspend,"
+							  " clock jumped by %.1f seconds.\n"),
+						jump);
+				} else {
+					fprintf(stderr, _("Clock jumped by %.1f seconds.\n"),
+						jump);
+				}
+				force_update = 1;
+				period_invalidate(&period_tracker);
+			}
 		}
 
+		hotplug_free();
+		if (location_free() == 0)
+			free(chosen_provider);
+		reload_free();
+		metrics_free();
+		eventloop_free();
+
 		/* Restore saved gamma ramps */
-		gamma_restore(&state);
+		gamma_restore(state);
 
 #ifdef __MACH__
 		systemtime_close();
@@ -1425,16 +2060,33 @@ main(int argc, char *argv[])
 	break;
 	}
 
+	if (verbose && mode != PROGRAM_MODE_PRINT) {
+		printf(_("Read gamma ramps %lu times, for %lu CRTCs.\n"),
+		       state->ramps_read, state->crtcs_used);
+		printf(_("Made %lu heap allocations for the CRTCs,"
+			 " %lu of them after start-up.\n"),
+		       state->allocations, state->allocations - gamma_allocations);
+	}
+
+	/* Write the metrics a last time. */
+	metrics_free();
+
 	/* Clean up gamma adjustment state */
-	gamma_free(&state);
+	if (gamma_free(state) == 0)
+		free(chosen_method);
 
 	/* Free memory */
 	if (method_args != NULL)
 		free(method_args);
 	if (provider_args != NULL)
 		free(provider_args);
+	free(gamma);
+	free(gamma_cmdline);
+	free(method_gamma);
+	config_ini_free(&config_state);
 
 	free_hooks();
+	free_plugins();
 	
 	if (config_filepath != NULL) free(config_filepath);
 	return EXIT_SUCCESS;
@@ -51,7 +51,8 @@ typedef enum {
 	PROGRAM_MODE_ONE_SHOT,
 	PROGRAM_MODE_PRINT,
 	PROGRAM_MODE_RESET,
-	PROGRAM_MODE_MANUAL
+	PROGRAM_MODE_MANUAL,
+	PROGRAM_MODE_REPLAY
 } program_mode_t;
 
 
@@ -86,6 +87,9 @@ typedef int location_provider_set_option_func(void *state, const char *key,
 					      const char *value);
 typedef int location_provider_get_location_func(void *state, float *lat,
 						float *lon);
+typedef int location_provider_get_fd_func(void *state);
+typedef int location_provider_handle_func(void *state, float *lat,
+					  float *lon);
 
 typedef struct {
 	char *name;
@@ -104,6 +108,14 @@ typedef struct {
 
 	/* Get current location. */
 	location_provider_get_location_func *get_location;
+
+	/* Get a file descriptor that becomes readable when the location
+	   may have changed, or -1. NULL if the location is not followed. */
+	location_provider_get_fd_func *get_fd;
+	/* Read the location when the file descriptor is readable. Returns
+	   1 if a new location has been read, zero if not, or -1 on error.
+	   The file descriptor may change afterwards. */
+	location_provider_handle_func *handle;
 } location_provider_t;
 
 
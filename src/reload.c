@@ -0,0 +1,619 @@
+/* reload.c -- Background configuration reload source
+   This file is part of Redshift.
+
+   Redshift is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Redshift is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Redshift.  If not, see <http://www.gnu.org/licenses/>.
+
+   Copyright (c) 2014  Mattias Andrée <maandree@member.fsf.org>
+*/
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "reload.h"
+#include "config-ini.h"
+#include "gamma-common.h"
+#include "eventloop.h"
+#include "metrics.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+# define RELOAD_THREADED
+# include <pthread.h>
+# include <signal.h>
+# include <fcntl.h>
+# include <unistd.h>
+#endif
+
+#ifdef __linux__
+# include "filewatch.h"
+# include <sys/inotify.h>
+# include <sys/timerfd.h>
+# include <time.h>
+# ifndef RELOAD_THREADED
+#  include <unistd.h>
+# endif
+#endif
+
+#ifdef ENABLE_NLS
+# include <libintl.h>
+# define _(s) gettext(s)
+#else
+# define _(s) s
+#endif
+
+
+#ifndef RELOAD_DEBOUNCE
+/* Seconds to wait for more changes to the config file. */
+# define RELOAD_DEBOUNCE  0.2
+#endif
+
+
+static reload_request_t request;
+
+/* The most recently loaded configuration and what it
+   resolved to, used for incremental reloads. Only
+   accessed by one reload at a time. */
+static config_ini_state_t previous_config;
+static reload_result_t *previous_result = NULL;
+
+/* Completed reload not yet taken by the main loop,
+   only accessed with atomic operations. */
+static reload_result_t *pending = NULL;
+
+#ifdef RELOAD_THREADED
+static pthread_t worker;
+static int worker_running = 0;
+static int worker_incremental = 0;
+static int restart = 0;
+static int restart_incremental = 0;
+/* Written to by the worker when it has finished. */
+static int wake_pipe[2] = { -1, -1 };
+#endif
+
+#ifdef __linux__
+/* Watch for changes to the config file. */
+static int inotify_fd = -1;
+static int debounce_fd = -1;
+static char *watch_name = NULL;
+#endif
+
+
+/* Parse and validate a gamma value, without modifying it. */
+static int
+reload_parse_gamma(const char *value, float gamma[3])
+{
+	char *str = strdup(value);
+	if (str == NULL) {
+		perror("strdup");
+		return -1;
+	}
+
+	int r = parse_gamma_string(str, gamma);
+	free(str);
+	if (r < 0) {
+		fputs(_("Malformed gamma setting.\n"), stderr);
+		return -1;
+	}
+
+#ifdef MAX_GAMMA
+	if (gamma[0] < MIN_GAMMA || gamma[0] > MAX_GAMMA ||
+	    gamma[1] < MIN_GAMMA || gamma[1] > MAX_GAMMA ||
+	    gamma[2] < MIN_GAMMA || gamma[2] > MAX_GAMMA) {
+		fprintf(stderr,
+			_("Gamma value must be between %.1f and %.1f.\n"),
+			MIN_GAMMA, MAX_GAMMA);
+		return -1;
+	}
+#else
+	if (gamma[0] < MIN_GAMMA ||
+	    gamma[1] < MIN_GAMMA ||
+	    gamma[2] < MIN_GAMMA) {
+		fprintf(stderr,
+			_("Gamma value must be atleast %.1f.\n"),
+			MIN_GAMMA);
+		return -1;
+	}
+#endif
+
+	return 0;
+}
+
+/* Read the per selection adjustments from the adjustment
+   method's sections, in the same way as they are assigned
+   when the adjustment method is started. */
+static int
+reload_selections(reload_result_t *result, config_ini_state_t *config,
+		  const char *gamma)
+{
+	reload_selection_t defaults;
+	config_ini_section_t **sections = NULL;
+	size_t i, n = 0;
+
+	defaults.gamma[0] = defaults.gamma[1] = defaults.gamma[2] = DEFAULT_GAMMA;
+	defaults.preserve_calibrations = result->settings.preserve_calibrations;
+	if (gamma != NULL && reload_parse_gamma(gamma, defaults.gamma) < 0)
+		return -1;
+
+	if (request.method_name != NULL) {
+		sections = config_ini_get_sections(config, request.method_name);
+		if (sections == NULL) return -1;
+		while (sections[n] != NULL) n++;
+	}
+
+	result->selections = malloc((n + 1) * sizeof(reload_selection_t));
+	if (result->selections == NULL) {
+		perror("malloc");
+		free(sections);
+		return -1;
+	}
+	result->selections_count = n + 1;
+
+	result->selections[0] = defaults;
+	for (i = 0; i < n; i++) {
+		reload_selection_t *sel = result->selections + i + 1;
+		config_ini_setting_t *setting = sections[i]->settings;
+		*sel = defaults;
+		for (; setting != NULL; setting = setting->next) {
+			if (strcasecmp(setting->name, "gamma") == 0) {
+				if (reload_parse_gamma(setting->value, sel->gamma) < 0)
+					goto fail;
+			} else if (strcasecmp(setting->name, "preserve-calibrations") == 0) {
+				int int_value = atoi(setting->value);
+				if (int_value != 0 && int_value != 1) {
+					/* TRANSLATORS: `preserve-calibrations' must not be translated. */
+					fprintf(stderr,
+						_("The value for `preserve-calibrations' must be either `1' or `0'.\n"));
+					goto fail;
+				}
+				sel->preserve_calibrations = int_value;
+			}
+		}
+	}
+	free(sections);
+
+	/* Options on the command line apply to all selections. */
+	if (request.method_gamma != NULL) {
+		float method_gamma[3];
+		if (reload_parse_gamma(request.method_gamma, method_gamma) < 0)
+			return -1;
+		for (i = 0; i <= n; i++)
+			memcpy(result->selections[i].gamma, method_gamma, sizeof(method_gamma));
+	}
+
+	return 0;
+
+fail:
+	free(sections);
+	return -1;
+}
+
+/* Resolve a loaded configuration. */
+static reload_result_t *
+reload_parse(config_ini_state_t *config)
+{
+	const char *gamma = request.gamma;
+	int r;
+
+	reload_result_t *result = calloc(1, sizeof(reload_result_t));
+	if (result == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+	settings_copy(&result->settings, &request.settings_cmdline);
+
+	/* Read global config settings. */
+	config_ini_section_t *section = config_ini_get_section(config, "redshift");
+	if (section != NULL) {
+		config_ini_setting_t *setting = section->settings;
+		for (; setting != NULL; setting = setting->next) {
+			r = settings_parse(&result->settings, setting->name,
+					   setting->value, request.mode);
+			if (r < 0) goto fail;
+			if (r > 0 && gamma == NULL &&
+			    strcasecmp(setting->name, "gamma") == 0)
+				gamma = setting->value;
+		}
+	}
+
+	settings_finalize(&result->settings);
+	r = settings_validate(&result->settings, 0, 0);
+	if (r < 0) goto fail;
+
+	r = reload_selections(result, config, gamma);
+	if (r < 0) goto fail;
+
+	/* Everything is changed until compared with
+	   the previous configuration. */
+	result->settings_changed = 1;
+	for (size_t i = 0; i < result->selections_count; i++)
+		result->selections[i].changed = 1;
+
+	return result;
+
+fail:
+	reload_free_result(result);
+	return NULL;
+}
+
+static reload_result_t *
+reload_copy_result(const reload_result_t *result)
+{
+	reload_result_t *copy = malloc(sizeof(reload_result_t));
+	if (copy == NULL) {
+		perror("malloc");
+		return NULL;
+	}
+	*copy = *result;
+
+	size_t size = result->selections_count * sizeof(reload_selection_t);
+	copy->selections = malloc(size);
+	if (copy->selections == NULL) {
+		perror("malloc");
+		free(copy);
+		return NULL;
+	}
+	memcpy(copy->selections, result->selections, size);
+
+	return copy;
+}
+
+/* Mark what has changed since the previous configuration,
+   returns zero if nothing has changed. */
+static int
+reload_diff(reload_result_t *result, const reload_result_t *old)
+{
+	int changed = 0;
+
+	if (old == NULL) return 1;
+
+	result->settings_changed =
+		memcmp(&result->settings, &old->settings, sizeof(settings_t)) != 0;
+	changed |= result->settings_changed;
+
+	for (size_t i = 0; i < result->selections_count; i++) {
+		reload_selection_t *sel = result->selections + i;
+		if (i < old->selections_count) {
+			const reload_selection_t *old_sel = old->selections + i;
+			sel->changed =
+				memcmp(sel->gamma, old_sel->gamma, sizeof(sel->gamma)) != 0 ||
+				sel->preserve_calibrations != old_sel->preserve_calibrations;
+		}
+		changed |= sel->changed;
+	}
+
+	return changed;
+}
+
+/* Load the configuration, this may take a while as it
+   can run commands from the config file, unless the
+   reload is incremental and the commands are unchanged.
+   Stores NULL if nothing has changed. */
+static int
+reload_config(int incremental, reload_result_t **result_out)
+{
+	config_ini_state_t config;
+	double start = metrics_begin();
+	double span = trace_begin("config reload");
+	int r;
+
+	*result_out = NULL;
+
+	r = config_ini_init(&config, request.config_filepath,
+			    incremental ? &previous_config : NULL,
+			    request.verbose);
+	if (r < 0) {
+		fputs(_("Unable to load config file.\n"), stderr);
+		return -1;
+	}
+
+	reload_result_t *result = reload_parse(&config);
+	if (result == NULL) {
+		config_ini_free(&config);
+		return -1;
+	}
+	metrics_end(METRICS_RELOAD_SECONDS, start);
+	metrics_count(METRICS_RELOADS, 1);
+	trace_end("config reload", span, request.config_filepath);
+
+	/* Keep the configuration for the next reload. */
+	config_ini_free(&previous_config);
+	previous_config = config;
+
+	int changed = reload_diff(result, previous_result);
+	reload_result_t *copy = reload_copy_result(result);
+	if (copy == NULL) {
+		reload_free_result(result);
+		return -1;
+	}
+	reload_free_result(previous_result);
+	previous_result = copy;
+
+	if (!changed) {
+		if (request.verbose)
+			printf(_("Configuration unchanged.\n"));
+		reload_free_result(result);
+		return 0;
+	}
+
+	*result_out = result;
+	return 0;
+}
+
+/* Publish a reloaded configuration to the main loop. */
+static void
+reload_publish(reload_result_t *result)
+{
+	/* Merge with a reload that was never taken, so that
+	   the changes it contained are not lost. */
+	reload_result_t *old = __atomic_exchange_n(&pending, NULL, __ATOMIC_ACQ_REL);
+	if (old != NULL) {
+		result->settings_changed |= old->settings_changed;
+		for (size_t i = 0; i < result->selections_count; i++)
+			if (i < old->selections_count)
+				result->selections[i].changed |= old->selections[i].changed;
+		reload_free_result(old);
+	}
+
+	__atomic_store_n(&pending, result, __ATOMIC_RELEASE);
+}
+
+
+#ifdef RELOAD_THREADED
+static void *
+reload_worker(void *data)
+{
+	reload_result_t *result;
+	if (reload_config(worker_incremental, &result) < 0)
+		fputs(_("Keeping the previous configuration.\n"), stderr);
+	else if (result != NULL)
+		reload_publish(result);
+
+	/* Wake the main loop. */
+	while (write(wake_pipe[1], "", 1) < 0 && errno == EINTR);
+	return NULL;
+}
+
+/* Called by the main loop when the worker has finished. */
+static void
+reload_finished(int fd, void *data)
+{
+	char buf[64];
+	while (read(fd, buf, sizeof(buf)) > 0);
+
+	if (worker_running) {
+		pthread_join(worker, NULL);
+		worker_running = 0;
+	}
+
+	if (restart) {
+		restart = 0;
+		reload_start(restart_incremental);
+	}
+}
+#endif
+
+
+#ifdef __linux__
+/* Called by the main loop when the directory of
+   the config file has changed. */
+static void
+reload_watch_event(int fd, void *data)
+{
+	if (!filewatch_changed(fd, watch_name)) return;
+
+	/* Wait for the file to settle, as editors
+	   often write it in multiple steps. */
+	struct itimerspec timeout = {
+		.it_interval = { 0, 0 },
+		.it_value = {
+			(time_t)RELOAD_DEBOUNCE,
+			(long)((RELOAD_DEBOUNCE - (time_t)RELOAD_DEBOUNCE) * 1000000000L)
+		}
+	};
+	if (timerfd_settime(debounce_fd, 0, &timeout, NULL))
+		perror("timerfd_settime");
+}
+
+/* Called by the main loop when the config file has settled. */
+static void
+reload_watch_settled(int fd, void *data)
+{
+	uint64_t expirations;
+	if (read(fd, &expirations, sizeof(expirations)) < 0)
+		return;
+
+	if (request.verbose)
+		printf(_("Config file changed.\n"));
+	reload_start(1);
+}
+
+/* Watch the directory of the config file, rather than the file
+   itself, so that files replaced by editors are also seen. */
+static int
+reload_watch(const char *filepath)
+{
+	inotify_fd = filewatch_open(filepath, IN_CLOSE_WRITE | IN_MOVED_TO |
+				    IN_CREATE | IN_DELETE, &watch_name);
+	if (inotify_fd < 0)
+		return -1;
+
+	debounce_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (debounce_fd < 0) {
+		perror("timerfd_create");
+		return -1;
+	}
+
+	if (eventloop_add(inotify_fd, reload_watch_event, NULL) < 0 ||
+	    eventloop_add(debounce_fd, reload_watch_settled, NULL) < 0)
+		return -1;
+
+	return 0;
+}
+
+static void
+reload_unwatch(void)
+{
+	if (inotify_fd >= 0) {
+		eventloop_remove(inotify_fd);
+		close(inotify_fd);
+		inotify_fd = -1;
+	}
+	if (debounce_fd >= 0) {
+		eventloop_remove(debounce_fd);
+		close(debounce_fd);
+		debounce_fd = -1;
+	}
+	free(watch_name);
+	watch_name = NULL;
+}
+#endif
+
+
+int
+reload_init(const reload_request_t *req, config_ini_state_t *config)
+{
+	request = *req;
+	pending = NULL;
+
+	/* Take over the configuration the program was started with. */
+	previous_config = *config;
+	memset(config, 0, sizeof(*config));
+	previous_result = reload_parse(&previous_config);
+
+#ifdef RELOAD_THREADED
+#ifdef HAVE_PIPE2
+	if (pipe2(wake_pipe, O_CLOEXEC | O_NONBLOCK)) {
+		perror("pipe2");
+		return -1;
+	}
+#else
+	if (pipe(wake_pipe)) {
+		perror("pipe");
+		return -1;
+	}
+	for (int i = 0; i < 2; i++) {
+		fcntl(wake_pipe[i], F_SETFD, FD_CLOEXEC);
+		fcntl(wake_pipe[i], F_SETFL, fcntl(wake_pipe[i], F_GETFL) | O_NONBLOCK);
+	}
+#endif
+
+	if (eventloop_add(wake_pipe[0], reload_finished, NULL) < 0) {
+		close(wake_pipe[0]);
+		close(wake_pipe[1]);
+		wake_pipe[0] = wake_pipe[1] = -1;
+		return -1;
+	}
+#endif
+
+#ifdef __linux__
+	/* Changes to the config file are picked up automatically,
+	   failing to watch it is not fatal. */
+	if (previous_config.filepath != NULL &&
+	    reload_watch(previous_config.filepath) < 0) {
+		fputs(_("Unable to watch config file for changes.\n"), stderr);
+		reload_unwatch();
+	}
+#endif
+
+	return 0;
+}
+
+void
+reload_free(void)
+{
+#ifdef __linux__
+	reload_unwatch();
+#endif
+
+#ifdef RELOAD_THREADED
+	if (worker_running) {
+		pthread_join(worker, NULL);
+		worker_running = 0;
+	}
+	restart = 0;
+
+	if (wake_pipe[0] >= 0) {
+		eventloop_remove(wake_pipe[0]);
+		close(wake_pipe[0]);
+		close(wake_pipe[1]);
+		wake_pipe[0] = wake_pipe[1] = -1;
+	}
+#endif
+
+	reload_free_result(reload_take());
+	reload_free_result(previous_result);
+	previous_result = NULL;
+	config_ini_free(&previous_config);
+}
+
+int
+reload_start(int incremental)
+{
+#ifdef RELOAD_THREADED
+	if (worker_running) {
+		/* A full reload is made if any is requested. */
+		restart_incremental = restart ?
+			restart_incremental && incremental : incremental;
+		restart = 1;
+		return 0;
+	}
+
+	/* Signals must be handled by the main loop,
+	   so block them in the worker. */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	worker_incremental = incremental;
+	int r = pthread_create(&worker, NULL, reload_worker, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (r != 0) {
+		errno = r;
+		perror("pthread_create");
+		return -1;
+	}
+
+	worker_running = 1;
+	return 0;
+#else
+	reload_result_t *result;
+	if (reload_config(incremental, &result) < 0) {
+		fputs(_("Keeping the previous configuration.\n"), stderr);
+		return -1;
+	}
+	if (result != NULL)
+		reload_publish(result);
+	return 0;
+#endif
+}
+
+reload_result_t *
+reload_take(void)
+{
+	return __atomic_exchange_n(&pending, NULL, __ATOMIC_ACQ_REL);
+}
+
+void
+reload_free_result(reload_result_t *result)
+{
+	if (result == NULL) return;
+	free(result->selections);
+	free(result);
+}
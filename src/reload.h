@@ -0,0 +1,83 @@
+/* reload.h -- Background configuration reload header
+   This file is part of Redshift.
+
+   Redshift is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Redshift is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Redshift.  If not, see <http://www.gnu.org/licenses/>.
+
+   Copyright (c) 2014  Mattias Andrée <maandree@member.fsf.org>
+*/
+
+#ifndef REDSHIFT_RELOAD_H
+#define REDSHIFT_RELOAD_H
+
+#include "settings.h"
+#include "config-ini.h"
+
+#include <stddef.h>
+
+
+/* What a reload is based on, this is fixed
+   for the lifetime of the program. */
+typedef struct {
+	/* The config file, NULL for the default. */
+	const char *config_filepath;
+	/* Settings from the command line. */
+	settings_t settings_cmdline;
+	/* Default gamma from the command line, or NULL. */
+	const char *gamma;
+	/* Gamma for all selections from the adjustment
+	   method options on the command line, or NULL. */
+	const char *method_gamma;
+	/* The adjustment method, whose sections are read. */
+	const char *method_name;
+	int mode;
+	int verbose;
+} reload_request_t;
+
+/* Adjustments of a CRTC selection. */
+typedef struct {
+	float gamma[3];
+	int preserve_calibrations;
+	/* Whether any of the above has changed. */
+	int changed;
+} reload_selection_t;
+
+/* A reloaded configuration. */
+typedef struct {
+	settings_t settings;
+	int settings_changed;
+	/* Indexed like the CRTCs' selections, zeroth
+	   is the default selection. */
+	size_t selections_count;
+	reload_selection_t *selections;
+} reload_result_t;
+
+
+/* Takes over `config', the configuration the program was started
+   with, and watches the config file for changes where supported. */
+int reload_init(const reload_request_t *request, config_ini_state_t *config);
+void reload_free(void);
+
+/* Start reloading the configuration in the background,
+   if a reload is already running, another one is made
+   when it has finished. An incremental reload reuses
+   the output of unchanged commands in the config file. */
+int reload_start(int incremental);
+
+/* Take the most recent reloaded configuration, NULL if
+   none has been completed since the last call. */
+reload_result_t *reload_take(void);
+void reload_free_result(reload_result_t *result);
+
+
+#endif /* ! REDSHIFT_RELOAD_H */
@@ -48,6 +48,8 @@ settings_init(settings_t *settings)
   settings->transition = -1;
   settings->transition_low = TRANSITION_LOW;
   settings->transition_high = TRANSITION_HIGH;
+  settings->elevation_hysteresis = NAN;
+  settings->period_dwell = NAN;
   settings->reload_transition = -1;
   settings->preserve_calibrations = -1;
 }
@@ -68,6 +70,8 @@ settings_finalize(settings_t *settings)
   if (isnan(settings->brightness_day))       settings->brightness_day        = DEFAULT_BRIGHTNESS;
   if (isnan(settings->brightness_night))     settings->brightness_night      = DEFAULT_BRIGHTNESS;
   if (settings->transition < 0)              settings->transition            = 1;
+  if (isnan(settings->elevation_hysteresis)) settings->elevation_hysteresis  = 0;
+  if (isnan(settings->period_dwell))         settings->period_dwell          = 0;
   if (settings->reload_transition < 0)       settings->reload_transition     = 1;
   if (settings->preserve_calibrations < 0)   settings->preserve_calibrations = 0;
 }
@@ -95,6 +99,10 @@ settings_parse(settings_t *settings, const char* name, char* value, int mode)
 		settings->transition_high = atof(value);
 	} else if (strcasecmp(name, "elevation-low") == 0) {
 		settings->transition_low = atof(value);
+	} else if (strcasecmp(name, "elevation-hysteresis") == 0) {
+		if (isnan(settings->elevation_hysteresis)) settings->elevation_hysteresis = atof(value);
+	} else if (strcasecmp(name, "period-dwell") == 0) {
+		if (isnan(settings->period_dwell)) settings->period_dwell = atof(value);
 	} else if (strcasecmp(name, "preserve-calibrations") == 0) {
 		if (settings->preserve_calibrations < 0 && mode == PROGRAM_MODE_CONTINUAL) {
 			settings->preserve_calibrations = !!atoi(value);
@@ -143,6 +151,13 @@ settings_validate(settings_t *settings, int manual_mode, int reset_mode)
 				  " the low transition elevation.\n"));
 		        rc = -1;
 		}
+
+		/* Period changes */
+		if (settings->elevation_hysteresis < 0 || settings->period_dwell < 0) {
+			fputs(_("Elevation hysteresis and period dwell time"
+				" cannot be negative.\n"), stderr);
+			rc = -1;
+		}
 	}
 
 	/* Brightness */
@@ -35,6 +35,8 @@ typedef struct
   int transition;
   float transition_low;
   float transition_high;
+  float elevation_hysteresis;
+  float period_dwell;
   int reload_transition;
   int preserve_calibrations;
   
@@ -20,13 +20,27 @@
 
 #include <stdio.h>
 
+#include <errno.h>
+#include <stdint.h>
+
 #ifndef _WIN32
 # include <time.h>
+# include <unistd.h>
+#else
+# include <windows.h>
+#endif
+
+#ifdef __linux__
+# include <sys/timerfd.h>
+# ifndef TFD_TIMER_CANCEL_ON_SET
+#  define TFD_TIMER_CANCEL_ON_SET  (1 << 1)
+# endif
 #endif
 
 #ifdef __MACH__
 # include <mach/clock.h>
 # include <mach/mach.h>
+# include <mach/mach_time.h>
 #endif
 
 #include "systemtime.h"
@@ -49,8 +63,21 @@ systemtime_close(void)
 #endif
 
 
-int
-systemtime_get_time(double *t)
+/* Virtual clock. When enabled, the time reported by
+   systemtime_get_time() starts at `virtual_start' and runs
+   `virtual_speed' times faster than the real clock. If the
+   speed is zero the clock only advances when the program
+   sleeps, and the sleeps themselves are skipped. */
+static int virtual_clock = 0;
+static double virtual_start;
+static double virtual_speed;
+static double virtual_now;
+static double real_start;
+static int real_start_set;
+
+
+static int
+systemtime_get_real_time(double *t)
 {
 #if defined(_WIN32) /* Windows. */
 	FILETIME now;
@@ -78,3 +105,253 @@ systemtime_get_time(double *t)
 
 	return 0;
 }
+
+
+/* Read a clock that is unaffected by changes to the system
+   time, for measuring durations, it is never virtual. */
+int
+systemtime_get_monotonic(double *t)
+{
+#if defined(_WIN32) /* Windows. */
+	*t = GetTickCount64() / 1000.0;
+
+#elif defined(__MACH__) /* OS X */
+	static mach_timebase_info_data_t timebase;
+	if (timebase.denom == 0)
+		mach_timebase_info(&timebase);
+	*t = (double)mach_absolute_time() * timebase.numer / timebase.denom / 1000000000.0;
+
+#else /* POSIX.1-2001 */
+	struct timespec now;
+	int r = clock_gettime(CLOCK_MONOTONIC, &now);
+	if (r < 0) {
+		perror("clock_gettime");
+		return -1;
+	}
+	*t = now.tv_sec + (now.tv_nsec / 1000000000.0);
+#endif
+
+	return 0;
+}
+
+
+/* Replace the system clock with a virtual clock starting at
+   `start' (seconds since the Unix epoch) and running `speed'
+   times faster than real time. If `speed' is zero, time only
+   advances by the amount of time the program sleeps, and
+   sleeping returns immediately. */
+void
+systemtime_set_virtual(double start, double speed)
+{
+	virtual_clock = 1;
+	real_start_set = 0;
+	virtual_start = start;
+	virtual_speed = speed < 0 ? 0 : speed;
+	virtual_now = start;
+}
+
+int
+systemtime_get_time(double *t)
+{
+	if (!virtual_clock)
+		return systemtime_get_real_time(t);
+
+	if (virtual_speed == 0) {
+		*t = virtual_now;
+		return 0;
+	}
+
+	double now;
+	int r = systemtime_get_real_time(&now);
+	if (r < 0) return r;
+	/* The real clock is not read until now, so that
+	   it need not be initialized when selecting the
+	   virtual clock. */
+	if (!real_start_set) {
+		real_start = now;
+		real_start_set = 1;
+	}
+	*t = virtual_start + (now - real_start) * virtual_speed;
+	return 0;
+}
+
+/* Prepare to sleep for `seconds' seconds as measured by the
+   clock returned by systemtime_get_time(), and return the
+   number of seconds to wait in real time. With the stepping
+   virtual clock, the clock is advanced and zero is returned. */
+double
+systemtime_begin_sleep(double seconds)
+{
+	if (virtual_clock) {
+		if (virtual_speed == 0) {
+			virtual_now += seconds;
+			return 0;
+		}
+		seconds /= virtual_speed;
+	}
+	return seconds;
+}
+
+/* Sleep for `seconds' seconds as measured by the
+   clock returned by systemtime_get_time(). */
+void
+systemtime_sleep(double seconds)
+{
+	seconds = systemtime_begin_sleep(seconds);
+	if (seconds <= 0)
+		return;
+
+#ifndef _WIN32
+	/* Interrupted by signals, so that they are handled promptly. */
+	struct timespec ts;
+	ts.tv_sec = (time_t)seconds;
+	ts.tv_nsec = (long)((seconds - (double)ts.tv_sec) * 1000000000.0);
+	nanosleep(&ts, NULL);
+#else /* ! _WIN32 */
+	Sleep((DWORD)(seconds * 1000.0));
+#endif /* ! _WIN32 */
+}
+
+
+#ifdef __linux__
+
+/* Clock discontinuity detection. A timer armed with
+   TFD_TIMER_CANCEL_ON_SET is cancelled whenever the real time
+   clock is set, including when the system resumes from suspend.
+   The jump itself is measured against the monotonic clock, which
+   neither jumps nor advances while the system is suspended. */
+static int jump_fd = -1;
+static int jump_clocks_read = 0;
+static double last_real, last_monotonic, last_boottime;
+
+static double
+read_clock(clockid_t clock)
+{
+	struct timespec now;
+	if (clock_gettime(clock, &now) < 0)
+		return 0;
+	return now.tv_sec + (now.tv_nsec / 1000000000.0);
+}
+
+static void
+read_jump_clocks(double *real, double *monotonic, double *boottime)
+{
+	*real = read_clock(CLOCK_REALTIME);
+	*monotonic = read_clock(CLOCK_MONOTONIC);
+#ifdef CLOCK_BOOTTIME
+	*boottime = read_clock(CLOCK_BOOTTIME);
+#else
+	*boottime = *monotonic;
+#endif
+}
+
+#ifndef TIME_T_MAX
+# define TIME_T_HALF  ((time_t)1 << (sizeof(time_t) * 8 - 2))
+# define TIME_T_MAX   (TIME_T_HALF - 1 + TIME_T_HALF)
+#endif
+
+static int
+arm_jump_timer(void)
+{
+	/* Any time in the future will do, the timer is only used
+	   for its cancellation. Use the largest time that can be
+	   represented so that it does not expire in 2038. */
+	struct itimerspec spec = {
+		.it_interval = { 0, 0 },
+		.it_value = { TIME_T_MAX, 0 }
+	};
+	return timerfd_settime(jump_fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET,
+			       &spec, NULL);
+}
+
+/* Get a file descriptor that becomes readable when the real
+   time clock is set, -1 if this is not supported. */
+int
+systemtime_jump_fd(void)
+{
+	if (virtual_clock)
+		return -1;
+	if (jump_fd >= 0)
+		return jump_fd;
+
+	jump_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (jump_fd < 0)
+		return -1;
+	if (arm_jump_timer() < 0) {
+		close(jump_fd);
+		jump_fd = -1;
+		return -1;
+	}
+
+	read_jump_clocks(&last_real, &last_monotonic, &last_boottime);
+	jump_clocks_read = 1;
+	return jump_fd;
+}
+
+/* Check whether the real time clock has jumped since the last
+   call. Returns 1 and stores the size of the jump in seconds
+   in `jump' if it has, and stores whether the system has been
+   suspended in `resumed'. */
+int
+systemtime_jumped(double *jump, int *resumed)
+{
+	double real, monotonic, boottime;
+	int cancelled = 0;
+	uint64_t expirations;
+
+	if (jump_fd < 0 || !jump_clocks_read)
+		return 0;
+
+	if (read(jump_fd, &expirations, sizeof(expirations)) < 0 &&
+	    errno == ECANCELED) {
+		cancelled = 1;
+		arm_jump_timer();
+	}
+
+	read_jump_clocks(&real, &monotonic, &boottime);
+	double elapsed = monotonic - last_monotonic;
+	double suspended = (boottime - last_boottime) - elapsed;
+	*jump = (real - last_real) - elapsed;
+	*resumed = suspended >= SYSTEMTIME_JUMP_THRESHOLD;
+	last_real = real;
+	last_monotonic = monotonic;
+	last_boottime = boottime;
+
+	return cancelled || *resumed ||
+	       *jump >= SYSTEMTIME_JUMP_THRESHOLD ||
+	       *jump <= -SYSTEMTIME_JUMP_THRESHOLD;
+}
+
+void
+systemtime_jump_close(void)
+{
+	if (jump_fd >= 0) {
+		close(jump_fd);
+		jump_fd = -1;
+	}
+	jump_clocks_read = 0;
+}
+
+#else /* ! __linux__ */
+
+int
+systemtime_jump_fd(void)
+{
+	return -1;
+}
+
+int
+systemtime_jumped(double *jump, int *resumed)
+{
+	(void) jump;
+	(void) resumed;
+	return 0;
+}
+
+void
+systemtime_jump_close(void)
+{
+	/* do nothing */
+}
+
+#endif /* ! __linux__ */
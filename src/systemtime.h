@@ -20,11 +20,26 @@
 #ifndef REDSHIFT_SYSTEMTIME_H
 #define REDSHIFT_SYSTEMTIME_H
 
+/* Smallest difference between the real time clock and the
+   monotonic clock, in seconds, that is considered a jump. */
+#ifndef SYSTEMTIME_JUMP_THRESHOLD
+#  define SYSTEMTIME_JUMP_THRESHOLD  1.0
+#endif
+
 #ifdef __MACH__
 void systemtime_init(void);
 void systemtime_close(void);
 #endif
 
+void systemtime_set_virtual(double start, double speed);
+
 int systemtime_get_time(double *now);
+int systemtime_get_monotonic(double *now);
+double systemtime_begin_sleep(double seconds);
+void systemtime_sleep(double seconds);
+
+int systemtime_jump_fd(void);
+int systemtime_jumped(double *jump, int *resumed);
+void systemtime_jump_close(void);
 
 #endif /* ! REDSHIFT_SYSTEMTIME_H */
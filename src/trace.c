@@ -0,0 +1,190 @@
+/* trace.c -- Tracing of the update pipeline source
+   This file is part of Redshift.
+
+   Redshift is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Redshift is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Redshift.  If not, see <http://www.gnu.org/licenses/>.
+
+   Copyright (c) 2014  Mattias Andrée <maandree@member.fsf.org>
+*/
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "trace.h"
+#include "systemtime.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#ifndef _WIN32
+# include <fcntl.h>
+# include <unistd.h>
+#endif
+#ifdef HAVE_SYS_SDT_H
+# include <sys/sdt.h>
+#endif
+
+
+static FILE *trace_file = NULL;
+static int enabled = 0;
+static double epoch;
+static long pid = 0;
+
+/* Threads are numbered in the order they first end a span. */
+static unsigned long threads = 0;
+static __thread unsigned long thread_id = 0;
+
+
+/* Write a string as the contents of a JSON string. */
+static void
+trace_write_string(const char *s)
+{
+	for (; *s; s++) {
+		unsigned char c = (unsigned char)*s;
+		if (c == '"' || c == '\\')
+			fprintf(trace_file, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(trace_file, "\\u%04x", c);
+		else
+			putc(c, trace_file);
+	}
+}
+
+/* Write a complete event, its argument is `detail' if it
+   is not NULL, otherwise `value' named `key' if `key' is
+   not NULL, otherwise it has no argument. */
+static void
+trace_write(const char *name, double start, const char *detail,
+	    const char *key, size_t value)
+{
+	double now;
+
+	if (start == 0 || systemtime_get_monotonic(&now) < 0)
+		return;
+	if (thread_id == 0)
+		thread_id = __atomic_add_fetch(&threads, 1, __ATOMIC_RELAXED);
+
+	/* Spans end in the ramp workers and I/O threads as well. */
+#ifndef _WIN32
+	flockfile(trace_file);
+#endif
+	if (__atomic_load_n(&enabled, __ATOMIC_RELAXED)) {
+		fputs(",\n{\"name\":\"", trace_file);
+		trace_write_string(name);
+		fprintf(trace_file, "\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+			"\"pid\":%ld,\"tid\":%lu",
+			(start - epoch) * 1000000., (now - start) * 1000000.,
+			pid, thread_id);
+		if (detail != NULL) {
+			fputs(",\"args\":{\"detail\":\"", trace_file);
+			trace_write_string(detail);
+			fputs("\"}", trace_file);
+		} else if (key != NULL) {
+			fputs(",\"args\":{\"", trace_file);
+			trace_write_string(key);
+			fprintf(trace_file, "\":%lu}", (unsigned long)value);
+		}
+		putc('}', trace_file);
+	}
+#ifndef _WIN32
+	funlockfile(trace_file);
+#endif
+}
+
+
+double
+trace_begin(const char *name)
+{
+	double now;
+#ifdef HAVE_SYS_SDT_H
+	DTRACE_PROBE1(redshift, span_begin, name);
+#else
+	(void) name;
+#endif
+	if (!__atomic_load_n(&enabled, __ATOMIC_RELAXED) ||
+	    systemtime_get_monotonic(&now) < 0)
+		return 0;
+	return now;
+}
+
+void
+trace_end(const char *name, double start, const char *detail)
+{
+#ifdef HAVE_SYS_SDT_H
+	DTRACE_PROBE2(redshift, span_end, name, detail);
+#endif
+	if (start != 0)
+		trace_write(name, start, detail, NULL, 0);
+}
+
+void
+trace_end_value(const char *name, double start, const char *key, size_t value)
+{
+#ifdef HAVE_SYS_SDT_H
+	DTRACE_PROBE2(redshift, span_end, name, NULL);
+#endif
+	if (start != 0)
+		trace_write(name, start, NULL, key, value);
+}
+
+
+int
+trace_open(const char *path)
+{
+	trace_file = fopen(path, "w");
+	if (trace_file == NULL) {
+		perror("fopen");
+		return -1;
+	}
+	if (systemtime_get_monotonic(&epoch) < 0) {
+		fclose(trace_file);
+		trace_file = NULL;
+		return -1;
+	}
+#ifndef _WIN32
+	fcntl(fileno(trace_file), F_SETFD, FD_CLOEXEC);
+	pid = (long)getpid();
+#endif
+
+	/* A trace that was cut short is still accepted by
+	   the trace viewers, the closing bracket is optional.
+	   The first event names the process, so that every
+	   span can be written with a comma before it. */
+	fprintf(trace_file, "[\n{\"name\":\"process_name\",\"ph\":\"M\","
+		"\"pid\":%ld,\"tid\":0,\"args\":{\"name\":\"redshift\"}}", pid);
+	__atomic_store_n(&enabled, 1, __ATOMIC_RELAXED);
+	atexit(trace_close);
+	return 0;
+}
+
+void
+trace_close(void)
+{
+	if (trace_file == NULL)
+		return;
+
+	/* The file is left to exit to close, as threads
+	   that are still running may end a span. */
+#ifndef _WIN32
+	flockfile(trace_file);
+#endif
+	if (__atomic_load_n(&enabled, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&enabled, 0, __ATOMIC_RELAXED);
+		fputs("\n]\n", trace_file);
+		if (fflush(trace_file) != 0)
+			perror("fflush");
+	}
+#ifndef _WIN32
+	funlockfile(trace_file);
+#endif
+}
@@ -0,0 +1,48 @@
+/* trace.h -- Tracing of the update pipeline header
+   This file is part of Redshift.
+
+   Redshift is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Redshift is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Redshift.  If not, see <http://www.gnu.org/licenses/>.
+
+   Copyright (c) 2014  Mattias Andrée <maandree@member.fsf.org>
+*/
+
+#ifndef REDSHIFT_TRACE_H
+#define REDSHIFT_TRACE_H
+
+#include <stddef.h>
+
+
+/* Start a span. Returns the current time, or zero if no trace
+   is being written, in which case `trace_end' writes nothing,
+   so that the clock is not read.
+
+   If Redshift was built with <sys/sdt.h>, the USDT probes
+   redshift:span_begin and redshift:span_end fire with the name
+   of the span, whether or not a trace is being written. */
+double trace_begin(const char *name);
+/* End a span, `detail' may be NULL, otherwise it is shown as the
+   argument of the span, for example which command was run. */
+void trace_end(const char *name, double start, const char *detail);
+/* End a span whose argument is a number, such as the index
+   of a CRTC, `key' is the name of the argument. */
+void trace_end_value(const char *name, double start, const char *key, size_t value);
+
+/* Write spans in the Chrome trace event format to a file, until
+   Redshift exits. Returns -1 on error. */
+int trace_open(const char *path);
+/* Finish the trace, so that it is valid JSON. */
+void trace_close(void);
+
+
+#endif /* ! REDSHIFT_TRACE_H */